@@ -0,0 +1,81 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cfloat>
+
+/// Measurement made by a benchmark.
+struct BenchResult {
+    std::string name;       ///< Name of the benchmark and of the measured quantity, e.g. "bvh/build_high"
+    double value;
+    std::string unit;
+    bool higher_is_better;
+};
+
+/// List of benchmark results, which can be saved as JSON and compared to the results of a previous run.
+class BenchReport {
+public:
+    void add(const std::string& name, double value, const std::string& unit, bool higher_is_better);
+
+    const std::vector<BenchResult>& results() const { return entries; }
+
+    /// Saves the results as JSON, with one result per line.
+    bool save(const std::string& file_name) const;
+    /// Loads results saved with save(). Returns false if the file cannot be read.
+    bool load(const std::string& file_name);
+
+    /// Prints the results next to the given baseline, and returns the number of results that
+    /// are worse than the baseline by more than the given relative tolerance.
+    size_t compare(const BenchReport& baseline, double tolerance) const;
+
+private:
+    std::vector<BenchResult> entries;
+};
+
+/// Options of the micro-benchmarks.
+struct MicroOptions {
+    size_t num_tris = 262144;   ///< Approximate number of triangles of the synthetic mesh
+    size_t num_rays = 262144;   ///< Number of rays of each traversal benchmark
+    size_t repeat = 3;          ///< Number of runs of each benchmark, the fastest one is reported
+    std::string work_dir;       ///< Directory where temporary files are written
+};
+
+/// Options of the scene-level harness.
+struct SceneOptions {
+    std::vector<std::string> scenes;        ///< Scene files, a built-in scene is generated if empty
+    std::vector<std::string> algos;         ///< Renderers to benchmark
+    size_t width = 320, height = 240;
+    size_t samples = 16;                    ///< Number of samples per pixel rendered by each renderer
+    double target_mse = 0.02;              ///< Error at which the time to reach the reference is measured
+    bool make_reference = false;            ///< Renders the reference images with the path tracer, instead of loading them
+    size_t reference_samples = 1024;
+    std::string work_dir;
+};
+
+void run_micro_benchmarks(const MicroOptions& options, BenchReport& report);
+bool run_scene_benchmarks(const SceneOptions& options, BenchReport& report);
+
+/// Returns the resident memory of the process, in bytes, or 0 if it is not available on this platform.
+size_t current_rss();
+/// Returns the peak resident memory of the process since the last call to reset_peak_rss(), in bytes, or 0 if it is not available on this platform.
+size_t peak_rss();
+/// Resets the peak resident memory of the process to its current resident memory.
+void reset_peak_rss();
+
+/// Runs the given function several times, and returns the duration of the fastest run, in milliseconds.
+template <typename F>
+double time_ms(size_t repeat, F f) {
+    double best = DBL_MAX;
+    for (size_t i = 0; i < std::max(repeat, size_t(1)); i++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return best;
+}
+
+#endif // BENCH_H
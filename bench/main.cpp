@@ -0,0 +1,89 @@
+#include <sstream>
+
+#include "common.h"
+#include "options.h"
+#include "thread_pool.h"
+#include "bench.h"
+
+static std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> items;
+    std::istringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty()) items.push_back(item);
+    return items;
+}
+
+int main(int argc, char** argv) {
+    ArgParser parser(argc, argv);
+
+    bool help, no_micro, no_scenes;
+    size_t num_threads;
+    std::string output_file, baseline_file, algos;
+    double tolerance;
+    MicroOptions micro;
+    SceneOptions scenes;
+
+    parser.add_option("help",      "h",  "Prints this message", help, false);
+    parser.add_option("no-micro",  "nm", "Skips the micro-benchmarks", no_micro, false);
+    parser.add_option("no-scenes", "ns", "Skips the scene benchmarks", no_scenes, false);
+    parser.add_option("threads",   "j",  "Sets the number of threads (0 = one per hardware thread)", num_threads, size_t(0));
+    parser.add_option("repeat",    "r",  "Sets the number of runs of each micro-benchmark, the fastest is reported", micro.repeat, size_t(3));
+    parser.add_option("triangles", "tri", "Sets the number of triangles of the synthetic mesh of the micro-benchmarks", micro.num_tris, size_t(262144));
+    parser.add_option("rays",      "rays", "Sets the number of rays of the traversal micro-benchmarks", micro.num_rays, size_t(262144));
+    parser.add_option("algos",     "a",  "Sets the comma-separated list of renderers used on the scenes", algos, std::string("debug,pt,ppm"));
+    parser.add_option("width",     "sx", "Sets the width of the scene renders, in pixels", scenes.width, size_t(320), "px");
+    parser.add_option("height",    "sy", "Sets the height of the scene renders, in pixels", scenes.height, size_t(240), "px");
+    parser.add_option("samples",   "s",  "Sets the number of samples per pixel of the scene renders", scenes.samples, size_t(16));
+    parser.add_option("target-mse", "mse", "Sets the error w.r.t. the reference at which the convergence time is measured", scenes.target_mse, 0.02);
+    parser.add_option("make-reference", "mr", "Renders the reference images of the scenes with the path tracer", scenes.make_reference, false);
+    parser.add_option("reference-samples", "rs", "Sets the number of samples per pixel of the reference images", scenes.reference_samples, size_t(1024));
+    parser.add_option("work-dir",  "w",  "Sets the directory where temporary files and the built-in scene are written", micro.work_dir, std::string("."), "dir");
+    parser.add_option("output",    "o",  "Saves the results to a JSON file", output_file, std::string("bench.json"), "file.json");
+    parser.add_option("baseline",  "bl", "Compares the results with those of a previous run", baseline_file, std::string(""), "file.json");
+    parser.add_option("tolerance", "tol", "Sets the relative difference with the baseline above which a result is a regression", tolerance, 0.05);
+
+    if (!parser.parse())
+        return 1;
+    if (help) {
+        parser.usage();
+        return 0;
+    }
+
+    scenes.scenes = parser.arguments();
+    scenes.algos = split(algos);
+    scenes.work_dir = micro.work_dir;
+
+    auto& thread_pool = ThreadPool::instance();
+    thread_pool.configure(num_threads, false);
+
+    BenchReport report;
+    // Scenes go first, so that their peak memory usage does not include the data of the micro-benchmarks
+    if (!no_scenes && !run_scene_benchmarks(scenes, report))
+        return 1;
+    if (!no_micro)
+        run_micro_benchmarks(micro, report);
+
+    if (output_file != "") {
+        if (!report.save(output_file)) {
+            error("Failed to save results to '", output_file, "'.");
+            return 1;
+        }
+        info("Results saved to '", output_file, "'.");
+    }
+
+    if (baseline_file != "") {
+        BenchReport baseline;
+        if (!baseline.load(baseline_file)) {
+            error("Cannot load baseline '", baseline_file, "'.");
+            return 1;
+        }
+        auto regressions = report.compare(baseline, tolerance);
+        if (regressions > 0) {
+            warn(regressions, " result(s) regressed w.r.t. the baseline.");
+            return 2;
+        }
+        info("No regression w.r.t. the baseline.");
+    }
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include <cmath>
+#include <fstream>
+#include <cstdio>
+
+#include "bench.h"
+#include "bvh.h"
+#include "hash_grid.h"
+#include "load_obj.h"
+#include "image.h"
+#include "samplers.h"
+#include "renderer.h"
+#include "common.h"
+
+/// Prevents the compiler from removing the computations whose result is only used for benchmarking.
+static volatile size_t sink;
+
+struct SyntheticMesh {
+    std::vector<float3> vertices;
+    std::vector<uint32_t> indices;  ///< Three vertex indices and a material index per triangle, as in the scene
+};
+
+/// Generates a grid of 4x4x4 bumpy spheres, which has both large empty areas and dense clusters of triangles.
+static SyntheticMesh generate_mesh(size_t num_tris) {
+    static constexpr size_t grid_size = 4;
+    auto res = std::max(size_t(4), size_t(std::sqrt(num_tris / double(grid_size * grid_size * grid_size * 2))));
+
+    SyntheticMesh mesh;
+    for (size_t i = 0; i < grid_size * grid_size * grid_size; i++) {
+        auto center = float3(i % grid_size, (i / grid_size) % grid_size, i / (grid_size * grid_size)) * 2.5f;
+        auto first = uint32_t(mesh.vertices.size());
+        for (size_t y = 0; y <= res; y++) {
+            auto theta = pi * y / res;
+            for (size_t x = 0; x <= res; x++) {
+                auto phi = 2.0f * pi * x / res;
+                auto r = 1.0f + 0.05f * std::sin(7.0f * theta + 3.0f * i) * std::cos(5.0f * phi);
+                mesh.vertices.push_back(center + r * float3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)));
+            }
+        }
+        for (size_t y = 0; y < res; y++) {
+            for (size_t x = 0; x < res; x++) {
+                auto v0 = uint32_t(first + y * (res + 1) + x), v1 = v0 + 1;
+                auto v2 = uint32_t(v0 + res + 1), v3 = v2 + 1;
+                mesh.indices.insert(mesh.indices.end(), { v0, v1, v3, 0, v0, v3, v2, 0 });
+            }
+        }
+    }
+    return mesh;
+}
+
+static float3 random_dir(PcgSampler& sampler) {
+    auto z = 2.0f * sampler() - 1.0f;
+    auto phi = 2.0f * pi * sampler();
+    auto r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    return float3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+/// Camera rays looking at the mesh, ordered by blocks of pixels like the renderers do.
+static std::vector<Ray> coherent_rays(const BBox& bbox, size_t num_rays) {
+    auto size = std::max(size_t(1), size_t(std::sqrt(double(num_rays))));
+    auto center = (bbox.min + bbox.max) * 0.5f;
+    auto eye = center + float3(0.3f, 0.4f, 1.0f) * length(bbox.max - bbox.min);
+    auto dir = normalize(center - eye);
+    auto right = normalize(cross(dir, float3(0.0f, 1.0f, 0.0f)));
+    auto up = cross(right, dir);
+
+    std::vector<Ray> rays;
+    for_each_pixel_in_blocks(0, 0, size, size, [&] (size_t x, size_t y) {
+        auto u = (x + 0.5f) / size * 2.0f - 1.0f;
+        auto v = (y + 0.5f) / size * 2.0f - 1.0f;
+        rays.emplace_back(eye, normalize(dir + 0.5f * (u * right + v * up)));
+    });
+    return rays;
+}
+
+/// Rays with random origins inside the mesh bounds and random directions, representative of secondary bounces.
+static std::vector<Ray> incoherent_rays(const BBox& bbox, size_t num_rays) {
+    std::vector<Ray> rays(num_rays);
+    for (size_t i = 0; i < num_rays; i++) {
+        PcgSampler sampler(pcg_hash(uint32_t(i)));
+        auto org = bbox.min + (bbox.max - bbox.min) * float3(sampler(), sampler(), sampler());
+        rays[i] = Ray(org, random_dir(sampler));
+    }
+    return rays;
+}
+
+template <bool any>
+static void bench_traverse(const Bvh& bvh, const std::vector<Ray>& rays, const std::string& name, size_t repeat, BenchReport& report) {
+    std::vector<Hit> hits(rays.size());
+    auto& pool = ThreadPool::instance();
+    auto num_tasks = (rays.size() + 1023) / 1024;
+
+    auto ms = time_ms(repeat, [&] {
+        pool.run_tasks(num_tasks, [&] (size_t task, size_t) {
+            for (size_t i = task * 1024, end = std::min(i + 1024, rays.size()); i < end; i++)
+                bvh.traverse<any>(rays[i], hits[i]);
+        });
+    });
+    report.add("bvh/" + name, rays.size() / (ms * 1e3), "Mrays/s", true);
+
+    ms = time_ms(repeat, [&] {
+        pool.run_tasks(num_tasks, [&] (size_t task, size_t) {
+            auto begin = task * 1024, end = std::min(begin + 1024, rays.size());
+            bvh.traverse_packet<any>(rays.data() + begin, hits.data() + begin, end - begin);
+        });
+    });
+    report.add("bvh/" + name + "_packet", rays.size() / (ms * 1e3), "Mrays/s", true);
+
+    size_t num_hits = 0;
+    for (auto& hit : hits) num_hits += hit.tri >= 0;
+    sink = num_hits;
+}
+
+static bool write_obj(const std::string& file_name, const SyntheticMesh& mesh) {
+    std::ofstream file(file_name);
+    for (auto& v : mesh.vertices)
+        file << "v " << v.x << " " << v.y << " " << v.z << "\n";
+    for (size_t i = 0; i < mesh.indices.size(); i += 4)
+        file << "f " << mesh.indices[i + 0] + 1 << " " << mesh.indices[i + 1] + 1 << " " << mesh.indices[i + 2] + 1 << "\n";
+    return static_cast<bool>(file);
+}
+
+void run_micro_benchmarks(const MicroOptions& options, BenchReport& report) {
+    auto mesh = generate_mesh(options.num_tris);
+    auto num_tris = mesh.indices.size() / 4;
+    info("Micro-benchmarks (", num_tris, " triangles, ", options.num_rays, " rays, ", ThreadPool::instance().num_threads(), " thread(s)):");
+
+    // BVH construction
+    Bvh bvh;
+    report.add("bvh/build_fast", time_ms(options.repeat, [&] {
+        bvh.build(mesh.vertices.data(), mesh.indices.data(), num_tris, BvhQuality::Fast);
+    }), "ms", false);
+    report.add("bvh/build_high", time_ms(options.repeat, [&] {
+        bvh.build(mesh.vertices.data(), mesh.indices.data(), num_tris, BvhQuality::High);
+    }), "ms", false);
+
+    // BVH traversal, with the high-quality BVH
+    auto bbox = BBox::empty();
+    for (auto& v : mesh.vertices) bbox = extend(bbox, v);
+    auto coherent = coherent_rays(bbox, options.num_rays);
+    auto incoherent = incoherent_rays(bbox, options.num_rays);
+    bench_traverse<false>(bvh, coherent,   "closest_coherent",   options.repeat, report);
+    bench_traverse<false>(bvh, incoherent, "closest_incoherent", options.repeat, report);
+    bench_traverse<true> (bvh, coherent,   "any_coherent",       options.repeat, report);
+    bench_traverse<true> (bvh, incoherent, "any_incoherent",     options.repeat, report);
+
+    // Single ray-triangle tests, with every ray tested against every triangle of a small set
+    {
+        static constexpr size_t num_test_tris = 1024, num_test_rays = 1024;
+        std::vector<PrecomputedTri> tris;
+        for (size_t i = 0; i < num_test_tris; i++) {
+            auto j = (i * 7919) % num_tris;
+            tris.emplace_back(
+                mesh.vertices[mesh.indices[j * 4 + 0]],
+                mesh.vertices[mesh.indices[j * 4 + 1]],
+                mesh.vertices[mesh.indices[j * 4 + 2]]);
+        }
+        size_t num_hits = 0;
+        auto ms = time_ms(options.repeat, [&] {
+            for (size_t i = 0; i < num_test_rays; i++) {
+                auto& ray = incoherent[i % incoherent.size()];
+                for (auto& tri : tris) {
+                    float t = FLT_MAX, u, v;
+                    num_hits += intersect_ray_tri(ray, tri, t, u, v);
+                }
+            }
+        });
+        sink = num_hits;
+        report.add("intersect/ray_tri", num_test_rays * num_test_tris / (ms * 1e3), "Mtests/s", true);
+    }
+
+    // Photon map construction and radius queries
+    {
+        static constexpr size_t num_points = 1 << 20, num_queries = 1 << 18;
+        static constexpr float radius = 0.01f;
+        std::vector<float3> points(num_points);
+        for (size_t i = 0; i < num_points; i++) {
+            PcgSampler sampler(pcg_hash(uint32_t(i) ^ 0x68E31DA4u));
+            points[i] = float3(sampler(), sampler(), sampler());
+        }
+        auto positions = [&] (size_t i) { return points[i]; };
+
+        HashGrid grid;
+        report.add("hash_grid/build", time_ms(options.repeat, [&] {
+            grid.build(positions, num_points, radius);
+        }), "ms", false);
+
+        size_t num_found = 0;
+        auto ms = time_ms(options.repeat, [&] {
+            for (size_t i = 0; i < num_queries; i++)
+                grid.query(points[(i * 4099) % num_points], positions, [&] (size_t, float) { num_found++; });
+        });
+        sink = num_found;
+        report.add("hash_grid/query", num_queries / (ms * 1e3), "Mqueries/s", true);
+    }
+
+    // OBJ parsing, with the synthetic mesh written to the disk
+    auto obj_file = options.work_dir + "/bench_mesh.obj";
+    if (write_obj(obj_file, mesh)) {
+        bool ok = true;
+        auto ms = time_ms(options.repeat, [&] {
+            obj::File file;
+            ok &= load_obj(obj_file, file);
+        });
+        if (ok)
+            report.add("load_obj", ms, "ms", false);
+        else
+            error("Cannot parse '", obj_file, "'.");
+        std::remove(obj_file.c_str());
+    } else {
+        error("Cannot write '", obj_file, "'.");
+    }
+
+    // EXR output of a full HD image
+    {
+        Image img(1920, 1080);
+        for (size_t i = 0; i < img.pixels.size(); i++) {
+            PcgSampler sampler(static_cast<uint32_t>(i));
+            img.pixels[i] = rgba(sampler(), sampler(), sampler(), 1.0f);
+        }
+        auto exr_file = options.work_dir + "/bench_image.exr";
+        bool ok = true;
+        auto ms = time_ms(options.repeat, [&] { ok &= save_exr(exr_file, img); });
+        if (ok)
+            report.add("save_exr", ms, "ms", false);
+        else
+            error("Cannot write '", exr_file, "'.");
+        std::remove(exr_file.c_str());
+    }
+}
@@ -0,0 +1,127 @@
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+
+#include <cstdlib>
+
+#include "bench.h"
+#include "common.h"
+
+void BenchReport::add(const std::string& name, double value, const std::string& unit, bool higher_is_better) {
+    info("  ", std::left, std::setw(40), name, " ", std::right, std::setw(12), std::setprecision(4), value, " ", unit);
+    entries.push_back(BenchResult { name, value, unit, higher_is_better });
+}
+
+bool BenchReport::save(const std::string& file_name) const {
+    std::ofstream file(file_name);
+    file << std::setprecision(8);
+    file << "{\n    \"results\": [\n";
+    for (size_t i = 0; i < entries.size(); i++) {
+        auto& entry = entries[i];
+        file << "        { \"name\": \"" << entry.name << "\", \"value\": " << entry.value
+             << ", \"unit\": \"" << entry.unit << "\", \"higher_is_better\": " << (entry.higher_is_better ? "true" : "false")
+             << " }" << (i + 1 < entries.size() ? "," : "") << "\n";
+    }
+    file << "    ]\n}\n";
+    return static_cast<bool>(file);
+}
+
+bool BenchReport::load(const std::string& file_name) {
+    std::ifstream file(file_name);
+    if (!file)
+        return false;
+
+    // The file is expected to be produced by save(), with one result per line
+    auto string_field = [] (const std::string& line, const std::string& key, std::string& value) {
+        auto pos = line.find("\"" + key + "\": \"");
+        if (pos == std::string::npos) return false;
+        pos += key.size() + 5;
+        auto end = line.find('"', pos);
+        if (end == std::string::npos) return false;
+        value = line.substr(pos, end - pos);
+        return true;
+    };
+    auto number_field = [] (const std::string& line, const std::string& key, double& value) {
+        auto pos = line.find("\"" + key + "\": ");
+        if (pos == std::string::npos) return false;
+        std::istringstream stream(line.substr(pos + key.size() + 4));
+        return static_cast<bool>(stream >> value);
+    };
+
+    entries.clear();
+    std::string line;
+    while (std::getline(file, line)) {
+        BenchResult result;
+        if (!string_field(line, "name", result.name) || !number_field(line, "value", result.value))
+            continue;
+        string_field(line, "unit", result.unit);
+        result.higher_is_better = line.find("\"higher_is_better\": true") != std::string::npos;
+        entries.push_back(result);
+    }
+    return true;
+}
+
+size_t BenchReport::compare(const BenchReport& baseline, double tolerance) const {
+    size_t regressions = 0;
+    info("Comparison with the baseline (tolerance: ", tolerance * 100.0, "%):");
+    for (auto& entry : entries) {
+        auto it = std::find_if(baseline.entries.begin(), baseline.entries.end(), [&] (const BenchResult& other) {
+            return other.name == entry.name;
+        });
+        if (it == baseline.entries.end() || it->value == 0.0)
+            continue;
+
+        auto change = (entry.value - it->value) / std::fabs(it->value);
+        bool worse = entry.higher_is_better ? change < -tolerance : change > tolerance;
+        bool better = entry.higher_is_better ? change > tolerance : change < -tolerance;
+        std::ostringstream line;
+        line << "  " << std::left << std::setw(40) << entry.name << " " << std::right
+             << std::setw(12) << std::setprecision(4) << it->value << " -> "
+             << std::setw(12) << std::setprecision(4) << entry.value << " " << entry.unit
+             << " (" << std::showpos << std::fixed << std::setprecision(1) << change * 100.0 << "%)";
+        if (worse) {
+            warn(line.str(), " REGRESSION");
+            regressions++;
+        } else {
+            info(line.str(), better ? " improvement" : "");
+        }
+    }
+    return regressions;
+}
+
+#ifdef __linux__
+/// Reads a memory counter of /proc/self/status, given in kB.
+static size_t proc_status_kb(const std::string& key) {
+    std::ifstream file("/proc/self/status");
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.compare(0, key.size() + 1, key + ":") == 0)
+            return std::strtoull(line.c_str() + key.size() + 1, nullptr, 10);
+    }
+    return 0;
+}
+#endif
+
+size_t current_rss() {
+#ifdef __linux__
+    return proc_status_kb("VmRSS") * 1024;
+#else
+    return 0;
+#endif
+}
+
+size_t peak_rss() {
+#ifdef __linux__
+    // Unlike ru_maxrss, the high-water mark of /proc can be reset
+    return proc_status_kb("VmHWM") * 1024;
+#else
+    return 0;
+#endif
+}
+
+void reset_peak_rss() {
+#ifdef __linux__
+    std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
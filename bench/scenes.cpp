@@ -0,0 +1,199 @@
+#include <fstream>
+#include <algorithm>
+
+#include "bench.h"
+#include "scene.h"
+#include "renderer.h"
+#include "image.h"
+#include "file_path.h"
+#include "stats.h"
+#include "common.h"
+
+/// Writes a Cornell box with an area light, a glossy block and a glass block, used when no scene is given.
+static bool write_builtin_scene(const std::string& dir, std::string& config) {
+    std::ofstream mtl(dir + "/bench_box.mtl");
+    // Every field is given, so that the materials do not depend on the defaults of the parser
+    auto material = [&] (const char* name, const char* kd, const char* ks, const char* ke, const char* ns, const char* ni, const char* tf, int illum) {
+        mtl << "newmtl " << name << "\nKa 0 0 0\nKd " << kd << "\nKs " << ks << "\nKe " << ke
+            << "\nNs " << ns << "\nNi " << ni << "\nTf " << tf << "\nTr 0\nd 1\nillum " << illum << "\n";
+    };
+    material("white", "0.7 0.7 0.7", "0 0 0",       "0 0 0",    "1",   "1",   "0 0 0", 2);
+    material("red",   "0.7 0.1 0.1", "0 0 0",       "0 0 0",    "1",   "1",   "0 0 0", 2);
+    material("green", "0.1 0.7 0.1", "0 0 0",       "0 0 0",    "1",   "1",   "0 0 0", 2);
+    material("light", "0 0 0",       "0 0 0",       "20 20 20", "1",   "1",   "0 0 0", 2);
+    material("glossy","0.2 0.2 0.5", "0.6 0.6 0.6", "0 0 0",    "100", "1",   "0 0 0", 2);
+    material("glass", "0 0 0",       "1 1 1",       "0 0 0",    "1",   "1.5", "1 1 1", 7);
+
+    std::ofstream obj(dir + "/bench_box.obj");
+    obj << "mtllib bench_box.mtl\n";
+    size_t num_verts = 0;
+    auto quad = [&] (const char* mat, float3 a, float3 b, float3 c, float3 d) {
+        obj << "usemtl " << mat << "\n";
+        for (auto& v : { a, b, c, d })
+            obj << "v " << v.x << " " << v.y << " " << v.z << "\n";
+        obj << "f " << num_verts + 1 << " " << num_verts + 2 << " " << num_verts + 3 << "\n";
+        obj << "f " << num_verts + 1 << " " << num_verts + 3 << " " << num_verts + 4 << "\n";
+        num_verts += 4;
+    };
+    auto block = [&] (const char* mat, float3 min, float3 max) {
+        float3 p[8];
+        for (int i = 0; i < 8; i++)
+            p[i] = float3(i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z);
+        quad(mat, p[0], p[1], p[3], p[2]);
+        quad(mat, p[4], p[6], p[7], p[5]);
+        quad(mat, p[0], p[4], p[5], p[1]);
+        quad(mat, p[2], p[3], p[7], p[6]);
+        quad(mat, p[0], p[2], p[6], p[4]);
+        quad(mat, p[1], p[5], p[7], p[3]);
+    };
+    quad("white", float3(-1, 0, -1), float3(-1, 0, 1), float3(1, 0, 1), float3(1, 0, -1));
+    quad("white", float3(-1, 2, -1), float3(1, 2, -1), float3(1, 2, 1), float3(-1, 2, 1));
+    quad("white", float3(-1, 0, -1), float3(1, 0, -1), float3(1, 2, -1), float3(-1, 2, -1));
+    quad("red",   float3(-1, 0, -1), float3(-1, 2, -1), float3(-1, 2, 1), float3(-1, 0, 1));
+    quad("green", float3(1, 0, -1), float3(1, 0, 1), float3(1, 2, 1), float3(1, 2, -1));
+    // The light faces downwards
+    quad("light", float3(-0.25f, 1.98f, -0.25f), float3(0.25f, 1.98f, -0.25f), float3(0.25f, 1.98f, 0.25f), float3(-0.25f, 1.98f, 0.25f));
+    block("glossy", float3(-0.7f, 0.0f, -0.6f), float3(-0.1f, 1.2f, 0.0f));
+    block("glass",  float3( 0.1f, 0.0f, -0.1f), float3( 0.6f, 0.5f, 0.4f));
+
+    config = dir + "/bench_box.yml";
+    std::ofstream yml(config);
+    yml << "---\nmeshes: [\"bench_box.obj\"]\n"
+        << "camera: !perspective_camera {\n    eye: [0, 1, 3.5],\n    center: [0, 1, 0],\n    up: [0, 1, 0],\n    fov: 45.0\n}\n"
+        << "lights: []\n";
+    return mtl && obj && yml;
+}
+
+static std::unique_ptr<Renderer> create_renderer(const std::string& name, const Scene& scene) {
+    if (name == "debug")  return create_debug_renderer(scene);
+    if (name == "pt")     return create_pt_renderer(scene);
+    if (name == "wpt")    return create_wpt_renderer(scene);
+    if (name == "bpt")    return create_bpt_renderer(scene);
+    if (name == "ppm")    return create_ppm_renderer(scene);
+    if (name == "sppm")   return create_sppm_renderer(scene);
+    if (name == "restir") return create_restir_renderer(scene);
+    return nullptr;
+}
+
+/// Returns the mean squared error of the accumulated image, divided by the number of samples, w.r.t. the reference.
+static double mean_squared_error(const Image& img, size_t samples, const Image& ref) {
+    double sum = 0.0;
+    auto inv = 1.0f / samples;
+    for (size_t i = 0; i < img.pixels.size(); i++) {
+        auto d = img.pixels[i] * inv - ref.pixels[i];
+        sum += double(d.x) * d.x + double(d.y) * d.y + double(d.z) * d.z;
+    }
+    return sum / (3.0 * img.pixels.size());
+}
+
+static uint64_t total_rays() {
+    auto stats = Stats::instance().total();
+    uint64_t sum = 0;
+    for (auto rays : stats.rays) sum += rays;
+    return sum;
+}
+
+/// Renders the reference with the path tracer, which is unbiased. Its samples start at a frame that the benchmark runs
+/// never reach, otherwise the pt runs would share their first samples with the reference and their error would be underestimated.
+static bool render_reference(const std::string& file_name, const Scene& scene, const SceneOptions& options) {
+    static constexpr size_t reference_first_frame = size_t(1) << 24;
+    info("Rendering reference '", file_name, "' with ", options.reference_samples, " samples...");
+    auto renderer = create_pt_renderer(scene);
+    Image img(options.width, options.height);
+    img.clear();
+    renderer->set_first_frame(reference_first_frame);
+    renderer->reset();
+    for (size_t i = 0; i < options.reference_samples; i++)
+        renderer->render(img);
+    for (auto& pixel : img.pixels)
+        pixel = pixel * (1.0f / options.reference_samples);
+    return save_exr(file_name, img);
+}
+
+static bool bench_scene(const std::string& config, const SceneOptions& options, BenchReport& report) {
+    Scene scene;
+    scene.width  = options.width;
+    scene.height = options.height;
+    LoadOptions load_options;
+    load_options.use_cache = false;
+    if (!load_scene(config, scene, load_options))
+        return false;
+
+    // The reference is stored next to the scene
+    FilePath path(config);
+    auto scene_name = path.remove_extension();
+    auto ref_file = path.base_name() + "/" + scene_name + ".ref.exr";
+    if (options.make_reference && !render_reference(ref_file, scene, options)) {
+        error("Cannot save reference image '", ref_file, "'.");
+        return false;
+    }
+    Image ref;
+    bool has_ref = load_exr(ref_file, ref) && ref.width == options.width && ref.height == options.height;
+    if (!has_ref)
+        warn("No reference image '", ref_file, "' of ", options.width, "x", options.height, " pixels, errors are not measured (use --make-reference).");
+
+    info("Scene '", config, "' (", options.width, "x", options.height, ", ", options.samples, " samples):");
+    for (auto& algo : options.algos) {
+        // The memory reported for a renderer is what it adds to the process, not counting the previous renderers
+        reset_peak_rss();
+        auto rss_before = current_rss();
+        auto renderer = create_renderer(algo, scene);
+        if (!renderer) {
+            error("No renderer with name '", algo, "'.");
+            return false;
+        }
+
+        // Every renderer seeds its samplers with the pixel index and the iteration, so runs are reproducible.
+        // The debug renderer does not estimate the radiance, so its error is meaningless.
+        bool measure_error = has_ref && algo != "debug";
+        Image img(options.width, options.height);
+        img.clear();
+        renderer->reset();
+        double render_ms = 0.0, time_to_target = -1.0, mse = 0.0;
+        auto rays_before = total_rays();
+        for (size_t i = 1; i <= options.samples; i++) {
+            render_ms += time_ms(1, [&] { renderer->render(img); });
+            scene.textures.end_frame();
+            if (measure_error) {
+                mse = mean_squared_error(img, i, ref);
+                if (time_to_target < 0.0 && mse <= options.target_mse)
+                    time_to_target = render_ms * 1e-3;
+            }
+        }
+
+        auto prefix = scene_name + "/" + algo + "/";
+        auto num_samples = double(options.width * options.height * options.samples);
+        report.add(prefix + "msamples_per_s", num_samples / (render_ms * 1e3), "Msamples/s", true);
+        if (Stats::enabled)
+            report.add(prefix + "mrays_per_s", (total_rays() - rays_before) / (render_ms * 1e3), "Mrays/s", true);
+        if (measure_error) {
+            report.add(prefix + "mse", mse, "", false);
+            if (time_to_target >= 0.0)
+                report.add(prefix + "time_to_target_mse", time_to_target, "s", false);
+            else
+                info("  ", prefix, "time_to_target_mse: target MSE of ", options.target_mse, " not reached");
+        }
+        if (rss_before != 0)
+            report.add(prefix + "peak_rss_growth", (std::max(peak_rss(), rss_before) - rss_before) / double(1 << 20), "MB", false);
+    }
+    return true;
+}
+
+bool run_scene_benchmarks(const SceneOptions& options, BenchReport& report) {
+    auto scenes = options.scenes;
+    if (scenes.empty()) {
+        std::string config;
+        if (!write_builtin_scene(options.work_dir, config)) {
+            error("Cannot write the built-in scene to '", options.work_dir, "'.");
+            return false;
+        }
+        scenes.push_back(config);
+    }
+    if (!Stats::enabled)
+        info("Ray throughput is only measured when compiled with ENABLE_STATS = ON.");
+
+    bool ok = true;
+    for (auto& scene : scenes)
+        ok &= bench_scene(scene, options, report);
+    return ok;
+}
@@ -0,0 +1,66 @@
+#include <cmath>
+
+#include "adaptive.h"
+
+void AdaptiveSampling::reset(size_t width, size_t height) {
+    moments.resize(width, height);
+    moments.clear();
+    tiles_x = (width + default_tile_width - 1) / default_tile_width;
+    auto tiles_y = (height + default_tile_height - 1) / default_tile_height;
+    tile_converged.assign(tiles_x * tiles_y, 0);
+    num_converged = 0;
+}
+
+float AdaptiveSampling::pixel_error(const Image& img, size_t frames, size_t x, size_t y) const {
+    auto& m = moments(x, y);
+    auto n = m.w;
+    if (n < 2.0f || frames == 0)
+        return INFINITY;
+
+    // The image holds the sum of the frames, whose average is the mean of the samples, even for the skipped tiles
+    auto mean = rgb(img(x, y)) / float(frames);
+    auto variance = max(rgb(m) / n - mean * mean, rgb(0.0f)) * (n / (n - 1.0f));
+    auto lum_mean = dot(luminance, mean);
+    auto lum_variance = dot(luminance, variance);
+    // The constant keeps the error of dark pixels from exploding, as their noise is not visible
+    return std::sqrt(lum_variance / n) / (lum_mean + 0.01f);
+}
+
+void AdaptiveSampling::fill_tile(Image& img, size_t frames, size_t xmin, size_t ymin, size_t xmax, size_t ymax) const {
+    auto inv = 1.0f / float(frames);
+    for (size_t y = ymin; y < ymax; y++) {
+        for (size_t x = xmin; x < xmax; x++)
+            img(x, y) += img(x, y) * inv;
+    }
+}
+
+void AdaptiveSampling::update_tile(const Image& img, size_t frames, size_t tile, size_t xmin, size_t ymin, size_t xmax, size_t ymax) {
+    // The brightest noise of the tile decides, so that small noisy features are not averaged away
+    float max_error = 0.0f;
+    for (size_t y = ymin; y < ymax; y++) {
+        for (size_t x = xmin; x < xmax; x++) {
+            if (samples(x, y) < min_samples)
+                return;
+            max_error = std::max(max_error, pixel_error(img, frames, x, y));
+        }
+    }
+    if (max_error < threshold) {
+        tile_converged[tile] = 1;
+        num_converged++;
+    }
+}
+
+bool AdaptiveSampling::save_map(const std::string& file_name, const Image& img, size_t frames) const {
+    Image map(img.width, img.height);
+    for (size_t y = 0; y < img.height; y++) {
+        for (size_t x = 0; x < img.width; x++) {
+            auto tile = (y / default_tile_height) * tiles_x + x / default_tile_width;
+            map(x, y) = rgba(
+                std::min(pixel_error(img, frames, x, y), 1e6f),
+                frames > 0 ? samples(x, y) / float(frames) : 0.0f,
+                tile_converged[tile] ? 1.0f : 0.0f,
+                1.0f);
+        }
+    }
+    return save_exr(file_name, map);
+}
@@ -0,0 +1,85 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <vector>
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+
+#include "image.h"
+#include "renderer.h"
+
+/// Per-pixel variance estimation, used to stop sampling the tiles whose estimated error is below a threshold.
+/// The time that is not spent on converged tiles goes to the remaining ones, which get more frames within a time budget.
+class AdaptiveSampling {
+public:
+    /// The threshold is the relative standard error of the mean luminance of a pixel. Tiles are only
+    /// retired once all their pixels have received at least the given number of samples.
+    AdaptiveSampling(float threshold, size_t min_samples)
+        : threshold(threshold), min_samples(std::max(min_samples, size_t(2)))
+    {}
+
+    /// Clears the statistics, for an image of the given size. Must be called whenever the renderer is reset.
+    void reset(size_t width, size_t height);
+
+    /// Calls f(xmin, ymin, xmax, ymax) on a tile of the default size, unless it has converged, and updates its error
+    /// once its pixels have received one more sample. The tiles that are skipped get the current average of their
+    /// pixels added to the image instead, so that every pixel of the image is still the sum of the given number of frames.
+    template <typename F>
+    void process_tile(Image& img, size_t frames, size_t xmin, size_t ymin, size_t xmax, size_t ymax, F f) {
+        auto tile = (ymin / default_tile_height) * tiles_x + xmin / default_tile_width;
+        if (tile_converged[tile]) {
+            fill_tile(img, frames, xmin, ymin, xmax, ymax);
+            return;
+        }
+        f(xmin, ymin, xmax, ymax);
+        update_tile(img, frames + 1, tile, xmin, ymin, xmax, ymax);
+    }
+
+    /// Records the second moment of a sample. Must be called for every sample added to the image.
+    void add_sample(size_t x, size_t y, const rgb& color) {
+        moments(x, y) += rgba(color * color, 1.0f);
+    }
+
+    /// Returns the number of samples that a pixel received.
+    size_t samples(size_t x, size_t y) const { return size_t(moments(x, y).w); }
+    /// Returns the estimated relative error of a pixel, after the given number of frames.
+    float pixel_error(const Image& img, size_t frames, size_t x, size_t y) const;
+
+    size_t num_tiles() const { return tile_converged.size(); }
+    size_t num_converged_tiles() const { return num_converged; }
+    bool converged() const { return num_converged == tile_converged.size(); }
+
+    /// Saves a map of the pixel errors (red), sample counts relative to the number of frames (green), and converged tiles (blue), in EXR format.
+    bool save_map(const std::string& file_name, const Image& img, size_t frames) const;
+
+private:
+    void fill_tile(Image& img, size_t frames, size_t xmin, size_t ymin, size_t xmax, size_t ymax) const;
+    void update_tile(const Image& img, size_t frames, size_t tile, size_t xmin, size_t ymin, size_t xmax, size_t ymax);
+
+    float threshold;
+    size_t min_samples;
+
+    Image moments;                          ///< Sum of the squared samples (RGB), and number of samples (A)
+    size_t tiles_x = 0;
+    std::vector<uint8_t> tile_converged;
+    std::atomic<size_t> num_converged { 0 };
+};
+
+/// Renders the whole image tile by tile, like process_tiles, but skips the converged tiles when adaptive sampling is enabled.
+/// The given number of frames is the number of frames already accumulated in the image.
+template <typename F>
+void process_adaptive_tiles(AdaptiveSampling* adaptive, Image& img, size_t frames, F f) {
+    if (!adaptive) {
+        process_tiles(0, 0, img.width, img.height, default_tile_width, default_tile_height, f);
+        return;
+    }
+    process_tiles(0, 0, img.width, img.height,
+        default_tile_width, default_tile_height,
+        [&] (size_t xmin, size_t ymin, size_t xmax, size_t ymax) {
+        adaptive->process_tile(img, frames, xmin, ymin, xmax, ymax, f);
+    });
+}
+
+#endif // ADAPTIVE_H
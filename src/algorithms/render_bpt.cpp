@@ -0,0 +1,395 @@
+#include <vector>
+#include <atomic>
+
+#include "../scene.h"
+#include "../color.h"
+#include "../samplers.h"
+#include "../cameras.h"
+#include "../hash.h"
+#include "../debug.h"
+#include "../renderer.h"
+
+/// Number of light paths traced by each task of the light pass.
+static constexpr size_t bpt_light_chunk_size = 256;
+
+/// Vertex of a light subpath, stored in the light vertex cache.
+struct LightVertex {
+    SurfaceParams surf;     ///< Surface parameters at the vertex
+    float3 in;              ///< Direction towards the previous vertex of the light subpath
+    const Bsdf* bsdf;       ///< BSDF at the vertex
+    rgb throughput;         ///< Throughput of the light subpath, including the emission
+    float dvcm, dvc;        ///< Partial MIS quantities (see below)
+    uint32_t path_len;      ///< Number of segments of the light subpath
+};
+
+/// State of a subpath that is being traced, including the partial MIS quantities of
+/// "Light Transport Simulation with Vertex Connection and Merging", Georgiev et al. 2012.
+/// Only the vertex connection part of the technique is used here.
+struct SubpathState {
+    Ray ray;
+    rgb throughput;
+    float dvcm, dvc;
+    uint32_t path_len;
+    bool specular;          ///< True if all the vertices so far were specular
+};
+
+/// Bidirectional Path Tracing, where the camera subpaths are connected to vertices chosen at random
+/// among all the light subpaths of the current iteration, following "Light Vertex Cache BPT", Davidovic et al. 2014.
+/// Light tracing splats are accumulated in one framebuffer per thread.
+class BidirPathTracingRenderer : public Renderer {
+public:
+    BidirPathTracingRenderer(const Scene& scene, bool connect, bool light_tracing, size_t max_path_len)
+        : Renderer(scene)
+        , connect(connect)
+        , light_tracing(light_tracing)
+        , max_path_len(max_path_len)
+    {}
+
+    std::string name() const override { return "bpt"; }
+
+    void reset() override { iter = 1; }
+
+    void render(Image& img) override {
+        auto& pool = ThreadPool::instance();
+        auto num_light_paths = img.width * img.height;
+        num_paths = num_light_paths;
+
+        auto kx = 2.0f / (img.width - 1);
+        auto ky = 2.0f / (img.height - 1);
+        pixel_density = 4.0f / (kx * ky);
+
+        // Trace the light subpaths, store their vertices, and connect them to the camera
+        auto num_chunks = connect || light_tracing ? num_light_paths / bpt_light_chunk_size + (num_light_paths % bpt_light_chunk_size ? 1 : 0) : 0;
+        vertex_caches.resize(num_chunks);
+        splat_buffers.resize(pool.num_threads());
+        for (auto& cache : vertex_caches) cache.clear();
+        if (light_tracing) {
+            for (auto& buffer : splat_buffers) {
+                buffer.resize(img.width, img.height);
+                buffer.clear();
+            }
+        }
+
+        // Each chunk has its own vertex cache, and each path its own sampler, so that the cache does not depend on scheduling
+        pool.run_tasks(num_chunks, [&] (size_t chunk, size_t worker) {
+            for (size_t i = chunk * bpt_light_chunk_size, n = std::min((chunk + 1) * bpt_light_chunk_size, num_light_paths); i < n; ++i) {
+                PcgSampler sampler(sampler_seed(i, iter) ^ 0x2C1B3C6D);
+                trace_light_path(vertex_caches[chunk], splat_buffers[worker], sampler);
+            }
+        });
+
+        cache_offsets.resize(vertex_caches.size() + 1);
+        cache_offsets[0] = 0;
+        for (size_t i = 0; i < vertex_caches.size(); ++i)
+            cache_offsets[i + 1] = cache_offsets[i] + vertex_caches[i].size();
+
+        // Connect each camera vertex to as many light vertices as there are, on average, in a light subpath
+        auto num_vertices = cache_offsets.back();
+        num_connections = std::max(size_t(1), (num_vertices + num_light_paths / 2) / num_light_paths);
+        connection_scale = float(num_vertices) / float(num_light_paths * num_connections);
+
+        process_tiles(0, 0, img.width, img.height,
+            default_tile_width, default_tile_height,
+            [&] (size_t xmin, size_t ymin, size_t xmax, size_t ymax) {
+                for (size_t y = ymin; y < ymax; y++) {
+                    for (size_t x = xmin; x < xmax; x++) {
+                        debug_raster(x, y);
+                        auto sampler = make_sampler<PcgSampler>(y * img.width + x, iter);
+                        auto u = (x + sampler()) * kx - 1.0f;
+                        auto v = 1.0f - (y + sampler()) * ky;
+                        auto color = trace_camera_path(u, v, sampler);
+
+                        // Add the light tracing contributions that were splatted on this pixel
+                        if (light_tracing) {
+                            for (auto& buffer : splat_buffers)
+                                color += rgb(buffer(x, y));
+                        }
+                        img(x, y) += rgba(color, 1.0f);
+                    }
+                }
+            });
+        iter++;
+    }
+
+private:
+    void trace_light_path(std::vector<LightVertex>& cache, Image& splats, Sampler& sampler);
+    void connect_to_camera(const LightVertex& vertex, Image& splats);
+    rgb trace_camera_path(float u, float v, Sampler& sampler);
+    rgb connect_to_light(const SubpathState& state, const SurfaceParams& surf, const Bsdf* bsdf, const float3& out, Sampler& sampler);
+    rgb connect_vertices(const SubpathState& state, const SurfaceParams& surf, const Bsdf* bsdf, const float3& out, const LightVertex& vertex);
+    bool sample_scattering(SubpathState& state, const SurfaceParams& surf, const Bsdf* bsdf, const float3& out, Sampler& sampler, bool adjoint);
+
+    /// Returns the probability density (in solid angle, per pixel) to generate a ray through the given point of the image plane.
+    float camera_pdf(float u, float v) const {
+        auto geom = scene.camera->geometry(u, v);
+        return geom.dist * geom.dist / geom.cos * geom.area * pixel_density;
+    }
+
+    const LightVertex& cache_vertex(size_t i) const {
+        auto cache = std::upper_bound(cache_offsets.begin(), cache_offsets.end(), i) - cache_offsets.begin() - 1;
+        return vertex_caches[cache][i - cache_offsets[cache]];
+    }
+
+    std::vector<std::vector<LightVertex>> vertex_caches;   ///< Light vertices of the current iteration, one cache per chunk of light paths
+    std::vector<size_t> cache_offsets;
+    std::vector<Image> splat_buffers;                       ///< Light tracing contributions, one framebuffer per thread
+    size_t num_paths;
+    float pixel_density;        ///< Number of pixels per unit area of the image plane, relative to the camera geometry
+    size_t num_connections;
+    float connection_scale;
+
+    bool connect;
+    bool light_tracing;
+    size_t max_path_len;
+    size_t iter;
+};
+
+bool BidirPathTracingRenderer::sample_scattering(SubpathState& state, const SurfaceParams& surf, const Bsdf* bsdf, const float3& out, Sampler& sampler, bool adjoint) {
+    auto bsdf_sample = bsdf->sample(sampler, surf, out, adjoint);
+    if (bsdf_sample.pdf <= 0.0f || lensqr(bsdf_sample.color) <= 0.0f)
+        return false;
+
+    auto cos_out = std::fabs(dot(bsdf_sample.in, surf.coords.n));
+    if (bsdf->type() == Bsdf::Type::Specular) {
+        state.dvcm = 0.0f;
+        state.dvc *= cos_out;
+    } else {
+        auto rev_pdf = bsdf->pdf(out, surf, bsdf_sample.in);
+        state.dvc = cos_out / bsdf_sample.pdf * (state.dvc * rev_pdf + state.dvcm);
+        state.dvcm = 1.0f / bsdf_sample.pdf;
+        state.specular = false;
+    }
+
+    // The color of the sample includes the cosine term
+    state.throughput *= bsdf_sample.color / bsdf_sample.pdf;
+    state.ray = Ray(surf.point, bsdf_sample.in, offset);
+
+    // Russian roulette only affects the throughput, not the MIS weights
+    if (state.path_len > 3) {
+        auto rr_prob = russian_roulette(state.throughput, 0.75f);
+        if (sampler() > rr_prob)
+            return false;
+        state.throughput = state.throughput / rr_prob;
+    }
+    return true;
+}
+
+void BidirPathTracingRenderer::trace_light_path(std::vector<LightVertex>& cache, Image& splats, Sampler& sampler) {
+    if (scene.lights.empty())
+        return;
+
+    // Lights are selected proportionally to their power, both here and when connecting camera vertices to lights
+    auto selection = scene.light_sampler.sample_emission(sampler());
+    auto light = selection.light;
+    auto emission = light->sample_emission(sampler);
+    auto emission_pdf = emission.pdf_area * emission.pdf_dir * selection.pdf;
+    if (emission_pdf <= 0.0f || emission.cos <= 0.0f)
+        return;
+
+    SubpathState state;
+    state.ray = Ray(emission.pos, emission.dir, offset);
+    state.throughput = emission.intensity * emission.cos / emission_pdf;
+    state.dvcm = 1.0f / emission.pdf_dir;
+    state.dvc = light->has_area() ? emission.cos / emission_pdf : 0.0f;
+    state.path_len = 1;
+    state.specular = false;
+
+    for (; state.path_len < max_path_len; state.path_len++) {
+        auto hit = scene.intersect(state.ray, RayStage::Photon);
+        if (hit.tri < 0)
+            break;
+
+        auto surf = scene.surface_params(state.ray, hit);
+        auto& mat = scene.material(hit);
+        auto out = -state.ray.dir;
+        if (!mat.bsdf)
+            break;
+
+        auto cos_in = std::fabs(dot(out, surf.coords.n));
+        state.dvcm *= hit.t * hit.t / cos_in;
+        state.dvc /= cos_in;
+
+        if (mat.bsdf.type() != Bsdf::Type::Specular) {
+            LightVertex vertex;
+            vertex.surf = surf;
+            vertex.in = out;
+            vertex.bsdf = &mat.bsdf;
+            vertex.throughput = state.throughput;
+            vertex.dvcm = state.dvcm;
+            vertex.dvc = state.dvc;
+            vertex.path_len = state.path_len;
+            if (connect)
+                cache.push_back(vertex);
+            if (light_tracing)
+                connect_to_camera(vertex, splats);
+        }
+
+        if (state.path_len + 2 > max_path_len || !sample_scattering(state, surf, &mat.bsdf, out, sampler, true))
+            break;
+    }
+}
+
+void BidirPathTracingRenderer::connect_to_camera(const LightVertex& vertex, Image& splats) {
+    auto uvz = scene.camera->project(vertex.surf.point);
+    if (uvz.z <= 0.0f)
+        return;
+    auto u = uvz.x / uvz.z;
+    auto v = uvz.y / uvz.z;
+    auto x = (u + 1.0f) * 0.5f * (splats.width - 1);
+    auto y = (1.0f - v) * 0.5f * (splats.height - 1);
+    if (x < 0 || y < 0 || x >= splats.width || y >= splats.height)
+        return;
+
+    auto eye = scene.camera->unproject(vertex.surf.point);
+    auto to_camera = eye - vertex.surf.point;
+    auto dist = length(to_camera);
+    to_camera = to_camera * (1.0f / dist);
+
+    auto cos_surf = std::fabs(dot(to_camera, vertex.surf.coords.n));
+    auto bsdf_value = vertex.bsdf->eval(vertex.in, vertex.surf, to_camera);
+    if (lensqr(bsdf_value) <= 0.0f)
+        return;
+
+    // Conversion from the image plane to the surface area measure
+    auto camera_pdf_a = camera_pdf(u, v) * cos_surf / (dist * dist);
+
+    float mis_weight = 1.0f;
+    if (connect) {
+        auto rev_pdf = vertex.bsdf->pdf(vertex.in, vertex.surf, to_camera);
+        auto w_light = camera_pdf_a / float(num_paths) * (vertex.dvcm + vertex.dvc * rev_pdf);
+        mis_weight = 1.0f / (w_light + 1.0f);
+    }
+
+    if (scene.occluded(Ray(vertex.surf.point, to_camera, offset, dist - offset)))
+        return;
+
+    auto contrib = vertex.throughput * bsdf_value * (mis_weight * camera_pdf_a / float(num_paths));
+    splats(x, y) += rgba(contrib, 0.0f);
+}
+
+rgb BidirPathTracingRenderer::connect_to_light(const SubpathState& state, const SurfaceParams& surf, const Bsdf* bsdf, const float3& out, Sampler& sampler) {
+    auto selection = scene.light_sampler.sample_emission(sampler());
+    auto light = selection.light;
+    auto ls = light->sample_direct(surf.point, sampler);
+    if (ls.cos <= 0.0f)
+        return rgb(0.0f);
+
+    auto dist = length(ls.pos - surf.point);
+    auto dir = (ls.pos - surf.point) * (1.0f / dist);
+    auto cos_surf = std::fabs(dot(dir, surf.coords.n));
+    auto bsdf_value = bsdf->eval(dir, surf, out);
+    if (lensqr(bsdf_value) <= 0.0f)
+        return rgb(0.0f);
+
+    // Probabilities to generate this connection with the other techniques
+    auto direct_pdf_w = ls.pdf_area * dist * dist / ls.cos;
+    auto emission_pdf_w = ls.pdf_area * ls.pdf_dir;
+    auto bsdf_pdf = light->has_area() ? bsdf->pdf(dir, surf, out) : 0.0f;
+    auto rev_pdf = bsdf->pdf(out, surf, dir);
+    auto w_light = bsdf_pdf / (direct_pdf_w * selection.pdf);
+    auto w_camera = emission_pdf_w * cos_surf / (direct_pdf_w * ls.cos) * (state.dvcm + state.dvc * rev_pdf);
+    auto mis_weight = 1.0f / (w_light + 1.0f + w_camera);
+
+    if (scene.occluded(Ray(surf.point, dir, offset, dist - offset)))
+        return rgb(0.0f);
+
+    return state.throughput * bsdf_value * ls.intensity * (mis_weight * cos_surf / (direct_pdf_w * selection.pdf));
+}
+
+rgb BidirPathTracingRenderer::connect_vertices(const SubpathState& state, const SurfaceParams& surf, const Bsdf* bsdf, const float3& out, const LightVertex& vertex) {
+    auto d = vertex.surf.point - surf.point;
+    auto dist2 = lensqr(d);
+    auto dist = std::sqrt(dist2);
+    auto dir = d * (1.0f / dist);
+
+    auto camera_value = bsdf->eval(dir, surf, out);
+    auto light_value = vertex.bsdf->eval(vertex.in, vertex.surf, -dir);
+    if (lensqr(camera_value) <= 0.0f || lensqr(light_value) <= 0.0f)
+        return rgb(0.0f);
+
+    auto cos_camera = std::fabs(dot(dir, surf.coords.n));
+    auto cos_light = std::fabs(dot(dir, vertex.surf.coords.n));
+    auto geom = cos_camera * cos_light / dist2;
+
+    // Convert the solid angle densities of both BSDFs to the area measure at the other vertex
+    auto camera_pdf_a = bsdf->pdf(dir, surf, out) * cos_light / dist2;
+    auto camera_rev_pdf = bsdf->pdf(out, surf, dir);
+    auto light_pdf_a = vertex.bsdf->pdf(-dir, vertex.surf, vertex.in) * cos_camera / dist2;
+    auto light_rev_pdf = vertex.bsdf->pdf(vertex.in, vertex.surf, -dir);
+
+    auto w_light = camera_pdf_a * (vertex.dvcm + vertex.dvc * light_rev_pdf);
+    auto w_camera = light_pdf_a * (state.dvcm + state.dvc * camera_rev_pdf);
+    auto mis_weight = 1.0f / (w_light + 1.0f + w_camera);
+
+    if (scene.occluded(Ray(surf.point, dir, offset, dist - offset)))
+        return rgb(0.0f);
+
+    return state.throughput * vertex.throughput * camera_value * light_value * (mis_weight * geom);
+}
+
+rgb BidirPathTracingRenderer::trace_camera_path(float u, float v, Sampler& sampler) {
+    SubpathState state;
+    state.ray = scene.camera->gen_ray(u, v);
+    state.ray.tmin = offset;
+    state.throughput = rgb(1.0f);
+    state.dvcm = light_tracing && connect ? float(num_paths) / camera_pdf(u, v) : 0.0f;
+    state.dvc = 0.0f;
+    state.path_len = 1;
+    state.specular = true;
+
+    auto num_vertices = cache_offsets.back();
+    rgb color(0.0f);
+    for (; state.path_len < max_path_len; state.path_len++) {
+        auto hit = scene.intersect(state.ray, state.path_len == 1 ? RayStage::Primary : RayStage::Bounce);
+        if (hit.tri < 0)
+            break;
+
+        auto surf = scene.surface_params(state.ray, hit);
+        auto& mat = scene.material(hit);
+        auto out = -state.ray.dir;
+
+        auto cos_in = std::fabs(dot(out, surf.coords.n));
+        state.dvcm *= hit.t * hit.t / cos_in;
+        state.dvc /= cos_in;
+
+        if (auto light = mat.emitter) {
+            if (surf.entering) {
+                auto emission = light->emission(out, hit.u, hit.v);
+                if (state.path_len == 1 || !connect) {
+                    // Light tracing cannot hit the camera, so directly visible lights are only found here
+                    if (state.path_len == 1 || !light_tracing)
+                        color += state.throughput * emission.intensity;
+                } else {
+                    auto light_pdf = scene.light_sampler.pdf_emission(light);
+                    auto direct_pdf_a = emission.pdf_area * light_pdf;
+                    auto emission_pdf_w = emission.pdf_area * emission.pdf_dir * light_pdf;
+                    auto w_camera = direct_pdf_a * state.dvcm + emission_pdf_w * state.dvc;
+                    color += state.throughput * emission.intensity * (1.0f / (1.0f + w_camera));
+                }
+            }
+        }
+
+        if (!mat.bsdf || state.path_len >= max_path_len)
+            break;
+
+        if (connect && mat.bsdf.type() != Bsdf::Type::Specular) {
+            if (!scene.lights.empty())
+                color += connect_to_light(state, surf, &mat.bsdf, out, sampler);
+
+            for (size_t i = 0; i < num_connections && num_vertices > 0; ++i) {
+                auto& vertex = cache_vertex(std::min(size_t(sampler() * num_vertices), num_vertices - 1));
+                if (vertex.path_len + state.path_len + 1 > max_path_len)
+                    continue;
+                color += connect_vertices(state, surf, &mat.bsdf, out, vertex) * connection_scale;
+            }
+        }
+
+        if (!sample_scattering(state, surf, &mat.bsdf, out, sampler, false))
+            break;
+    }
+    return color;
+}
+
+std::unique_ptr<Renderer> create_bpt_renderer(const Scene& scene, bool connect, bool light_tracing, size_t max_path_len) {
+    return std::unique_ptr<Renderer>(new BidirPathTracingRenderer(scene, connect, light_tracing, max_path_len));
+}
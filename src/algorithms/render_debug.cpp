@@ -6,6 +6,8 @@
 #include "../hash.h"
 #include "../debug.h"
 #include "../renderer.h"
+#include "../adaptive.h"
+#include "../denoise.h"
 
 class DebugRenderer : public Renderer {
 public:
@@ -15,35 +17,47 @@ public:
 
     std::string name() const override { return "debug"; }
 
-    void reset() override { iter = 1; }
+    bool supports_adaptive() const override { return true; }
+    bool supports_features() const override { return true; }
+    bool supports_sample_ranges() const override { return true; }
+
+    void reset() override { iter = first_frame + 1; }
 
     void render(Image& img) {
         auto kx = 2.0f / (img.width - 1);
         auto ky = 2.0f / (img.height - 1);
-        process_tiles(0, 0, img.width, img.height,
-            default_tile_width, default_tile_height,
+        process_adaptive_tiles(adaptive, img, iter - 1 - first_frame,
             [&] (size_t xmin, size_t ymin, size_t xmax, size_t ymax) {
-            UniformSampler sampler(sampler_seed(xmin ^ ymin, iter));
-            for (size_t y = ymin; y < ymax; ++y) {
-                for (size_t x = xmin; x < xmax; ++x) {
-                    auto ray = scene.camera->gen_ray(
-                        (x + sampler()) * kx - 1.0f,
-                        1.0f - (y + sampler()) * ky);
-                    Hit hit = scene.intersect(ray);
-
-                    rgba color(0.0f);
-                    if (hit.tri >= 0) {
-                        auto n0 = scene.normals[scene.indices[hit.tri * 4 + 0]];
-                        auto n1 = scene.normals[scene.indices[hit.tri * 4 + 1]];
-                        auto n2 = scene.normals[scene.indices[hit.tri * 4 + 2]];
-                        auto n = normalize(lerp(n0, n1, n2, hit.u, hit.v));
-                        auto k = fabsf(dot(n, ray.dir));
-                        color = rgba(k, k, k, 1.0f);
-                    }
-
-                    img(x, y) += color;
+            // Trace all the camera rays of the tile at once
+            Ray rays[default_tile_width * default_tile_height];
+            Hit hits[default_tile_width * default_tile_height];
+            size_t count = 0;
+            for_each_pixel_in_blocks(xmin, ymin, xmax, ymax, [&] (size_t x, size_t y) {
+                auto sampler = make_sampler<PcgSampler>(y * img.width + x, iter);
+                rays[count++] = scene.camera->gen_ray(
+                    (x + sampler()) * kx - 1.0f,
+                    1.0f - (y + sampler()) * ky);
+            });
+            scene.intersect_stream(rays, hits, count);
+
+            count = 0;
+            for_each_pixel_in_blocks(xmin, ymin, xmax, ymax, [&] (size_t x, size_t y) {
+                auto& ray = rays[count];
+                auto& hit = hits[count++];
+
+                rgba color(0.0f);
+                if (hit.tri >= 0) {
+                    auto n = scene.shading_normal(hit);
+                    auto k = fabsf(dot(n, ray.dir));
+                    color = rgba(k, k, k, 1.0f);
                 }
-            }
+
+                img(x, y) += color;
+                if (adaptive)
+                    adaptive->add_sample(x, y, rgb(color));
+                if (features)
+                    features->add_first_hit(x, y, scene, ray, hit);
+            });
         });
         iter++;
     }
@@ -6,41 +6,47 @@
 #include "../hash_grid.h"
 #include "../debug.h"
 #include "../renderer.h"
+#include "../adaptive.h"
+#include "../arena.h"
+#include "../kernels.h"
 
-#ifdef USE_STD_THREAD
-#include <mutex>
-#endif
-
-#ifdef _OPENMP
-#include <omp.h>
-#define OMP_THREAD_NUM() omp_get_thread_num()
-#else
-#define OMP_THREAD_NUM() 0
-#endif
+#include "../parallel.h"
 
+/// Compact photon record: the full surface parameters are not needed during the gather pass.
 struct Photon
 {
-  rgb contrib;        ///< Path contribution
-  SurfaceParams surf; ///< Surface parameters at the vertex
-  float3 in_dir;      ///< Incoming direction
+  float3 pos;         ///< Position of the vertex
+  uint32_t in_dir;    ///< Incoming direction (octahedral encoding, see pack_unit_vector)
+  uint32_t contrib;   ///< Path contribution (RGBE encoding, see pack_rgbe)
+  uint32_t normal;    ///< Shading normal at the vertex (octahedral encoding)
 
   Photon() {}
   Photon(const rgb &c, const SurfaceParams &s, const float3 &i)
-    : contrib(c), surf(s), in_dir(i)
+    : pos(s.point), in_dir(pack_unit_vector(i)), contrib(pack_rgbe(c)), normal(pack_unit_vector(s.coords.n))
   {
   }
 };
 
+/// Photons of a batch of light paths, allocated in the arena of the emitting thread.
+using PhotonBuffer = ArenaVector<Photon>;
+
+/// Number of light paths traced by each task during photon emission.
+static constexpr size_t photon_chunk_size = 256;
+/// Number of light paths traced between two reservations of space in the photon store.
+static constexpr size_t photon_batch_size = 32;
+
 class PhotonMappingRenderer : public Renderer
 {
   public:
     PhotonMappingRenderer(const Scene &scene, size_t max_path_len)
-      : Renderer(scene), max_path_len(max_path_len)
+      : Renderer(scene), kernel(kernel_features(scene)), max_path_len(max_path_len)
     {
     }
 
     std::string name() const override { return "ppm"; }
 
+    bool supports_adaptive() const override { return true; }
+
     void reset() override { iter = 1; }
 
     void render(Image &img) override
@@ -51,93 +57,138 @@ class PhotonMappingRenderer : public Renderer
       if (iter == 1)
 	base_radius = 2.0f * estimate_pixel_size(img.width, img.height);
 
-      auto kx = 2.0f / (img.width - 1);
-      auto ky = 2.0f / (img.height - 1);
-
       auto light_path_count = img.width * img.height;
-      photons.clear();
-
-      // Trace a light path for every pixel
-#ifdef USE_STD_THREAD
-      std::mutex photon_mutex;
-      size_t batch_size = 32;
-      parallel_for(0, light_path_count / batch_size + (light_path_count % batch_size ? 1 : 0),
-	  [&](size_t batch_id)
-	  {
-	  std::vector<Photon> photon_buffer;
-	  UniformSampler sampler(sampler_seed(batch_id, iter));
-
-	  int num = std::min((batch_id + 1) * batch_size, light_path_count) - batch_id * batch_size;
-	  for (int i = 0; i < num; ++i)
-	  trace_photons(photon_buffer, sampler);
-
-	  {
-	  std::lock_guard guard(photon_mutex);
-	  photons.insert(photons.end(), photon_buffer.begin(), photon_buffer.end());
-	  }
-	  });
-#else
-#pragma omp parallel
-      {
-	std::vector<Photon> photon_buffer;
-	UniformSampler sampler(sampler_seed(OMP_THREAD_NUM(), iter));
-
-#pragma omp for schedule(dynamic) nowait
-	for (size_t i = 0; i < light_path_count; i++)
-	  trace_photons(photon_buffer, sampler);
-
-#pragma omp critical
-	{
-	  photons.insert(photons.end(), photon_buffer.begin(), photon_buffer.end());
-	}
-      }
-#endif
+      emit_photons(light_path_count);
 
       // Build the photon map
       radius = base_radius / std::pow(float(iter), 0.5f * (1.0f - alpha));
-      photon_map.build(
-	  [&](size_t i)
-	  { return photons[i].surf.point; },
-	  photons.size(),
+      photon_map.build(photons, num_photons,
+	  [](const Photon &p)
+	  { return p.pos; },
 	  radius);
 
-      // Trace the eye paths
-      process_tiles(0, 0, img.width, img.height,
-	  default_tile_width, default_tile_height,
+      dispatch_kernel(kernel, [&](auto lights, auto)
+	  { gather<decltype(lights)::value>(img, light_path_count); });
+      iter++;
+    }
+
+    /// Traces the eye paths with a kernel specialized for the kinds of lights of the scene.
+    template <LightKinds lights>
+    void gather(Image &img, size_t light_path_count)
+    {
+      auto kx = 2.0f / (img.width - 1);
+      auto ky = 2.0f / (img.height - 1);
+
+      // Trace the eye paths, except in the converged tiles (the photons are still emitted for the whole image)
+      process_adaptive_tiles(adaptive, img, iter - 1,
 	  [&](size_t xmin, size_t ymin, size_t xmax, size_t ymax)
 	  {
-	  UniformSampler sampler(sampler_seed(xmin ^ ymin, iter));
+	  OccluderCache occluder;
 	  for (size_t y = ymin; y < ymax; y++)
 	  {
 	  for (size_t x = xmin; x < xmax; x++)
 	  {
+	  auto sampler = make_sampler<PcgSampler>(y * img.width + x, iter);
 	  auto ray = scene.camera->gen_ray((x + sampler()) * kx - 1.0f, 1.0f - (y + sampler()) * ky);
 	  debug_raster(x, y);
-	  img(x, y) += atomically(rgba(trace_eye_path(ray, sampler, light_path_count), 1.0f));
+	  // Every pixel belongs to exactly one tile, so it can be accumulated without atomics
+	  auto color = trace_eye_path<lights>(ray, sampler, light_path_count, occluder);
+	  img(x, y) += rgba(color, 1.0f);
+	  if (adaptive)
+	    adaptive->add_sample(x, y, color);
 	  }
 	  }
 	  });
-      iter++;
     }
 
-    void trace_photons(std::vector<Photon> &photons, Sampler &sampler);
-    rgb trace_eye_path(Ray ray, Sampler &sampler, size_t light_path_count);
+    void emit_photons(size_t light_path_count);
+    void trace_photons(PhotonBuffer &photons, Sampler &sampler, OccluderCache &occluder);
+    template <LightKinds lights>
+    rgb trace_eye_path(Ray ray, Sampler &sampler, size_t light_path_count, OccluderCache &occluder);
     float estimate_pixel_size(size_t w, size_t h);
 
   private:
-    std::vector<Photon> photons;
-    HashGrid photon_map;
+    /// Photons that did not fit in the store when they were emitted, along with their reserved position.
+    struct Overflow
+    {
+      size_t first = 0;
+      std::vector<Photon> photons;
+    };
+
+    std::vector<Photon> photons;    ///< Photon store, only the first num_photons elements are valid
+    std::vector<std::vector<Overflow>> overflows;
+    size_t num_photons = 0;
+    SortedHashGrid<Photon> photon_map;
+    KernelFeatures kernel;
     size_t max_path_len;
     size_t iter;
     float radius;
 };
 
-void PhotonMappingRenderer::trace_photons(std::vector<Photon> &photons, Sampler &sampler)
+void PhotonMappingRenderer::emit_photons(size_t light_path_count)
+{
+  // Each task traces its light paths in small batches into a local buffer, then atomically reserves
+  // a range in the photon store and copies the batch there. The store keeps its size from one
+  // iteration to the next, and the buffers are taken from the arena of the thread, so that in the common case,
+  // no allocation or lock is needed.
+  auto num_chunks = light_path_count / photon_chunk_size + (light_path_count % photon_chunk_size ? 1 : 0);
+  overflows.resize(num_chunks);
+
+  std::atomic<size_t> photon_count(0);
+  parallel_for(0, num_chunks, [&](size_t chunk)
+      {
+      ArenaScope scope;
+      PhotonBuffer buffer(scope.arena);
+      buffer.reserve(photon_batch_size * 4);
+      OccluderCache occluder;
+
+      auto& chunk_overflows = overflows[chunk];
+      chunk_overflows.clear();
+
+      size_t chunk_end = std::min((chunk + 1) * photon_chunk_size, light_path_count);
+      for (size_t i = chunk * photon_chunk_size; i < chunk_end; i += photon_batch_size)
+      {
+      buffer.clear();
+      for (size_t j = i, n = std::min(i + photon_batch_size, chunk_end); j < n; ++j)
+      {
+      PcgSampler sampler(sampler_seed(j, iter) ^ 0x5BD1E995);
+      trace_photons(buffer, sampler, occluder);
+      }
+
+      auto first = photon_count.fetch_add(buffer.size());
+      auto fit = std::min(buffer.size(), first < photons.size() ? photons.size() - first : 0);
+      // When the store is already full, first may be past its end
+      if (fit > 0)
+        std::copy(buffer.begin(), buffer.begin() + fit, photons.begin() + first);
+      if (fit < buffer.size())
+      {
+      // Photons that do not fit are copied once the store has been enlarged
+      chunk_overflows.emplace_back();
+      chunk_overflows.back().first = first + fit;
+      chunk_overflows.back().photons.assign(buffer.begin() + fit, buffer.end());
+      }
+      }
+      });
+
+  num_photons = photon_count;
+  if (num_photons > photons.size())
+  {
+    // Leave some room for the next iterations
+    photons.resize(num_photons + num_photons / 4);
+    parallel_for(0, num_chunks, [&](size_t chunk)
+        {
+        for (auto& overflow : overflows[chunk])
+        std::copy(overflow.photons.begin(), overflow.photons.end(), photons.begin() + overflow.first);
+        });
+  }
+}
+
+void PhotonMappingRenderer::trace_photons(PhotonBuffer &photons, Sampler &sampler, OccluderCache &occluder)
 {
-  // Choose a light to sample from (uniformly)
-  size_t light_idx = size_t(sampler() * scene.lights.size()) % scene.lights.size();
-  auto &light = scene.lights[light_idx];
-  float light_select_prob = 1.0f / scene.lights.size();
+  // Choose a light to sample from (proportionally to its power)
+  auto selection = scene.light_sampler.sample_emission(sampler());
+  auto light = selection.light;
+  float light_select_prob = selection.pdf;
   EmissionSample emission = light->sample_emission(sampler);
   Ray ray(emission.pos, emission.dir, offset);
   rgb throughput = rgb(1.0f);
@@ -145,32 +196,32 @@ void PhotonMappingRenderer::trace_photons(std::vector<Photon> &photons, Sampler
   // Compute total PDF for importance weighting:
   // - Area PDF (position on light)
   // - Direction PDF (direction from light)
-  // - Uniform probability over lights
+  // - Probability to select the light
   float total_light_pdf = emission.pdf_area * emission.pdf_dir * light_select_prob;
   // Multiply throughput by emitted radiance (already includes any color/intensity)
   throughput *= emission.intensity / total_light_pdf;
 
   for (size_t path_len = 0; path_len < max_path_len; path_len++)
   {
-    Hit hit = scene.intersect(ray);
+    Hit hit = scene.intersect(ray, RayStage::Photon);
     if (hit.tri < 0)
       break;
-    auto mat = scene.material(hit);
+    auto& mat = scene.material(hit);
     auto surf = scene.surface_params(ray, hit);
     auto out = -ray.dir;
 
     if (!mat.bsdf)
       break;
 
-    if (mat.bsdf->type() == Bsdf::Type::Glossy)
+    if (mat.bsdf.type() == Bsdf::Type::Glossy)
     {
       auto ls = light->sample_direct(surf.point, sampler);
       auto wi = normalize(ls.pos - surf.point);
       float dist = length(ls.pos - surf.point);
       //if (dot(wi, surf.coords.n) > 0 && !scene.occluded(Ray(surf.point, wi, offset, dist - offset)))
-      if (ls.cos > 0 && !scene.occluded(Ray(surf.point, wi, offset, dist - offset)))
+      if (ls.cos > 0 && !scene.occluded(Ray(surf.point, wi, offset, dist - offset), occluder))
       {
-	// auto bsdf_val = mat.bsdf->eval(wi, surf, out);
+	// auto bsdf_val = mat.bsdf.eval(wi, surf, out);
 	// convert area to solid‐angle or use pdf_dir for point lights
 	// The light pdf is wrong here
 	// float light_pdf = ls.pdf_dir;
@@ -184,9 +235,10 @@ void PhotonMappingRenderer::trace_photons(std::vector<Photon> &photons, Sampler
 	// add the NEE contribution (no MIS here for simplicity)
 	//throughput += throughput * bsdf_val * Li * ls.cos / (light_pdf * light_select_prob);
 	photons.push_back(Photon(throughput, surf, out));
+	Stats::count_photons(1);
       }
       // Now sample the glossy lobe and continue the eye path
-      auto bs = mat.bsdf->sample(sampler, surf, out);
+      auto bs = mat.bsdf.sample(sampler, surf, out);
       if (bs.pdf <= 0.0f)
 	break;
       throughput *= bs.color / bs.pdf; // bs.color includes cosine
@@ -195,14 +247,15 @@ void PhotonMappingRenderer::trace_photons(std::vector<Photon> &photons, Sampler
     }
 
     // Sample BSDF for next direction
-    BsdfSample bsdf_sample = mat.bsdf->sample(sampler, surf, out);
+    BsdfSample bsdf_sample = mat.bsdf.sample(sampler, surf, out);
     if (bsdf_sample.pdf <= 0.0f)
       break;
 
     // Store photon if surface is non-specular
-    if (mat.bsdf->type() != Bsdf::Type::Specular)
+    if (mat.bsdf.type() != Bsdf::Type::Specular)
     {
       photons.push_back(Photon(throughput, surf, out));
+      Stats::count_photons(1);
     }
 
     // Update throughput: multiply by BSDF/pdf
@@ -222,7 +275,8 @@ void PhotonMappingRenderer::trace_photons(std::vector<Photon> &photons, Sampler
   }
 }
 
-rgb PhotonMappingRenderer::trace_eye_path(Ray ray, Sampler &sampler, size_t light_path_count)
+template <LightKinds lights>
+rgb PhotonMappingRenderer::trace_eye_path(Ray ray, Sampler &sampler, size_t light_path_count, OccluderCache &occluder)
 {
   static size_t max_path_len = 10;
   rgb color(0.0f);
@@ -232,16 +286,15 @@ rgb PhotonMappingRenderer::trace_eye_path(Ray ray, Sampler &sampler, size_t ligh
   ray.tmin = offset;
   for (size_t path_len = 0; path_len < max_path_len; path_len++)
   {
-    Hit hit = scene.intersect(ray);
+    Hit hit = scene.intersect(ray, RayStage::Gather);
     if (hit.tri < 0)
       break;
 
     auto surf = scene.surface_params(ray, hit);
-    auto mat = scene.material(hit);
+    auto& mat = scene.material(hit);
     auto out = -ray.dir;
-    auto cosTheta = std::abs(dot(out, surf.face_normal));
 
-    if (auto light = mat.emitter)
+    if (auto light = lights != LightKinds::Point ? mat.emitter : nullptr)
     {
       // Direct hits on a light source - add the emission
       if (surf.entering && !lastBounceGlossy)
@@ -254,25 +307,25 @@ rgb PhotonMappingRenderer::trace_eye_path(Ray ray, Sampler &sampler, size_t ligh
     if (!mat.bsdf)
       break;
 
-    if (mat.bsdf->type() == Bsdf::Type::Glossy)
+    if (mat.bsdf.type() == Bsdf::Type::Glossy)
     {
       // (a) Compute direct illumination: sample a light
-      size_t light_idx = size_t(sampler() * scene.lights.size());
-      float light_select_prob = 1.0f / scene.lights.size();
-      auto light = scene.lights[light_idx].get();
+      auto selection = scene.light_sampler.sample_direct(surf.point, surf.coords.n, sampler());
+      float light_select_prob = selection.pdf;
+      auto light = selection.light;
       auto ls = light->sample_direct(surf.point, sampler);
       auto wi = normalize(ls.pos - surf.point);
       float dist = length(ls.pos - surf.point);
 
-      if (dot(wi, surf.coords.n) > 0 && !scene.occluded(Ray(surf.point, wi, offset, dist - offset)))
+      if (dot(wi, surf.coords.n) > 0 && !scene.occluded(Ray(surf.point, wi, offset, dist - offset), occluder))
       {
-	auto bsdf_val = mat.bsdf->eval(wi, surf, out);
-	float light_pdf = light->has_area()
+	auto bsdf_val = mat.bsdf.eval(wi, surf, out);
+	float light_pdf = has_area<lights>(light)
 	  ? ls.pdf_area * dist * dist / ls.cos
 	  : ls.pdf_dir;
 	float cos_theta = std::abs(dot(wi, surf.coords.n));
 	rgb Li = ls.intensity;
-	if (!light->has_area())
+	if (!has_area<lights>(light))
 	  Li *= (1.0f / (dist * dist));
 
 	// add direct lighting (no MIS here, as per instruction)
@@ -280,37 +333,38 @@ rgb PhotonMappingRenderer::trace_eye_path(Ray ray, Sampler &sampler, size_t ligh
       }
 
       // (b) Continue via glossy lobe
-      auto bs = mat.bsdf->sample(sampler, surf, out);
+      auto bs = mat.bsdf.sample(sampler, surf, out);
       if (bs.pdf <= 0.0f)
 	break;
       ray = Ray(surf.point, bs.in, offset);
       lastBounceGlossy = true;
     }
 
-    if (mat.bsdf->type() != Bsdf::Type::Specular)
+    if (mat.bsdf.type() != Bsdf::Type::Specular)
     {
       rgb accumulated = rgb(0.0f);
 
-      photon_map.query(surf.point, [&](size_t i)
-	  { return photons[i].surf.point; }, [&](size_t i, float d)
+      photon_map.query(surf.point, photons, [&](const Photon &p, float d)
 	  {
-	  const Photon& p = photons[i];
-	  auto hitDiff = p.surf.point - surf.point;
+	  // Reject photons that were deposited on surfaces facing away (e.g. the other side of a thin wall)
+	  if (dot(unpack_unit_vector(p.normal), surf.coords.n) <= 0.0f) return;
+	  auto in_dir = unpack_unit_vector(p.in_dir);
+	  auto hitDiff = p.pos - surf.point;
 	  hitDiff = hitDiff / radius;
 	  auto square = dot(hitDiff, hitDiff);
 	  square = 1 - square;
 	  float r2 = radius * radius;
 	  float d2 = d * d;
-	  float cosTheta_p = std::abs(dot(p.in_dir, surf.face_normal));
+	  float cosTheta_p = std::abs(dot(in_dir, surf.face_normal));
 
 	  if (d2 > r2) return;
 	  float r = d / radius;
 	  float k = (r <= 1.0f) ? (3.0f / 4.0f) * (1.0f - r * r) : 0.0f;
 
-	  rgb bsdf = mat.bsdf->eval(p.in_dir, surf, out);
+	  rgb bsdf = mat.bsdf.eval(in_dir, surf, out);
 
 	  float norm = (3.0f / (4.0f * M_PI * r2)) * (1.0f / light_path_count);
-	  accumulated += bsdf * p.contrib * k * cosTheta_p * norm;
+	  accumulated += bsdf * unpack_rgbe(p.contrib) * k * cosTheta_p * norm;
 	  });
 
       lastBounceGlossy = false;
@@ -318,7 +372,7 @@ rgb PhotonMappingRenderer::trace_eye_path(Ray ray, Sampler &sampler, size_t ligh
     }
 
     // Sample BSDF for next direction
-    BsdfSample bsdf = mat.bsdf->sample(sampler, surf, out);
+    BsdfSample bsdf = mat.bsdf.sample(sampler, surf, out);
     if (bsdf.pdf <= 0.0f)
       break;
 
@@ -360,7 +414,7 @@ float PhotonMappingRenderer::estimate_pixel_size(size_t w, size_t h)
       rays[i] = scene.camera->gen_ray(
 	  (x + (i % 2 ? 4 : 0)) * kx - 1.0f,
 	  1.0f - (y + (i / 2 ? 4 : 0)) * ky);
-      hits[i] = scene.intersect(rays[i]);
+      hits[i] = scene.intersect(rays[i], RayStage::Primary);
       }
       auto eval_distance = [&] (int i, int j) {
       if (hits[i].tri >= 0 && hits[i].tri == hits[j].tri) {
@@ -392,7 +446,7 @@ float PhotonMappingRenderer::estimate_pixel_size(size_t w, size_t h)
 	rays[i] = scene.camera->gen_ray(
 	    (x + (i % 2 ? 4 : 0)) * kx - 1.0f,
 	    1.0f - (y + (i / 2 ? 4 : 0)) * ky);
-	hits[i] = scene.intersect(rays[i]);
+	hits[i] = scene.intersect(rays[i], RayStage::Primary);
       }
       auto eval_distance = [&](int i, int j)
       {
@@ -5,75 +5,249 @@
 #include "../hash.h"
 #include "../debug.h"
 #include "../renderer.h"
+#include "../adaptive.h"
+#include "../guiding.h"
+#include "../denoise.h"
+#include "../kernels.h"
+#include "../shadows.h"
+#include "../spectrum.h"
 
-/// Path Tracing with MIS and Russian Roulette.
+/// Path Tracing with MIS and Russian Roulette, optionally guided by a spatio-directional radiance cache,
+/// or carrying the spectra of the light at four wavelengths per path instead of RGB colors.
 class PathTracingRenderer : public Renderer
 {
 public:
-    PathTracingRenderer(const Scene &scene, size_t max_path_len)
-        : Renderer(scene), max_path_len(max_path_len)
+    PathTracingRenderer(const Scene &scene, size_t max_path_len, SamplerType sampler_type, bool use_guiding, bool spectral)
+        : Renderer(scene), max_path_len(max_path_len), sampler_type(sampler_type), kernel(kernel_features(scene)), spectral(spectral), use_guiding(use_guiding)
     {
     }
 
     std::string name() const override { return "pt"; }
 
-    void reset() override { iter = 1; }
+    bool supports_adaptive() const override { return true; }
+    bool supports_features() const override { return true; }
+    bool supports_sample_ranges() const override { return true; }
+
+    void reset() override
+    {
+        iter = first_frame + 1;
+        if (use_guiding)
+        {
+            guiding = std::make_unique<GuidingField>(scene.bounds());
+            guiding_iter = 0;
+            guiding_frames = 0;
+        }
+    }
 
     void render(Image &img) override
+    {
+        if (sampler_type == SamplerType::Sobol)
+            render_with<SobolSampler>(img);
+        else
+            render_with<PcgSampler>(img);
+        iter++;
+
+        // Training iterations double in length, and the field learned during one is sampled during the next
+        if (guiding && ++guiding_frames == size_t(1) << guiding_iter)
+        {
+            guiding->end_iteration(guiding_iter++);
+            guiding_frames = 0;
+        }
+    }
+
+    /// Renders one sample per pixel, with the given sampler type, which is called without going through the virtual Sampler interface.
+    template <typename S>
+    void render_with(Image &img)
+    {
+        // The spectral mode is not specialized, as it is used for accuracy rather than speed
+        if (spectral)
+        {
+            render_kernel<S, LightKinds::Mixed, true, SpectralColors>(img);
+            return;
+        }
+        dispatch_kernel(kernel, [&](auto lights, auto specular)
+                        { render_kernel<S, decltype(lights)::value, decltype(specular)::value>(img); });
+    }
+
+    /// Renders one sample per pixel, with a kernel specialized for the kinds of lights of the scene and the presence of specular materials.
+    /// The paths carry the colors given by the color policy C (RgbColors or SpectralColors).
+    template <typename S, LightKinds lights, bool has_specular, typename C = RgbColors>
+    void render_kernel(Image &img)
     {
         auto kx = 2.0f / (img.width - 1);
         auto ky = 2.0f / (img.height - 1);
 
-        process_tiles(0, 0, img.width, img.height,
-                      default_tile_width, default_tile_height,
+        process_adaptive_tiles(adaptive, img, iter - 1 - first_frame,
                       [&](size_t xmin, size_t ymin, size_t xmax, size_t ymax)
                       {
-                          UniformSampler sampler(sampler_seed(xmin ^ ymin, iter));
-                          for (size_t y = ymin; y < ymax; y++)
-                          {
-                              for (size_t x = xmin; x < xmax; x++)
-                              {
-                                  auto ray = scene.camera->gen_ray(
-                                      (x + sampler()) * kx - 1.0f,
-                                      1.0f - (y + sampler()) * ky);
-
-                                  debug_raster(x, y);
-                                  img(x, y) += rgba(path_trace(ray, sampler), 1.0f);
-                              }
-                          }
+                          // Each pixel has its own sampler, so that the image does not depend on the tile size or scheduling
+                          S samplers[default_tile_width * default_tile_height];
+
+                          // The shadow rays of the tile are traced in batches, whose contributions are added to the colors of the pixels
+                          rgb colors[default_tile_width * default_tile_height];
+                          ArenaScope scope;
+                          ShadowBatch shadows(scene, scope.arena, colors);
+
+                          // Trace all the camera rays of the tile at once
+                          Ray rays[default_tile_width * default_tile_height];
+                          Hit hits[default_tile_width * default_tile_height];
+                          size_t count = 0;
+                          for_each_pixel_in_blocks(xmin, ymin, xmax, ymax, [&](size_t x, size_t y)
+                                                   {
+                                                       auto& sampler = samplers[count];
+                                                       sampler = make_sampler<S>(y * img.width + x, iter);
+                                                       auto& ray = rays[count++];
+                                                       ray = scene.camera->gen_ray(
+                                                           (x + sampler()) * kx - 1.0f,
+                                                           1.0f - (y + sampler()) * ky);
+                                                       ray.tmin = offset;
+                                                   });
+                          scene.intersect_stream(rays, hits, count);
+
+                          count = 0;
+                          for_each_pixel_in_blocks(xmin, ymin, xmax, ymax, [&](size_t x, size_t y)
+                                                   {
+                                                       debug_raster(x, y);
+                                                       if (features)
+                                                           features->add_first_hit(x, y, scene, rays[count], hits[count]);
+                                                       colors[count] = rgb(0.0f);
+                                                       auto color = path_trace<S, lights, has_specular, C>(rays[count], hits[count], samplers[count], shadows, count);
+                                                       colors[count] += color;
+                                                       count++;
+                                                   });
+                          shadows.flush();
+
+                          count = 0;
+                          for_each_pixel_in_blocks(xmin, ymin, xmax, ymax, [&](size_t x, size_t y)
+                                                   {
+                                                       auto& color = colors[count++];
+                                                       img(x, y) += rgba(color, 1.0f);
+                                                       if (adaptive)
+                                                           adaptive->add_sample(x, y, color);
+                                                   });
                       });
-        iter++;
     }
 
-    inline rgb path_trace(Ray ray, Sampler &sampler);
+    /// Traces a path starting with the given camera ray, whose first hit is already known.
+    /// Direct lighting is added to the given target of the shadow batch once its shadow rays are traced,
+    /// except with path guiding, which needs the complete contribution of the path when it ends.
+    template <typename S, LightKinds lights, bool has_specular, typename C>
+    inline rgb path_trace(Ray ray, Hit hit, S &sampler, ShadowBatch &shadows, uint32_t target);
 
 private:
+    /// Probability to sample the guiding distribution instead of the BSDF, when something has been learned at the vertex.
+    static constexpr float guide_fraction = 0.5f;
+    /// Number of vertices of a path whose incident radiance is recorded in the guiding field.
+    static constexpr size_t max_guided_vertices = 16;
+
+    /// Vertex of a path, whose incident radiance is known once the rest of the path has been traced.
+    struct GuidedVertex
+    {
+        float3 pos;
+        float3 dir;             ///< Sampled direction
+        float pdf;              ///< Probability density of the sampled direction
+        rgb throughput;         ///< Throughput of the path after the vertex
+        rgb color;              ///< Contribution of the path up to the vertex
+    };
+
+    /// Returns the pdf of the one-sample MIS combination of the guiding distribution and the BSDF.
+    static float guided_pdf(const DirectionalTree &guide, float bsdf_pdf, const float3 &dir)
+    {
+        return guide_fraction * guide.pdf(dir) + (1.0f - guide_fraction) * bsdf_pdf;
+    }
+
+    /// Samples either the guiding distribution or the BSDF, and weights the sample with the pdf of their combination.
+    /// Like Bsdf::sample(), the color of the sample includes the cosine term.
+    template <typename S>
+    static BsdfSample sample_guided(const DirectionalTree &guide, const Bsdf &bsdf, S &sampler, const SurfaceParams &surf, const float3 &out)
+    {
+        float3 in;
+        if (sampler() < guide_fraction)
+        {
+            auto u = sampler();
+            auto v = sampler();
+            in = guide.sample(u, v);
+        }
+        else
+            in = bsdf.sample(sampler, surf, out).in;
+        auto cos = std::max(dot(in, surf.coords.n), 0.0f);
+        return make_bsdf_sample(in, guided_pdf(guide, bsdf.pdf(in, surf, out), in), bsdf.eval(in, surf, out) * cos, surf);
+    }
+
+    /// Records the incident radiance at the vertices of a complete path, given its final contribution.
+    void record_guiding(const GuidedVertex *vertices, size_t num_vertices, const rgb &color)
+    {
+        for (size_t i = 0; i < num_vertices; i++)
+        {
+            auto &vertex = vertices[i];
+            auto incident = color - vertex.color;
+            auto radiance = rgb(
+                vertex.throughput.x > 0.0f ? incident.x / vertex.throughput.x : 0.0f,
+                vertex.throughput.y > 0.0f ? incident.y / vertex.throughput.y : 0.0f,
+                vertex.throughput.z > 0.0f ? incident.z / vertex.throughput.z : 0.0f);
+            auto value = dot(radiance, luminance) / vertex.pdf;
+            if (value > 0.0f && std::isfinite(value))
+                guiding->record(vertex.pos, vertex.dir, value);
+        }
+    }
+
     size_t max_path_len;
+    SamplerType sampler_type;
+    KernelFeatures kernel;
+    bool spectral;
     size_t iter;
+
+    bool use_guiding;
+    std::unique_ptr<GuidingField> guiding;
+    size_t guiding_iter = 0;                ///< Index of the current training iteration, which lasts 2^guiding_iter frames
+    size_t guiding_frames = 0;              ///< Number of frames rendered during the current training iteration
 };
 
-rgb PathTracingRenderer::path_trace(Ray ray, Sampler &sampler)
+template <typename S, LightKinds lights, bool has_specular, typename C>
+rgb PathTracingRenderer::path_trace(Ray ray, Hit hit, S &sampler, ShadowBatch &shadows, uint32_t target)
 {
-    rgb color(0.0f);
-    rgb throughput(1.0f);
+    // Colors are lifted to the wavelengths of the path in spectral mode, and converted back to RGB when they leave it
+    auto colors = C::sample(sampler);
+    typename C::Color color(0.0f);
+    typename C::Color throughput(1.0f);
+
+    // Previous vertex information, required to weight hits on light sources with MIS
+    float3 prev_normal(0.0f);
+    float prev_pdf = 0.0f;
+    bool prev_specular = true;
+
+    // Vertices whose incident radiance is recorded in the guiding field, once the path is complete
+    GuidedVertex guided_vertices[max_guided_vertices];
+    size_t num_guided_vertices = 0;
 
     ray.tmin = offset;
     for (size_t path_len = 0; path_len < max_path_len; path_len++)
     {
-        Hit hit = scene.intersect(ray);
+        if (path_len > 0)
+            hit = scene.intersect(ray);
         if (hit.tri < 0)
             break;
 
         auto surf = scene.surface_params(ray, hit);
-        auto mat = scene.material(hit);
+        auto& mat = scene.material(hit);
         auto out = -ray.dir;
-        if (auto light = mat.emitter)
+        // Point lights cannot be hit, and scenes that only have point lights have no emissive materials
+        if (auto light = lights != LightKinds::Point ? mat.emitter : nullptr)
         {
             // Direct hits on a light source
             if (surf.entering)
             {
                 auto light_emission = light->emission(out, hit.u, hit.v);
-                color += throughput * light_emission.intensity;
+
+                // Weight the contribution with MIS, unless this light could not have been sampled with NEE
+                float mis_weight = 1.0f;
+                if (path_len > 0 && !prev_specular)
+                {
+                    auto light_pdf = light_emission.pdf_area * hit.t * hit.t / dot(out, surf.face_normal) *
+                                     scene.light_sampler.pdf_direct(ray.org, prev_normal, light);
+                    mis_weight = prev_pdf / (prev_pdf + light_pdf);
+                }
+                color += throughput * colors.lift(light_emission.intensity) * mis_weight;
             }
         }
 
@@ -81,100 +255,133 @@ rgb PathTracingRenderer::path_trace(Ray ray, Sampler &sampler)
         if (!mat.bsdf)
             break;
 
-        bool specular = mat.bsdf->type() == Bsdf::Type::Specular;
+        // Dispersive materials send each wavelength in another direction, hence only the hero wavelength follows the path
+        auto bsdf = &mat.bsdf;
+        Bsdf dispersed;
+        if constexpr (C::spectral)
+        {
+            if (mat.bsdf.dispersive())
+            {
+                dispersed = mat.bsdf.at_wavelength(colors.wavelengths.hero());
+                colors.wavelengths.terminate_secondary();
+                bsdf = &dispersed;
+            }
+        }
+
+        bool specular = has_specular && bsdf->type() == Bsdf::Type::Specular;
+        auto guide = guiding && !specular ? guiding->sampling_tree(surf.point) : nullptr;
 
         float cos_theta = -3;
         // Evaluate direct lighting using Next Event Estimation (NEE)
         if (!specular && !scene.lights.empty())
         {
-            // Randomly select a light source
-            size_t light_idx = size_t(sampler() * scene.lights.size());
-            float light_select_prob = 1.0f / scene.lights.size();
+            // Select a light source according to its estimated contribution
+            auto selection = scene.light_sampler.sample_direct(surf.point, surf.coords.n, sampler());
+            float light_select_prob = selection.pdf;
 
             // Sample direct illumination from the selected light
-            auto light = scene.lights[light_idx].get();
+            auto light = selection.light;
             auto light_sample = light->sample_direct(surf.point, sampler);
             auto light_dir = normalize(light_sample.pos - surf.point);
             float dist = length(light_sample.pos - surf.point);
 
-            // Check visibility
-            Ray shadow_ray(surf.point, light_dir, offset, dist - offset);
-            if (!scene.occluded(shadow_ray))
-            {
-                // Evaluate BSDF for the light direction
-                auto bsdf_val = mat.bsdf->eval(light_dir, surf, out);
-                float bsdf_pdf = mat.bsdf->pdf(light_dir, surf, out);
+            // Evaluate BSDF for the light direction
+            auto bsdf_val = bsdf->eval(light_dir, surf, out);
+            float bsdf_pdf = bsdf->pdf(light_dir, surf, out);
+            if (guide)
+                bsdf_pdf = guided_pdf(*guide, bsdf_pdf, light_dir);
 
-                // Multiple Importance Sampling weight
-                float light_pdf;
-                if (light->has_area())
-                {
-                    // For area lights, convert area PDF to solid angle PDF
-                    light_pdf = light_sample.pdf_area * dist * dist / light_sample.cos;
-                }
-                else
-                { // PointLight
-                    // For point lights, use directional PDF as solid angle PDF
-                    light_pdf = light_sample.pdf_dir;
-                }
+            // Multiple Importance Sampling weight
+            float light_pdf;
+            if (has_area<lights>(light))
+            {
+                // For area lights, convert area PDF to solid angle PDF
+                light_pdf = light_sample.pdf_area * dist * dist / light_sample.cos;
+            }
+            else
+            { // PointLight
+                // For point lights, use directional PDF as solid angle PDF
+                light_pdf = light_sample.pdf_dir;
+                // Point lights cannot be hit by BSDF sampling
+                bsdf_pdf = 0.0f;
+            }
+            light_pdf *= light_select_prob;
 
-                //**float mis_weight = light_pdf / (light_pdf + bsdf_pdf);** replacing this with bellow
+            //**float mis_weight = light_pdf / (light_pdf + bsdf_pdf);** replacing this with bellow
 
-                float sum_pdf = light_pdf + bsdf_pdf;
-                float w_ne, w_brdf;
-                if (sum_pdf > 0.0f)
-                {
-                    w_ne = light_pdf / sum_pdf;
-                    w_brdf = bsdf_pdf / sum_pdf;
-                }
+            float sum_pdf = light_pdf + bsdf_pdf;
+            float w_ne;
+            if (sum_pdf > 0.0f)
+            {
+                w_ne = light_pdf / sum_pdf;
+            }
 
-                else
-                {
-                    w_ne = 0.0f;
-                    w_brdf = 0.0f;
-                }
+            else
+            {
+                w_ne = 0.0f;
+            }
 
-                // Add contribution
-                cos_theta = std::abs(dot(light_dir, surf.coords.n));
+            // Add contribution
+            cos_theta = std::abs(dot(light_dir, surf.coords.n));
 
-                rgb light_contribution = light_sample.intensity;
-                if (!light->has_area())
-                {
-                    // For point lights, radiance is intensity / (dist^2)
-                    light_contribution = light_contribution * (1.0f / (dist * dist));
-                }
+            rgb light_contribution = light_sample.intensity;
+            if (!has_area<lights>(light))
+            {
+                // For point lights, radiance is intensity / (dist^2)
+                light_contribution = light_contribution * (1.0f / (dist * dist));
+            }
 
-                // color += throughput * bsdf_val * light_contribution * mis_weight / (light_pdf * light_select_prob);
-                //**color += throughput * bsdf_val * light_contribution * cos_theta * mis_weight / (light_pdf * light_select_prob);**
+            // color += throughput * bsdf_val * light_contribution * mis_weight / (light_pdf * light_select_prob);
+            //**color += throughput * bsdf_val * light_contribution * cos_theta * mis_weight / (light_pdf * light_select_prob);**
+            auto contrib = throughput * colors.lift(bsdf_val) * colors.lift(light_contribution) * cos_theta * w_ne / light_pdf;
 
-                color += throughput * bsdf_val * light_contribution * cos_theta * w_ne / (light_pdf * light_select_prob);
+            // Check visibility, in a batch unless path guiding needs the contribution of the path when it ends.
+            // Shadow rays that cannot contribute (e.g. towards the back of the surface) are not traced.
+            Ray shadow_ray(surf.point, light_dir, offset, dist - offset);
+            if (C::max_component(contrib) > 0.0f)
+            {
+                if (!guiding)
+                    shadows.add(shadow_ray, colors.to_rgb(contrib), target);
+                else if (!shadows.occluded(shadow_ray))
+                    color += contrib;
             }
         }
 
         // Russian Roulette for path termination
         if (path_len > 3)
         {
-            float rr_prob = std::min(0.95f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+            float rr_prob = std::min(0.95f, C::max_component(throughput));
             if (sampler() > rr_prob)
                 break;
-            throughput = rgb(throughput.x / rr_prob, throughput.y / rr_prob, throughput.z / rr_prob);
+            throughput = throughput / rr_prob;
         }
 
-        // Sample new direction from BSDF
-        auto bsdf_sample = mat.bsdf->sample(sampler, surf, out);
+        // Sample new direction from BSDF, or from the guiding field
+        auto bsdf_sample = guide ? sample_guided(*guide, *bsdf, sampler, surf, out) : bsdf->sample(sampler, surf, out);
         if (bsdf_sample.pdf <= 0.0f)
             break;
 
-        cos_theta = std::abs(dot(bsdf_sample.in, surf.coords.n));
-
-        // Update throughput and ray
-        throughput *= bsdf_sample.color * cos_theta / bsdf_sample.pdf;
+        // Update throughput and ray (the color of the sample already includes the cosine term)
+        throughput *= colors.lift(bsdf_sample.color) / bsdf_sample.pdf;
+        if constexpr (!C::spectral)
+        {
+            if (guiding && !specular && num_guided_vertices < max_guided_vertices)
+                guided_vertices[num_guided_vertices++] = GuidedVertex { surf.point, bsdf_sample.in, bsdf_sample.pdf, throughput, color };
+        }
         ray = Ray(surf.point, bsdf_sample.in, offset);
+        prev_normal = surf.coords.n;
+        prev_pdf = bsdf_sample.pdf;
+        prev_specular = specular;
+    }
+    if constexpr (!C::spectral)
+    {
+        if (guiding)
+            record_guiding(guided_vertices, num_guided_vertices, color);
     }
-    return color;
+    return colors.to_rgb(color);
 }
 
-std::unique_ptr<Renderer> create_pt_renderer(const Scene &scene, size_t max_path_len)
+std::unique_ptr<Renderer> create_pt_renderer(const Scene &scene, size_t max_path_len, SamplerType sampler_type, bool guiding, bool spectral)
 {
-    return std::unique_ptr<Renderer>(new PathTracingRenderer(scene, max_path_len));
+    return std::unique_ptr<Renderer>(new PathTracingRenderer(scene, max_path_len, sampler_type, guiding, spectral));
 }
@@ -0,0 +1,366 @@
+#include <vector>
+
+#include "../scene.h"
+#include "../color.h"
+#include "../samplers.h"
+#include "../cameras.h"
+#include "../debug.h"
+#include "../renderer.h"
+
+/// Point on a light source, selected by resampling.
+struct LightCandidate {
+    int32_t light;      ///< Index of the light in the scene, or -1 if there is no candidate
+    float3 pos;         ///< Position on the light source
+};
+
+/// Weighted reservoir, holding one light candidate out of a stream of candidates.
+struct Reservoir {
+    LightCandidate sample;
+    float w_sum;        ///< Sum of the resampling weights of all the candidates seen so far
+    float M;            ///< Number of candidates seen so far
+    float W;            ///< Unbiased contribution weight of the selected candidate
+
+    void clear() {
+        sample.light = -1;
+        w_sum = 0.0f;
+        M = 0.0f;
+        W = 0.0f;
+    }
+
+    /// Streams a new candidate with resampling weight w, which stands for m candidates.
+    bool update(const LightCandidate& c, float w, float m, float u) {
+        w_sum += w;
+        M += m;
+        if (w > 0.0f && u * w_sum < w) {
+            sample = c;
+            return true;
+        }
+        return false;
+    }
+
+    /// Computes the contribution weight, given the target function evaluated at the selected candidate.
+    void finalize(float target) {
+        W = target > 0.0f && M > 0.0f ? w_sum / (M * target) : 0.0f;
+    }
+};
+
+/// Primary hit information, shared between the passes of one frame.
+struct PrimaryVertex {
+    Ray ray;            ///< Camera ray
+    Hit hit;            ///< Intersection of the camera ray with the scene
+    float3 normal;      ///< Shading normal (used to reject dissimilar neighbors)
+    rgb emission;       ///< Emission directly seen through the pixel
+    size_t frame = 0;   ///< Frame in which the vertex was computed (tiles skipped by the deadline keep older ones)
+};
+
+/// Path Tracing where direct lighting is computed using Resampled Importance Sampling (RIS).
+/// On the first vertex of each path, the reservoirs are reused temporally (from the previous frame)
+/// and spatially (from neighboring pixels), following "Spatiotemporal reservoir resampling for real-time
+/// ray tracing with dynamic direct lighting", Bitterli et al. 2020. Spatial reuse uses the biased
+/// variant of the algorithm: Neighbors are only rejected based on geometric similarity.
+class RestirRenderer : public Renderer {
+public:
+    RestirRenderer(const Scene& scene, size_t num_candidates, size_t num_neighbors, bool temporal_reuse, size_t max_path_len)
+        : Renderer(scene)
+        , num_candidates(num_candidates)
+        , num_neighbors(num_neighbors)
+        , temporal_reuse(temporal_reuse)
+        , max_path_len(max_path_len)
+    {}
+
+    std::string name() const override { return "restir"; }
+
+    void reset() override {
+        iter = 1;
+        for (auto& r : reservoirs) r.clear();
+        for (auto& v : vertices) v.frame = 0;
+    }
+
+    void render(Image& img) override {
+        auto kx = 2.0f / (img.width - 1);
+        auto ky = 2.0f / (img.height - 1);
+
+        if (vertices.size() != img.width * img.height) {
+            vertices.resize(img.width * img.height);
+            reservoirs.resize(img.width * img.height);
+            temporal.resize(img.width * img.height);
+            for (auto& r : reservoirs) r.clear();
+        }
+
+        // Generate the initial candidates and reuse the reservoirs of the previous frame
+        process_tiles(0, 0, img.width, img.height,
+            default_tile_width, default_tile_height,
+            [&] (size_t xmin, size_t ymin, size_t xmax, size_t ymax) {
+            for (size_t y = ymin; y < ymax; ++y) {
+                for (size_t x = xmin; x < xmax; ++x) {
+                    auto sampler = make_sampler<PcgSampler>(y * img.width + x, 2 * iter);
+                    auto ray = scene.camera->gen_ray(
+                        (x + sampler()) * kx - 1.0f,
+                        1.0f - (y + sampler()) * ky);
+                    ray.tmin = offset;
+                    initial_pass(ray, sampler, y * img.width + x);
+                }
+            }
+        });
+
+        // Reuse the reservoirs of neighboring pixels, and shade each pixel
+        process_tiles(0, 0, img.width, img.height,
+            default_tile_width, default_tile_height,
+            [&] (size_t xmin, size_t ymin, size_t xmax, size_t ymax) {
+            for (size_t y = ymin; y < ymax; ++y) {
+                for (size_t x = xmin; x < xmax; ++x) {
+                    auto sampler = make_sampler<PcgSampler>(y * img.width + x, 2 * iter + 1);
+                    debug_raster(x, y);
+                    img(x, y) += rgba(shading_pass(x, y, img.width, img.height, sampler), 1.0f);
+                }
+            }
+        });
+        iter++;
+    }
+
+private:
+    /// Radius in pixels of the disk in which neighbors are selected for spatial reuse.
+    static constexpr float spatial_radius = 30.0f;
+    /// Maximum number of candidates a reservoir stands for, relative to the number of initial candidates.
+    static constexpr float temporal_history = 20.0f;
+    /// Maximum number of candidates on the secondary vertices of a path, where reservoirs are not reused.
+    static constexpr size_t secondary_candidates = 4;
+
+    void initial_pass(const Ray& ray, Sampler& sampler, size_t pixel);
+    rgb shading_pass(size_t x, size_t y, size_t w, size_t h, Sampler& sampler);
+    rgb shade_direct(size_t x, size_t y, size_t w, size_t h, const SurfaceParams& surf, const Bsdf& bsdf, const float3& out, Sampler& sampler);
+    rgb path_trace(Ray ray, rgb throughput, Sampler& sampler, size_t path_len, bool specular);
+
+    LightCandidate sample_candidate(const float3& from, Sampler& sampler, float& pdf) const;
+    rgb eval_candidate(const LightCandidate& c, const SurfaceParams& surf, const Bsdf& bsdf, const float3& out, Ray& shadow_ray) const;
+    Reservoir resample_lights(const SurfaceParams& surf, const Bsdf& bsdf, const float3& out, Sampler& sampler, size_t count) const;
+    void reuse(Reservoir& dst, const Reservoir& src, const SurfaceParams& surf, const Bsdf& bsdf, const float3& out, Sampler& sampler) const;
+
+    static float target(const rgb& contrib) { return std::max(dot(contrib, luminance), 0.0f); }
+
+    std::vector<PrimaryVertex> vertices;
+    std::vector<Reservoir> reservoirs;
+    std::vector<Reservoir> temporal;
+    size_t num_candidates;
+    size_t num_neighbors;
+    bool temporal_reuse;
+    size_t max_path_len;
+    size_t iter;
+};
+
+LightCandidate RestirRenderer::sample_candidate(const float3& from, Sampler& sampler, float& pdf) const {
+    // Candidates are cheap by design: select lights proportionally to their power and let resampling
+    // account for the geometric terms, instead of traversing the light tree for each candidate.
+    auto selection = scene.light_sampler.sample_emission(sampler());
+    auto light_sample = selection.light->sample_direct(from, sampler);
+    pdf = light_sample.pdf_area * selection.pdf;
+    return LightCandidate { int32_t(selection.index), light_sample.pos };
+}
+
+rgb RestirRenderer::eval_candidate(const LightCandidate& c, const SurfaceParams& surf, const Bsdf& bsdf, const float3& out, Ray& shadow_ray) const {
+    // Unshadowed contribution of the candidate, without the probability to sample the point on the light
+    auto light = scene.lights[c.light].get();
+    auto light_sample = light->eval_direct(surf.point, c.pos);
+    auto dist = length(light_sample.pos - surf.point);
+    auto light_dir = (light_sample.pos - surf.point) * (1.0f / dist);
+    auto cos_theta = dot(light_dir, surf.coords.n);
+    if (cos_theta <= 0.0f || dist <= 2.0f * offset)
+        return rgb(0.0f);
+
+    // Area lights are converted to solid angle, point lights follow the same convention as the path tracer
+    float geom = light->has_area()
+        ? light_sample.cos / (dist * dist)
+        : 1.0f / (dist * dist * light_sample.pdf_dir);
+    shadow_ray = Ray(surf.point, light_dir, offset, dist - offset);
+    return bsdf.eval(light_dir, surf, out) * light_sample.intensity * (cos_theta * geom);
+}
+
+Reservoir RestirRenderer::resample_lights(const SurfaceParams& surf, const Bsdf& bsdf, const float3& out, Sampler& sampler, size_t count) const {
+    Reservoir r;
+    r.clear();
+    Ray shadow_ray;
+    for (size_t i = 0; i < count; ++i) {
+        float pdf;
+        auto c = sample_candidate(surf.point, sampler, pdf);
+        auto p = pdf > 0.0f ? target(eval_candidate(c, surf, bsdf, out, shadow_ray)) : 0.0f;
+        r.update(c, pdf > 0.0f ? p / pdf : 0.0f, 1.0f, sampler());
+    }
+    r.finalize(r.sample.light >= 0 ? target(eval_candidate(r.sample, surf, bsdf, out, shadow_ray)) : 0.0f);
+    return r;
+}
+
+void RestirRenderer::reuse(Reservoir& dst, const Reservoir& src, const SurfaceParams& surf, const Bsdf& bsdf, const float3& out, Sampler& sampler) const {
+    if (src.M <= 0.0f)
+        return;
+    Ray shadow_ray;
+    auto p = src.sample.light >= 0 ? target(eval_candidate(src.sample, surf, bsdf, out, shadow_ray)) : 0.0f;
+    dst.update(src.sample, p * src.W * src.M, src.M, sampler());
+}
+
+void RestirRenderer::initial_pass(const Ray& ray, Sampler& sampler, size_t pixel) {
+    auto& vertex = vertices[pixel];
+    auto& prev = reservoirs[pixel];
+    auto& r = temporal[pixel];
+    auto prev_normal = vertex.normal;
+    r.clear();
+
+    vertex.frame = iter;
+    vertex.ray = ray;
+    vertex.hit = scene.intersect(ray, RayStage::Primary);
+    vertex.emission = rgb(0.0f);
+    if (vertex.hit.tri < 0) {
+        prev.clear();
+        return;
+    }
+
+    auto surf = scene.surface_params(ray, vertex.hit);
+    auto& mat = scene.material(vertex.hit);
+    auto out = -ray.dir;
+    vertex.normal = surf.coords.n;
+
+    if (auto light = mat.emitter; light && surf.entering)
+        vertex.emission = light->emission(out, vertex.hit.u, vertex.hit.v).intensity;
+
+    if (!mat.bsdf || mat.bsdf.type() == Bsdf::Type::Specular || scene.lights.empty()) {
+        prev.clear();
+        return;
+    }
+
+    r = resample_lights(surf, mat.bsdf, out, sampler, num_candidates);
+
+    // Discard occluded candidates before they get reused
+    if (r.W > 0.0f) {
+        Ray shadow_ray;
+        eval_candidate(r.sample, surf, mat.bsdf, out, shadow_ray);
+        if (scene.occluded(shadow_ray))
+            r.W = 0.0f;
+    }
+
+    // The camera does not move between two frames (reset() is called otherwise), hence the previous
+    // reservoir of this pixel corresponds to a nearby point on the same surface, unless the normals differ.
+    if (temporal_reuse && prev.M > 0.0f && dot(prev_normal, surf.coords.n) > 0.9f) {
+        Reservoir merged;
+        merged.clear();
+        reuse(merged, r, surf, mat.bsdf, out, sampler);
+        prev.M = std::min(prev.M, temporal_history * num_candidates);
+        reuse(merged, prev, surf, mat.bsdf, out, sampler);
+
+        Ray shadow_ray;
+        merged.finalize(merged.sample.light >= 0 ? target(eval_candidate(merged.sample, surf, mat.bsdf, out, shadow_ray)) : 0.0f);
+        r = merged;
+    }
+}
+
+rgb RestirRenderer::shading_pass(size_t x, size_t y, size_t w, size_t h, Sampler& sampler) {
+    auto pixel = y * w + x;
+    auto& vertex = vertices[pixel];
+    if (vertex.hit.tri < 0)
+        return rgb(0.0f);
+
+    auto surf = scene.surface_params(vertex.ray, vertex.hit);
+    auto& mat = scene.material(vertex.hit);
+    auto out = -vertex.ray.dir;
+    rgb color = vertex.emission;
+
+    if (!mat.bsdf)
+        return color;
+
+    auto specular = mat.bsdf.type() == Bsdf::Type::Specular;
+    if (!specular) {
+        color += shade_direct(x, y, w, h, surf, mat.bsdf, out, sampler);
+    }
+
+    // Indirect illumination
+    auto bsdf_sample = mat.bsdf.sample(sampler, surf, out);
+    if (bsdf_sample.pdf <= 0.0f)
+        return color;
+    auto throughput = bsdf_sample.color / bsdf_sample.pdf;
+    return color + path_trace(Ray(surf.point, bsdf_sample.in, offset), throughput, sampler, 1, specular);
+}
+
+rgb RestirRenderer::shade_direct(size_t x, size_t y, size_t w, size_t h, const SurfaceParams& surf, const Bsdf& bsdf, const float3& out, Sampler& sampler) {
+    auto pixel = y * w + x;
+    auto& vertex = vertices[pixel];
+
+    // Combine the reservoir of this pixel with the ones of similar neighbors
+    Reservoir r;
+    r.clear();
+    reuse(r, temporal[pixel], surf, bsdf, out, sampler);
+    auto depth = vertex.hit.t;
+    for (size_t i = 0; i < num_neighbors; ++i) {
+        auto radius = spatial_radius * std::sqrt(sampler());
+        auto phi = 2.0f * pi * sampler();
+        auto nx = int(x) + int(radius * std::cos(phi));
+        auto ny = int(y) + int(radius * std::sin(phi));
+        if (nx < 0 || ny < 0 || nx >= int(w) || ny >= int(h) || (size_t(nx) == x && size_t(ny) == y))
+            continue;
+        auto neighbor = ny * w + nx;
+        auto& other = vertices[neighbor];
+        if (other.frame != iter ||
+            other.hit.tri < 0 ||
+            std::fabs(other.hit.t - depth) > 0.1f * depth ||
+            dot(other.normal, surf.coords.n) < 0.9f)
+            continue;
+        reuse(r, temporal[neighbor], surf, bsdf, out, sampler);
+    }
+
+    Ray shadow_ray;
+    rgb contrib(0.0f);
+    if (r.sample.light >= 0)
+        contrib = eval_candidate(r.sample, surf, bsdf, out, shadow_ray);
+    r.finalize(target(contrib));
+
+    // Keep the result for the next frame
+    reservoirs[pixel] = r;
+
+    return r.W > 0.0f && !scene.occluded(shadow_ray) ? contrib * r.W : rgb(0.0f);
+}
+
+rgb RestirRenderer::path_trace(Ray ray, rgb throughput, Sampler& sampler, size_t path_len, bool specular) {
+    rgb color(0.0f);
+    for (; path_len < max_path_len; path_len++) {
+        Hit hit = scene.intersect(ray);
+        if (hit.tri < 0)
+            break;
+
+        auto surf = scene.surface_params(ray, hit);
+        auto& mat = scene.material(hit);
+        auto out = -ray.dir;
+
+        // Emission is only accounted for when it cannot be sampled with RIS
+        if (auto light = mat.emitter; light && specular && surf.entering)
+            color += throughput * light->emission(out, hit.u, hit.v).intensity;
+
+        if (!mat.bsdf)
+            break;
+
+        specular = mat.bsdf.type() == Bsdf::Type::Specular;
+        if (!specular && !scene.lights.empty()) {
+            auto r = resample_lights(surf, mat.bsdf, out, sampler, std::min(num_candidates, secondary_candidates));
+            Ray shadow_ray;
+            if (r.W > 0.0f) {
+                auto contrib = eval_candidate(r.sample, surf, mat.bsdf, out, shadow_ray);
+                if (!scene.occluded(shadow_ray))
+                    color += throughput * contrib * r.W;
+            }
+        }
+
+        if (path_len > 3) {
+            auto rr_prob = russian_roulette(throughput, 0.95f);
+            if (sampler() >= rr_prob)
+                break;
+            throughput = throughput / rr_prob;
+        }
+
+        auto bsdf_sample = mat.bsdf.sample(sampler, surf, out);
+        if (bsdf_sample.pdf <= 0.0f)
+            break;
+        throughput *= bsdf_sample.color / bsdf_sample.pdf;
+        ray = Ray(surf.point, bsdf_sample.in, offset);
+    }
+    return color;
+}
+
+std::unique_ptr<Renderer> create_restir_renderer(const Scene& scene, size_t num_candidates, size_t num_neighbors, bool temporal_reuse, size_t max_path_len) {
+    return std::unique_ptr<Renderer>(new RestirRenderer(scene, num_candidates, num_neighbors, temporal_reuse, max_path_len));
+}
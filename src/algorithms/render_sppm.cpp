@@ -0,0 +1,357 @@
+#include <vector>
+#include <numeric>
+#include <atomic>
+
+#include "../scene.h"
+#include "../color.h"
+#include "../samplers.h"
+#include "../cameras.h"
+#include "../hash.h"
+#include "../debug.h"
+#include "../parallel.h"
+#include "../renderer.h"
+
+/// Number of light paths traced by each task during the photon pass.
+static constexpr size_t sppm_photon_chunk_size = 256;
+
+/// Point where a camera path of the current iteration reached a non-specular surface.
+struct VisiblePoint {
+    SurfaceParams surf;     ///< Surface parameters at the vertex
+    float3 out;             ///< Direction towards the camera
+    const Bsdf* bsdf;       ///< BSDF at the vertex, or nullptr if the camera path did not find a valid vertex
+    rgb beta;               ///< Throughput of the camera path
+};
+
+/// Statistics gathered for each pixel over all the iterations.
+struct SppmPixel {
+    VisiblePoint vp;
+    rgb ld;                 ///< Sum of the direct lighting over all the iterations
+    rgb tau;                ///< Accumulated (reflected) flux
+    rgb phi;                ///< Flux gathered during the current iteration
+    float radius;           ///< Current gather radius
+    float n;                ///< Accumulated photon count
+    uint32_t m;             ///< Number of photons gathered during the current iteration
+};
+
+/// Stochastic Progressive Photon Mapping, following "Stochastic Progressive Photon Mapping", Hachisuka and Jensen 2009.
+/// Each iteration traces one camera path per pixel, stores its first non-specular vertex as a visible point,
+/// builds a grid over the visible points, and splats the photons into them as they are traced.
+/// Contrary to PPM, photons are never stored: Memory is proportional to the number of pixels.
+class SppmRenderer : public Renderer {
+public:
+    SppmRenderer(const Scene& scene, size_t photons_per_pass, size_t max_path_len)
+        : Renderer(scene)
+        , photons_per_pass(photons_per_pass)
+        , max_path_len(max_path_len)
+    {}
+
+    std::string name() const override { return "sppm"; }
+
+    void reset() override {
+        iter = 1;
+        pixels.clear();
+    }
+
+    void render(Image& img) override {
+        if (pixels.size() != img.width * img.height) {
+            pixels.resize(img.width * img.height);
+            for (auto& pixel : pixels) {
+                pixel.ld = rgb(0.0f);
+                pixel.tau = rgb(0.0f);
+                pixel.phi = rgb(0.0f);
+                pixel.radius = 0.0f;
+                pixel.n = 0.0f;
+                pixel.m = 0;
+            }
+        }
+
+        auto kx = 2.0f / (img.width - 1);
+        auto ky = 2.0f / (img.height - 1);
+
+        // Find the visible points of this iteration
+        process_tiles(0, 0, img.width, img.height,
+            default_tile_width, default_tile_height,
+            [&] (size_t xmin, size_t ymin, size_t xmax, size_t ymax) {
+                for (size_t y = ymin; y < ymax; y++) {
+                    for (size_t x = xmin; x < xmax; x++) {
+                        debug_raster(x, y);
+                        auto sampler = make_sampler<PcgSampler>(y * img.width + x, iter);
+                        auto u = (x + sampler()) * kx - 1.0f;
+                        auto v = 1.0f - (y + sampler()) * ky;
+                        auto& pixel = pixels[y * img.width + x];
+                        auto dist = trace_camera_path(scene.camera->gen_ray(u, v), pixel, sampler);
+
+                        // The initial radius covers about two pixels at the distance of the first visible point
+                        if (pixel.radius == 0.0f && pixel.vp.bsdf) {
+                            auto d0 = scene.camera->gen_ray(u, v).dir;
+                            auto d1 = scene.camera->gen_ray(u + kx, v).dir;
+                            pixel.radius = 2.0f * dist * length(d1 - d0);
+                        }
+                    }
+                }
+            });
+
+        build_grid();
+
+        // Trace the photons, and splat them into the visible points
+        auto num_photons = photons_per_pass != 0 ? photons_per_pass : img.width * img.height;
+        auto num_chunks = num_photons / sppm_photon_chunk_size + (num_photons % sppm_photon_chunk_size ? 1 : 0);
+        parallel_for(0, num_chunks, [&] (size_t chunk) {
+            for (size_t i = chunk * sppm_photon_chunk_size, n = std::min((chunk + 1) * sppm_photon_chunk_size, num_photons); i < n; ++i) {
+                PcgSampler sampler(sampler_seed(i, iter) ^ 0x5BD1E995);
+                trace_photon(sampler);
+            }
+        });
+
+        // Update the statistics and radius of each pixel, and write the current estimate
+        process_tiles(0, 0, img.width, img.height,
+            default_tile_width, default_tile_height,
+            [&] (size_t xmin, size_t ymin, size_t xmax, size_t ymax) {
+                for (size_t y = ymin; y < ymax; y++) {
+                    for (size_t x = xmin; x < xmax; x++) {
+                        auto& pixel = pixels[y * img.width + x];
+                        if (pixel.m > 0) {
+                            auto n = pixel.n + gamma * pixel.m;
+                            auto radius = pixel.radius * std::sqrt(n / (pixel.n + pixel.m));
+                            pixel.tau = (pixel.tau + pixel.vp.beta * pixel.phi) * ((radius * radius) / (pixel.radius * pixel.radius));
+                            pixel.n = n;
+                            pixel.radius = radius;
+                            pixel.phi = rgb(0.0f);
+                            pixel.m = 0;
+                        }
+
+                        // The image is divided by the number of iterations when displayed,
+                        // which gives the total number of emitted photons for the density estimate
+                        auto area = pi * pixel.radius * pixel.radius;
+                        auto indirect = area > 0.0f ? pixel.tau / (area * float(num_photons)) : rgb(0.0f);
+                        img(x, y) = rgba(pixel.ld + indirect, float(iter));
+                    }
+                }
+            });
+
+        iter++;
+    }
+
+private:
+    static constexpr float gamma = 2.0f / 3.0f;
+
+    float trace_camera_path(Ray ray, SppmPixel& pixel, Sampler& sampler);
+    void trace_photon(Sampler& sampler);
+    void build_grid();
+    void splat(const float3& pos, const float3& n, const float3& in, const rgb& contrib);
+
+    uint32_t hash_cell(uint32_t x, uint32_t y, uint32_t z) const {
+        return morton_code(x, y, z) & (cell_starts.size() - 2);
+    }
+
+    std::vector<SppmPixel> pixels;
+
+    // Grid over the visible points, rebuilt every iteration
+    std::vector<uint32_t> cell_starts;
+    std::vector<uint32_t> cell_entries;
+    std::vector<uint32_t> grid_pixels;
+    BBox grid_bbox;
+    float inv_cell_size;
+
+    size_t photons_per_pass;
+    size_t max_path_len;
+    size_t iter;
+};
+
+float SppmRenderer::trace_camera_path(Ray ray, SppmPixel& pixel, Sampler& sampler) {
+    rgb beta(1.0f);
+    float dist = 0.0f;
+
+    pixel.vp.bsdf = nullptr;
+    ray.tmin = offset;
+    for (size_t path_len = 0; path_len < max_path_len; path_len++) {
+        auto hit = scene.intersect(ray, RayStage::Gather);
+        if (hit.tri < 0)
+            break;
+        dist += hit.t;
+
+        auto surf = scene.surface_params(ray, hit);
+        auto& mat = scene.material(hit);
+        auto out = -ray.dir;
+
+        // The camera path only goes through specular bounces: Every other light path is accounted for by NEE or photons
+        if (auto light = mat.emitter) {
+            if (surf.entering)
+                pixel.ld += beta * light->emission(out, hit.u, hit.v).intensity;
+        }
+
+        if (!mat.bsdf)
+            break;
+
+        if (mat.bsdf.type() != Bsdf::Type::Specular) {
+            // Compute direct lighting with the light tree
+            if (!scene.lights.empty()) {
+                auto selection = scene.light_sampler.sample_direct(surf.point, surf.coords.n, sampler());
+                auto light = selection.light;
+                auto ls = light->sample_direct(surf.point, sampler);
+                auto light_dist = length(ls.pos - surf.point);
+                auto light_dir = (ls.pos - surf.point) * (1.0f / light_dist);
+                auto cos_theta = dot(light_dir, surf.coords.n);
+                if (cos_theta > 0 && ls.cos > 0 && !scene.occluded(Ray(surf.point, light_dir, offset, light_dist - offset))) {
+                    auto light_pdf = light->has_area()
+                        ? ls.pdf_area * light_dist * light_dist / ls.cos
+                        : ls.pdf_dir * light_dist * light_dist;
+                    pixel.ld += beta * mat.bsdf.eval(light_dir, surf, out) * ls.intensity * cos_theta / (light_pdf * selection.pdf);
+                }
+            }
+
+            pixel.vp.surf = surf;
+            pixel.vp.out = out;
+            pixel.vp.bsdf = &mat.bsdf;
+            pixel.vp.beta = beta;
+            break;
+        }
+
+        auto bsdf_sample = mat.bsdf.sample(sampler, surf, out);
+        if (bsdf_sample.pdf <= 0.0f)
+            break;
+        beta *= bsdf_sample.color / bsdf_sample.pdf;
+        ray = Ray(surf.point, bsdf_sample.in, offset);
+    }
+    return dist;
+}
+
+void SppmRenderer::build_grid() {
+    // Collect the pixels that have a visible point, and compute the grid resolution from the largest radius
+    grid_pixels.clear();
+    float max_radius = 0.0f;
+    grid_bbox = BBox::empty();
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        if (!pixels[i].vp.bsdf) continue;
+        grid_pixels.push_back(i);
+        max_radius = std::max(max_radius, pixels[i].radius);
+        grid_bbox = extend(grid_bbox, pixels[i].vp.surf.point);
+    }
+
+    cell_starts.assign(2, 0);
+    cell_entries.clear();
+    if (grid_pixels.empty() || max_radius <= 0.0f)
+        return;
+
+    // Cells are twice as large as the largest radius, so that a visible point overlaps at most 8 cells
+    grid_bbox.min -= float3(max_radius);
+    grid_bbox.max += float3(max_radius);
+    inv_cell_size = 0.5f / max_radius;
+
+    auto num_cells = size_t(1) << (closest_log2(grid_pixels.size() * 8) + 1);
+    cell_starts.assign(num_cells + 1, 0);
+
+    auto for_each_cell = [&] (uint32_t pixel_id, auto f) {
+        auto& pixel = pixels[pixel_id];
+        auto p = pixel.vp.surf.point;
+        auto min = (p - float3(pixel.radius) - grid_bbox.min) * inv_cell_size;
+        auto max = (p + float3(pixel.radius) - grid_bbox.min) * inv_cell_size;
+        uint32_t hashes[8];
+        size_t count = 0;
+        for (uint32_t z = min.z; z <= uint32_t(max.z); z++) {
+            for (uint32_t y = min.y; y <= uint32_t(max.y); y++) {
+                for (uint32_t x = min.x; x <= uint32_t(max.x); x++) {
+                    auto h = hash_cell(x, y, z);
+                    if (std::find(hashes, hashes + count, h) != hashes + count) continue;
+                    hashes[count++] = h;
+                    f(h);
+                }
+            }
+        }
+    };
+
+    // Count the number of visible points per cell, and then insert them
+    parallel_for(0, grid_pixels.size(), [&] (size_t i) {
+        for_each_cell(grid_pixels[i], [&] (uint32_t h) {
+#ifdef USE_STD_THREAD
+            std::atomic_ref<uint32_t>(cell_starts[h])++;
+#else
+            #pragma omp atomic
+            cell_starts[h]++;
+#endif
+        });
+    });
+
+    std::partial_sum(cell_starts.begin(), cell_starts.end(), cell_starts.begin());
+    cell_entries.resize(cell_starts.back());
+
+    parallel_for(0, grid_pixels.size(), [&] (size_t i) {
+        for_each_cell(grid_pixels[i], [&] (uint32_t h) {
+            uint32_t pos;
+#ifdef USE_STD_THREAD
+            pos = --std::atomic_ref<uint32_t>(cell_starts[h]);
+#else
+            #pragma omp atomic capture
+            pos = --cell_starts[h];
+#endif
+            cell_entries[pos] = grid_pixels[i];
+        });
+    });
+}
+
+void SppmRenderer::splat(const float3& pos, const float3& n, const float3& in, const rgb& contrib) {
+    if (cell_entries.empty() || !is_inside(grid_bbox, pos))
+        return;
+    Stats::count_photons(1);
+
+    auto p = (pos - grid_bbox.min) * inv_cell_size;
+    auto h = hash_cell(p.x, p.y, p.z);
+    for (auto i = cell_starts[h], end = cell_starts[h + 1]; i < end; ++i) {
+        auto& pixel = pixels[cell_entries[i]];
+        auto& vp = pixel.vp;
+        if (lensqr(vp.surf.point - pos) >= pixel.radius * pixel.radius || dot(vp.surf.coords.n, n) <= 0.0f)
+            continue;
+
+        pixel.phi += atomically(rgb(contrib * vp.bsdf->eval(in, vp.surf, vp.out)));
+#ifdef USE_STD_THREAD
+        std::atomic_ref<uint32_t>(pixel.m)++;
+#else
+        #pragma omp atomic
+        pixel.m++;
+#endif
+    }
+}
+
+void SppmRenderer::trace_photon(Sampler& sampler) {
+    if (scene.lights.empty())
+        return;
+
+    auto selection = scene.light_sampler.sample_emission(sampler());
+    auto emission = selection.light->sample_emission(sampler);
+    Ray ray(emission.pos, emission.dir, offset);
+    rgb throughput = emission.intensity * emission.cos / (emission.pdf_area * emission.pdf_dir * selection.pdf);
+
+    for (size_t path_len = 0; path_len < max_path_len; path_len++) {
+        auto hit = scene.intersect(ray, RayStage::Photon);
+        if (hit.tri < 0)
+            break;
+
+        auto& mat = scene.material(hit);
+        if (!mat.bsdf)
+            break;
+
+        auto surf = scene.surface_params(ray, hit);
+        auto out = -ray.dir;
+
+        // Direct lighting is already computed on the visible points
+        if (path_len > 0 && mat.bsdf.type() != Bsdf::Type::Specular)
+            splat(surf.point, surf.coords.n, out, throughput);
+
+        auto bsdf_sample = mat.bsdf.sample(sampler, surf, out, true);
+        if (bsdf_sample.pdf <= 0.0f)
+            break;
+        throughput *= bsdf_sample.color / bsdf_sample.pdf;
+        ray = Ray(surf.point, bsdf_sample.in, offset);
+
+        if (path_len > 3) {
+            float rr_prob = russian_roulette(throughput, 0.75f);
+            if (sampler() > rr_prob)
+                break;
+            throughput = throughput / rr_prob;
+        }
+    }
+}
+
+std::unique_ptr<Renderer> create_sppm_renderer(const Scene& scene, size_t photons_per_pass, size_t max_path_len) {
+    return std::unique_ptr<Renderer>(new SppmRenderer(scene, photons_per_pass, max_path_len));
+}
@@ -0,0 +1,347 @@
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "../scene.h"
+#include "../color.h"
+#include "../samplers.h"
+#include "../cameras.h"
+#include "../hash.h"
+#include "../thread_pool.h"
+#include "../renderer.h"
+
+/// Sampler that works on a 32-bit state stored outside of the object (PCG RXS-M-XS), so that
+/// each path of the wavefront only needs to store one integer to keep its random sequence.
+class PathStateSampler final : public Sampler {
+public:
+    PathStateSampler(uint32_t& state)
+        : state(state)
+    {}
+
+    float operator () () override final {
+        state = state * 747796405u + 2891336453u;
+        uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+        return float(((word >> 22u) ^ word) >> 8) * 0x1p-24f;
+    }
+
+private:
+    uint32_t& state;
+};
+
+/// Wavefront Path Tracing: computes the same estimate as the pt renderer, but processes all the paths of
+/// the frame together, one stage at a time (extension, sorting by material, shading, shadow rays).
+class WavefrontPathTracingRenderer : public Renderer {
+public:
+    WavefrontPathTracingRenderer(const Scene& scene, size_t max_path_len)
+        : Renderer(scene), max_path_len(max_path_len)
+    {}
+
+    std::string name() const override { return "wpt"; }
+
+    bool supports_sample_ranges() const override { return true; }
+
+    void reset() override { iter = first_frame + 1; }
+
+    void render(Image& img) override;
+
+private:
+    /// Number of paths (or rays) processed by a task in each stage.
+    static constexpr size_t chunk_size = 256;
+
+    void resize(size_t num_paths);
+    void generate(const Image& img);
+    void extend(size_t count, bool coherent);
+    void sort(size_t count);
+    void shade(size_t count, size_t path_len);
+    void shadow(size_t count, bool coherent);
+    size_t compact(size_t count);
+
+    /// Runs every stage on the thread pool, so that the thread count and pinning options apply. Tasks are never
+    /// skipped by the deadline, so every frame is complete.
+    template <typename F>
+    static void parallel_chunks(size_t count, F f) {
+        ThreadPool::instance().run_tasks((count + chunk_size - 1) / chunk_size, [&] (size_t chunk, size_t) {
+            auto begin = chunk * chunk_size;
+            f(begin, std::min(begin + chunk_size, count));
+        });
+    }
+
+    // Path states, indexed by path (one path per pixel)
+    std::vector<rgb>      throughput;
+    std::vector<rgb>      radiance;
+    std::vector<uint32_t> rng_states;
+    std::vector<float3>   prev_normals;
+    std::vector<float>    prev_pdfs;
+    std::vector<uint8_t>  prev_specular;
+
+    // Queue of active paths, along with their rays and hits
+    std::vector<uint32_t> queue, next_queue;
+    std::vector<Ray>      queue_rays;
+    std::vector<Hit>      queue_hits;
+
+    // Active paths sorted by material: the queue entry of each shaded path
+    std::vector<uint32_t> sorted;
+    std::vector<uint32_t> material_keys;
+    std::vector<uint32_t> key_offsets;
+
+    // Shading results, indexed like the sorted queue
+    std::vector<Ray>      next_rays;
+    std::vector<uint8_t>  alive;
+
+    // Shadow rays and their unoccluded contribution, compacted before being traced
+    std::vector<Ray>      shadow_rays;
+    std::vector<rgb>      shadow_contribs;
+    std::vector<uint8_t>  shadow_valid;
+    std::vector<uint32_t> shadow_paths;
+    std::unique_ptr<bool[]> shadow_occluded;
+
+    size_t max_path_len;
+    size_t iter;
+};
+
+void WavefrontPathTracingRenderer::resize(size_t num_paths) {
+    // Buffers are only reallocated when the image size changes
+    if (throughput.size() == num_paths)
+        return;
+
+    throughput.resize(num_paths);
+    radiance.resize(num_paths);
+    rng_states.resize(num_paths);
+    prev_normals.resize(num_paths);
+    prev_pdfs.resize(num_paths);
+    prev_specular.resize(num_paths);
+    queue.resize(num_paths);
+    next_queue.resize(num_paths);
+    queue_rays.resize(num_paths);
+    queue_hits.resize(num_paths);
+    sorted.resize(num_paths);
+    material_keys.resize(num_paths);
+    next_rays.resize(num_paths);
+    alive.resize(num_paths);
+    shadow_contribs.resize(num_paths);
+    shadow_valid.resize(num_paths);
+    shadow_rays.resize(num_paths);
+    shadow_paths.resize(num_paths);
+    shadow_occluded.reset(new bool[num_paths]);
+    key_offsets.resize(scene.materials.size() + 2);
+}
+
+void WavefrontPathTracingRenderer::generate(const Image& img) {
+    auto kx = 2.0f / (img.width - 1);
+    auto ky = 2.0f / (img.height - 1);
+
+    // Paths are generated in the order of the pixels, which keeps neighboring camera rays in the same packets
+    parallel_chunks(img.width * img.height, [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            size_t x = i % img.width;
+            size_t y = i / img.width;
+            rng_states[i] = sampler_seed(i, iter);
+            PathStateSampler sampler(rng_states[i]);
+            auto ray = scene.camera->gen_ray(
+                (x + sampler()) * kx - 1.0f,
+                1.0f - (y + sampler()) * ky);
+            ray.tmin = offset;
+
+            throughput[i] = rgb(1.0f);
+            radiance[i] = rgb(0.0f);
+            prev_normals[i] = float3(0.0f);
+            prev_pdfs[i] = 0.0f;
+            prev_specular[i] = true;
+            queue[i] = i;
+            queue_rays[i] = ray;
+        }
+    });
+}
+
+void WavefrontPathTracingRenderer::extend(size_t count, bool coherent) {
+    // Packets only pay off for coherent rays, secondary rays are traced one by one
+    parallel_chunks(count, [&] (size_t begin, size_t end) {
+        if (coherent) {
+            scene.intersect_stream(queue_rays.data() + begin, queue_hits.data() + begin, end - begin);
+        } else {
+            for (size_t i = begin; i < end; i++)
+                queue_hits[i] = scene.intersect(queue_rays[i]);
+        }
+    });
+}
+
+void WavefrontPathTracingRenderer::sort(size_t count) {
+    // Counting sort on the material index, paths that left the scene get the last key
+    auto num_keys = scene.materials.size() + 1;
+    parallel_chunks(count, [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            auto& hit = queue_hits[i];
+            material_keys[i] = hit.tri >= 0 ? scene.indices[hit.tri * 4 + 3] : num_keys - 1;
+        }
+    });
+
+    std::fill(key_offsets.begin(), key_offsets.end(), 0);
+    for (size_t i = 0; i < count; i++)
+        key_offsets[material_keys[i] + 1]++;
+    for (size_t i = 1; i <= num_keys; i++)
+        key_offsets[i] += key_offsets[i - 1];
+    for (size_t i = 0; i < count; i++)
+        sorted[key_offsets[material_keys[i]]++] = i;
+}
+
+void WavefrontPathTracingRenderer::shade(size_t count, size_t path_len) {
+    parallel_chunks(count, [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            auto entry = sorted[i];
+            auto path = queue[entry];
+            auto& ray = queue_rays[entry];
+            auto& hit = queue_hits[entry];
+            PathStateSampler sampler(rng_states[path]);
+
+            alive[i] = false;
+            shadow_valid[i] = false;
+            if (hit.tri < 0)
+                continue;
+
+            auto surf = scene.surface_params(ray, hit);
+            auto& mat = scene.material(hit);
+            auto out = -ray.dir;
+            if (auto light = mat.emitter) {
+                // Direct hits on a light source
+                if (surf.entering) {
+                    auto light_emission = light->emission(out, hit.u, hit.v);
+
+                    // Weight the contribution with MIS, unless this light could not have been sampled with NEE
+                    float mis_weight = 1.0f;
+                    if (path_len > 0 && !prev_specular[path]) {
+                        auto light_pdf = light_emission.pdf_area * hit.t * hit.t / dot(out, surf.face_normal) *
+                                         scene.light_sampler.pdf_direct(ray.org, prev_normals[path], light);
+                        mis_weight = prev_pdfs[path] / (prev_pdfs[path] + light_pdf);
+                    }
+                    radiance[path] += throughput[path] * light_emission.intensity * mis_weight;
+                }
+            }
+
+            // Materials without BSDFs act like black bodies
+            if (!mat.bsdf)
+                continue;
+
+            bool specular = mat.bsdf.type() == Bsdf::Type::Specular;
+
+            // Prepare a shadow ray for Next Event Estimation (NEE), traced later in a batch
+            if (!specular && !scene.lights.empty()) {
+                auto selection = scene.light_sampler.sample_direct(surf.point, surf.coords.n, sampler());
+                auto light = selection.light;
+                auto light_sample = light->sample_direct(surf.point, sampler);
+                auto light_dir = normalize(light_sample.pos - surf.point);
+                float dist = length(light_sample.pos - surf.point);
+
+                auto bsdf_val = mat.bsdf.eval(light_dir, surf, out);
+                float bsdf_pdf = mat.bsdf.pdf(light_dir, surf, out);
+                float light_pdf;
+                rgb light_contribution = light_sample.intensity;
+                if (light->has_area()) {
+                    light_pdf = light_sample.pdf_area * dist * dist / light_sample.cos;
+                } else {
+                    // Point lights cannot be hit by BSDF sampling
+                    light_pdf = light_sample.pdf_dir;
+                    bsdf_pdf = 0.0f;
+                    light_contribution = light_contribution * (1.0f / (dist * dist));
+                }
+                light_pdf *= selection.pdf;
+
+                float sum_pdf = light_pdf + bsdf_pdf;
+                if (sum_pdf > 0.0f) {
+                    float w_ne = light_pdf / sum_pdf;
+                    float cos_theta = std::abs(dot(light_dir, surf.coords.n));
+                    shadow_contribs[i] = throughput[path] * bsdf_val * light_contribution * cos_theta * w_ne / light_pdf;
+                    shadow_valid[i] = true;
+                    shadow_rays[i] = Ray(surf.point, light_dir, offset, dist - offset);
+                }
+            }
+
+            // Russian Roulette for path termination
+            if (path_len > 3) {
+                auto& t = throughput[path];
+                float rr_prob = std::min(0.95f, std::max(t.x, std::max(t.y, t.z)));
+                if (sampler() > rr_prob)
+                    continue;
+                t = rgb(t.x / rr_prob, t.y / rr_prob, t.z / rr_prob);
+            }
+
+            // Sample new direction from BSDF
+            auto bsdf_sample = mat.bsdf.sample(sampler, surf, out);
+            if (bsdf_sample.pdf <= 0.0f)
+                continue;
+
+            // The color of the sample already includes the cosine term
+            throughput[path] *= bsdf_sample.color / bsdf_sample.pdf;
+            prev_normals[path] = surf.coords.n;
+            prev_pdfs[path] = bsdf_sample.pdf;
+            prev_specular[path] = specular;
+            alive[i] = true;
+            next_rays[i] = Ray(surf.point, bsdf_sample.in, offset);
+        }
+    });
+}
+
+void WavefrontPathTracingRenderer::shadow(size_t count, bool coherent) {
+    // Gather the shadow rays in a contiguous array (in place, since there are at most as many shadow rays as paths)
+    size_t num_shadow = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!shadow_valid[i])
+            continue;
+        shadow_rays[num_shadow] = shadow_rays[i];
+        shadow_contribs[num_shadow] = shadow_contribs[i];
+        shadow_paths[num_shadow] = queue[sorted[i]];
+        num_shadow++;
+    }
+
+    parallel_chunks(num_shadow, [&] (size_t begin, size_t end) {
+        OccluderCache occluder;
+        if (coherent) {
+            scene.occluded_stream(shadow_rays.data() + begin, shadow_occluded.get() + begin, end - begin, occluder);
+        } else {
+            for (size_t i = begin; i < end; i++)
+                shadow_occluded[i] = scene.occluded(shadow_rays[i], occluder);
+        }
+        for (size_t i = begin; i < end; i++) {
+            if (!shadow_occluded[i])
+                radiance[shadow_paths[i]] += shadow_contribs[i];
+        }
+    });
+}
+
+size_t WavefrontPathTracingRenderer::compact(size_t count) {
+    // Keep the paths in material order, which tends to keep rays that leave similar surfaces together
+    size_t num_alive = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!alive[i])
+            continue;
+        next_queue[num_alive] = queue[sorted[i]];
+        queue_rays[num_alive] = next_rays[i];
+        num_alive++;
+    }
+    std::swap(queue, next_queue);
+    return num_alive;
+}
+
+void WavefrontPathTracingRenderer::render(Image& img) {
+    auto num_paths = img.width * img.height;
+    resize(num_paths);
+    generate(img);
+
+    size_t count = num_paths;
+    for (size_t path_len = 0; path_len < max_path_len && count > 0; path_len++) {
+        extend(count, path_len == 0);
+        sort(count);
+        shade(count, path_len);
+        shadow(count, path_len == 0);
+        count = compact(count);
+    }
+
+    parallel_chunks(num_paths, [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            img.pixels[i] += rgba(radiance[i], 1.0f);
+    });
+    iter++;
+}
+
+std::unique_ptr<Renderer> create_wpt_renderer(const Scene& scene, size_t max_path_len) {
+    return std::unique_ptr<Renderer>(new WavefrontPathTracingRenderer(scene, max_path_len));
+}
@@ -0,0 +1,41 @@
+#include <algorithm>
+#include <cstdint>
+
+#include "arena.h"
+
+void* Arena::alloc(size_t size, size_t align) {
+    // Use the current block if the allocation fits, and otherwise the next block that is large enough
+    while (cur_block < blocks.size()) {
+        auto& block = blocks[cur_block];
+        auto addr  = reinterpret_cast<uintptr_t>(block.data.get());
+        auto start = ((addr + offset + align - 1) & ~uintptr_t(align - 1)) - addr;
+        if (start + size <= block.size) {
+            offset = start + size;
+            return block.data.get() + start;
+        }
+        cur_block++;
+        offset = 0;
+    }
+
+    // Only reached when the arena grows: the blocks are kept, so that the next frames find them.
+    // Memory from operator new is aligned for any fundamental type.
+    Block block { nullptr, std::max(block_size, size) };
+    block.data.reset(new std::byte[block.size]);
+    auto ptr = block.data.get();
+    blocks.push_back(std::move(block));
+    cur_block = blocks.size() - 1;
+    offset = size;
+    return ptr;
+}
+
+size_t Arena::capacity() const {
+    size_t total = 0;
+    for (auto& block : blocks)
+        total += block.size;
+    return total;
+}
+
+Arena& thread_arena() {
+    static thread_local Arena arena;
+    return arena;
+}
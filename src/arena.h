@@ -0,0 +1,112 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <type_traits>
+
+/// Bump allocator for transient data. Memory is taken from large blocks, and is only given back all at once,
+/// by releasing the arena to an earlier mark. Blocks are kept when the arena is released, so that once the
+/// arena has grown to the size needed by a frame, the following frames do not allocate memory.
+class Arena {
+public:
+    /// Position in the arena, used to release the memory allocated after it.
+    struct Mark {
+        size_t block;
+        size_t offset;
+    };
+
+    static constexpr size_t default_block_size = size_t(1) << 20;
+
+    explicit Arena(size_t block_size = default_block_size) : block_size(block_size) {}
+    Arena(const Arena&) = delete;
+    Arena& operator = (const Arena&) = delete;
+
+    /// Allocates uninitialized memory with the given alignment (at most the alignment of std::max_align_t).
+    void* alloc(size_t size, size_t align);
+
+    /// Allocates and default-initializes an array. Destructors are never called, hence the elements must be trivially destructible.
+    template <typename T>
+    T* alloc(size_t count) {
+        static_assert(std::is_trivially_destructible_v<T>, "Objects allocated in an arena are never destroyed");
+        auto ptr = static_cast<T*>(alloc(sizeof(T) * count, alignof(T)));
+        std::uninitialized_default_construct_n(ptr, count);
+        return ptr;
+    }
+
+    Mark mark() const { return Mark { cur_block, offset }; }
+    /// Releases the memory allocated since the given mark.
+    void release(const Mark& mark) {
+        cur_block = mark.block;
+        offset = mark.offset;
+    }
+    /// Releases all the memory of the arena, and keeps its blocks for the next allocations.
+    void reset() { release(Mark { 0, 0 }); }
+
+    /// Returns the total size of the blocks of the arena, in bytes.
+    size_t capacity() const;
+
+private:
+    struct Block {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t cur_block = 0;
+    size_t offset = 0;
+    size_t block_size;
+};
+
+/// Returns the arena of the calling thread. Data allocated in it must not outlive the task that allocated it:
+/// tasks release what they allocate with an ArenaScope, so that the arena is empty between frames.
+Arena& thread_arena();
+
+/// Releases the memory allocated in an arena during the lifetime of the scope.
+/// Scopes must be nested, which is always the case for the scopes of a single thread.
+class ArenaScope {
+public:
+    explicit ArenaScope(Arena& arena = thread_arena())
+        : arena(arena), start(arena.mark())
+    {}
+    ~ArenaScope() { arena.release(start); }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator = (const ArenaScope&) = delete;
+
+    Arena& arena;
+
+private:
+    Arena::Mark start;
+};
+
+/// Standard allocator using an arena, so that containers can be used for transient data.
+/// Deallocation does nothing: the memory is reclaimed when the arena is released.
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    ArenaAllocator(Arena& arena) : arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(arena->alloc(sizeof(T) * n, alignof(T))); }
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator == (const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator != (const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+private:
+    template <typename U> friend class ArenaAllocator;
+    Arena* arena;
+};
+
+/// Vector whose elements are allocated in an arena.
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+#endif // ARENA_H
@@ -6,12 +6,28 @@
 #include <queue>
 #include <tuple>
 #include <numeric>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <bit>
 
 #include "bvh.h"
 #include "bbox.h"
+#include "hash.h"
+#include "stats.h"
 
 template void Bvh::traverse<true>(const Ray&, Hit&) const;
 template void Bvh::traverse<false>(const Ray&, Hit&) const;
+template void Bvh::traverse_packet<true>(const Ray*, Hit*, size_t) const;
+template void Bvh::traverse_packet<false>(const Ray*, Hit*, size_t) const;
+
+uint64_t Bvh::key(const float3* verts, size_t num_verts, const uint32_t* indices, size_t num_tris, BvhQuality quality, BvhLayout layout) {
+    auto h = block_hash(hash64_init(), verts, sizeof(float3) * num_verts);
+    h = block_hash(h, indices, sizeof(uint32_t) * 4 * num_tris);
+    uint32_t options[] = { uint32_t(quality), uint32_t(layout) };
+    return block_hash(h, options, sizeof(options));
+}
 
 #ifdef EMBREE
 Bvh::~Bvh() {
@@ -20,7 +36,7 @@ Bvh::~Bvh() {
     rtcReleaseDevice(device);
 }
 
-void Bvh::build(const float3* verts, const uint32_t* indices, size_t num_tris) {
+void Bvh::build(const float3* verts, const uint32_t* indices, size_t num_tris, BvhQuality, BvhLayout) {
     device = rtcNewDevice(nullptr);
 
     scene = rtcNewScene(device);
@@ -91,6 +107,25 @@ void Bvh::traverse(const Ray& ray, Hit& hit) const {
         hit.v = ray_hit.hit.v;
     }
 }
+
+template <bool any>
+void Bvh::traverse_packet(const Ray* rays, Hit* hits, size_t count) const {
+    for (size_t i = 0; i < count; i++)
+        traverse<any>(rays[i], hits[i]);
+}
+
+bool Bvh::save(const std::string&, uint64_t) const {
+    // The acceleration structure is owned by Embree, and cannot be serialized
+    return false;
+}
+
+bool Bvh::load(const std::string&, uint64_t, const float3*, const uint32_t*) {
+    return false;
+}
+
+bool Bvh::copy(const Bvh&) {
+    return false;
+}
 #else
 static inline std::tuple<size_t, float, BBox> find_split(const uint32_t* prims, float* costs, size_t begin, size_t end, const BBox* bboxes) {
     BBox cur_bb = BBox::empty();
@@ -295,6 +330,279 @@ void Bvh::build(const BBox& global_bbox, const BBox* bboxes, const float3* cente
     nodes.reset(tmp_nodes);
 }
 
+struct BinnedBvhBuilder {
+    static constexpr size_t num_bins = 32;
+
+    struct Bin {
+        BBox bbox;
+        size_t count;
+    };
+
+    /// Bins for the three axes
+    struct BinSet {
+        Bin bins[3][num_bins];
+        size_t count;   ///< Number of bins actually used on each axis
+
+        void clear(size_t n) {
+            count = n;
+            for (size_t i = 0; i < 3; i++) {
+                for (size_t j = 0; j < count; j++) {
+                    bins[i][j].bbox = BBox::empty();
+                    bins[i][j].count = 0;
+                }
+            }
+        }
+
+        void merge(const BinSet& other) {
+            for (size_t i = 0; i < 3; i++) {
+                for (size_t j = 0; j < count; j++) {
+                    bins[i][j].bbox = extend(bins[i][j].bbox, other.bins[i][j].bbox);
+                    bins[i][j].count += other.bins[i][j].count;
+                }
+            }
+        }
+    };
+
+    BinnedBvhBuilder(const BBox* bboxes,
+                     const float3* centers,
+                     uint32_t* prims,
+                     Bvh::Node* nodes,
+                     size_t& node_count)
+        : bboxes(bboxes)
+        , centers(centers)
+        , prims(prims)
+        , nodes(nodes)
+        , node_count(node_count)
+    {}
+
+    static inline size_t bin_index(float pos, float min, float scale, size_t count) {
+        return std::min(size_t(std::max((pos - min) * scale, 0.0f)), count - 1);
+    }
+
+    void fill_bins(BinSet& set, size_t count, const float3& cmin, const float3& scale, size_t begin, size_t end) const {
+        set.clear(count);
+        for (size_t i = begin; i < end; i++) {
+            auto ref = prims[i];
+            auto& center = centers[ref];
+            for (size_t axis = 0; axis < 3; axis++) {
+                auto& bin = set.bins[axis][bin_index(center[axis], cmin[axis], scale[axis], count)];
+                bin.bbox = extend(bin.bbox, bboxes[ref]);
+                bin.count++;
+            }
+        }
+    }
+
+    void compute_bins(BinSet& set, size_t count, const float3& cmin, const float3& scale, size_t begin, size_t end) const {
+        if (end - begin <= parallel_binning_threshold()) {
+            fill_bins(set, count, cmin, scale, begin, end);
+            return;
+        }
+
+        // Large nodes are binned in parallel, by chunks of primitives
+        size_t num_chunks = (end - begin + binning_chunk_size() - 1) / binning_chunk_size();
+        std::unique_ptr<BinSet[]> chunks(new BinSet[num_chunks]);
+        for (size_t i = 0; i < num_chunks; i++) {
+            #pragma omp task firstprivate(i) shared(chunks, cmin, scale)
+            {
+                auto chunk_begin = begin + i * binning_chunk_size();
+                auto chunk_end   = std::min(end, chunk_begin + binning_chunk_size());
+                fill_bins(chunks[i], count, cmin, scale, chunk_begin, chunk_end);
+            }
+        }
+        #pragma omp taskwait
+
+        set = chunks[0];
+        for (size_t i = 1; i < num_chunks; i++)
+            set.merge(chunks[i]);
+    }
+
+    void build(size_t node_id, BBox center_bbox) {
+        const float traversal_cost = 1.0f;
+
+        Bvh::Node& node = nodes[node_id];
+        const size_t begin = node.first_prim;
+        const size_t end   = node.first_prim + node.num_prims;
+
+        if (end - begin <= 1)
+            return;
+
+        // Bin primitives according to their centers, using fewer bins for small nodes
+        auto bin_count = std::min(num_bins, std::max(size_t(4), end - begin));
+        auto extents = center_bbox.max - center_bbox.min;
+        auto scale = float3(
+            extents.x > 0.0f ? bin_count / extents.x : 0.0f,
+            extents.y > 0.0f ? bin_count / extents.y : 0.0f,
+            extents.z > 0.0f ? bin_count / extents.z : 0.0f);
+
+        BinSet set;
+        compute_bins(set, bin_count, center_bbox.min, scale, begin, end);
+
+        // Find the split with the minimum SAH cost on all three axes
+        float min_cost   = FLT_MAX;
+        size_t min_split = 0;
+        size_t min_axis  = 0;
+        BBox min_left    = BBox::empty();
+        BBox min_right   = BBox::empty();
+
+        for (size_t axis = 0; axis < 3; axis++) {
+            if (scale[axis] == 0.0f)
+                continue;
+
+            auto& bins = set.bins[axis];
+            float right_costs[num_bins];
+            BBox right_bboxes[num_bins];
+
+            // Sweep from the right and compute costs
+            BBox cur_bb = BBox::empty();
+            size_t cur_count = 0;
+            for (size_t i = bin_count - 1; i > 0; i--) {
+                cur_bb = extend(cur_bb, bins[i].bbox);
+                cur_count += bins[i].count;
+                right_costs[i] = cur_count * half_area(cur_bb);
+                right_bboxes[i] = cur_bb;
+            }
+
+            // Sweep from the left and find the minimum cost
+            cur_bb = BBox::empty();
+            cur_count = 0;
+            for (size_t i = 1; i < bin_count; i++) {
+                cur_bb = extend(cur_bb, bins[i - 1].bbox);
+                cur_count += bins[i - 1].count;
+                if (cur_count == 0 || cur_count == end - begin)
+                    continue;
+                const float c = cur_count * half_area(cur_bb) + right_costs[i];
+                if (c < min_cost) {
+                    min_cost  = c;
+                    min_split = i;
+                    min_axis  = axis;
+                    min_left  = cur_bb;
+                    min_right = right_bboxes[i];
+                }
+            }
+        }
+
+        // Compare the minimum split cost with the SAH of this node
+        bool force_split = end - begin > max_leaf_size();
+        if (min_cost >= ((end - begin) - traversal_cost) * half_area(node.min, node.max) && !force_split)
+            return;
+
+        BBox left_centers  = BBox::empty();
+        BBox right_centers = BBox::empty();
+        size_t mid;
+        if (min_cost < FLT_MAX) {
+            // Partition primitives, and compute the bounding box of the centers of each side
+            auto axis = min_axis;
+            auto is_on_left_side = [&] (uint32_t ref) {
+                return bin_index(centers[ref][axis], center_bbox.min[axis], scale[axis], bin_count) < min_split;
+            };
+            size_t i = begin, j = end;
+            while (true) {
+                while (i < j && is_on_left_side(prims[i]))
+                    left_centers = extend(left_centers, centers[prims[i++]]);
+                while (i < j && !is_on_left_side(prims[j - 1]))
+                    right_centers = extend(right_centers, centers[prims[--j]]);
+                if (i >= j)
+                    break;
+                std::swap(prims[i], prims[j - 1]);
+            }
+            mid = i;
+        } else {
+            // All the centers are at the same position: split the node in the middle
+            mid = (begin + end) / 2;
+            for (size_t i = begin; i < mid; i++) {
+                min_left = extend(min_left, bboxes[prims[i]]);
+                left_centers = extend(left_centers, centers[prims[i]]);
+            }
+            for (size_t i = mid; i < end; i++) {
+                min_right = extend(min_right, bboxes[prims[i]]);
+                right_centers = extend(right_centers, centers[prims[i]]);
+            }
+        }
+        assert(mid > begin && mid < end);
+
+        size_t num_nodes;
+
+        #pragma omp atomic capture
+        { num_nodes = node_count; node_count += 2; }
+
+        // Mark the node as an inner node
+        node.child = num_nodes;
+        node.axis = -int32_t(min_axis);
+
+        // Setup the child nodes
+        Bvh::Node& left = nodes[num_nodes];
+        left.first_prim = begin;
+        left.num_prims  = mid - begin;
+        left.min = min_left.min;
+        left.max = min_left.max;
+
+        Bvh::Node& right = nodes[num_nodes + 1];
+        right.first_prim = mid;
+        right.num_prims  = end - mid;
+        right.min = min_right.min;
+        right.max = min_right.max;
+
+        const auto smallest_node = right.num_prims <  left.num_prims ? num_nodes + 1 : num_nodes;
+        const auto biggest_node  = right.num_prims >= left.num_prims ? num_nodes + 1 : num_nodes;
+        const auto smallest_centers = smallest_node == num_nodes ? left_centers : right_centers;
+        const auto biggest_centers  = smallest_node == num_nodes ? right_centers : left_centers;
+
+        bool spawn_task = size_t(nodes[smallest_node].num_prims) > parallel_threshold();
+        if (spawn_task) {
+            #pragma omp task firstprivate(smallest_node, smallest_centers)
+            {
+                build(smallest_node, smallest_centers);
+            }
+        }
+
+        build(biggest_node, biggest_centers);
+        if (!spawn_task) build(smallest_node, smallest_centers);
+    }
+
+    static constexpr size_t parallel_threshold() { return 1000; }
+    static constexpr size_t parallel_binning_threshold() { return 1 << 16; }
+    static constexpr size_t binning_chunk_size() { return 1 << 14; }
+    static constexpr size_t max_leaf_size() { return 16; }
+
+    const BBox*   bboxes;
+    const float3* centers;
+
+    uint32_t* prims;
+
+    Bvh::Node* nodes;
+    size_t& node_count;
+};
+
+void Bvh::build_binned(const BBox& global_bbox, const BBox& center_bbox, const BBox* bboxes, const float3* centers, size_t num_refs) {
+    prim_ids.reset(new uint32_t[num_refs]);
+    nodes.reset(new Node[num_refs * 2 + 1]);
+
+    BinnedBvhBuilder builder(bboxes, centers, prim_ids.get(), nodes.get(), num_nodes);
+
+    #pragma omp parallel
+    {
+        #pragma omp for
+        for (size_t i = 0; i < num_refs; i++) prim_ids[i] = i;
+
+        // Start first builder task, the end of the parallel region waits for all the tasks to finish
+        #pragma omp single
+        {
+            Node& root = nodes[0];
+            root.first_prim = 0;
+            root.num_prims  = num_refs;
+            root.min = global_bbox.min;
+            root.max = global_bbox.max;
+            num_nodes = 1;
+            builder.build(0, center_bbox);
+        }
+    }
+
+    // Resize the array of nodes
+    Node* tmp_nodes = new Node[num_nodes];
+    std::copy(nodes.get(), nodes.get() + num_nodes, tmp_nodes);
+    nodes.reset(tmp_nodes);
+}
+
 void Bvh::try_split(size_t ref, const float3* tri, BBox* bboxes, float3* centers, uint32_t* refs, float threshold, size_t& num_refs, size_t max_refs) {
     // Triangle splitting according to the Edge Volume Heuristic
     static constexpr size_t stack_size = 32;
@@ -376,7 +684,30 @@ void Bvh::fix_refs(const uint32_t* refs) {
     }
 }
 
-void Bvh::build(const float3* verts, const uint32_t* indices, size_t num_tris) {
+void Bvh::build(const float3* verts, const uint32_t* indices, size_t num_tris, BvhQuality quality, BvhLayout layout) {
+    if (quality == BvhQuality::Fast) {
+        std::unique_ptr<BBox[]>   bboxes(new BBox[num_tris]);
+        std::unique_ptr<float3[]> centers(new float3[num_tris]);
+
+        // Compute the bounding box of each triangle, along with the global bounding boxes
+        auto global_bbox = BBox::empty();
+        auto center_bbox = BBox::empty();
+        #pragma omp parallel for reduction(bbox_extend: global_bbox) reduction(bbox_extend: center_bbox)
+        for (size_t i = 0; i < num_tris; ++i) {
+            auto& v0 = verts[indices[i * 4 + 0]];
+            auto& v1 = verts[indices[i * 4 + 1]];
+            auto& v2 = verts[indices[i * 4 + 2]];
+            bboxes[i] = extend(extend(BBox(v0), v1), v2);
+            centers[i] = (1.0f / 3.0f) * (v0 + v1 + v2);
+            global_bbox = extend(global_bbox, bboxes[i]);
+            center_bbox = extend(center_bbox, centers[i]);
+        }
+
+        build_binned(global_bbox, center_bbox, bboxes.get(), centers.get(), num_tris);
+        collapse(verts, indices, layout);
+        return;
+    }
+
     auto max_refs = num_tris * 3 / 2;
     std::unique_ptr<BBox[]>     bboxes(new BBox[max_refs]);
     std::unique_ptr<float3[]>   centers(new float3[max_refs]);
@@ -399,17 +730,355 @@ void Bvh::build(const float3* verts, const uint32_t* indices, size_t num_tris) {
     build(global_bbox, bboxes.get(), centers.get(), num_refs);
     fix_refs(refs.get());
     optimize(3);
+    collapse(verts, indices, layout);
+}
 
-    tris.reset(new PrecomputedTri[num_refs]);
+Bvh::CompactNode Bvh::compress(const WideNode& wide) const {
+    CompactNode node;
+    node.padding = 0;
+    for (size_t j = 0; j < 3; ++j) {
+        // Compute the grid that covers the bounding box of the children
+        float lo = FLT_MAX, hi = -FLT_MAX;
+        for (size_t i = 0; i < simd_width; ++i) {
+            if (wide.child[i] < 0) continue;
+            lo = std::min(lo, wide.bounds[2 * j + 0][i]);
+            hi = std::max(hi, wide.bounds[2 * j + 1][i]);
+        }
+        if (lo > hi) lo = hi = 0.0f;
+        int exp = hi > lo ? int(std::ceil(std::log2((hi - lo) / 255.0f))) : -100;
+        exp = std::max(-100, std::min(exp, 127));
+        while (lo + std::ldexp(255.0f, exp) < hi && exp < 127) exp++;
+        node.origin[j]   = lo;
+        node.exponent[j] = exp;
+
+        // Round the bounds outwards, so that the quantized boxes contain the original ones
+        auto scale = std::ldexp(1.0f, exp);
+        for (size_t i = 0; i < simd_width; ++i) {
+            if (wide.child[i] < 0) {
+                // Empty boxes are never intersected
+                node.bounds[2 * j + 0][i] = 1;
+                node.bounds[2 * j + 1][i] = 0;
+                continue;
+            }
+            int qmin = std::max(0,   int(std::floor((wide.bounds[2 * j + 0][i] - lo) / scale)));
+            int qmax = std::min(255, int(std::ceil ((wide.bounds[2 * j + 1][i] - lo) / scale)));
+            while (qmin > 0   && lo + qmin * scale > wide.bounds[2 * j + 0][i]) qmin--;
+            while (qmax < 255 && lo + qmax * scale < wide.bounds[2 * j + 1][i]) qmax++;
+            node.bounds[2 * j + 0][i] = qmin;
+            node.bounds[2 * j + 1][i] = qmax;
+        }
+    }
+    for (size_t i = 0; i < simd_width; ++i) {
+        node.child[i] = wide.child[i];
+        node.num_tris[i] = wide.num_tris[i];
+    }
+    return node;
+}
 
-    #pragma omp parallel for
-    for (size_t i = 0; i < num_refs; i++) {
-        auto tri_id = prim_ids[i];
-        auto i0 = indices[tri_id * 4 + 0];
-        auto i1 = indices[tri_id * 4 + 1];
-        auto i2 = indices[tri_id * 4 + 2];
-        tris[i] = PrecomputedTri(verts[i0], verts[i1], verts[i2]);
+void Bvh::collapse(const float3* verts, const uint32_t* indices, BvhLayout new_layout) {
+    std::vector<WideNode> new_nodes;
+    std::vector<PrecomputedTri4> new_tris;
+    std::vector<uint32_t> new_tri_ids;
+
+    // Count the primitives in each subtree: subtrees that fit in one group of triangles become leaves.
+    // Children are always located after their parent, which allows to do this in one reverse pass.
+    std::unique_ptr<size_t[]> subtree_prims(new size_t[num_nodes]);
+    for (ptrdiff_t i = num_nodes - 1; i >= 0; --i) {
+        auto& node = nodes[i];
+        subtree_prims[i] = node.is_leaf()
+            ? node.num_prims
+            : subtree_prims[node.child + 0] + subtree_prims[node.child + 1];
+    }
+    auto is_leaf = [&] (size_t node_id) {
+        return nodes[node_id].is_leaf() || subtree_prims[node_id] <= simd_width;
+    };
+    std::vector<uint32_t> leaf_prims;
+    std::vector<size_t> leaf_stack;
+    auto gather_prims = [&] (size_t node_id) {
+        leaf_prims.clear();
+        leaf_stack.push_back(node_id);
+        while (!leaf_stack.empty()) {
+            auto& node = nodes[leaf_stack.back()];
+            leaf_stack.pop_back();
+            if (node.is_leaf()) {
+                leaf_prims.insert(leaf_prims.end(), prim_ids.get() + node.first_prim, prim_ids.get() + node.first_prim + node.num_prims);
+            } else {
+                leaf_stack.push_back(node.child + 0);
+                leaf_stack.push_back(node.child + 1);
+            }
+        }
+        // Remove duplicate references introduced by triangle splitting
+        std::sort(leaf_prims.begin(), leaf_prims.end());
+        leaf_prims.erase(std::unique(leaf_prims.begin(), leaf_prims.end()), leaf_prims.end());
+    };
+
+    // Each entry contains the index of a binary node and of the wide node it is collapsed into
+    std::vector<std::pair<size_t, size_t>> stack;
+    stack.emplace_back(0, 0);
+    new_nodes.emplace_back();
+    while (!stack.empty()) {
+        size_t node_id, wide_id;
+        std::tie(node_id, wide_id) = stack.back();
+        stack.pop_back();
+
+        // Open the inner children with the largest area until there are enough children to fill a wide node
+        size_t children[simd_width] = { node_id };
+        size_t num_children = 1;
+        if (!is_leaf(node_id)) {
+            children[0] = nodes[node_id].child + 0;
+            children[1] = nodes[node_id].child + 1;
+            num_children = 2;
+        }
+        while (num_children < simd_width) {
+            int best = -1;
+            float best_area = -FLT_MAX;
+            for (size_t i = 0; i < num_children; ++i) {
+                auto& child = nodes[children[i]];
+                if (!is_leaf(children[i]) && half_area(child.bbox()) > best_area) {
+                    best = i;
+                    best_area = half_area(child.bbox());
+                }
+            }
+            if (best < 0)
+                break;
+            auto first = nodes[children[best]].child;
+            children[best] = first + 0;
+            children[num_children++] = first + 1;
+        }
+
+        WideNode wide;
+        for (size_t i = 0; i < simd_width; ++i) {
+            for (size_t j = 0; j < 3; ++j) {
+                wide.bounds[2 * j + 0][i] =  FLT_MAX;
+                wide.bounds[2 * j + 1][i] = -FLT_MAX;
+            }
+            wide.child[i] = -1;
+            wide.num_tris[i] = 0;
+        }
+
+        for (size_t i = 0; i < num_children; ++i) {
+            auto& child = nodes[children[i]];
+            for (size_t j = 0; j < 3; ++j) {
+                wide.bounds[2 * j + 0][i] = child.min[j];
+                wide.bounds[2 * j + 1][i] = child.max[j];
+            }
+
+            if (is_leaf(children[i])) {
+                // Pack the triangles of the leaf in groups
+                gather_prims(children[i]);
+                int32_t num_prims = leaf_prims.size();
+                if (new_layout == BvhLayout::Compact) {
+                    // Only store the triangle indices, the vertices are read from the mesh during traversal
+                    assert(num_prims <= UINT16_MAX);
+                    wide.child[i] = new_tri_ids.size();
+                    wide.num_tris[i] = num_prims;
+                    new_tri_ids.insert(new_tri_ids.end(), leaf_prims.begin(), leaf_prims.end());
+                    continue;
+                }
+                wide.child[i] = new_tris.size();
+                wide.num_tris[i] = (num_prims + simd_width - 1) / simd_width;
+                for (int32_t k = 0; k < num_prims; k += simd_width) {
+                    PrecomputedTri4 group;
+                    for (int32_t l = 0; l < simd_width && k + l < num_prims; ++l) {
+                        auto tri_id = leaf_prims[k + l];
+                        auto i0 = indices[tri_id * 4 + 0];
+                        auto i1 = indices[tri_id * 4 + 1];
+                        auto i2 = indices[tri_id * 4 + 2];
+                        group.set(l, PrecomputedTri(verts[i0], verts[i1], verts[i2]), tri_id);
+                    }
+                    new_tris.push_back(group);
+                }
+            } else {
+                wide.child[i] = new_nodes.size();
+                new_nodes.emplace_back();
+                stack.emplace_back(children[i], wide.child[i]);
+            }
+        }
+        new_nodes[wide_id] = wide;
+    }
+
+    layout = new_layout;
+    num_nodes = new_nodes.size();
+    owned_nodes.reset();
+    owned_tris.reset();
+    owned_compact_nodes.reset();
+    owned_tri_ids.reset();
+    if (layout == BvhLayout::Compact) {
+        owned_compact_nodes.reset(new CompactNode[new_nodes.size()]);
+        std::transform(new_nodes.begin(), new_nodes.end(), owned_compact_nodes.get(), [&] (const WideNode& node) { return compress(node); });
+        num_tri_groups = new_tri_ids.size();
+        owned_tri_ids.reset(new uint32_t[new_tri_ids.size()]);
+        std::copy(new_tri_ids.begin(), new_tri_ids.end(), owned_tri_ids.get());
+        mesh_verts = verts;
+        mesh_indices = indices;
+    } else {
+        owned_nodes.reset(new WideNode[new_nodes.size()]);
+        std::copy(new_nodes.begin(), new_nodes.end(), owned_nodes.get());
+        num_tri_groups = new_tris.size();
+        owned_tris.reset(new PrecomputedTri4[new_tris.size()]);
+        std::copy(new_tris.begin(), new_tris.end(), owned_tris.get());
+    }
+    wide_nodes = owned_nodes.get();
+    tris = owned_tris.get();
+    compact_nodes = owned_compact_nodes.get();
+    tri_ids = owned_tri_ids.get();
+    mapped_file.reset();
+
+    // The binary tree is not needed anymore
+    nodes.reset();
+    prim_ids.reset();
+}
+
+/// Header of a BVH file. The arrays follow the header, at offsets that are multiples of the alignment.
+struct BvhFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t endianness;        ///< Written in native byte order, to detect files created on machines with a different endianness
+    uint32_t simd_width;
+    uint32_t node_size;         ///< Size of a node, in bytes
+    uint32_t tri_size;          ///< Size of a triangle group (or triangle index for the compact layout), in bytes
+    uint32_t alignment;
+    uint32_t layout;
+    uint32_t padding;
+    uint64_t key;               ///< Key of the mesh the BVH was built for
+    uint64_t num_nodes;
+    uint64_t num_tri_groups;
+    uint64_t nodes_offset;      ///< Offset of the nodes from the beginning of the file, in bytes
+    uint64_t tris_offset;       ///< Offset of the triangle groups from the beginning of the file, in bytes
+};
+
+static constexpr char     bvh_file_magic[8] = "ARTYBVH";
+static constexpr uint32_t bvh_file_version  = 2;
+static constexpr uint32_t bvh_file_alignment = 64;
+
+static BvhFileHeader bvh_file_header(uint64_t key, BvhLayout layout, size_t node_size, size_t tri_size) {
+    BvhFileHeader header;
+    std::memset(&header, 0, sizeof(BvhFileHeader));
+    std::memcpy(header.magic, bvh_file_magic, sizeof(bvh_file_magic));
+    header.version    = bvh_file_version;
+    header.endianness = 0x01020304;
+    header.simd_width = simd_width;
+    header.node_size  = node_size;
+    header.tri_size   = tri_size;
+    header.alignment  = bvh_file_alignment;
+    header.layout     = uint32_t(layout);
+    header.key        = key;
+    return header;
+}
+
+static uint64_t align_offset(uint64_t offset) {
+    return (offset + bvh_file_alignment - 1) / bvh_file_alignment * bvh_file_alignment;
+}
+
+bool Bvh::save(const std::string& path, uint64_t key) const {
+    bool compact = layout == BvhLayout::Compact;
+    auto node_size = compact ? sizeof(CompactNode) : sizeof(WideNode);
+    auto tri_size  = compact ? sizeof(uint32_t) : sizeof(PrecomputedTri4);
+    auto node_data = compact ? reinterpret_cast<const char*>(compact_nodes) : reinterpret_cast<const char*>(wide_nodes);
+    auto tri_data  = compact ? reinterpret_cast<const char*>(tri_ids) : reinterpret_cast<const char*>(tris);
+
+    auto header = bvh_file_header(key, layout, node_size, tri_size);
+    header.num_nodes      = num_nodes;
+    header.num_tri_groups = num_tri_groups;
+    header.nodes_offset   = align_offset(sizeof(BvhFileHeader));
+    header.tris_offset    = align_offset(header.nodes_offset + node_size * num_nodes);
+
+    // Write to a temporary file first, so that other processes never map a partially written file
+    auto tmp_path = path + ".tmp";
+    {
+        std::ofstream stream(tmp_path, std::ios::binary);
+        const char padding[bvh_file_alignment] = {};
+        stream.write(reinterpret_cast<const char*>(&header), sizeof(BvhFileHeader));
+        stream.write(padding, header.nodes_offset - sizeof(BvhFileHeader));
+        stream.write(node_data, node_size * num_nodes);
+        stream.write(padding, header.tris_offset - header.nodes_offset - node_size * num_nodes);
+        stream.write(tri_data, tri_size * num_tri_groups);
+        if (!stream) {
+            stream.close();
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+    }
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+bool Bvh::load(const std::string& path, uint64_t key, const float3* verts, const uint32_t* indices) {
+    std::unique_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(path, false) || file->size() < sizeof(BvhFileHeader))
+        return false;
+
+    BvhFileHeader header;
+    std::memcpy(&header, file->data(), sizeof(BvhFileHeader));
+    auto new_layout = header.layout == uint32_t(BvhLayout::Compact) ? BvhLayout::Compact : BvhLayout::Standard;
+    bool compact = new_layout == BvhLayout::Compact;
+    auto node_size = compact ? sizeof(CompactNode) : sizeof(WideNode);
+    auto tri_size  = compact ? sizeof(uint32_t) : sizeof(PrecomputedTri4);
+
+    // Everything but the array sizes and offsets must match exactly
+    auto expected = bvh_file_header(key, new_layout, node_size, tri_size);
+    expected.num_nodes      = header.num_nodes;
+    expected.num_tri_groups = header.num_tri_groups;
+    expected.nodes_offset   = header.nodes_offset;
+    expected.tris_offset    = header.tris_offset;
+    if (std::memcmp(&header, &expected, sizeof(BvhFileHeader)) ||
+        header.num_nodes == 0 ||
+        header.nodes_offset % bvh_file_alignment != 0 ||
+        header.tris_offset  % bvh_file_alignment != 0 ||
+        header.nodes_offset < sizeof(BvhFileHeader) ||
+        header.num_nodes > (file->size() - header.nodes_offset) / node_size ||
+        header.tris_offset < header.nodes_offset + node_size * header.num_nodes ||
+        header.tris_offset > file->size() ||
+        header.num_tri_groups > (file->size() - header.tris_offset) / tri_size)
+        return false;
+
+    // Use the arrays in place
+    layout         = new_layout;
+    num_nodes      = header.num_nodes;
+    num_tri_groups = header.num_tri_groups;
+    auto node_data = file->data() + header.nodes_offset;
+    auto tri_data  = file->data() + header.tris_offset;
+    wide_nodes    = compact ? nullptr : reinterpret_cast<const WideNode*>(node_data);
+    tris          = compact ? nullptr : reinterpret_cast<const PrecomputedTri4*>(tri_data);
+    compact_nodes = compact ? reinterpret_cast<const CompactNode*>(node_data) : nullptr;
+    tri_ids       = compact ? reinterpret_cast<const uint32_t*>(tri_data) : nullptr;
+    mesh_verts    = verts;
+    mesh_indices  = indices;
+    owned_nodes.reset();
+    owned_tris.reset();
+    owned_compact_nodes.reset();
+    owned_tri_ids.reset();
+    mapped_file = std::move(file);
+    return true;
+}
+
+bool Bvh::copy(const Bvh& other) {
+    layout         = other.layout;
+    num_nodes      = other.num_nodes;
+    num_tri_groups = other.num_tri_groups;
+    mesh_verts     = other.mesh_verts;
+    mesh_indices   = other.mesh_indices;
+    owned_nodes.reset();
+    owned_tris.reset();
+    owned_compact_nodes.reset();
+    owned_tri_ids.reset();
+    mapped_file.reset();
+    // The arrays are allocated and filled by the calling thread, which decides where they are placed in memory
+    if (layout == BvhLayout::Compact) {
+        owned_compact_nodes.reset(new CompactNode[num_nodes]);
+        std::copy(other.compact_nodes, other.compact_nodes + num_nodes, owned_compact_nodes.get());
+        owned_tri_ids.reset(new uint32_t[num_tri_groups]);
+        std::copy(other.tri_ids, other.tri_ids + num_tri_groups, owned_tri_ids.get());
+    } else {
+        owned_nodes.reset(new WideNode[num_nodes]);
+        std::copy(other.wide_nodes, other.wide_nodes + num_nodes, owned_nodes.get());
+        owned_tris.reset(new PrecomputedTri4[num_tri_groups]);
+        std::copy(other.tris, other.tris + num_tri_groups, owned_tris.get());
     }
+    wide_nodes    = owned_nodes.get();
+    tris          = owned_tris.get();
+    compact_nodes = owned_compact_nodes.get();
+    tri_ids       = owned_tri_ids.get();
+    return true;
 }
 
 void Bvh::compute_inefficiencies(float* inefficiencies) {
@@ -609,32 +1278,91 @@ void Bvh::optimize(size_t num_iters) {
     }
 }
 
-inline float fast_multiply_add(float a, float b, float c) {
-#ifdef FP_FAST_FMAF
-    return std::fmaf(a, b, c);
-#else
-    return a * b + c;
-#endif
+template <bool compact>
+inline void Bvh::load_node(int32_t index, vfloat4* bounds, int32_t* child, int32_t* num_tris) const {
+    if constexpr (compact) {
+        auto& node = compact_nodes[index];
+        for (int j = 0; j < 3; j++) {
+            vfloat4 origin(node.origin[j]), scale(std::ldexp(1.0f, node.exponent[j]));
+            bounds[2 * j + 0] = vfloat4::load(node.bounds[2 * j + 0]) * scale + origin;
+            bounds[2 * j + 1] = vfloat4::load(node.bounds[2 * j + 1]) * scale + origin;
+        }
+        for (size_t i = 0; i < simd_width; i++) {
+            child[i] = node.child[i];
+            num_tris[i] = node.num_tris[i];
+        }
+    } else {
+        auto& node = wide_nodes[index];
+        for (int j = 0; j < 6; j++)
+            bounds[j] = vfloat4::load(node.bounds[j]);
+        std::copy(node.child, node.child + simd_width, child);
+        std::copy(node.num_tris, node.num_tris + simd_width, num_tris);
+    }
 }
 
-std::pair<float, float> Bvh::Node::intersect(const float3& inv_dir, const float3& org_div_dir, float tmin, float tmax, const int* octant) const {
-    const float* bounds = reinterpret_cast<const float*>(this);
-    float t0x = fast_multiply_add(bounds[    octant[0]], inv_dir.x, -org_div_dir.x);
-    float t1x = fast_multiply_add(bounds[4 - octant[0]], inv_dir.x, -org_div_dir.x);
-    float t0y = fast_multiply_add(bounds[    octant[1]], inv_dir.y, -org_div_dir.y);
-    float t1y = fast_multiply_add(bounds[6 - octant[1]], inv_dir.y, -org_div_dir.y);
-    float t0z = fast_multiply_add(bounds[    octant[2]], inv_dir.z, -org_div_dir.z);
-    float t1z = fast_multiply_add(bounds[8 - octant[2]], inv_dir.z, -org_div_dir.z);
-    auto t0 = std::max(std::max(t0x, t0y), std::max(tmin, t0z));
-    auto t1 = std::min(std::min(t1x, t1y), std::min(tmax, t1z));
-    return std::make_pair(t0, t1);
+inline void Bvh::gather_tris(int32_t first, int32_t count, PrecomputedTri4& group) const {
+    for (int32_t l = 0; l < count; l++) {
+        auto tri_id = tri_ids[first + l];
+        group.set(l, PrecomputedTri(
+            mesh_verts[mesh_indices[tri_id * 4 + 0]],
+            mesh_verts[mesh_indices[tri_id * 4 + 1]],
+            mesh_verts[mesh_indices[tri_id * 4 + 2]]), tri_id);
+    }
+}
+
+template <bool compact, bool any>
+inline int Bvh::intersect_leaf(const RayVec& ray_vec, float tmin, int32_t first, int32_t count, Hit& hit) const {
+    bool found = false;
+    if constexpr (compact) {
+        // Gather the triangles from the mesh, in groups
+        for (int32_t k = 0; likely(k < count); k += simd_width) {
+            PrecomputedTri4 group;
+            gather_tris(first + k, std::min(count - k, int32_t(simd_width)), group);
+            int lane = intersect_ray_tri4(ray_vec, tmin, group, hit.t, hit.u, hit.v, any);
+            if (lane >= 0) {
+                hit.tri = group.ids[lane];
+                found = true;
+                if (any) break;
+            }
+        }
+    } else {
+        for (auto j = first; likely(j < first + count); j++) {
+            int lane = intersect_ray_tri4(ray_vec, tmin, tris[j], hit.t, hit.u, hit.v, any);
+            if (lane >= 0) {
+                hit.tri = tris[j].ids[lane];
+                found = true;
+                if (any) break;
+            }
+        }
+    }
+    return found;
 }
 
 template <bool any>
 void Bvh::traverse(const Ray& ray, Hit& hit) const {
-    constexpr int stack_size = 64;
-    int32_t stack[stack_size];
-    int32_t top = nodes[0].child;
+    if (layout == BvhLayout::Compact)
+        traverse_layout<any, true>(ray, hit);
+    else
+        traverse_layout<any, false>(ray, hit);
+}
+
+template <bool any>
+void Bvh::traverse_packet(const Ray* rays, Hit* hits, size_t count) const {
+    if (layout == BvhLayout::Compact)
+        traverse_packet_layout<any, true>(rays, hits, count);
+    else
+        traverse_packet_layout<any, false>(rays, hits, count);
+}
+
+template <bool any, bool compact>
+void Bvh::traverse_layout(const Ray& ray, Hit& hit) const {
+    struct StackElem {
+        int32_t child;
+        int32_t num_tris;
+        float t;
+    };
+    constexpr int stack_size = 256;
+    StackElem stack[stack_size];
     int32_t stack_ptr = 0;
 
     hit.tri = -1;
@@ -642,61 +1370,207 @@ void Bvh::traverse(const Ray& ray, Hit& hit) const {
     hit.u = 0;
     hit.v = 0;
 
-    int octant[] = {
-        ray.dir.x > 0 ? 0 : 4,
-        ray.dir.y > 0 ? 1 : 5,
-        ray.dir.z > 0 ? 2 : 6
+    // Index of the near plane on each axis in the node bounds, the far plane is the other one
+    int near[] = {
+        ray.dir.x >= 0 ? 0 : 1,
+        ray.dir.y >= 0 ? 2 : 3,
+        ray.dir.z >= 0 ? 4 : 5
     };
     auto inv_dir = float3(1.0f) / ray.dir;
     auto org_div_dir = ray.org * inv_dir;
+    vfloat4 inv_dir_x(inv_dir.x), inv_dir_y(inv_dir.y), inv_dir_z(inv_dir.z);
+    vfloat4 org_div_dir_x(org_div_dir.x), org_div_dir_y(org_div_dir.y), org_div_dir_z(org_div_dir.z);
+    vfloat4 tmin(ray.tmin);
+    RayVec ray_vec(ray);
+    TraversalStats traversal;
 
-    stack[0] = -1;
+    StackElem top { 0, 0, ray.tmin };
     while (true) {
-        auto& left  = nodes[top + 0];
-        auto& right = nodes[top + 1];
-
-        // Intersect the two children of this node
-        float t0[2], t1[2];
-        std::tie(t0[0], t1[0]) = left .intersect(inv_dir, org_div_dir, ray.tmin, hit.t, octant);
-        std::tie(t0[1], t1[1]) = right.intersect(inv_dir, org_div_dir, ray.tmin, hit.t, octant);
-
-#define INTERSECT_LEAF(leaf) \
-    { \
-        for (auto j = leaf.first_prim; likely(j < leaf.first_prim + leaf.num_prims); j++) { \
-            if (intersect_ray_tri(ray, tris[j], hit.t, hit.u, hit.v)) { \
-                hit.tri = j; \
-                if (any) return; \
-            } \
-        } \
-    }
-
-        int32_t child[2] = { -1, -1 };
-        if (t0[0] <= t1[0]) {
-            if unlikely(left.is_leaf()) INTERSECT_LEAF(left)
-            else child[0] = left.child;
-        }
-        if (t0[1] <= t1[1]) {
-            if unlikely(right.is_leaf()) INTERSECT_LEAF(right)
-            else child[1] = right.child;
-        }
-
-        // Push the children on the stack
-        if (child[0] >= 0 && child[1] >= 0) {
-            if (t0[0] < t0[1])
-                std::swap(child[0], child[1]);
-            stack[++stack_ptr] = child[0];
-            top = child[1];
-        } else if (child[1] >= 0) {
-            top = child[1];
-        } else if (child[0] >= 0) {
-            top = child[0];
+        if (top.num_tris == 0) {
+            vfloat4 bounds[6];
+            int32_t child[simd_width], num_tris[simd_width];
+            load_node<compact>(top.child, bounds, child, num_tris);
+            traversal.visit_node();
+
+            // Intersect the children of this node
+            auto t0x = bounds[near[0] + 0] * inv_dir_x - org_div_dir_x;
+            auto t1x = bounds[near[0] ^ 1] * inv_dir_x - org_div_dir_x;
+            auto t0y = bounds[near[1] + 0] * inv_dir_y - org_div_dir_y;
+            auto t1y = bounds[near[1] ^ 1] * inv_dir_y - org_div_dir_y;
+            auto t0z = bounds[near[2] + 0] * inv_dir_z - org_div_dir_z;
+            auto t1z = bounds[near[2] ^ 1] * inv_dir_z - org_div_dir_z;
+            auto t0 = max(max(t0x, t0y), max(t0z, tmin));
+            auto t1 = min(min(t1x, t1y), min(t1z, vfloat4(hit.t)));
+            int mask = (t0 <= t1).mask();
+
+            if likely(mask != 0) {
+                alignas(16) float dist[simd_width];
+                t0.store(dist);
+
+                // Push the children on the stack, from the farthest to the closest, and process the closest one first
+                int first = stack_ptr;
+                while (mask) {
+                    int i = first_bit(mask);
+                    mask &= mask - 1;
+                    StackElem elem { child[i], num_tris[i], dist[i] };
+                    int j = stack_ptr++;
+                    for (; j > first && stack[j - 1].t < elem.t; --j)
+                        stack[j] = stack[j - 1];
+                    stack[j] = elem;
+                }
+                top = stack[--stack_ptr];
+                continue;
+            }
         } else {
-            top = stack[stack_ptr--];
-            if (top < 0)
-                break;
+            // Intersect the triangles of this leaf
+            traversal.test_tris(compact ? top.num_tris : top.num_tris * simd_width);
+            if (intersect_leaf<compact, any>(ray_vec, ray.tmin, top.child, top.num_tris, hit) && any)
+                return;
         }
+
+        // Pop the next node, skipping those that are farther than the closest hit
+        do {
+            if (stack_ptr == 0)
+                return;
+            top = stack[--stack_ptr];
+        } while (top.t > hit.t);
     }
+}
+template <bool any, bool compact>
+void Bvh::traverse_packet_layout(const Ray* rays, Hit* hits, size_t count) const {
+    static_assert(packet_size <= 32, "Packet masks are stored on 32 bits");
+
+    struct StackElem {
+        int32_t child;
+        int32_t num_tris;
+        uint32_t mask;      ///< Rays of the packet that intersect this node
+        float t;            ///< Distance to the node for the closest ray of the packet
+    };
+    constexpr int stack_size = 256;
+    StackElem stack[stack_size];
+
+    struct RayData {
+        vfloat4 inv_dir[3];
+        vfloat4 org_div_dir[3];
+        vfloat4 tmin;
+        int near[3];
+    };
+    RayData data[packet_size];
+    TraversalStats traversal;
+
+    for (size_t first = 0; first < count; first += packet_size) {
+        auto packet_rays = rays + first;
+        auto packet_hits = hits + first;
+        size_t n = std::min(packet_size, count - first);
+
+        for (size_t i = 0; i < n; i++) {
+            auto& ray = packet_rays[i];
+            auto inv_dir = float3(1.0f) / ray.dir;
+            auto org_div_dir = ray.org * inv_dir;
+            for (int j = 0; j < 3; j++) {
+                data[i].inv_dir[j] = vfloat4(inv_dir[j]);
+                data[i].org_div_dir[j] = vfloat4(org_div_dir[j]);
+                data[i].near[j] = 2 * j + (ray.dir[j] >= 0 ? 0 : 1);
+            }
+            data[i].tmin = vfloat4(ray.tmin);
+            packet_hits[i] = Hit(-1, ray.tmax, 0, 0);
+        }
 
-    if (hit.tri >= 0) hit.tri = prim_ids[hit.tri];
+        // Rays that are still looking for an intersection
+        uint32_t active = n == 32 ? 0xFFFFFFFF : (uint32_t(1) << n) - 1;
+        int32_t stack_ptr = 0;
+        StackElem top { 0, 0, active, 0.0f };
+        while (true) {
+            if (top.num_tris == 0) {
+                vfloat4 bounds[6];
+                int32_t child[simd_width], num_tris[simd_width];
+                load_node<compact>(top.child, bounds, child, num_tris);
+                traversal.visit_node(std::popcount(top.mask));
+
+                // Intersect the children of this node with every ray of the packet
+                uint32_t child_masks[simd_width] = { 0 };
+                vfloat4 child_dist(FLT_MAX);
+                for (auto ray_mask = top.mask; ray_mask; ray_mask &= ray_mask - 1) {
+                    int i = first_bit(ray_mask);
+                    auto& d = data[i];
+                    auto t0x = bounds[d.near[0] + 0] * d.inv_dir[0] - d.org_div_dir[0];
+                    auto t1x = bounds[d.near[0] ^ 1] * d.inv_dir[0] - d.org_div_dir[0];
+                    auto t0y = bounds[d.near[1] + 0] * d.inv_dir[1] - d.org_div_dir[1];
+                    auto t1y = bounds[d.near[1] ^ 1] * d.inv_dir[1] - d.org_div_dir[1];
+                    auto t0z = bounds[d.near[2] + 0] * d.inv_dir[2] - d.org_div_dir[2];
+                    auto t1z = bounds[d.near[2] ^ 1] * d.inv_dir[2] - d.org_div_dir[2];
+                    auto t0 = max(max(t0x, t0y), max(t0z, d.tmin));
+                    auto t1 = min(min(t1x, t1y), min(t1z, vfloat4(packet_hits[i].t)));
+                    auto hit_mask = t0 <= t1;
+                    child_dist = select(hit_mask, min(child_dist, t0), child_dist);
+                    for (int mask = hit_mask.mask(); mask; mask &= mask - 1)
+                        child_masks[first_bit(mask)] |= uint32_t(1) << i;
+                }
+
+                alignas(16) float dist[simd_width];
+                child_dist.store(dist);
+
+                // Push the children on the stack, from the farthest to the closest, based on the closest ray of the packet
+                int first_elem = stack_ptr;
+                for (size_t i = 0; i < simd_width; i++) {
+                    if (!child_masks[i])
+                        continue;
+                    StackElem elem { child[i], num_tris[i], child_masks[i], dist[i] };
+                    int j = stack_ptr++;
+                    for (; j > first_elem && stack[j - 1].t < elem.t; --j)
+                        stack[j] = stack[j - 1];
+                    stack[j] = elem;
+                }
+            } else if constexpr (compact) {
+                traversal.test_tris(top.num_tris * std::popcount(top.mask));
+                // Gather each group of triangles of this leaf from the mesh once, and intersect it with every ray of the packet
+                for (int32_t k = 0; k < top.num_tris && top.mask; k += simd_width) {
+                    PrecomputedTri4 group;
+                    gather_tris(top.child + k, std::min(top.num_tris - k, int32_t(simd_width)), group);
+                    for (auto ray_mask = top.mask; ray_mask; ray_mask &= ray_mask - 1) {
+                        int i = first_bit(ray_mask);
+                        auto& ray = packet_rays[i];
+                        auto& hit = packet_hits[i];
+                        int lane = intersect_ray_tri4(RayVec(ray), ray.tmin, group, hit.t, hit.u, hit.v, any);
+                        if (lane >= 0) {
+                            hit.tri = group.ids[lane];
+                            if (any) {
+                                active &= ~(uint32_t(1) << i);
+                                top.mask &= ~(uint32_t(1) << i);
+                            }
+                        }
+                    }
+                }
+            } else {
+                traversal.test_tris(top.num_tris * simd_width * std::popcount(top.mask));
+                // Intersect the triangles of this leaf with every ray of the packet
+                for (auto ray_mask = top.mask; ray_mask; ray_mask &= ray_mask - 1) {
+                    int i = first_bit(ray_mask);
+                    auto& ray = packet_rays[i];
+                    auto& hit = packet_hits[i];
+                    RayVec ray_vec(ray);
+                    for (auto j = top.child; likely(j < top.child + top.num_tris); j++) {
+                        int lane = intersect_ray_tri4(ray_vec, ray.tmin, tris[j], hit.t, hit.u, hit.v, any);
+                        if (lane >= 0) {
+                            hit.tri = tris[j].ids[lane];
+                            if (any) {
+                                active &= ~(uint32_t(1) << i);
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+
+            // Pop the next node, skipping those that are only intersected by terminated rays
+            top.mask = 0;
+            while (stack_ptr > 0 && !top.mask) {
+                top = stack[--stack_ptr];
+                top.mask &= active;
+            }
+            if (!top.mask)
+                break;
+        }
+    }
 }
 #endif // EMBREE
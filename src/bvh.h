@@ -2,17 +2,32 @@
 #define BVH_H
 
 #include <memory>
+#include <string>
 #include <cstdint>
 
 #include "float3.h"
 #include "intersect.h"
 #include "bbox.h"
+#include "mapped_file.h"
 
 #ifdef EMBREE
 #include <embree3/rtcore.h>
 #endif
 
-/// Bounding Volume Hierarchy.
+/// Construction algorithm used to build a BVH.
+enum class BvhQuality {
+    Fast,   ///< Parallel binned SAH builder, no triangle splitting or post-optimization
+    High    ///< Full sweep SAH builder with triangle pre-splitting and reinsertion-based optimization
+};
+
+/// Memory layout of a BVH.
+enum class BvhLayout {
+    Standard,   ///< Full-precision nodes, and a precomputed copy of every triangle
+    Compact     ///< Nodes with quantized bounds, and leaves that reference the triangles of the mesh
+};
+
+/// Bounding Volume Hierarchy. The BVH is built as a binary tree, and then collapsed into
+/// a 4-wide tree that is traversed with SIMD instructions.
 class Bvh {
 public:
 #ifdef EMBREE
@@ -20,13 +35,36 @@ public:
 #endif
 
     /// Builds a BVH given a list of vertices and a list of indices.
-    void build(const float3* verts, const uint32_t* indices, size_t num_tris);
+    /// With the compact layout, the vertices and indices are referenced by the BVH, and must outlive it.
+    void build(const float3* verts, const uint32_t* indices, size_t num_tris,
+               BvhQuality quality = BvhQuality::High, BvhLayout layout = BvhLayout::Standard);
+
+    /// Computes the key identifying a BVH built from the given mesh, used to check that a saved BVH matches the scene.
+    static uint64_t key(const float3* verts, size_t num_verts, const uint32_t* indices, size_t num_tris, BvhQuality quality, BvhLayout layout);
+
+    /// Saves the BVH to a file, tagged with the given key. Returns false if the BVH cannot be saved.
+    bool save(const std::string& path, uint64_t key) const;
+    /// Loads a BVH saved with the given key. The file is memory-mapped and used in place, without copying it.
+    /// Compact BVHs reference the given vertices and indices, which must be the ones the BVH was built with.
+    /// Returns false if the file does not exist, is invalid, or was saved with another key or on an incompatible machine.
+    bool load(const std::string& path, uint64_t key, const float3* verts, const uint32_t* indices);
+    /// Replaces this BVH by a copy of another one, whose nodes and triangles are copied by the calling thread
+    /// (compact BVHs keep referencing the same mesh). Returns false if the BVH cannot be copied (with Embree).
+    bool copy(const Bvh& other);
 
     /// Traverses the BVH in order to find the closest intersection, or any intersection if 'any' is set.
     template <bool any = false>
     void traverse(const Ray& ray, Hit& hit) const;
 
-    /// Returns the number of nodes in the BVH.
+    /// Traverses the BVH with a batch of rays, which is processed in packets of at most 'packet_size' rays.
+    /// Rays in a packet share node fetches and the traversal stack, which is efficient for coherent rays.
+    template <bool any = false>
+    void traverse_packet(const Ray* rays, Hit* hits, size_t count) const;
+
+    /// Maximum number of rays traversed together by traverse_packet.
+    static constexpr size_t packet_size = 16;
+
+    /// Returns the number of (wide) nodes in the BVH.
     size_t node_count() const { return num_nodes; }
 
 private:
@@ -36,6 +74,7 @@ private:
     RTCScene scene;
 #else
     friend struct BvhBuilder;
+    friend struct BinnedBvhBuilder;
     struct Node {
         float3 min;             ///< Min. BB corners
         union {
@@ -50,13 +89,39 @@ private:
 
         BBox bbox() const { return BBox(min, max); }
         bool is_leaf() const { return num_prims > 0; };
-        inline std::pair<float, float> intersect(const float3&, const float3&, float, float, const int*) const;
     };
 
+    /// Node of the collapsed BVH, with the bounding boxes of its children stored in SoA layout.
+    struct WideNode {
+        float bounds[6][simd_width];    ///< Min. and max. BB corners of the children, in the order: min x, max x, min y, max y, min z, max z
+        int32_t child[simd_width];      ///< Index of the child node, or of its first triangle group for leaves, or -1 for empty slots
+        int32_t num_tris[simd_width];   ///< Number of triangle groups for a leaf, or 0 for inner nodes
+    };
+
+    /// Node of the compact BVH. The bounds of the children are quantized on a grid of 256 cells of the node
+    /// bounding box, whose size is a power of two on each axis.
+    struct CompactNode {
+        float    origin[3];                 ///< Min. corner of the quantization grid
+        int8_t   exponent[3];               ///< Size of a grid cell on each axis, as a power of two
+        uint8_t  padding;
+        uint8_t  bounds[6][simd_width];     ///< Quantized min. and max. BB corners of the children, in the same order as WideNode
+        int32_t  child[simd_width];         ///< Index of the child node, or of its first triangle index for leaves
+        uint16_t num_tris[simd_width];      ///< Number of triangles for a leaf, or 0 for inner nodes
+    };
+
+    template <bool compact> void load_node(int32_t, vfloat4*, int32_t*, int32_t*) const;
+    void gather_tris(int32_t, int32_t, PrecomputedTri4&) const;
+    template <bool compact, bool any> int intersect_leaf(const RayVec&, float, int32_t, int32_t, Hit&) const;
+    template <bool any, bool compact> void traverse_layout(const Ray&, Hit&) const;
+    template <bool any, bool compact> void traverse_packet_layout(const Ray*, Hit*, size_t) const;
+    CompactNode compress(const WideNode&) const;
+
     void try_split(size_t, const float3*, BBox*, float3*, uint32_t*, float, size_t&, size_t);
     size_t pre_split(const float3*, const uint32_t*, BBox*, float3*, uint32_t*, float, size_t, size_t);
     void fix_refs(const uint32_t*);
     void build(const BBox&, const BBox*, const float3*, size_t);
+    void build_binned(const BBox&, const BBox&, const BBox*, const float3*, size_t);
+    void collapse(const float3*, const uint32_t*, BvhLayout);
     void compute_inefficiencies(float*);
     void compute_parents(size_t*);
     size_t remove_node(size_t, size_t*);
@@ -66,11 +131,30 @@ private:
     void reorder_nodes(std::unique_ptr<Node[]>&, size_t*);
     void optimize(size_t);
 
-    std::unique_ptr<Node[]>           nodes;
-    std::unique_ptr<uint32_t[]>       prim_ids;
-    std::unique_ptr<PrecomputedTri[]> tris;
+    // Binary tree, only used during construction
+    std::unique_ptr<Node[]>            nodes;
+    std::unique_ptr<uint32_t[]>        prim_ids;
+
+    // Collapsed BVH, pointing either to the arrays below, or to a memory-mapped file.
+    // The standard layout uses wide nodes and triangle groups, the compact one uses compact nodes and triangle indices.
+    BvhLayout                          layout = BvhLayout::Standard;
+    const WideNode*                    wide_nodes = nullptr;
+    const PrecomputedTri4*             tris = nullptr;
+    const CompactNode*                 compact_nodes = nullptr;
+    const uint32_t*                    tri_ids = nullptr;
+    size_t                             num_tri_groups = 0;  ///< Number of triangle groups, or of triangle indices for the compact layout
+
+    std::unique_ptr<WideNode[]>        owned_nodes;
+    std::unique_ptr<PrecomputedTri4[]> owned_tris;
+    std::unique_ptr<CompactNode[]>     owned_compact_nodes;
+    std::unique_ptr<uint32_t[]>        owned_tri_ids;
+    std::unique_ptr<MappedFile>        mapped_file;
+
+    // Mesh referenced by the compact layout
+    const float3*                      mesh_verts = nullptr;
+    const uint32_t*                    mesh_indices = nullptr;
 #endif
-    size_t                            num_nodes;
+    size_t                            num_nodes = 0;
 };
 
 #endif // BVH_H
@@ -56,6 +56,25 @@ struct rgba : public float4 {
 
 inline rgb::rgb(const rgba& rgba) : float3(rgba) {}
 
+/// Packs a positive color into 32 bits, using a shared 8-bit exponent (RGBE format).
+inline uint32_t pack_rgbe(const rgb& c) {
+    auto m = std::max(c.x, std::max(c.y, c.z));
+    if (!(m > 1e-32f)) return 0;
+    int e;
+    auto scale = std::frexp(m, &e) * 256.0f / m;
+    auto r = uint32_t(std::max(c.x, 0.0f) * scale);
+    auto g = uint32_t(std::max(c.y, 0.0f) * scale);
+    auto b = uint32_t(std::max(c.z, 0.0f) * scale);
+    return r | (g << 8) | (b << 16) | (uint32_t(clamp(e + 128, 0, 255)) << 24);
+}
+
+/// Unpacks a color packed with pack_rgbe.
+inline rgb unpack_rgbe(uint32_t p) {
+    if (!(p >> 24)) return rgb(0.0f);
+    auto scale = std::ldexp(1.0f, int(p >> 24) - (128 + 8));
+    return rgb(float(p & 0xFF) + 0.5f, float((p >> 8) & 0xFF) + 0.5f, float((p >> 16) & 0xFF) + 0.5f) * scale;
+}
+
 static const rgb luminance(0.2126f, 0.7152f, 0.0722f);
 
 inline rgb gamma(const rgb& c, float g = 0.454545f) {
@@ -0,0 +1,132 @@
+#include <cmath>
+#include <algorithm>
+
+#include "denoise.h"
+#include "scene.h"
+#include "parallel.h"
+
+/// Number of passes of the filter, whose footprint doubles with each pass (5 passes cover 125x125 pixels).
+static constexpr size_t num_passes = 5;
+/// Standard deviations of the edge-stopping functions. The one of the color is halved after every pass.
+static constexpr float color_sigma  = 0.5f;
+static constexpr float albedo_sigma = 0.1f;
+static constexpr float normal_sigma = 0.2f;
+static constexpr float depth_sigma  = 0.05f;   ///< Relative to the depth, for neighbors one pixel away
+/// Albedo below which the lighting is not divided by the albedo (lights, black materials and the background).
+static constexpr float min_albedo = 0.01f;
+
+void FeatureBuffers::add_first_hit(size_t x, size_t y, const Scene& scene, const Ray& ray, const Hit& hit) {
+    if (hit.tri < 0) {
+        albedo(x, y).w += 1.0f;
+        return;
+    }
+    auto surf = scene.surface_params(ray, hit);
+    auto& n = surf.coords.n;
+    albedo(x, y) += rgba(scene.material(hit).bsdf.albedo(surf), 1.0f);
+    normal(x, y) += rgba(n.x, n.y, n.z, hit.t);
+}
+
+FeatureBuffers FeatureBuffers::average() const {
+    FeatureBuffers result;
+    result.reset(albedo.width, albedo.height);
+    for (size_t i = 0; i < albedo.pixels.size(); i++) {
+        auto samples = albedo.pixels[i].w;
+        if (samples == 0.0f) continue;
+        auto n = normal.pixels[i];
+        auto len = length(float3(n.x, n.y, n.z));
+        result.albedo.pixels[i] = rgba(rgb(albedo.pixels[i]) / samples, 1.0f);
+        result.normal.pixels[i] = len > 0.0f
+            ? rgba(n.x / len, n.y / len, n.z / len, n.w / samples)
+            : rgba(0.0f, 0.0f, 0.0f, n.w / samples);
+    }
+    return result;
+}
+
+std::vector<ExrChannel> FeatureBuffers::exr_channels() const {
+    return {
+        ExrChannel { "albedo.R", &albedo, 0 },
+        ExrChannel { "albedo.G", &albedo, 1 },
+        ExrChannel { "albedo.B", &albedo, 2 },
+        ExrChannel { "N.X", &normal, 0 },
+        ExrChannel { "N.Y", &normal, 1 },
+        ExrChannel { "N.Z", &normal, 2 },
+        ExrChannel { "Z",   &normal, 3 }
+    };
+}
+
+static inline rgb demodulation_factor(const rgba& albedo) {
+    return rgb(
+        albedo.x > min_albedo ? albedo.x : 1.0f,
+        albedo.y > min_albedo ? albedo.y : 1.0f,
+        albedo.z > min_albedo ? albedo.z : 1.0f);
+}
+
+/// Compresses the dynamic range of a color, so that the color weights do not depend on the brightness of the scene.
+static inline rgb compress(const rgb& color) {
+    return color / (1.0f + std::max(dot(luminance, color), 0.0f));
+}
+
+void denoise(Image& img, const FeatureBuffers& features) {
+    auto width = img.width, height = img.height;
+
+    // The lighting (the image divided by the albedo) is filtered, with the range of its values compressed for the color weights
+    Image lighting(width, height), next(width, height);
+    for (size_t i = 0; i < img.pixels.size(); i++) {
+        auto light = rgb(img.pixels[i]) / demodulation_factor(features.albedo.pixels[i]);
+        lighting.pixels[i] = rgba(light, 0.0f);
+    }
+
+    // B3 spline kernel, whose taps are spread 2^i pixels apart at pass i
+    const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+    for (size_t pass = 0; pass < num_passes; pass++) {
+        auto step = int(1) << pass;
+        auto inv_color_var  = 1.0f / (color_sigma * color_sigma * std::ldexp(1.0f, -2 * int(pass)));
+        auto inv_albedo_var = 1.0f / (albedo_sigma * albedo_sigma);
+        auto inv_normal_var = 1.0f / (normal_sigma * normal_sigma);
+        auto inv_depth_var  = 1.0f / (depth_sigma * depth_sigma * step * step);
+
+        parallel_for(0, height, [&] (size_t y) {
+            for (size_t x = 0; x < width; x++) {
+                auto p = y * width + x;
+                auto color_p  = compress(rgb(lighting.pixels[p]));
+                auto albedo_p = rgb(features.albedo.pixels[p]);
+                auto normal_p = features.normal.pixels[p];
+                auto depth_p  = std::max(normal_p.w, 1e-4f);
+
+                rgb sum(0.0f);
+                float total = 0.0f;
+                for (int dy = -2; dy <= 2; dy++) {
+                    auto qy = int(y) + dy * step;
+                    if (qy < 0 || qy >= int(height)) continue;
+                    for (int dx = -2; dx <= 2; dx++) {
+                        auto qx = int(x) + dx * step;
+                        if (qx < 0 || qx >= int(width)) continue;
+
+                        auto q = size_t(qy) * width + size_t(qx);
+                        auto& normal_q = features.normal.pixels[q];
+                        auto d_color  = color_p - compress(rgb(lighting.pixels[q]));
+                        auto d_albedo = albedo_p - rgb(features.albedo.pixels[q]);
+                        auto d_normal = float3(normal_p.x - normal_q.x, normal_p.y - normal_q.y, normal_p.z - normal_q.z);
+                        auto d_depth  = (normal_p.w - normal_q.w) / depth_p;
+                        auto weight = kernel[dx + 2] * kernel[dy + 2] * std::exp(-(
+                            dot(d_color,  d_color)  * inv_color_var +
+                            dot(d_albedo, d_albedo) * inv_albedo_var +
+                            dot(d_normal, d_normal) * inv_normal_var +
+                            d_depth * d_depth * inv_depth_var));
+                        sum += rgb(lighting.pixels[q]) * weight;
+                        total += weight;
+                    }
+                }
+                // The center pixel always has a positive weight
+                next.pixels[p] = rgba(sum / total, 0.0f);
+            }
+        });
+        std::swap(lighting, next);
+    }
+
+    // The albedo is multiplied back, and the alpha channel is left untouched
+    for (size_t i = 0; i < img.pixels.size(); i++) {
+        auto color = rgb(lighting.pixels[i]) * demodulation_factor(features.albedo.pixels[i]);
+        img.pixels[i] = rgba(color, img.pixels[i].w);
+    }
+}
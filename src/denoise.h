@@ -0,0 +1,45 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <vector>
+
+#include "image.h"
+#include "float3.h"
+
+struct Scene;
+struct Ray;
+struct Hit;
+
+/// Features of the first hits of the camera rays (albedo, shading normal and depth), accumulated like the image.
+/// They guide the denoiser, and can be saved as extra channels of EXR files (AOVs) for external denoisers.
+struct FeatureBuffers {
+    Image albedo;       ///< Sum of the albedos (RGB), and number of samples (A)
+    Image normal;       ///< Sum of the shading normals (XYZ), and of the depths (W)
+
+    /// Clears the buffers, for an image of the given size. Must be called whenever the renderer is reset.
+    void reset(size_t width, size_t height) {
+        albedo.resize(width, height);
+        normal.resize(width, height);
+        albedo.clear();
+        normal.clear();
+    }
+
+    /// Adds the features of the first hit of a camera ray, or zero features if the ray missed the scene.
+    /// Pixels are only written by the thread that renders their tile.
+    void add_first_hit(size_t x, size_t y, const Scene& scene, const Ray& ray, const Hit& hit);
+
+    /// Returns the average features of every pixel. Pixels keep their own number of samples,
+    /// since adaptive sampling does not trace rays through the converged tiles.
+    FeatureBuffers average() const;
+
+    /// Returns the EXR channels of averaged features: albedo.R/G/B, N.X/Y/Z and Z (depth).
+    std::vector<ExrChannel> exr_channels() const;
+};
+
+/// Denoises an image of averaged samples with an edge-avoiding à-trous wavelet filter, whose weights depend on
+/// the differences of color, albedo, normal and depth between pixels ("Edge-Avoiding À-Trous Wavelet Transform
+/// for fast Global Illumination Filtering", H. Dammertz et al., 2010). The lighting is divided by the albedo
+/// before filtering, so that textures stay sharp. The features must have been averaged.
+void denoise(Image& img, const FeatureBuffers& features);
+
+#endif // DENOISE_H
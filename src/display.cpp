@@ -0,0 +1,96 @@
+#include <cmath>
+
+#include "display.h"
+#include "simd.h"
+
+static constexpr size_t gamma_table_size = 4096;
+
+DisplayThread::DisplayThread(const PixelFormat& format)
+    : format(format), gamma_table(gamma_table_size)
+{
+    // Entry i holds the gamma-corrected value of (i / (n - 1))^2. Indexing by the square root keeps the
+    // error below one level in the dark values, where the gamma curve is the steepest.
+    for (size_t i = 0; i < gamma_table_size; i++) {
+        auto s = float(i) / float(gamma_table_size - 1);
+        gamma_table[i] = uint8_t(std::pow(s * s, 0.454545f) * 255.0f + 0.5f);
+    }
+    thread = std::thread([this] { loop(); });
+}
+
+DisplayThread::~DisplayThread() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    cond.notify_one();
+    thread.join();
+}
+
+bool DisplayThread::publish(const Image& img, size_t accum, const std::vector<uint8_t>& last_frame_mask) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (has_input)
+            return false;
+    }
+
+    // The display thread only touches the input once has_input is set, so it can be filled without the lock
+    input.img = img;
+    input.accum = accum;
+    input.last_frame_mask = last_frame_mask;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        has_input = true;
+    }
+    cond.notify_one();
+    return true;
+}
+
+void DisplayThread::loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cond.wait(lock, [this] { return has_input || quit; });
+        if (quit)
+            break;
+        std::swap(input, source);
+        has_input = false;
+
+        lock.unlock();
+        convert(source, converted);
+        lock.lock();
+
+        std::swap(converted, output);
+        output_width  = source.img.width;
+        output_height = source.img.height;
+        has_output = true;
+    }
+}
+
+void DisplayThread::convert(const Frame& frame, std::vector<uint32_t>& pixels) const {
+    auto& img = frame.img;
+    pixels.resize(img.width * img.height);
+
+    // When the last frame was interrupted by the deadline, only the pixels in the mask received the last sample
+    auto inv_accum   = frame.accum > 0 ? 1.0f / frame.accum : 0.0f;
+    auto inv_partial = frame.accum > 1 ? 1.0f / (frame.accum - 1) : 0.0f;
+    auto has_mask = !frame.last_frame_mask.empty();
+
+    auto zero = vfloat4(0.0f), one = vfloat4(1.0f);
+    auto table_scale = vfloat4(float(gamma_table_size - 1));
+    for (size_t i = 0, n = img.pixels.size(); i < n; i++) {
+        auto scale = has_mask && !frame.last_frame_mask[i] ? inv_partial : inv_accum;
+        auto color = min(max(vfloat4::load(&img.pixels[i].x) * vfloat4(scale), zero), one);
+        auto index = sqrt(color) * table_scale + vfloat4(0.5f);
+
+        alignas(16) float c[4], k[4];
+        color.store(c);
+        index.store(k);
+        auto r = gamma_table[size_t(k[0])];
+        auto g = gamma_table[size_t(k[1])];
+        auto b = gamma_table[size_t(k[2])];
+        auto a = uint32_t(c[3] * 255.0f + 0.5f);
+        pixels[i] = ((uint32_t(r) << format.rshift) & format.rmask) |
+                    ((uint32_t(g) << format.gshift) & format.gmask) |
+                    ((uint32_t(b) << format.bshift) & format.bmask) |
+                    ((a << format.ashift) & format.amask);
+    }
+}
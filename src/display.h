@@ -0,0 +1,72 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include "image.h"
+
+/// Layout of the channels in a packed 32-bit pixel.
+struct PixelFormat {
+    uint32_t rshift, gshift, bshift, ashift;
+    uint32_t rmask, gmask, bmask, amask;
+};
+
+/// Converts accumulated images to gamma-corrected, packed 8-bit pixels on a separate thread.
+/// Images are handed over through a double buffer: the render loop fills one copy while the
+/// display thread converts the other, so that rendering never waits for the conversion.
+class DisplayThread {
+public:
+    DisplayThread(const PixelFormat& format);
+    ~DisplayThread();
+
+    /// Copies the given accumulation buffer and hands it over to the display thread, along with the
+    /// number of samples per pixel (see last_frame_mask in main.cpp). Never blocks: returns false, and
+    /// drops the image, if the display thread has not started converting the previous one yet.
+    bool publish(const Image& img, size_t accum, const std::vector<uint8_t>& last_frame_mask);
+
+    /// Calls f(pixels, width, height) with the last converted frame and returns true, if it has not been
+    /// consumed yet. The display thread cannot publish a new frame while the function runs.
+    template <typename F>
+    bool consume(F f) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!has_output)
+            return false;
+        f(output.data(), output_width, output_height);
+        has_output = false;
+        return true;
+    }
+
+private:
+    struct Frame {
+        Image img;
+        size_t accum = 0;
+        std::vector<uint8_t> last_frame_mask;
+    };
+
+    void loop();
+    void convert(const Frame& frame, std::vector<uint32_t>& pixels) const;
+
+    PixelFormat format;
+    /// Gamma curve, indexed by the square root of the linear value so that dark values are precise
+    std::vector<uint8_t> gamma_table;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool quit = false;
+
+    Frame input;                        ///< Filled by publish(), when has_input is false
+    Frame source;                       ///< Frame being converted
+    bool has_input = false;
+
+    std::vector<uint32_t> converted;    ///< Pixels being written by the display thread
+    std::vector<uint32_t> output;       ///< Last frame converted, swapped with the converted pixels
+    size_t output_width = 0, output_height = 0;
+    bool has_output = false;
+};
+
+#endif // DISPLAY_H
@@ -3,6 +3,8 @@
 
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include "common.h"
 
 struct float3;
@@ -102,4 +104,40 @@ inline float2 normalize(const float2& a) {
     return a * (1.0f / length(a));
 }
 
+/// Converts a float to a half-precision float, rounding to the nearest value. Values too small to be represented as normalized half-precision floats are flushed to zero.
+inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(float));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t  exp  = int32_t((x >> 23) & 0xFF) - 127 + 15;
+    uint32_t mant = x & 0x7FFFFF;
+    if (exp <= 0)  return sign;
+    if (exp >= 31) return sign | 0x7C00;
+    // Rounding may carry into the exponent, which gives the correct result
+    return (sign | (uint32_t(exp) << 10) | (mant >> 13)) + ((mant >> 12) & 1);
+}
+
+/// Converts a half-precision float produced by float_to_half back to a float.
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exp  = (h >> 10) & 0x1F;
+    uint32_t mant = h & 0x3FF;
+    uint32_t x = exp == 0  ? sign :
+                 exp == 31 ? sign | 0x7F800000 | (mant << 13) :
+                 sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    float f;
+    std::memcpy(&f, &x, sizeof(float));
+    return f;
+}
+
+/// Packs a pair of floats into 32 bits, as two half-precision floats.
+inline uint32_t pack_half2(const float2& v) {
+    return uint32_t(float_to_half(v.x)) | (uint32_t(float_to_half(v.y)) << 16);
+}
+
+/// Unpacks a pair of floats packed with pack_half2.
+inline float2 unpack_half2(uint32_t p) {
+    return float2(half_to_float(p & 0xFFFF), half_to_float(p >> 16));
+}
+
 #endif // FLOAT2_H
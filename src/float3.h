@@ -3,6 +3,7 @@
 
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include "common.h"
 #include "float2.h"
 
@@ -142,4 +143,31 @@ inline float3 normalize(const float3& a) {
     return a * (1.0f / length(a));
 }
 
+/// Packs a unit vector into 32 bits, using an octahedral mapping with 16 bits per coordinate.
+inline uint32_t pack_unit_vector(const float3& v) {
+    auto inv = 1.0f / (std::fabs(v.x) + std::fabs(v.y) + std::fabs(v.z));
+    auto x = v.x * inv, y = v.y * inv;
+    if (v.z < 0) {
+        auto tx = (1.0f - std::fabs(y)) * prodsign(1.0f, x);
+        auto ty = (1.0f - std::fabs(x)) * prodsign(1.0f, y);
+        x = tx, y = ty;
+    }
+    auto qx = uint32_t(std::round(clamp(x * 0.5f + 0.5f, 0.0f, 1.0f) * 65535.0f));
+    auto qy = uint32_t(std::round(clamp(y * 0.5f + 0.5f, 0.0f, 1.0f) * 65535.0f));
+    return qx | (qy << 16);
+}
+
+/// Unpacks a unit vector packed with pack_unit_vector.
+inline float3 unpack_unit_vector(uint32_t p) {
+    auto x = float(p & 0xFFFF) * (2.0f / 65535.0f) - 1.0f;
+    auto y = float(p >> 16)    * (2.0f / 65535.0f) - 1.0f;
+    auto z = 1.0f - std::fabs(x) - std::fabs(y);
+    if (z < 0) {
+        auto tx = (1.0f - std::fabs(y)) * prodsign(1.0f, x);
+        auto ty = (1.0f - std::fabs(x)) * prodsign(1.0f, y);
+        x = tx, y = ty;
+    }
+    return normalize(float3(x, y, z));
+}
+
 #endif // FLOAT3_H
@@ -0,0 +1,204 @@
+#include <cmath>
+#include <algorithm>
+
+#include "guiding.h"
+#include "parallel.h"
+#include "arena.h"
+
+/// Largest float below 1, to keep coordinates inside the unit square.
+static constexpr float one_minus_epsilon = 0x1.fffffep-1f;
+
+/// Maps a direction to the unit square, using cylindrical coordinates (which preserve areas).
+static inline float2 dir_to_square(const float3& dir) {
+    auto u = (clamp(dir.z, -1.0f, 1.0f) + 1.0f) * 0.5f;
+    auto phi = std::atan2(dir.y, dir.x);
+    if (phi < 0.0f) phi += 2.0f * pi;
+    auto v = phi * (0.5f / pi);
+    return float2(std::min(u, one_minus_epsilon), std::min(v, one_minus_epsilon));
+}
+
+static inline float3 square_to_dir(float u, float v) {
+    auto z = 2.0f * u - 1.0f;
+    auto r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    auto phi = 2.0f * pi * v;
+    return float3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+/// Returns the quadrant of a node that contains the given point, and maps the point to the unit square of that quadrant.
+static inline int enter_quadrant(float2& p) {
+    int qx = p.x >= 0.5f;
+    int qy = p.y >= 0.5f;
+    p.x = std::min(p.x * 2.0f - qx, one_minus_epsilon);
+    p.y = std::min(p.y * 2.0f - qy, one_minus_epsilon);
+    return qx + 2 * qy;
+}
+
+/// Chooses between two halves with the given energies, and remaps the random number to the chosen half.
+static inline int choose_half(float a, float b, float& u) {
+    auto p = a + b > 0.0f ? a / (a + b) : 0.5f;
+    if (u < p) {
+        u = std::min(u / p, one_minus_epsilon);
+        return 0;
+    }
+    u = std::min((u - p) / (1.0f - p), one_minus_epsilon);
+    return 1;
+}
+
+void DirectionalTree::record(const float3& dir, float value) {
+    auto p = dir_to_square(dir);
+    uint32_t i = 0;
+    while (true) {
+        auto q = enter_quadrant(p);
+        atomic_add(nodes[i].sums[q], value);
+        if (!nodes[i].children[q])
+            break;
+        i = nodes[i].children[q];
+    }
+}
+
+float3 DirectionalTree::sample(float u, float v) const {
+    float2 origin(0.0f, 0.0f);
+    float size = 1.0f;
+    uint32_t i = 0;
+    while (true) {
+        auto& node = nodes[i];
+        auto qx = choose_half(node.sums[0] + node.sums[2], node.sums[1] + node.sums[3], u);
+        auto qy = choose_half(node.sums[qx], node.sums[qx + 2], v);
+        auto q = qx + 2 * qy;
+        size *= 0.5f;
+        origin.x += qx * size;
+        origin.y += qy * size;
+        if (!node.children[q])
+            break;
+        i = node.children[q];
+    }
+    return square_to_dir(origin.x + u * size, origin.y + v * size);
+}
+
+float DirectionalTree::pdf(const float3& dir) const {
+    auto p = dir_to_square(dir);
+    float pdf = 1.0f / (4.0f * pi);
+    uint32_t i = 0;
+    while (true) {
+        auto& node = nodes[i];
+        auto sum = node.sums[0] + node.sums[1] + node.sums[2] + node.sums[3];
+        if (sum <= 0.0f)
+            return 0.0f;
+        auto q = enter_quadrant(p);
+        pdf *= 4.0f * node.sums[q] / sum;
+        if (!node.children[q])
+            break;
+        i = node.children[q];
+    }
+    return pdf;
+}
+
+void DirectionalTree::refine(const DirectionalTree& src, float threshold, size_t max_depth, size_t max_nodes) {
+    nodes.clear();
+    nodes.emplace_back();
+
+    auto total = src.total();
+    if (total <= 0.0f)
+        return;
+
+    // Nodes that do not exist in the source tree get a quarter of the energy of their parent in each quadrant
+    struct Item {
+        uint32_t node;
+        int64_t src;
+        float energy;
+        size_t depth;
+    };
+    ArenaScope scope;
+    ArenaVector<Item> queue(scope.arena);
+    queue.push_back(Item { 0, 0, total, 1 });
+
+    // Breadth-first, so that the node budget is spent on the coarse levels first
+    for (size_t head = 0; head < queue.size(); head++) {
+        auto item = queue[head];
+        for (int q = 0; q < 4; q++) {
+            auto energy = item.src >= 0 ? src.nodes[item.src].sums[q] : item.energy * 0.25f;
+            if (energy <= threshold * total || item.depth >= max_depth || nodes.size() >= max_nodes)
+                continue;
+            auto child = uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[item.node].children[q] = child;
+            auto src_child = item.src >= 0 && src.nodes[item.src].children[q] ? int64_t(src.nodes[item.src].children[q]) : -1;
+            queue.push_back(Item { child, src_child, energy, item.depth + 1 });
+        }
+    }
+}
+
+GuidingField::GuidingField(const BBox& scene_bbox)
+    : bbox(scene_bbox), nodes(1), regions(1)
+{
+    // Slightly enlarge the bounding box to avoid numerical problems, as for the photon grid
+    auto extents = bbox.max - bbox.min;
+    bbox.max += extents * 0.001f + float3(1e-4f);
+    bbox.min -= extents * 0.001f + float3(1e-4f);
+    extents = bbox.max - bbox.min;
+    inv_extents = float3(1.0f / extents.x, 1.0f / extents.y, 1.0f / extents.z);
+}
+
+size_t GuidingField::find_leaf(const float3& pos) const {
+    auto p = (pos - bbox.min) * inv_extents;
+    for (int i = 0; i < 3; i++)
+        p[i] = clamp(p[i], 0.0f, one_minus_epsilon);
+
+    size_t i = 0;
+    while (nodes[i].children[0]) {
+        auto& node = nodes[i];
+        auto half = p[node.axis] >= 0.5f;
+        p[node.axis] = std::min(p[node.axis] * 2.0f - half, one_minus_epsilon);
+        i = node.children[half];
+    }
+    return i;
+}
+
+void GuidingField::record(const float3& pos, const float3& dir, float value) {
+    auto& region = regions[nodes[find_leaf(pos)].region];
+    atomic_add(region.samples, uint32_t(1));
+    region.building.record(dir, value);
+}
+
+void GuidingField::end_iteration(size_t iteration) {
+    auto threshold = region_threshold * std::sqrt(float(size_t(1) << iteration));
+
+    // Split the leaves that received too many samples, assuming that the samples are evenly distributed between the two halves
+    ArenaScope scope;
+    ArenaVector<std::pair<size_t, float>> stack(scope.arena);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!nodes[i].children[0])
+            stack.emplace_back(i, float(regions[nodes[i].region].samples));
+    }
+    while (!stack.empty() && regions.size() < max_regions) {
+        auto [i, samples] = stack.back();
+        stack.pop_back();
+        if (samples <= threshold)
+            continue;
+
+        // The halves start with a copy of the trees of their parent
+        auto first = uint32_t(nodes.size());
+        auto axis = (nodes[i].axis + 1) % 3;
+        nodes.emplace_back();
+        nodes.emplace_back();
+        nodes[first + 0].region = nodes[i].region;
+        nodes[first + 1].region = uint32_t(regions.size());
+        nodes[first + 0].axis = axis;
+        nodes[first + 1].axis = axis;
+        nodes[i].children[0] = first + 0;
+        nodes[i].children[1] = first + 1;
+        auto copy = regions[nodes[i].region];
+        regions.push_back(std::move(copy));
+
+        stack.emplace_back(first + 0, samples * 0.5f);
+        stack.emplace_back(first + 1, samples * 0.5f);
+    }
+
+    // The radiance recorded during this iteration is used for sampling during the next one
+    parallel_for(0, regions.size(), [&] (size_t i) {
+        auto& region = regions[i];
+        std::swap(region.sampling, region.building);
+        region.building.refine(region.sampling, tree_threshold, max_tree_depth, max_tree_nodes);
+        region.samples = 0;
+    });
+}
@@ -0,0 +1,101 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include <vector>
+#include <cstdint>
+
+#include "float3.h"
+#include "bbox.h"
+
+/// Distribution of the incident radiance over the sphere of directions, as a quadtree over the cylindrical coordinates of the directions.
+/// Each node stores the energy of its four quadrants, so that directions can be sampled by descending the tree.
+class DirectionalTree {
+public:
+    DirectionalTree()
+        : nodes(1)
+    {}
+
+    /// Adds a radiance estimate to the quadrants that contain the given direction. Can be called from several threads.
+    void record(const float3& dir, float value);
+
+    /// Samples a direction proportionally to the recorded energy. The tree must have a positive total energy.
+    float3 sample(float u, float v) const;
+    /// Returns the probability density (w.r.t. the solid angle) to sample the given direction.
+    float pdf(const float3& dir) const;
+
+    /// Returns the total energy recorded in the tree.
+    float total() const {
+        auto& root = nodes[0];
+        return root.sums[0] + root.sums[1] + root.sums[2] + root.sums[3];
+    }
+
+    size_t num_nodes() const { return nodes.size(); }
+
+    /// Replaces this tree by an empty tree, whose structure follows the energy of the given one:
+    /// quadrants holding more than the given fraction of the energy are subdivided, the others are leaves.
+    void refine(const DirectionalTree& src, float threshold, size_t max_depth, size_t max_nodes);
+
+private:
+    struct Node {
+        float sums[4] = { 0.0f, 0.0f, 0.0f, 0.0f };     ///< Energy of each quadrant (x + 2 * y)
+        uint32_t children[4] = { 0, 0, 0, 0 };          ///< Index of the node of each quadrant, or 0 for leaves
+    };
+
+    std::vector<Node> nodes;
+};
+
+/// Spatio-directional tree (SD-tree) learning the incident radiance in the scene, used to guide the paths of the path tracer.
+/// The bounding box of the scene is subdivided by a binary tree, whose leaves hold two directional trees: one that is sampled,
+/// learned during the previous iteration, and one that records the paths of the current iteration.
+/// Iterations should double in length, so that the learned distributions improve while rebuilds become rare.
+/// See "Practical Path Guiding for Efficient Light-Transport Simulation", T. Müller et al., 2017.
+class GuidingField {
+public:
+    /// The number of regions and the size of their trees are bounded, so that the field takes at most 128 MB.
+    static constexpr size_t max_regions    = 4096;
+    static constexpr size_t max_tree_nodes = 512;
+    static constexpr size_t max_tree_depth = 20;
+    /// Fraction of the energy of a directional tree above which a quadrant is subdivided.
+    static constexpr float tree_threshold = 0.01f;
+    /// Number of samples above which a region is split, for the first iteration (the threshold grows with the square root of the length of the iterations).
+    static constexpr float region_threshold = 12000.0f;
+
+    GuidingField(const BBox& bbox);
+
+    /// Records the radiance arriving at the given point from the given direction. Can be called from several threads.
+    void record(const float3& pos, const float3& dir, float value);
+
+    /// Returns the directional distribution learned at the given point, or null if nothing has been learned there yet.
+    const DirectionalTree* sampling_tree(const float3& pos) const {
+        auto& tree = regions[nodes[find_leaf(pos)].region].sampling;
+        return tree.total() > 0.0f ? &tree : nullptr;
+    }
+
+    /// Ends a training iteration: splits the regions that received many samples, and uses the recorded radiance for sampling.
+    /// Must not be called while paths are recorded. The iteration index starts at 0 and gives the length of the iteration (2^k frames).
+    void end_iteration(size_t iteration);
+
+    size_t num_regions() const { return regions.size(); }
+
+private:
+    struct Region {
+        DirectionalTree sampling;
+        DirectionalTree building;
+        uint32_t samples = 0;
+    };
+
+    struct Node {
+        uint32_t children[2] = { 0, 0 };    ///< Index of the two halves, or 0 for leaves
+        uint32_t region = 0;                ///< Region of leaves
+        uint32_t axis = 0;                  ///< Axis along which the node is split in half
+    };
+
+    size_t find_leaf(const float3& pos) const;
+
+    BBox bbox;
+    float3 inv_extents;
+    std::vector<Node> nodes;
+    std::vector<Region> regions;
+};
+
+#endif // GUIDING_H
@@ -1,6 +1,10 @@
 #ifndef HASH_H
 #define HASH_H
 
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
 /// Returns the initializer for Bernstein's hash function
 inline uint32_t bernstein_init() { return 5381; }
 
@@ -25,9 +29,68 @@ inline uint32_t fnv_hash(uint32_t h, uint32_t d) {
     return h;
 }
 
-/// Returns a seed for a sampler object, based on the current pixel id and iteration count
+/// Returns the initializer for the 64-bit FNV-1a hash function
+inline uint64_t fnv64_init() { return 0xCBF29CE484222325ull; }
+
+/// Hashes a block of memory using 64-bit FNV-1a
+inline uint64_t fnv64_hash(uint64_t h, const void* data, size_t size) {
+    auto bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i)
+        h = (h ^ bytes[i]) * 0x100000001B3ull;
+    return h;
+}
+
+/// Returns the initializer for block_hash
+inline uint64_t hash64_init() { return 0x9E3779B97F4A7C15ull; }
+
+/// Hashes a large block of memory 8 bytes at a time, using the MurmurHash3 mixing steps. Much faster than FNV on large arrays.
+inline uint64_t block_hash(uint64_t h, const void* data, size_t size) {
+    auto rotl = [] (uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto bytes = static_cast<const uint8_t*>(data);
+    for (; size >= 8; size -= 8, bytes += 8) {
+        uint64_t k;
+        std::memcpy(&k, bytes, 8);
+        k *= 0x87C37B91114253D5ull;
+        k  = rotl(k, 31);
+        k *= 0x4CF5AD432745937Full;
+        h ^= k;
+        h  = rotl(h, 27) * 5 + 0x52DCE729;
+    }
+    h = fnv64_hash(h, bytes, size);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+/// Spreads the lower 10 bits of the input so that there are two zero bits between each of them
+inline uint32_t morton_split(uint32_t x) {
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x <<  8)) & 0x0300F00F;
+    x = (x | (x <<  4)) & 0x030C30C3;
+    x = (x | (x <<  2)) & 0x09249249;
+    return x;
+}
+
+/// Interleaves the lower 10 bits of each coordinate into a 30-bit Morton code (Z-order curve)
+inline uint32_t morton_code(uint32_t x, uint32_t y, uint32_t z) {
+    return morton_split(x) | (morton_split(y) << 1) | (morton_split(z) << 2);
+}
+
+/// Hashes a 32-bit integer with the output permutation of PCG (RXS-M-XS), after one LCG step.
+/// From "Hash Functions for GPU Rendering", Jarzynski and Olano.
+inline uint32_t pcg_hash(uint32_t x) {
+    uint32_t state = x * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+/// Returns a seed for a sampler object, based on the current pixel (or path) id and iteration count
 inline uint32_t sampler_seed(uint32_t pixel, uint32_t iter) {
-    return fnv_hash(fnv_hash(fnv_init(), pixel), iter);
+    return pcg_hash(pixel + pcg_hash(iter));
 }
 
 #endif // HASH_H
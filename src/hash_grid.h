@@ -6,9 +6,11 @@
 #include <numeric>
 #include <cstdint>
 #include <atomic>
+#include <cassert>
 
 #include "hash.h"
 #include "parallel.h"
+#include "simd.h"
 
 class HashGrid {
 public:
@@ -128,4 +130,140 @@ private:
     float radius_sqr;
 };
 
+/// Variant of HashGrid that stores the elements themselves, in the Z-order of the grid cells.
+/// Elements of neighboring cells are close in memory, and positions are kept in SoA form to be tested four at a time.
+/// Buffers are kept from one build to the next, and the cell size follows the query radius.
+template <typename T>
+class SortedHashGrid {
+public:
+    SortedHashGrid() {}
+
+    /// Sorts the first count elements of the given array by grid cell and builds the grid.
+    /// The array is swapped with an internal buffer of the same size, so that no allocation is needed in subsequent builds.
+    template <typename PositionFn>
+    void build(std::vector<T>& items, size_t count, PositionFn positions, float radius) {
+        radius_sqr = radius * radius;
+        inv_size  = 0.5f / radius;
+        num_items = count;
+
+        bbox = BBox::empty();
+
+        #pragma omp parallel for reduction(bbox_extend: bbox)
+        for (size_t i = 0; i < count; ++i)
+            bbox = extend(bbox, positions(items[i]));
+
+        auto extents = bbox.max - bbox.min;
+        bbox.max += extents * 0.001f;
+        bbox.min -= extents * 0.001f;
+
+        sorted.resize(items.size());
+        cells.resize(count);
+        cell_counts.resize(size_t(1) << (closest_log2(count) + 1));
+        std::fill(cell_counts.begin(), cell_counts.end(), 0);
+
+        // Positions are padded so that the last group of four can always be loaded
+        xs.resize(count + simd_width);
+        ys.resize(count + simd_width);
+        zs.resize(count + simd_width);
+
+        parallel_for(0, count, [&] (size_t i) {
+            auto h = hash_position(positions(items[i]));
+            cells[i] = h;
+#ifdef USE_STD_THREAD
+            std::atomic_ref<uint32_t>(cell_counts[h])++;
+#else
+            #pragma omp atomic
+            cell_counts[h]++;
+#endif
+        });
+
+        std::partial_sum(cell_counts.begin(), cell_counts.end(), cell_counts.begin());
+        assert(cell_counts.back() == count);
+
+        // Move the elements and their positions to their cell
+        parallel_for(0, count, [&] (size_t i) {
+            uint32_t old_count;
+#ifdef USE_STD_THREAD
+            old_count = --std::atomic_ref<uint32_t>(cell_counts[cells[i]]);
+#else
+            #pragma omp atomic capture
+            old_count = --cell_counts[cells[i]];
+#endif
+            auto pos = positions(items[i]);
+            sorted[old_count] = items[i];
+            xs[old_count] = pos.x;
+            ys[old_count] = pos.y;
+            zs[old_count] = pos.z;
+        });
+
+        std::swap(items, sorted);
+    }
+
+    /// Calls insert(element, squared distance) for each element within the radius of the given position.
+    /// The elements are given by reference into the array that was passed to build.
+    template <typename InsertFn>
+    void query(const float3& pos, const std::vector<T>& items, InsertFn insert) const {
+        if (!is_inside(bbox, pos)) return;
+
+        auto p = (pos - bbox.min) * inv_size;
+        int px1 = p.x;
+        int py1 = p.y;
+        int pz1 = p.z;
+        int px2 = px1 + (p.x - px1 > 0.5f ? 1 : -1);
+        int py2 = py1 + (p.y - py1 > 0.5f ? 1 : -1);
+        int pz2 = pz1 + (p.z - pz1 > 0.5f ? 1 : -1);
+
+        vfloat4 qx(pos.x), qy(pos.y), qz(pos.z), r2(radius_sqr);
+
+        uint32_t visited[8];
+        for (int i = 0; i < 8; i++) {
+            auto h = hash_cell(i & 1 ? px2 : px1,
+                               i & 2 ? py2 : py1,
+                               i & 4 ? pz2 : pz1);
+
+            // Distinct cells may map to the same entry of the table
+            visited[i] = h;
+            if (std::find(visited, visited + i, h) != visited + i)
+                continue;
+
+            size_t begin = cell_counts[h];
+            size_t end = h == cell_counts.size() - 1 ? num_items : cell_counts[h + 1];
+            for (auto j = begin; j < end; j += simd_width) {
+                auto dx = vfloat4::load(&xs[j]) - qx;
+                auto dy = vfloat4::load(&ys[j]) - qy;
+                auto dz = vfloat4::load(&zs[j]) - qz;
+                auto d = dx * dx + dy * dy + dz * dz;
+                int mask = (d < r2).mask();
+                if (end - j < size_t(simd_width))
+                    mask &= (1 << (end - j)) - 1;
+                while (mask) {
+                    auto lane = first_bit(mask);
+                    insert(items[j + lane], d[lane]);
+                    mask &= mask - 1;
+                }
+            }
+        }
+    }
+
+private:
+    uint32_t hash_cell(uint32_t x, uint32_t y, uint32_t z) const {
+        // Using the Morton code keeps neighboring cells close in memory
+        return morton_code(x, y, z) & (cell_counts.size() - 1);
+    }
+
+    uint32_t hash_position(const float3& pos) const {
+        auto p = (pos - bbox.min) * inv_size;
+        return hash_cell(p.x, p.y, p.z);
+    }
+
+    std::vector<T> sorted;
+    std::vector<uint32_t> cells;
+    std::vector<uint32_t> cell_counts;
+    std::vector<float> xs, ys, zs;
+    size_t num_items = 0;
+    BBox bbox;
+    float inv_size;
+    float radius_sqr;
+};
+
 #endif // HASH_GRID_H
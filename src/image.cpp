@@ -4,6 +4,8 @@
 #include <memory>
 #include <exception>
 #include <vector>
+#include <atomic>
+#include <algorithm>
 
 #include <png.h>
 #include <jpeglib.h>
@@ -12,6 +14,7 @@
 #include <tinyexr.h>
 
 #include "image.h"
+#include "thread_pool.h"
 
 static void png_read_from_stream(png_structp png_ptr, png_bytep data, png_size_t length) {
     png_voidp a = png_get_io_ptr(png_ptr);
@@ -444,7 +447,9 @@ bool load_tiff(const std::string& tiff_file, Image& image) {
     return true;
 }
 
-bool load_exr(const std::string& exr_file, Image& image) {
+/// Parses an EXR file and loads its pixels, with half-precision channels converted to floats.
+/// On success, the header and image must be freed by the caller.
+static bool read_exr(const std::string& exr_file, EXRHeader& exr_header, EXRImage& exr_image) {
     std::ifstream file(exr_file, std::ifstream::binary);
     if (!file)
         return false;
@@ -455,117 +460,320 @@ bool load_exr(const std::string& exr_file, Image& image) {
         return false;
 
     const char* err = nullptr;
-    EXRHeader exr_header;
-    EXRImage exr_image;
-    int channel_r = 0;
-    int channel_g = 0;
-    int channel_b = 0;
-    int channel_a = 0;
-
     InitEXRHeader(&exr_header);
     InitEXRImage(&exr_image);
     if (ParseEXRHeaderFromMemory(&exr_header, &exr_version, buffer.data(), buffer.size(), &err) || exr_header.num_channels == 0)
         goto error;
+    for (int i = 0; i < exr_header.num_channels; ++i) {
+        if (exr_header.pixel_types[i] == TINYEXR_PIXELTYPE_HALF)
+            exr_header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT;
+    }
     if (LoadEXRImageFromMemory(&exr_image, &exr_header, buffer.data(), buffer.size(), &err))
         goto error;
+    return true;
 
-    image.resize(exr_image.width, exr_image.height);
-    for (int i = 0; i < exr_header.num_channels; ++i) {
-        const char* name = exr_header.channels[i].name;
-        if (!strcmp(name, "r") || !strcmp(name, "R"))
-            channel_r = i;
-        else if (!strcmp(name, "g") || !strcmp(name, "G"))
-            channel_g = i;
-        else if (!strcmp(name, "b") || !strcmp(name, "B"))
-            channel_b = i;
-        else if (!strcmp(name, "a") || !strcmp(name, "A"))
-            channel_a = i;
-    }
+error:
+    FreeEXRImage(&exr_image);
+    FreeEXRHeader(&exr_header);
+    FreeEXRErrorMessage(err);
+    return false;
+}
+
+/// Copies the values of the given channels of a loaded EXR file to consecutive components of an image, starting at the given one.
+/// The image must have the size of the file.
+static void copy_exr_channels(const EXRHeader& exr_header, const EXRImage& exr_image, const int* channels, size_t num_channels, size_t first_component, Image& image) {
     if (exr_image.images) {
         for (size_t y = 0; y < image.height; ++y) {
             for (size_t x = 0; x < image.width; ++x) {
-                float r = ((float*)exr_image.images[channel_r])[y * image.width + x];
-                float g = ((float*)exr_image.images[channel_g])[y * image.width + x];
-                float b = ((float*)exr_image.images[channel_b])[y * image.width + x];
-                float a = ((float*)exr_image.images[channel_a])[y * image.width + x];
-                image.pixels[y * image.width + x] = rgba(r, g, b, a);
+                for (size_t c = 0; c < num_channels; ++c)
+                    image.pixels[y * image.width + x][first_component + c] = ((float*)exr_image.images[channels[c]])[y * image.width + x];
             }
         }
     } else {
+        // Tiles are given by their index, and their pixels are stored with a stride of one full tile
         for (int i = 0; i < exr_image.num_tiles; ++i) {
             auto& tile = exr_image.tiles[i];
+            auto stride = exr_header.tile_size_x;
+            auto tile_x = tile.offset_x * exr_header.tile_size_x;
+            auto tile_y = tile.offset_y * exr_header.tile_size_y;
             for (int y = 0; y < tile.height; ++y) {
                 for (int x = 0; x < tile.width; ++x) {
-                    float r = ((float*)tile.images[channel_r])[y * tile.width + x];
-                    float g = ((float*)tile.images[channel_g])[y * tile.width + x];
-                    float b = ((float*)tile.images[channel_b])[y * tile.width + x];
-                    float a = ((float*)tile.images[channel_a])[y * tile.width + x];
-                    image.pixels[(y + tile.offset_y) * image.width + (x + tile.offset_x)] = rgba(r, g, b, a);
+                    for (size_t c = 0; c < num_channels; ++c)
+                        image.pixels[(y + tile_y) * image.width + (x + tile_x)][first_component + c] = ((float*)tile.images[channels[c]])[y * stride + x];
                 }
             }
         }
     }
+}
+
+bool load_exr(const std::string& exr_file, Image& image) {
+    EXRHeader exr_header;
+    EXRImage exr_image;
+    if (!read_exr(exr_file, exr_header, exr_image))
+        return false;
+
+    int channels[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < exr_header.num_channels; ++i) {
+        const char* name = exr_header.channels[i].name;
+        if (!strcmp(name, "r") || !strcmp(name, "R"))
+            channels[0] = i;
+        else if (!strcmp(name, "g") || !strcmp(name, "G"))
+            channels[1] = i;
+        else if (!strcmp(name, "b") || !strcmp(name, "B"))
+            channels[2] = i;
+        else if (!strcmp(name, "a") || !strcmp(name, "A"))
+            channels[3] = i;
+    }
+    image.resize(exr_image.width, exr_image.height);
+    copy_exr_channels(exr_header, exr_image, channels, 4, 0, image);
     FreeEXRHeader(&exr_header);
     FreeEXRImage(&exr_image);
     return true;
+}
 
-error:
-    FreeEXRImage(&exr_image);
+bool load_exr_channel(const std::string& exr_file, const std::string& name, Image& image, size_t component) {
+    EXRHeader exr_header;
+    EXRImage exr_image;
+    if (!read_exr(exr_file, exr_header, exr_image))
+        return false;
+
+    int channel = -1;
+    for (int i = 0; i < exr_header.num_channels; ++i) {
+        if (name == exr_header.channels[i].name)
+            channel = i;
+    }
+    bool ok = channel >= 0 && component < 4;
+    if (ok) {
+        // The other components are kept, unless the image does not have the size of the file
+        if (image.width != size_t(exr_image.width) || image.height != size_t(exr_image.height)) {
+            image.resize(exr_image.width, exr_image.height);
+            image.clear();
+        }
+        copy_exr_channels(exr_header, exr_image, &channel, 1, component, image);
+    }
     FreeEXRHeader(&exr_header);
-    FreeEXRErrorMessage(err);
-    return false;
+    FreeEXRImage(&exr_image);
+    return ok;
 }
 
-bool save_exr(const std::string& exr_file, const Image& image) {
+/// Region of the image stored in one chunk of an EXR file: a group of scanlines, or a tile.
+struct ExrChunk {
+    size_t xmin, ymin, xmax, ymax;
+};
+
+/// Compresses one chunk of the image, converting its pixels to planar channels on the fly.
+static bool encode_exr_chunk(const std::vector<ExrChannel>& sources, const ExrChunk& chunk, bool tiled, size_t tile_size,
+                             const ExrOptions& options, int compression_type,
+                             const std::vector<tinyexr::ChannelInfo>& channels,
+                             std::vector<unsigned char>& data) {
+    auto w = chunk.xmax - chunk.xmin;
+    auto h = chunk.ymax - chunk.ymin;
+    auto sample_size = options.half ? sizeof(uint16_t) : sizeof(float);
+    auto num_channels = sources.size();
+
+    // Channels are stored in alphabetical order (e.g. A, B, G, R), as PIZ compression requires
+    std::vector<unsigned char> planes(num_channels * w * h * sample_size);
+    std::vector<unsigned char*> images(num_channels);
+    for (size_t c = 0; c < num_channels; ++c)
+        images[c] = planes.data() + c * w * h * sample_size;
+    for (size_t c = 0; c < num_channels; ++c) {
+        auto& source = sources[c];
+        for (size_t y = 0; y < h; ++y) {
+            auto row = source.image->row(chunk.ymin + y) + chunk.xmin;
+            for (size_t x = 0; x < w; ++x) {
+                auto value = row[x][source.component];
+                if (options.half) {
+                    tinyexr::FP32 f32;
+                    f32.f = value;
+                    auto h16 = tinyexr::float_to_half_full(f32);
+                    reinterpret_cast<uint16_t*>(images[c])[y * w + x] = h16.u;
+                } else {
+                    reinterpret_cast<float*>(images[c])[y * w + x] = value;
+                }
+            }
+        }
+    }
+
+    int pixel_type = options.half ? TINYEXR_PIXELTYPE_HALF : TINYEXR_PIXELTYPE_FLOAT;
+    std::vector<int> pixel_types(num_channels, pixel_type);
+    std::vector<size_t> channel_offsets(num_channels);
+    for (size_t c = 0; c < num_channels; ++c)
+        channel_offsets[c] = c * sample_size;
+
+    // The chunk starts with its coordinates (tile index and level, or first scanline) and the size of the data
+    data.resize(tiled ? 5 * sizeof(int) : 2 * sizeof(int));
+    auto header_size = data.size();
+    if (!tinyexr::EncodePixelData(data, images.data(), pixel_types.data(), compression_type, 0,
+                                  w, h, w, 0, h, num_channels * sample_size, channels, channel_offsets))
+        return false;
+
+    int header[5];
+    int num_fields = 0;
+    if (tiled) {
+        header[num_fields++] = chunk.xmin / tile_size;
+        header[num_fields++] = chunk.ymin / tile_size;
+        header[num_fields++] = 0;
+        header[num_fields++] = 0;
+    } else {
+        header[num_fields++] = chunk.ymin;
+    }
+    header[num_fields++] = data.size() - header_size;
+    for (int i = 0; i < num_fields; ++i) {
+        tinyexr::swap4(&header[i]);
+        memcpy(data.data() + i * sizeof(int), &header[i], sizeof(int));
+    }
+    return true;
+}
+
+bool save_exr(const std::string& exr_file, const Image& image, const ExrOptions& options, const std::vector<ExrChannel>& extra_channels) {
     std::ofstream file(exr_file, std::ofstream::binary);
     if (!file)
         return false;
 
-    std::unique_ptr<float[]> channels[4];
-    for (size_t i = 0; i < 4; ++i)
-        channels[i].reset(new float[image.width * image.height]);
-
-    for (size_t y = 0; y < image.height; ++y) {
-        for (size_t x = 0; x < image.width; ++x) {
-            auto& pix = image.pixels[y * image.width + x];
-            channels[0][y * image.width + x] = pix.w;
-            channels[1][y * image.width + x] = pix.z;
-            channels[2][y * image.width + x] = pix.y;
-            channels[3][y * image.width + x] = pix.x;
+    int compression_type = TINYEXR_COMPRESSIONTYPE_NONE;
+    switch (options.compression) {
+        case ExrCompression::None: compression_type = TINYEXR_COMPRESSIONTYPE_NONE; break;
+        case ExrCompression::Zips: compression_type = TINYEXR_COMPRESSIONTYPE_ZIPS; break;
+        case ExrCompression::Zip:  compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;  break;
+        case ExrCompression::Piz:  compression_type = TINYEXR_COMPRESSIONTYPE_PIZ;  break;
+    }
+
+    // The image is cut into chunks, in the order in which they are stored in the file
+    bool tiled = options.tile_size > 0;
+    auto tile_size = options.tile_size;
+    if (tiled && compression_type == TINYEXR_COMPRESSIONTYPE_PIZ)
+        return false;
+    std::vector<ExrChunk> chunks;
+    if (tiled) {
+        for (size_t y = 0; y < image.height; y += tile_size) {
+            for (size_t x = 0; x < image.width; x += tile_size)
+                chunks.push_back(ExrChunk { x, y, std::min(x + tile_size, image.width), std::min(y + tile_size, image.height) });
+        }
+    } else {
+        size_t lines = tinyexr::NumScanlines(compression_type);
+        for (size_t y = 0; y < image.height; y += lines)
+            chunks.push_back(ExrChunk { 0, y, image.width, std::min(y + lines, image.height) });
+    }
+
+    std::vector<ExrChannel> sources = {
+        ExrChannel { "R", &image, 0 },
+        ExrChannel { "G", &image, 1 },
+        ExrChannel { "B", &image, 2 },
+        ExrChannel { "A", &image, 3 }
+    };
+    for (auto& channel : extra_channels) {
+        if (channel.image->width != image.width || channel.image->height != image.height || channel.component > 3)
+            return false;
+        sources.push_back(channel);
+    }
+    std::sort(sources.begin(), sources.end(), [] (const ExrChannel& a, const ExrChannel& b) { return a.name < b.name; });
+
+    std::vector<tinyexr::ChannelInfo> channels(sources.size());
+    for (size_t c = 0; c < sources.size(); ++c) {
+        channels[c].name = sources[c].name;
+        channels[c].pixel_type = options.half ? TINYEXR_PIXELTYPE_HALF : TINYEXR_PIXELTYPE_FLOAT;
+        channels[c].x_sampling = 1;
+        channels[c].y_sampling = 1;
+        channels[c].p_linear = 0;
+    }
+
+    // Magic number, version (with the tiled flag), and attributes
+    std::vector<unsigned char> header = { 0x76, 0x2f, 0x31, 0x01, 2, uint8_t(tiled ? 0x2 : 0x0), 0, 0 };
+    {
+        std::vector<unsigned char> data;
+        tinyexr::WriteChannelInfo(data, channels);
+        tinyexr::WriteAttributeToMemory(&header, "channels", "chlist", data.data(), data.size());
+    }
+    {
+        auto comp = uint8_t(compression_type);
+        tinyexr::WriteAttributeToMemory(&header, "compression", "compression", &comp, 1);
+    }
+    {
+        int window[4] = { 0, 0, int(image.width) - 1, int(image.height) - 1 };
+        for (auto& i : window) tinyexr::swap4(&i);
+        tinyexr::WriteAttributeToMemory(&header, "dataWindow", "box2i", reinterpret_cast<const unsigned char*>(window), sizeof(window));
+        tinyexr::WriteAttributeToMemory(&header, "displayWindow", "box2i", reinterpret_cast<const unsigned char*>(window), sizeof(window));
+    }
+    {
+        unsigned char line_order = 0;   // Increasing Y
+        tinyexr::WriteAttributeToMemory(&header, "lineOrder", "lineOrder", &line_order, 1);
+    }
+    {
+        float aspect = 1.0f, center[2] = { 0.0f, 0.0f }, width = 1.0f;
+        tinyexr::swap4(&aspect);
+        tinyexr::swap4(&width);
+        tinyexr::WriteAttributeToMemory(&header, "pixelAspectRatio", "float", reinterpret_cast<const unsigned char*>(&aspect), sizeof(float));
+        tinyexr::WriteAttributeToMemory(&header, "screenWindowCenter", "v2f", reinterpret_cast<const unsigned char*>(center), sizeof(center));
+        tinyexr::WriteAttributeToMemory(&header, "screenWindowWidth", "float", reinterpret_cast<const unsigned char*>(&width), sizeof(float));
+    }
+    if (tiled) {
+        // Tile size, followed by the level mode (one level, rounded down)
+        unsigned char data[9] = { 0 };
+        unsigned int sizes[2] = { unsigned(tile_size), unsigned(tile_size) };
+        for (auto& i : sizes) tinyexr::swap4(&i);
+        memcpy(data, sizes, sizeof(sizes));
+        tinyexr::WriteAttributeToMemory(&header, "tiles", "tiledesc", data, sizeof(data));
+    }
+    header.push_back(0);
+    file.write(reinterpret_cast<const char*>(header.data()), header.size());
+
+    // The offset table is written once all the chunks are, since their size is only known after compression
+    auto table_pos = file.tellp();
+    std::vector<tinyexr::tinyexr_uint64> offsets(chunks.size(), 0);
+    file.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(tinyexr::tinyexr_uint64));
+
+    // Chunks are compressed in parallel, in batches, so that only a few of them are in memory at a time
+    auto& pool = ThreadPool::instance();
+    auto batch_size = pool.num_threads() * 4;
+    std::vector<std::vector<unsigned char>> batch(batch_size);
+    std::atomic<bool> ok(true);
+    auto offset = tinyexr::tinyexr_uint64(header.size() + offsets.size() * sizeof(tinyexr::tinyexr_uint64));
+    for (size_t first = 0; first < chunks.size() && ok; first += batch_size) {
+        auto count = std::min(batch_size, chunks.size() - first);
+        pool.run_tasks(count, [&] (size_t i, size_t) {
+            if (!encode_exr_chunk(sources, chunks[first + i], tiled, tile_size, options, compression_type, channels, batch[i]))
+                ok = false;
+        });
+        for (size_t i = 0; i < count; ++i) {
+            offsets[first + i] = offset;
+            tinyexr::swap8(&offsets[first + i]);
+            offset += batch[i].size();
+            file.write(reinterpret_cast<const char*>(batch[i].data()), batch[i].size());
         }
     }
 
-    EXRHeader exr_header;
-    EXRImage exr_image;
-    InitEXRHeader(&exr_header);
-    InitEXRImage(&exr_image);
-    float* images[4] = { channels[0].get(), channels[1].get(), channels[2].get(), channels[3].get() };
-    exr_image.images = (unsigned char**)images;
-    exr_image.width = image.width;
-    exr_image.height = image.height;
-
-    std::unique_ptr<EXRChannelInfo[]> channel_infos(new EXRChannelInfo[4]);
-    exr_header.num_channels = 4;
-    exr_header.channels = channel_infos.get();
-    strcpy(exr_header.channels[0].name, "A");
-    strcpy(exr_header.channels[1].name, "B");
-    strcpy(exr_header.channels[2].name, "G");
-    strcpy(exr_header.channels[3].name, "R");
-
-    std::unique_ptr<int[]> pixel_types(new int[4]);
-    for (size_t i = 0; i < 4; ++i)
-        pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT;
-    exr_header.pixel_types = pixel_types.get();
-    exr_header.requested_pixel_types = pixel_types.get();
+    file.seekp(table_pos);
+    file.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(tinyexr::tinyexr_uint64));
+    return ok && static_cast<bool>(file);
+}
 
-    const char* err = nullptr;
-    unsigned char* mem = nullptr;
-    size_t size = SaveEXRImageToMemory(&exr_image, &exr_header, &mem, &err);
-    if (size == 0) {
-        FreeEXRErrorMessage(err);
-        return false;
+ImageFormat detect_image_format(const std::string& file) {
+    std::ifstream stream(file, std::ifstream::binary);
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    if (!stream || !stream.read((char*)magic, 4))
+        return ImageFormat::Unknown;
+
+    if (magic[0] == 0x89 && magic[1] == 'P' && magic[2] == 'N' && magic[3] == 'G')
+        return ImageFormat::Png;
+    if (magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF)
+        return ImageFormat::Jpeg;
+    if ((magic[0] == 'I' && magic[1] == 'I' && magic[2] == 42 && magic[3] == 0) ||
+        (magic[0] == 'M' && magic[1] == 'M' && magic[2] == 0  && magic[3] == 42))
+        return ImageFormat::Tiff;
+    if (magic[0] == 0x76 && magic[1] == 0x2F && magic[2] == 0x31 && magic[3] == 0x01)
+        return ImageFormat::Exr;
+    return ImageFormat::Tga;
+}
+
+bool load_image(const std::string& file, Image& image, ImageFormat* format) {
+    auto detected = detect_image_format(file);
+    if (format) *format = detected;
+    switch (detected) {
+        case ImageFormat::Png:  return load_png(file, image);
+        case ImageFormat::Jpeg: return load_jpeg(file, image);
+        case ImageFormat::Tiff: return load_tiff(file, image);
+        case ImageFormat::Exr:  return load_exr(file, image);
+        case ImageFormat::Tga:  return load_tga(file, image);
+        default:                return false;
     }
-    file.write((const char*)mem, size);
-    free(mem);
-    return true;
 }
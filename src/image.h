@@ -32,6 +32,23 @@ struct Image {
     size_t width, height;
 };
 
+/// File formats of the images that can be loaded.
+enum class ImageFormat {
+    Unknown,
+    Png,
+    Jpeg,
+    Tiff,
+    Exr,
+    Tga         ///< TGA files have no magic number: any file that is not recognized is assumed to be a TGA file
+};
+
+/// Detects the format of an image file from the magic number at its beginning, without decoding it.
+/// Returns ImageFormat::Unknown if the file cannot be read or is too short.
+ImageFormat detect_image_format(const std::string& file);
+
+/// Loads an image in any of the supported formats, detected with detect_image_format(). The format is returned when not null.
+bool load_image(const std::string& file, Image& image, ImageFormat* format = nullptr);
+
 /// Loads an image from a PNG file.
 bool load_png(const std::string& png_file, Image& image);
 /// Stores an image as a PNG file.
@@ -48,7 +65,33 @@ bool load_tiff(const std::string& tiff_file, Image& image);
 
 /// Loads an image from an EXR file.
 bool load_exr(const std::string& exr_file, Image& image);
-/// Stores an image as an EXR file.
-bool save_exr(const std::string& exr_file, const Image& image);
+/// Loads one channel of an EXR file (e.g. "samples") into one component of an image. The other components are kept,
+/// unless the image is resized to the size of the file, in which case they are cleared. Returns false if the channel does not exist.
+bool load_exr_channel(const std::string& exr_file, const std::string& name, Image& image, size_t component = 0);
+/// Compression method of EXR files.
+enum class ExrCompression {
+    None,
+    Zips,   ///< Deflate, one scanline per chunk
+    Zip,    ///< Deflate, 16 scanlines per chunk
+    Piz     ///< Wavelet and Huffman coding, 32 scanlines per chunk, well suited to noisy images
+};
+
+/// Options controlling how EXR files are written.
+struct ExrOptions {
+    ExrCompression compression = ExrCompression::None;
+    bool half = false;          ///< Stores half-precision floats instead of single-precision ones
+    size_t tile_size = 0;       ///< Writes a tiled file with square tiles of this size, or a scanline file if zero (not supported with PIZ)
+};
+
+/// Extra channel of an EXR file, taken from one component of an image of the same size (e.g. "N.X" for the X component of normals).
+struct ExrChannel {
+    std::string name;
+    const Image* image;
+    size_t component;           ///< Index of the component (0 to 3 for R, G, B, A)
+};
+
+/// Stores an image as an EXR file, with the given extra channels. The chunks of the file are compressed in parallel
+/// on the thread pool, and written as they are compressed, without making a copy of the whole image.
+bool save_exr(const std::string& exr_file, const Image& image, const ExrOptions& options = ExrOptions(), const std::vector<ExrChannel>& extra_channels = {});
 
 #endif // IMAGE_H
@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <numeric>
+#include <memory>
+
+#include "instances.h"
+
+/// Depth after which nodes are split at the median, so that the traversal stack cannot overflow.
+static constexpr int32_t max_sah_depth = 48;
+
+void TopLevelBvh::build(const BBox* bboxes, size_t count) {
+    nodes.clear();
+    if (count == 0) return;
+
+    std::unique_ptr<uint32_t[]> ids(new uint32_t[count]);
+    std::iota(ids.get(), ids.get() + count, 0);
+    nodes.reserve(2 * count - 1);
+    nodes.emplace_back();
+    build_node(0, bboxes, ids.get(), count, 0);
+
+    // The build is recursive, so the node bounds are computed afterwards
+    refit(bboxes);
+}
+
+void TopLevelBvh::build_node(int32_t node_id, const BBox* bboxes, uint32_t* ids, size_t count, int32_t depth) {
+    if (count == 1) {
+        nodes[node_id].child = ids[0];
+        nodes[node_id].is_leaf = 1;
+        return;
+    }
+
+    auto centroid = [&] (uint32_t id, int axis) { return (bboxes[id].min[axis] + bboxes[id].max[axis]) * 0.5f; };
+    std::unique_ptr<float[]> right_areas(new float[count]);
+
+    // Full sweep SAH over the three axes: instances are few, and the quality of this BVH matters for every ray
+    float best_cost = FLT_MAX;
+    int best_axis = 0;
+    size_t best_split = count / 2;
+    for (int axis = 0; axis < 3 && depth < max_sah_depth; axis++) {
+        std::sort(ids, ids + count, [&] (uint32_t a, uint32_t b) { return centroid(a, axis) < centroid(b, axis); });
+        auto right = BBox::empty();
+        for (size_t i = count - 1; i > 0; i--) {
+            right = extend(right, bboxes[ids[i]]);
+            right_areas[i] = half_area(right);
+        }
+        auto left = BBox::empty();
+        for (size_t i = 1; i < count; i++) {
+            left = extend(left, bboxes[ids[i - 1]]);
+            auto cost = half_area(left) * i + right_areas[i] * (count - i);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = i;
+            }
+        }
+    }
+    std::sort(ids, ids + count, [&] (uint32_t a, uint32_t b) { return centroid(a, best_axis) < centroid(b, best_axis); });
+
+    auto child = int32_t(nodes.size());
+    nodes[node_id].child = child;
+    nodes[node_id].is_leaf = 0;
+    nodes.emplace_back();
+    nodes.emplace_back();
+    build_node(child + 0, bboxes, ids, best_split, depth + 1);
+    build_node(child + 1, bboxes, ids + best_split, count - best_split, depth + 1);
+}
+
+void TopLevelBvh::refit(const BBox* bboxes) {
+    // Children are always stored after their parent
+    for (size_t i = nodes.size(); i-- > 0;) {
+        auto& node = nodes[i];
+        auto bbox = node.is_leaf
+            ? bboxes[node.child]
+            : extend(nodes[node.child + 0].bbox(), nodes[node.child + 1].bbox());
+        node.min = bbox.min;
+        node.max = bbox.max;
+    }
+}
+
+float TopLevelBvh::cost() const {
+    if (nodes.empty()) return 0.0f;
+    float cost = 0.0f;
+    for (auto& node : nodes)
+        cost += half_area(node.bbox());
+    return cost / half_area(nodes[0].bbox());
+}
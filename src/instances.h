@@ -0,0 +1,110 @@
+#ifndef INSTANCES_H
+#define INSTANCES_H
+
+#include <vector>
+#include <cstdint>
+#include <cfloat>
+
+#include "bvh.h"
+#include "transform.h"
+
+/// Mesh that is placed in the scene by instances. Its triangles are stored once, in object space,
+/// in the arrays of the scene, and its BVH (the bottom-level BVH) is shared by all its instances.
+struct InstancedMesh {
+    std::string file;
+    uint32_t first_tri;     ///< Index of the first triangle of the mesh in the scene
+    uint32_t num_tris;
+    BBox bbox;              ///< Bounding box, in object space
+    Bvh bvh;                ///< BVH over the triangles of the mesh, whose triangle indices start at first_tri
+};
+
+/// Instance of a mesh, placed in the scene with a transformation.
+struct Instance {
+    uint32_t mesh;
+    Transform to_world;
+    Transform to_object;    ///< Inverse of to_world
+    BBox bbox;              ///< Bounding box, in world space
+};
+
+/// Binary BVH over the bounding boxes of the instances (top-level BVH). It is small, so that it can
+/// be refitted or rebuilt in a few milliseconds when instances move.
+class TopLevelBvh {
+public:
+    /// Builds the BVH with the full sweep SAH. Leaves contain one instance.
+    void build(const BBox* bboxes, size_t count);
+    /// Recomputes the bounds of the nodes after the bounding boxes of the instances have changed, without changing the tree.
+    void refit(const BBox* bboxes);
+    /// Returns the SAH cost of the tree, which grows when instances move away from their position at construction time.
+    float cost() const;
+
+    bool empty() const { return nodes.empty(); }
+
+    /// Calls intersect(instance, tmax) for the instances whose bounding box is hit by the ray within [ray.tmin, tmax],
+    /// closest first. The callback lowers tmax when it finds an intersection, and returns true to end the traversal.
+    template <typename F>
+    void traverse(const Ray& ray, float tmax, F intersect) const;
+
+private:
+    struct Node {
+        float3 min;
+        int32_t child;      ///< Index of the first child (children are next to each other), or of the instance for leaves
+        float3 max;
+        int32_t is_leaf;
+
+        BBox bbox() const { return BBox(min, max); }
+    };
+
+    void build_node(int32_t, const BBox*, uint32_t*, size_t, int32_t);
+
+    std::vector<Node> nodes;
+};
+
+template <typename F>
+void TopLevelBvh::traverse(const Ray& ray, float tmax, F intersect) const {
+    if (nodes.empty()) return;
+
+    auto inv_dir = float3(1.0f) / ray.dir;
+    auto box_entry = [&] (const Node& node) {
+        auto t0 = (node.min - ray.org) * inv_dir;
+        auto t1 = (node.max - ray.org) * inv_dir;
+        auto tentry = std::max(std::max(std::min(t0.x, t1.x), std::min(t0.y, t1.y)), std::max(std::min(t0.z, t1.z), ray.tmin));
+        auto texit  = std::min(std::min(std::max(t0.x, t1.x), std::max(t0.y, t1.y)), std::min(std::max(t0.z, t1.z), tmax));
+        return tentry <= texit ? tentry : FLT_MAX;
+    };
+
+    struct StackElem {
+        int32_t node;
+        float t;
+    };
+    // The depth of the tree is bounded by the median splits below max_sah_depth
+    constexpr int stack_size = 128;
+    StackElem stack[stack_size];
+    int stack_ptr = 0;
+    if (box_entry(nodes[0]) == FLT_MAX) return;
+    stack[0] = StackElem { 0, ray.tmin };
+
+    while (stack_ptr >= 0) {
+        auto elem = stack[stack_ptr--];
+        if (elem.t > tmax) continue;
+
+        auto& node = nodes[elem.node];
+        if (node.is_leaf) {
+            if (intersect(uint32_t(node.child), tmax))
+                return;
+            continue;
+        }
+
+        auto t_left  = box_entry(nodes[node.child + 0]);
+        auto t_right = box_entry(nodes[node.child + 1]);
+        // Push the farthest child first, so that the closest one is visited next
+        if (t_left > t_right) {
+            if (t_left  != FLT_MAX) stack[++stack_ptr] = StackElem { node.child + 0, t_left };
+            if (t_right != FLT_MAX) stack[++stack_ptr] = StackElem { node.child + 1, t_right };
+        } else {
+            if (t_right != FLT_MAX) stack[++stack_ptr] = StackElem { node.child + 1, t_right };
+            if (t_left  != FLT_MAX) stack[++stack_ptr] = StackElem { node.child + 0, t_left };
+        }
+    }
+}
+
+#endif // INSTANCES_H
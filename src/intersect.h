@@ -6,6 +6,7 @@
 
 #include "float4.h"
 #include "float3.h"
+#include "simd.h"
 
 /// Ray defined as org + t * dir, with t in [tmin, tmax].
 struct Ray {
@@ -30,13 +31,14 @@ struct Hit {
     float t;        ///< Time of intersection
     float u;        ///< First barycentric coordinate
     float v;        ///< Second barycentric coordinate
+    int32_t inst;   ///< Instance of the triangle, or -1 for the triangles that are not instanced
 
     Hit()
-        : tri(-1), t(0.0f), u(0.0f), v(0.0f)
+        : tri(-1), t(0.0f), u(0.0f), v(0.0f), inst(-1)
     {}
 
-    Hit(int32_t tri, float t, float u, float v)
-        : tri(tri), t(t), u(u), v(v)
+    Hit(int32_t tri, float t, float u, float v, int32_t inst = -1)
+        : tri(tri), t(t), u(u), v(v), inst(inst)
     {}
 };
 
@@ -85,4 +87,89 @@ inline bool intersect_ray_tri(const Ray& ray, const PrecomputedTri& tri, float&
     return false;
 }
 
+/// Group of precomputed triangles stored in SoA layout, to be intersected simultaneously using SIMD instructions.
+struct PrecomputedTri4 {
+    float v0[3][simd_width];
+    float e1[3][simd_width];
+    float e2[3][simd_width];
+    float n[3][simd_width];
+    int32_t ids[simd_width];    ///< Triangle indices, or -1 for unused lanes
+
+    PrecomputedTri4() {
+        std::fill(&v0[0][0], &n[2][simd_width - 1] + 1, 0.0f);
+        std::fill(ids, ids + simd_width, -1);
+    }
+
+    /// Stores a triangle into one lane of this group.
+    void set(int lane, const PrecomputedTri& tri, int32_t id) {
+        for (int i = 0; i < 3; ++i) {
+            v0[i][lane] = tri.v0[i];
+            e1[i][lane] = tri.e1[i];
+            e2[i][lane] = tri.e2[i];
+        }
+        n[0][lane] = tri.nx;
+        n[1][lane] = tri.ny;
+        n[2][lane] = tri.nz;
+        ids[lane] = id;
+    }
+};
+
+/// Ray in a format suitable for SIMD intersection routines, i.e. with its components broadcast on all lanes.
+struct RayVec {
+    vfloat4 org[3];
+    vfloat4 dir[3];
+
+    RayVec(const Ray& ray) {
+        for (int i = 0; i < 3; ++i) {
+            org[i] = vfloat4(ray.org[i]);
+            dir[i] = vfloat4(ray.dir[i]);
+        }
+    }
+};
+
+/// Intersects a ray with a group of precomputed triangles. Returns the lane of the closest hit, or -1 if there is none.
+/// Unused lanes contain degenerate triangles, which are never intersected.
+inline int intersect_ray_tri4(const RayVec& ray, float tmin, const PrecomputedTri4& tri, float& t, float& u, float& v, bool any = false) {
+    const vfloat4 eps(-1e-9f);
+
+    vfloat4 nx = vfloat4::load(tri.n[0]), ny = vfloat4::load(tri.n[1]), nz = vfloat4::load(tri.n[2]);
+    vfloat4 cx = vfloat4::load(tri.v0[0]) - ray.org[0];
+    vfloat4 cy = vfloat4::load(tri.v0[1]) - ray.org[1];
+    vfloat4 cz = vfloat4::load(tri.v0[2]) - ray.org[2];
+
+    // r = cross(ray.dir, c)
+    vfloat4 rx = ray.dir[1] * cz - ray.dir[2] * cy;
+    vfloat4 ry = ray.dir[2] * cx - ray.dir[0] * cz;
+    vfloat4 rz = ray.dir[0] * cy - ray.dir[1] * cx;
+
+    vfloat4 det = nx * ray.dir[0] + ny * ray.dir[1] + nz * ray.dir[2];
+    vfloat4 abs_det = abs(det);
+
+    vfloat4 u_ = prodsign(rx * vfloat4::load(tri.e2[0]) + ry * vfloat4::load(tri.e2[1]) + rz * vfloat4::load(tri.e2[2]), det);
+    vfloat4 v_ = prodsign(rx * vfloat4::load(tri.e1[0]) + ry * vfloat4::load(tri.e1[1]) + rz * vfloat4::load(tri.e1[2]), det);
+    vfloat4 w_ = abs_det - u_ - v_;
+    auto mask = (u_ >= eps) & (v_ >= eps) & (w_ >= eps);
+    if (!mask.any())
+        return -1;
+
+    vfloat4 t_ = prodsign(nx * cx + ny * cy + nz * cz, det);
+    mask = mask & (t_ >= abs_det * vfloat4(tmin)) & (abs_det * vfloat4(t) > t_);
+    if (!mask.any())
+        return -1;
+
+    // Find the closest hit among the lanes that passed the test
+    vfloat4 inv_det = rcp(abs_det);
+    vfloat4 t_hit = select(mask, t_ * inv_det, vfloat4(FLT_MAX));
+    int lane = first_bit(mask.mask());
+    if (!any) {
+        float t_min = reduce_min(t_hit);
+        lane = first_bit((t_hit <= vfloat4(t_min)).mask() & mask.mask());
+    }
+
+    t = t_hit[lane];
+    u = u_[lane] * inv_det[lane];
+    v = v_[lane] * inv_det[lane];
+    return lane;
+}
+
 #endif // INTERSECT_H
@@ -0,0 +1,63 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <type_traits>
+
+#include "scene.h"
+
+/// Kinds of lights in a scene.
+enum class LightKinds {
+    Mixed,      ///< Area and point lights
+    Area,       ///< Only area lights (including emissive materials)
+    Point       ///< Only point lights: no material is emissive, and no light can be hit by a ray
+};
+
+/// Features of a scene that rendering kernels are specialized on, so that the compiler can remove
+/// the branches that the scene never takes. They are computed once, after the scene is loaded.
+struct KernelFeatures {
+    LightKinds lights = LightKinds::Mixed;
+    bool specular = true;   ///< True if some materials are purely specular
+};
+
+inline KernelFeatures kernel_features(const Scene& scene) {
+    size_t area_lights = 0;
+    for (auto& light : scene.lights)
+        area_lights += light->has_area() ? 1 : 0;
+
+    KernelFeatures features;
+    features.lights =
+        area_lights == scene.lights.size() ? LightKinds::Area :
+        area_lights == 0 ? LightKinds::Point : LightKinds::Mixed;
+    features.specular = std::any_of(scene.materials.begin(), scene.materials.end(), [] (const Material& mat) {
+        return mat.bsdf && mat.bsdf.type() == Bsdf::Type::Specular;
+    });
+    return features;
+}
+
+/// Calls the given function with the features as compile-time constants (std::integral_constant values),
+/// which it can pass as template arguments to a specialized kernel.
+template <typename F>
+void dispatch_kernel(const KernelFeatures& features, F f) {
+    auto with_specular = [&] (auto lights) {
+        if (features.specular)
+            f(lights, std::true_type());
+        else
+            f(lights, std::false_type());
+    };
+    switch (features.lights) {
+        case LightKinds::Area:  with_specular(std::integral_constant<LightKinds, LightKinds::Area>());  break;
+        case LightKinds::Point: with_specular(std::integral_constant<LightKinds, LightKinds::Point>()); break;
+        default:                with_specular(std::integral_constant<LightKinds, LightKinds::Mixed>()); break;
+    }
+}
+
+/// Returns true if a light has an area, knowing the kinds of lights of the scene.
+template <LightKinds lights>
+inline bool has_area(const Light* light) {
+    if constexpr (lights == LightKinds::Mixed)
+        return light->has_area();
+    else
+        return lights == LightKinds::Area;
+}
+
+#endif // KERNELS_H
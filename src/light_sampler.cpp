@@ -0,0 +1,268 @@
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+#include <numeric>
+
+#include "light_sampler.h"
+#include "color.h"
+
+/// Returns cos(max(0, a - b)), given the sine and cosine of a and b.
+static inline float cos_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+    return cos_a > cos_b ? 1.0f : cos_a * cos_b + sin_a * sin_b;
+}
+
+/// Returns sin(max(0, a - b)), given the sine and cosine of a and b.
+static inline float sin_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+    return cos_a > cos_b ? 0.0f : sin_a * cos_b - cos_a * sin_b;
+}
+
+static inline float safe_sqrt(float x) {
+    return std::sqrt(std::max(x, 0.0f));
+}
+
+/// Computes a cone that bounds the two given cones of directions.
+static inline void cone_union(float3& axis_a, float& cos_a, const float3& axis_b, float cos_b) {
+    if (cos_a <= -1.0f) return;
+    if (cos_b <= -1.0f) {
+        cos_a = -1.0f;
+        return;
+    }
+
+    auto theta_a = std::acos(clamp(cos_a, -1.0f, 1.0f));
+    auto theta_b = std::acos(clamp(cos_b, -1.0f, 1.0f));
+    auto theta_d = std::acos(clamp(dot(axis_a, axis_b), -1.0f, 1.0f));
+    if (std::min(theta_d + theta_b, pi) <= theta_a)
+        return;
+    if (std::min(theta_d + theta_a, pi) <= theta_b) {
+        axis_a = axis_b;
+        cos_a = cos_b;
+        return;
+    }
+
+    auto theta_o = (theta_a + theta_d + theta_b) * 0.5f;
+    auto rot_axis = cross(axis_a, axis_b);
+    if (theta_o >= pi || lensqr(rot_axis) == 0.0f) {
+        cos_a = -1.0f;
+        return;
+    }
+
+    axis_a = normalize(rotate(axis_a, normalize(rot_axis), theta_o - theta_a));
+    cos_a = std::cos(theta_o);
+}
+
+float LightSampler::Node::importance(const float3& p, const float3& n) const {
+    // Conservative estimate of the contribution of the lights in the node, as described by Conty and Kulla.
+    auto center = (bbox.min + bbox.max) * 0.5f;
+    auto radius_sqr = lensqr(bbox.max - bbox.min) * 0.25f;
+    auto d = p - center;
+    auto d2 = lensqr(d);
+    auto dir = d2 > 0.0f ? d * (1.0f / std::sqrt(d2)) : float3(0.0f);
+
+    // Angle between the emission axis and the receiving point
+    auto cos_theta_w = dot(axis, dir);
+    auto sin_theta_w = safe_sqrt(1.0f - cos_theta_w * cos_theta_w);
+
+    // Angle subtended by the bounding box, as seen from the receiving point
+    auto cos_theta_b = is_inside(bbox, p) || d2 <= radius_sqr ? -1.0f : safe_sqrt(1.0f - radius_sqr / d2);
+    auto sin_theta_b = safe_sqrt(1.0f - cos_theta_b * cos_theta_b);
+
+    auto sin_theta_o = safe_sqrt(1.0f - cos_theta_o * cos_theta_o);
+    auto cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+    auto sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+    auto cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+
+    // All the lights emit on a hemisphere (or the whole sphere for point lights)
+    if (cos_theta_p <= 0.0f)
+        return 0.0f;
+
+    auto imp = power * cos_theta_p / std::max(d2, radius_sqr);
+
+    // Angle between the receiver normal and the light
+    if (n != float3(0.0f)) {
+        auto cos_theta_i = std::fabs(dot(dir, n));
+        auto sin_theta_i = safe_sqrt(1.0f - cos_theta_i * cos_theta_i);
+        imp *= cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+    }
+    return std::max(imp, 0.0f);
+}
+
+void LightSampler::build_node(size_t node_id, const LightBounds* bounds, const float* powers, uint32_t* ids, size_t begin, size_t end) {
+    // Compute the bounds of this node
+    Node node;
+    node.bbox = BBox::empty();
+    node.axis = bounds[ids[begin]].axis;
+    node.cos_theta_o = bounds[ids[begin]].cos_theta_o;
+    node.power = 0.0f;
+    auto centers = BBox::empty();
+    for (size_t i = begin; i < end; ++i) {
+        auto& b = bounds[ids[i]];
+        node.bbox = extend(node.bbox, b.bbox);
+        node.power += powers[ids[i]];
+        cone_union(node.axis, node.cos_theta_o, b.axis, b.cos_theta_o);
+        centers = extend(centers, (b.bbox.min + b.bbox.max) * 0.5f);
+    }
+
+    if (end - begin == 1) {
+        node.child = -int32_t(ids[begin]) - 1;
+        nodes[node_id] = node;
+        return;
+    }
+
+    // Split the lights in two halves along the largest axis, which keeps the tree balanced
+    auto extents = centers.max - centers.min;
+    int axis = extents.x > extents.y ? (extents.x > extents.z ? 0 : 2) : (extents.y > extents.z ? 1 : 2);
+    auto mid = begin + (end - begin) / 2;
+    std::nth_element(ids + begin, ids + mid, ids + end, [&] (uint32_t a, uint32_t b) {
+        return bounds[a].bbox.min[axis] + bounds[a].bbox.max[axis] < bounds[b].bbox.min[axis] + bounds[b].bbox.max[axis];
+    });
+
+    // Children are placed next to each other in memory
+    node.child = nodes.size();
+    nodes[node_id] = node;
+    nodes.resize(node.child + 2);
+    build_node(node.child + 0, bounds, powers, ids, begin, mid);
+    build_node(node.child + 1, bounds, powers, ids, mid, end);
+}
+
+void LightSampler::build(const std::vector<std::unique_ptr<Light>>& scene_lights) {
+    lights.clear();
+    light_ids.clear();
+    nodes.clear();
+    alias_probs.clear();
+    alias_ids.clear();
+    emission_pdfs.clear();
+    bit_trails.clear();
+
+    auto num_lights = scene_lights.size();
+    if (num_lights == 0)
+        return;
+
+    std::vector<LightBounds> bounds(num_lights);
+    std::vector<float> powers(num_lights);
+    for (size_t i = 0; i < num_lights; ++i) {
+        lights.push_back(scene_lights[i].get());
+        light_ids.emplace(lights[i], i);
+        bounds[i] = lights[i]->bounds();
+        powers[i] = std::max(dot(lights[i]->power(), luminance), 0.0f);
+    }
+
+    // Use uniform probabilities if the lights have no power
+    auto total_power = std::accumulate(powers.begin(), powers.end(), 0.0f);
+    if (total_power <= 0.0f || !std::isfinite(total_power)) {
+        std::fill(powers.begin(), powers.end(), 1.0f);
+        total_power = num_lights;
+    }
+
+    // Build the alias table with Vose's method
+    alias_probs.resize(num_lights);
+    alias_ids.resize(num_lights);
+    emission_pdfs.resize(num_lights);
+    std::vector<uint32_t> small, large;
+    std::vector<float> scaled(num_lights);
+    for (size_t i = 0; i < num_lights; ++i) {
+        emission_pdfs[i] = powers[i] / total_power;
+        scaled[i] = emission_pdfs[i] * num_lights;
+        (scaled[i] < 1.0f ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        auto s = small.back(); small.pop_back();
+        auto l = large.back(); large.pop_back();
+        alias_probs[s] = scaled[s];
+        alias_ids[s] = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+        (scaled[l] < 1.0f ? small : large).push_back(l);
+    }
+    for (auto i : large) alias_probs[i] = 1.0f, alias_ids[i] = i;
+    for (auto i : small) alias_probs[i] = 1.0f, alias_ids[i] = i;
+
+    // Build the light tree
+    std::vector<uint32_t> ids(num_lights);
+    std::iota(ids.begin(), ids.end(), 0);
+    nodes.reserve(2 * num_lights);
+    nodes.resize(1);
+    build_node(0, bounds.data(), powers.data(), ids.data(), 0, num_lights);
+
+    // Record the path to each leaf, in order to evaluate probabilities without searching the tree
+    bit_trails.resize(num_lights);
+    struct StackElem { int32_t node; uint64_t trail; int depth; };
+    std::vector<StackElem> stack;
+    stack.push_back(StackElem { 0, 0, 0 });
+    while (!stack.empty()) {
+        auto elem = stack.back();
+        stack.pop_back();
+        auto& node = nodes[elem.node];
+        if (node.is_leaf()) {
+            bit_trails[-node.child - 1] = elem.trail;
+            continue;
+        }
+        assert(elem.depth < 64);
+        stack.push_back(StackElem { node.child + 0, elem.trail, elem.depth + 1 });
+        stack.push_back(StackElem { node.child + 1, elem.trail | (uint64_t(1) << elem.depth), elem.depth + 1 });
+    }
+}
+
+LightSelection LightSampler::sample_emission(float u) const {
+    if (lights.empty())
+        return LightSelection(nullptr, 0, 0.0f);
+    auto k = u * lights.size();
+    auto i = std::min(size_t(k), lights.size() - 1);
+    auto j = k - i < alias_probs[i] ? i : alias_ids[i];
+    return LightSelection(lights[j], j, emission_pdfs[j]);
+}
+
+float LightSampler::pdf_emission(const Light* light) const {
+    auto it = light_ids.find(light);
+    return it != light_ids.end() ? emission_pdfs[it->second] : 0.0f;
+}
+
+float LightSampler::left_probability(const Node& node, const float3& from, const float3& n) const {
+    auto left  = nodes[node.child + 0].importance(from, n);
+    auto right = nodes[node.child + 1].importance(from, n);
+    auto sum = left + right;
+    return sum > 0.0f ? left / sum : 0.5f;
+}
+
+LightSelection LightSampler::sample_direct(const float3& from, const float3& n, float u) const {
+    if (lights.empty())
+        return LightSelection(nullptr, 0, 0.0f);
+
+    float pdf = 1.0f;
+    const Node* node = &nodes[0];
+    while (!node->is_leaf()) {
+        auto p = left_probability(*node, from, n);
+        if (u < p) {
+            u = std::min(u / p, 0x1.fffffep-1f);
+            pdf *= p;
+            node = &nodes[node->child + 0];
+        } else {
+            u = std::min((u - p) / (1.0f - p), 0x1.fffffep-1f);
+            pdf *= 1.0f - p;
+            node = &nodes[node->child + 1];
+        }
+    }
+
+    auto i = -node->child - 1;
+    return LightSelection(lights[i], i, pdf);
+}
+
+float LightSampler::pdf_direct(const float3& from, const float3& n, const Light* light) const {
+    auto it = light_ids.find(light);
+    if (it == light_ids.end())
+        return 0.0f;
+
+    auto trail = bit_trails[it->second];
+    float pdf = 1.0f;
+    const Node* node = &nodes[0];
+    while (!node->is_leaf()) {
+        auto p = left_probability(*node, from, n);
+        if (trail & 1) {
+            pdf *= 1.0f - p;
+            node = &nodes[node->child + 1];
+        } else {
+            pdf *= p;
+            node = &nodes[node->child + 0];
+        }
+        trail >>= 1;
+    }
+    return pdf;
+}
@@ -0,0 +1,74 @@
+#ifndef LIGHT_SAMPLER_H
+#define LIGHT_SAMPLER_H
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+
+#include "lights.h"
+#include "bbox.h"
+
+/// Light source selected by a light sampler, along with the probability to select it.
+struct LightSelection {
+    const Light* light;     ///< Selected light, or nullptr if there is no light to select
+    size_t index;           ///< Index of the light in the list of lights
+    float pdf;              ///< Probability to select this light
+
+    LightSelection() {}
+    LightSelection(const Light* l, size_t i, float p)
+        : light(l), index(i), pdf(p)
+    {}
+};
+
+/// Acceleration structure to select light sources in scenes with many lights.
+/// Lights are selected proportionally to their power when sampling emission (using an alias table),
+/// and according to their estimated contribution to a point when sampling direct lighting (using a light tree).
+/// See "Importance Sampling of Many Lights with Adaptive Tree Splitting", Conty and Kulla 2018.
+class LightSampler {
+public:
+    /// Builds the light sampler for the given list of lights.
+    void build(const std::vector<std::unique_ptr<Light>>& lights);
+
+    /// Selects a light proportionally to its power, typically to start light paths.
+    LightSelection sample_emission(float u) const;
+    /// Returns the probability to select the given light with sample_emission.
+    float pdf_emission(const Light* light) const;
+
+    /// Selects a light for direct lighting at the given point, with the given (optional, may be zero) surface normal.
+    LightSelection sample_direct(const float3& from, const float3& n, float u) const;
+    /// Returns the probability to select the given light with sample_direct, for the given point and normal.
+    float pdf_direct(const float3& from, const float3& n, const Light* light) const;
+
+    /// Returns the number of nodes in the light tree.
+    size_t node_count() const { return nodes.size(); }
+
+private:
+    struct Node {
+        BBox bbox;              ///< Bounding box of the lights in this node
+        float3 axis;            ///< Axis of the cone that bounds the emission normals
+        float cos_theta_o;      ///< Cosine of the half-angle of the cone that bounds the emission normals
+        float power;            ///< Total power (luminance) of the lights in this node
+        int32_t child;          ///< Index of the first child for inner nodes, or the negated index of the light plus one for leaves
+
+        bool is_leaf() const { return child < 0; }
+        float importance(const float3& p, const float3& n) const;
+    };
+
+    void build_node(size_t, const LightBounds*, const float*, uint32_t*, size_t, size_t);
+    float left_probability(const Node&, const float3&, const float3&) const;
+
+    std::vector<const Light*> lights;
+    std::unordered_map<const Light*, uint32_t> light_ids;
+
+    // Alias table for emission sampling
+    std::vector<float>    alias_probs;
+    std::vector<uint32_t> alias_ids;
+    std::vector<float>    emission_pdfs;
+
+    // Light tree for direct lighting
+    std::vector<Node>     nodes;
+    std::vector<uint64_t> bit_trails;   ///< Path from the root to the leaf of each light (0 = left, 1 = right)
+};
+
+#endif // LIGHT_SAMPLER_H
@@ -3,6 +3,7 @@
 
 #include "color.h"
 #include "float3.h"
+#include "bbox.h"
 #include "samplers.h"
 
 /// Result from sampling a light source.
@@ -46,6 +47,18 @@ struct EmissionValue {
     {}
 };
 
+/// Spatial and directional extent of the emitting geometry of a light source.
+struct LightBounds {
+    BBox bbox;          ///< Bounding box of the emitting geometry
+    float3 axis;        ///< Principal direction of emission
+    float cos_theta_o;  ///< Cosine of the angle around the axis that bounds the normals of the emitting geometry
+
+    LightBounds() {}
+    LightBounds(const BBox& b, const float3& a, float c)
+        : bbox(b), axis(a), cos_theta_o(c)
+    {}
+};
+
 /// Base class for all lights.
 class Light {
 public:
@@ -54,6 +67,9 @@ public:
     /// Samples direct illumination from this light source at the given point on a surface.
     virtual DirectLightingSample sample_direct(const float3& from, Sampler& sampler) const = 0;
 
+    /// Evaluates direct illumination at the given point on a surface, for a point on the light that was previously obtained with sample_direct.
+    virtual DirectLightingSample eval_direct(const float3& from, const float3& pos) const = 0;
+
     /// Samples the emitting surface of the light.
     virtual EmissionSample sample_emission(Sampler& sampler) const = 0;
 
@@ -63,6 +79,12 @@ public:
     /// Returns true if the light has an area (i.e. can be hit by a ray).
     virtual bool has_area() const = 0;
 
+    /// Returns the total power emitted by the light source.
+    virtual rgb power() const = 0;
+
+    /// Returns the bounds of the emitting geometry, used to build light acceleration structures.
+    virtual LightBounds bounds() const = 0;
+
 protected:
     EmissionSample make_emission_sample(const float3& pos, const float3& dir, const rgb& intensity, float pdf_area, float pdf_dir, float cos) const {
         return pdf_area > 0 && pdf_dir > 0 && cos > 0
@@ -86,6 +108,10 @@ public:
         return make_direct_sample(pos, color, 1.0f, uniform_sphere_pdf(), 1.0f);
     }
 
+    DirectLightingSample eval_direct(const float3&, const float3&) const override final {
+        return make_direct_sample(pos, color, 1.0f, uniform_sphere_pdf(), 1.0f);
+    }
+
     EmissionSample sample_emission(Sampler& sampler) const override final {
         auto sample = sample_uniform_sphere(sampler(), sampler());
         return make_emission_sample(pos, sample.dir, color, 1.0f, sample.pdf, 1.0f);
@@ -99,6 +125,14 @@ public:
         return false;
     }
 
+    rgb power() const override final {
+        return color * (4.0f * pi);
+    }
+
+    LightBounds bounds() const override final {
+        return LightBounds(BBox(pos), float3(0.0f, 0.0f, 1.0f), -1.0f);
+    }
+
 private:
     float3 pos;
     rgb color;
@@ -118,7 +152,10 @@ public:
     }
 
     DirectLightingSample sample_direct(const float3& from, Sampler& sampler) const override final {
-        auto pos = sample(sampler);
+        return eval_direct(from, sample(sampler));
+    }
+
+    DirectLightingSample eval_direct(const float3& from, const float3& pos) const override final {
         auto dir = from - pos;
         float cos = dot(dir, n) / length(dir);
         return make_direct_sample(pos, color, inv_area, cosine_hemisphere_pdf(cos), cos);
@@ -141,6 +178,14 @@ public:
         return true;
     }
 
+    rgb power() const override final {
+        return color * (pi / inv_area);
+    }
+
+    LightBounds bounds() const override final {
+        return LightBounds(extend(extend(BBox(v0), v1), v2), n, 1.0f);
+    }
+
 private:
     float3 sample(Sampler& sampler) const {
         float u = sampler();
@@ -3,9 +3,12 @@
 #include <cstring>
 #include <cstdlib>
 #include <cctype>
+#include <algorithm>
 
 #include "common.h"
 #include "load_obj.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
 
 inline void remove_eol(char* ptr) {
     int i = 0;
@@ -63,33 +66,58 @@ inline bool read_index(char** ptr, obj::Index& idx) {
     return true;
 }
 
-static bool parse_obj(std::istream& stream, obj::File& file) {
-    // Add an empty object to the scene
-    int cur_object = 0;
-    file.objects.emplace_back();
-
-    // Add an empty group to this object
-    int cur_group = 0;
-    file.objects[0].groups.emplace_back();
-
-    // Add an empty material to the scene
-    int cur_mtl = 0;
-    file.materials.emplace_back("");
-
-    // Add dummy vertex, normal, and texcoord
-    file.vertices.emplace_back();
-    file.normals.emplace_back();
-    file.texcoords.emplace_back();
-
-    int err_count = 0, cur_line = 0;
-    const int max_line = 1024;
-    char line[max_line];
-
-    while (stream.getline(line, max_line)) {
+namespace {
+
+/// Command that changes the group, object or material of the faces that follow it.
+struct ObjCommand {
+    enum Type { Group, Object, UseMtl, MtlLib } type;
+    size_t face;                            ///< Number of faces of the chunk that precede the command
+    std::string name;                       ///< Material or library name
+};
+
+/// Relative (negative) index, which can only be resolved once the number of elements in the previous chunks is known.
+struct RelativeIndex {
+    size_t index;                           ///< Position of the reference in the index list of the chunk
+    size_t face;                            ///< Face of the chunk that contains the reference
+    int component;                          ///< 0 for vertices, 1 for texture coordinates, 2 for normals
+    int value;                              ///< Index relative to the beginning of the chunk
+    int line;                               ///< Line (relative to the chunk) where the reference occurs
+};
+
+/// Part of an OBJ file made of complete lines, which can be parsed independently of the others.
+struct ObjChunk {
+    const char* begin;
+    const char* end;
+
+    std::vector<float3>      vertices;
+    std::vector<float3>      normals;
+    std::vector<float2>      texcoords;
+    std::vector<obj::Index>  indices;
+    std::vector<obj::Face>   faces;
+    std::vector<ObjCommand>  commands;
+    std::vector<RelativeIndex> relative;
+    std::vector<std::pair<int, std::string>> errors;   ///< Error messages, along with the line (relative to the chunk) where they occurred
+    int num_lines = 0;
+};
+
+} // namespace
+
+static void parse_obj_chunk(ObjChunk& chunk) {
+    std::vector<char> line;
+    auto cur = chunk.begin;
+    int cur_line = 0;
+
+    while (cur < chunk.end) {
+        // Copy the line to a null-terminated buffer, so that it can be parsed with the standard library functions
+        auto eol = static_cast<const char*>(std::memchr(cur, '\n', chunk.end - cur));
+        if (!eol) eol = chunk.end;
+        line.assign(cur, eol);
+        line.push_back('\0');
+        cur = eol + 1;
         cur_line++;
 
         // Strip spaces
-        char* ptr = strip_spaces(line);
+        char* ptr = strip_spaces(line.data());
 
         // Skip comments and empty lines
         if (*ptr == '\0' || *ptr == '#')
@@ -107,7 +135,7 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
                         v.x = std::strtof(ptr + 1, &ptr);
                         v.y = std::strtof(ptr, &ptr);
                         v.z = std::strtof(ptr, &ptr);
-                        file.vertices.push_back(v);
+                        chunk.vertices.push_back(v);
                     }
                     break;
                 case 'n':
@@ -116,7 +144,7 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
                         n.x = std::strtof(ptr + 2, &ptr);
                         n.y = std::strtof(ptr, &ptr);
                         n.z = std::strtof(ptr, &ptr);
-                        file.normals.push_back(n);
+                        chunk.normals.push_back(n);
                     }
                     break;
                 case 't':
@@ -124,64 +152,50 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
                         float2 t;
                         t.x = std::strtof(ptr + 2, &ptr);
                         t.y = std::strtof(ptr, &ptr);
-                        file.texcoords.push_back(t);
+                        chunk.texcoords.push_back(t);
                     }
                     break;
                 default:
-                    error("Invalid vertex (line ", cur_line, ").");
-                    err_count++;
+                    chunk.errors.emplace_back(cur_line, "Invalid vertex");
                     break;
             }
         } else if (*ptr == 'f' && std::isspace(ptr[1])) {
-            obj::Face f;
+            auto first_index = chunk.indices.size();
+            auto first_relative = chunk.relative.size();
 
-            f.material = cur_mtl;
+            ptr += 2;
+            obj::Index index;
+            while (read_index(&ptr, index))
+                chunk.indices.push_back(index);
+
+            auto num_indices = chunk.indices.size() - first_index;
+            if (num_indices < 3) {
+                chunk.errors.emplace_back(cur_line, "Invalid face");
+                chunk.indices.resize(first_index);
+                continue;
+            }
 
+            // Record relative indices, they are converted to absolute indices once the chunks are merged
             bool valid = true;
-            ptr += 2;
-            while (valid) {
-                obj::Index index;
-                valid = read_index(&ptr, index);
-                if (valid)
-                    f.indices.push_back(index);
+            for (auto i = first_index; i < chunk.indices.size(); i++) {
+                auto& idx = chunk.indices[i];
+                if (idx.v < 0) chunk.relative.push_back(RelativeIndex { i, chunk.faces.size(), 0, int(chunk.vertices.size())  + idx.v, cur_line });
+                if (idx.t < 0) chunk.relative.push_back(RelativeIndex { i, chunk.faces.size(), 1, int(chunk.texcoords.size()) + idx.t, cur_line });
+                if (idx.n < 0) chunk.relative.push_back(RelativeIndex { i, chunk.faces.size(), 2, int(chunk.normals.size())   + idx.n, cur_line });
+                valid &= idx.v != 0;
             }
 
-            if (f.indices.size() < 3) {
-                error("Invalid face (line ", cur_line, ").");
-                err_count++;
+            if (valid) {
+                chunk.faces.push_back(obj::Face { first_index, num_indices, 0 });
             } else {
-                // Convert relative indices to absolute
-                for (size_t i = 0; i < f.indices.size(); i++) {
-                    f.indices[i].v = (f.indices[i].v < 0) ? file.vertices.size()  + f.indices[i].v : f.indices[i].v;
-                    f.indices[i].t = (f.indices[i].t < 0) ? file.texcoords.size() + f.indices[i].t : f.indices[i].t;
-                    f.indices[i].n = (f.indices[i].n < 0) ? file.normals.size()   + f.indices[i].n : f.indices[i].n;
-                }
-
-                // Check if the indices are valid or not
-                valid = true;
-                for (size_t i = 0; i < f.indices.size(); i++) {
-                    if (f.indices[i].v <= 0 || f.indices[i].t < 0 || f.indices[i].n < 0) {
-                        valid = false;
-                        break;
-                    }
-                }
-
-                if (valid) {
-                    file.objects[cur_object].groups[cur_group].faces.push_back(f);
-                } else {
-                    error("Invalid indices in face definition (line ", cur_line, ").");
-                    err_count++;
-                }
+                chunk.errors.emplace_back(cur_line, "Invalid indices in face definition");
+                chunk.indices.resize(first_index);
+                chunk.relative.resize(first_relative);
             }
         } else if (*ptr == 'g' && std::isspace(ptr[1])) {
-            file.objects[cur_object].groups.emplace_back();
-            cur_group++;
+            chunk.commands.push_back(ObjCommand { ObjCommand::Group, chunk.faces.size(), "" });
         } else if (*ptr == 'o' && std::isspace(ptr[1])) {
-            file.objects.emplace_back();
-            cur_object++;
-
-            file.objects[cur_object].groups.emplace_back();
-            cur_group = 0;
+            chunk.commands.push_back(ObjCommand { ObjCommand::Object, chunk.faces.size(), "" });
         } else if (!std::strncmp(ptr, "usemtl", 6) && std::isspace(ptr[6])) {
             ptr += 6;
 
@@ -189,12 +203,7 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
             char* base = ptr;
             ptr = strip_text(ptr);
 
-            const std::string mtl_name(base, ptr);
-
-            cur_mtl = std::find(file.materials.begin(), file.materials.end(), mtl_name) - file.materials.begin();
-            if (cur_mtl == (int)file.materials.size()) {
-                file.materials.push_back(mtl_name);
-            }
+            chunk.commands.push_back(ObjCommand { ObjCommand::UseMtl, chunk.faces.size(), std::string(base, ptr) });
         } else if (!std::strncmp(ptr, "mtllib", 6) && std::isspace(ptr[6])) {
             ptr += 6;
 
@@ -202,15 +211,122 @@ static bool parse_obj(std::istream& stream, obj::File& file) {
             char* base = ptr;
             ptr = strip_text(ptr);
 
-            const std::string lib_name(base, ptr);
-
-            file.mtl_libs.push_back(lib_name);
+            chunk.commands.push_back(ObjCommand { ObjCommand::MtlLib, chunk.faces.size(), std::string(base, ptr) });
         } else if (*ptr == 's' && std::isspace(ptr[1])) {
             // Ignore smooth commands
         } else {
-            error("Unknown command '", ptr, "' (line ", cur_line, ").");
+            chunk.errors.emplace_back(cur_line, "Unknown command '" + std::string(ptr) + "'");
+        }
+    }
+
+    chunk.num_lines = cur_line;
+}
+
+/// Splits an OBJ file in chunks that end on a line boundary, so that they can be parsed in parallel.
+static void split_obj(const char* data, size_t size, std::vector<ObjChunk>& chunks) {
+    constexpr size_t chunk_size = 1 << 20;
+    for (auto cur = data, end = data + size; cur < end;) {
+        auto next = cur + std::min(chunk_size, size_t(end - cur));
+        if (next < end) {
+            auto eol = static_cast<const char*>(std::memchr(next, '\n', end - next));
+            next = eol ? eol + 1 : end;
+        }
+        chunks.emplace_back();
+        chunks.back().begin = cur;
+        chunks.back().end   = next;
+        cur = next;
+    }
+}
+
+/// Merges the parsed chunks of an OBJ file in order, resolving relative indices and material names.
+static bool merge_obj(std::vector<ObjChunk>& chunks, obj::File& file) {
+    // Add an empty object to the scene
+    int cur_object = 0;
+    file.objects.emplace_back();
+
+    // Add an empty group to this object
+    int cur_group = 0;
+    file.objects[0].groups.emplace_back();
+
+    // Add an empty material to the scene
+    int cur_mtl = 0;
+    file.materials.emplace_back("");
+
+    // Add dummy vertex, normal, and texcoord
+    file.vertices.emplace_back();
+    file.normals.emplace_back();
+    file.texcoords.emplace_back();
+
+    int err_count = 0, first_line = 0;
+    for (auto& chunk : chunks) {
+        for (auto& err : chunk.errors) {
+            error(err.second, " (line ", first_line + err.first, ").");
             err_count++;
         }
+
+        for (auto& rel : chunk.relative) {
+            auto& idx = chunk.indices[rel.index];
+            switch (rel.component) {
+                case 0: idx.v = file.vertices.size()  + rel.value; break;
+                case 1: idx.t = file.texcoords.size() + rel.value; break;
+                case 2: idx.n = file.normals.size()   + rel.value; break;
+            }
+            if (idx.v <= 0 || idx.t < 0 || idx.n < 0) {
+                auto& face = chunk.faces[rel.face];
+                if (face.num_indices > 0) {
+                    error("Invalid indices in face definition (line ", first_line + rel.line, ").");
+                    err_count++;
+                }
+                face.num_indices = 0;
+            }
+        }
+
+        auto index_offset = file.indices.size();
+        file.vertices.insert(file.vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+        file.normals.insert(file.normals.end(), chunk.normals.begin(), chunk.normals.end());
+        file.texcoords.insert(file.texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+        file.indices.insert(file.indices.end(), chunk.indices.begin(), chunk.indices.end());
+
+        auto apply = [&] (const ObjCommand& cmd) {
+            switch (cmd.type) {
+                case ObjCommand::Group:
+                    file.objects[cur_object].groups.emplace_back();
+                    cur_group++;
+                    break;
+                case ObjCommand::Object:
+                    file.objects.emplace_back();
+                    cur_object++;
+
+                    file.objects[cur_object].groups.emplace_back();
+                    cur_group = 0;
+                    break;
+                case ObjCommand::UseMtl:
+                    cur_mtl = std::find(file.materials.begin(), file.materials.end(), cmd.name) - file.materials.begin();
+                    if (cur_mtl == (int)file.materials.size()) {
+                        file.materials.push_back(cmd.name);
+                    }
+                    break;
+                case ObjCommand::MtlLib:
+                    file.mtl_libs.push_back(cmd.name);
+                    break;
+            }
+        };
+
+        size_t cur_cmd = 0;
+        for (size_t i = 0; i < chunk.faces.size(); i++) {
+            for (; cur_cmd < chunk.commands.size() && chunk.commands[cur_cmd].face <= i; cur_cmd++)
+                apply(chunk.commands[cur_cmd]);
+            auto face = chunk.faces[i];
+            if (face.num_indices == 0) continue;
+            face.first_index += index_offset;
+            face.material = cur_mtl;
+            file.objects[cur_object].groups[cur_group].faces.push_back(face);
+        }
+        for (; cur_cmd < chunk.commands.size(); cur_cmd++)
+            apply(chunk.commands[cur_cmd]);
+
+        first_line += chunk.num_lines;
+        chunk = ObjChunk();
     }
 
     return (err_count == 0);
@@ -280,6 +396,9 @@ static bool parse_mtl(std::istream& stream, obj::MaterialLib& mtl_lib) {
             } else if (ptr[1] == 'i' && std::isspace(ptr[2])) {
                 auto& mat = current_material();
                 mat.ni = std::strtof(ptr + 3, &ptr);
+            } else if (ptr[1] == 'v' && std::isspace(ptr[2])) {
+                auto& mat = current_material();
+                mat.nv = std::strtof(ptr + 3, &ptr);
             } else {
                 error("Invalid command '", ptr, "' (line ", cur_line , ").");
                 err_count++;
@@ -333,9 +452,39 @@ static bool parse_mtl(std::istream& stream, obj::MaterialLib& mtl_lib) {
 }
 
 bool load_obj(const FilePath& path, obj::File& obj_file) {
-    // Parse the OBJ file
-    std::ifstream stream(path);
-    return stream && parse_obj(stream, obj_file);
+    std::vector<obj::File> obj_files(1);
+    auto loaded = load_objs({ path }, obj_files);
+    obj_file = std::move(obj_files[0]);
+    return loaded[0];
+}
+
+std::vector<bool> load_objs(const std::vector<std::string>& paths, std::vector<obj::File>& obj_files) {
+    // Map the OBJ files in memory, and split them in chunks
+    std::vector<MappedFile> files(paths.size());
+    std::vector<bool> loaded(paths.size());
+    std::vector<std::vector<ObjChunk>> chunks(paths.size());
+    std::vector<std::pair<size_t, size_t>> tasks;
+    for (size_t i = 0; i < paths.size(); i++) {
+        loaded[i] = files[i].open(paths[i]);
+        if (!loaded[i]) continue;
+        split_obj(files[i].data(), files[i].size(), chunks[i]);
+        for (size_t j = 0; j < chunks[i].size(); j++)
+            tasks.emplace_back(i, j);
+    }
+
+    // Parse the chunks of all the files at once, so that small files are parsed in parallel with each other
+    ThreadPool::instance().run_tasks(tasks.size(), [&] (size_t i, size_t) {
+        parse_obj_chunk(chunks[tasks[i].first][tasks[i].second]);
+    });
+
+    // Merge the chunks sequentially, so that errors are reported in the order of the files
+    obj_files.resize(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (loaded[i])
+            loaded[i] = merge_obj(chunks[i], obj_files[i]);
+        files[i].close();
+    }
+    return loaded;
 }
 
 bool load_mtl(const FilePath& path, obj::MaterialLib& mtl_lib) {
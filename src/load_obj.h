@@ -17,7 +17,8 @@ struct Index {
 };
 
 struct Face {
-    std::vector<Index> indices;             ///< Indices of the face
+    size_t first_index;                     ///< Index of the first vertex reference of the face in the index list of the model
+    size_t num_indices;                     ///< Number of vertex references of the face
     int material;                           ///< Index into the material names of the model
 };
 
@@ -38,6 +39,7 @@ struct Material {
     rgb ke;                     ///< Emitting term
     float ns;                   ///< Specular index
     float ni;                   ///< Medium index
+    float nv;                   ///< Abbe number of the medium, for dispersion (non-standard, 0 if not dispersive)
     rgb tf;                     ///< Transmittance
     float tr;                   ///< Transparency
     float d;                    ///< Dissolve factor
@@ -52,6 +54,7 @@ struct Material {
 
 struct File {
     std::vector<Object>      objects;       ///< List of objects in the model
+    std::vector<Index>       indices;       ///< List of vertex references of all the faces in the model
     std::vector<float3>      vertices;      ///< List of vertices in the model
     std::vector<float3>      normals;       ///< List of normals in the model
     std::vector<float2>      texcoords;     ///< List of texture coordinates in the model
@@ -65,6 +68,8 @@ typedef std::unordered_map<std::string, Material> MaterialLib;
 
 /// Loads an OBJ model from a file.
 bool load_obj(const FilePath&, obj::File&);
+/// Loads several OBJ models, whose chunks are all parsed in parallel. Returns, for each file, whether it was loaded successfully.
+std::vector<bool> load_objs(const std::vector<std::string>& paths, std::vector<obj::File>& obj_files);
 /// Loads an MTL file from a file.
 bool load_mtl(const FilePath&, obj::MaterialLib&);
 
@@ -3,6 +3,7 @@
 #include <climits>
 #include <fstream>
 #include <sstream>
+#include <future>
 
 #ifndef DISABLE_GUI
 #include <SDL2/SDL.h>
@@ -14,6 +15,10 @@
 #include "renderer.h"
 #include "cameras.h"
 #include "debug.h"
+#include "stats.h"
+#include "display.h"
+#include "adaptive.h"
+#include "denoise.h"
 
 #ifndef NDEBUG
 static bool debug = false;
@@ -22,10 +27,13 @@ static bool debug = false;
 static std::vector<std::unique_ptr<Renderer>> renderers;
 
 #ifndef DISABLE_GUI
-bool handle_events(SDL_Window* window, Scene& scene, size_t& render_fn, size_t& accum) {
+bool handle_events(SDL_Window* window, Scene& scene, size_t& render_fn, bool& moved) {
     SDL_Event event;
 
     static bool arrows[4], speed[2];
+    // Instance moved with the I, J, K, L, U, O keys (along Z, X and Y), selected with Tab
+    static bool moves[6];
+    static int selected = -1;
     const float rspeed = 0.005f;
     static float tspeed = 0.1f;
 
@@ -67,7 +75,7 @@ bool handle_events(SDL_Window* window, Scene& scene, size_t& render_fn, size_t&
                 {
                     if (camera_on) {
                         scene.camera->mouse_motion(event.motion.xrel * rspeed, event.motion.yrel * rspeed);
-                        accum = 0;
+                        moved = true;
                     }
 #ifndef NDEBUG
                     if (select_on) {
@@ -89,13 +97,28 @@ bool handle_events(SDL_Window* window, Scene& scene, size_t& render_fn, size_t&
                     case SDLK_RIGHT:    arrows[3] = key_down; break;
                     case SDLK_KP_PLUS:  speed[0] = key_down; break;
                     case SDLK_KP_MINUS: speed[1] = key_down; break;
+                    case SDLK_i:        moves[0] = key_down; break;
+                    case SDLK_k:        moves[1] = key_down; break;
+                    case SDLK_j:        moves[2] = key_down; break;
+                    case SDLK_l:        moves[3] = key_down; break;
+                    case SDLK_u:        moves[4] = key_down; break;
+                    case SDLK_o:        moves[5] = key_down; break;
+                    case SDLK_TAB:
+                        if (key_down && !scene.instances.empty()) {
+                            selected = selected + 1 < int(scene.instances.size()) ? selected + 1 : -1;
+                            if (selected >= 0)
+                                info("Instance ", selected, " of '", scene.instanced_meshes[scene.instances[selected].mesh]->file, "' selected.");
+                            else
+                                info("No instance selected.");
+                        }
+                        break;
                     case SDLK_r:
                         if (key_down) {
                             std::ostringstream title;
                             render_fn = (render_fn + 1) % renderers.size();
                             title << "arty (" << renderers[render_fn]->name() << ")";
                             SDL_SetWindowTitle(window, title.str().c_str());
-                            accum = 0;
+                            moved = true;
                         }
                         break;
                     case SDLK_ESCAPE:
@@ -109,10 +132,20 @@ bool handle_events(SDL_Window* window, Scene& scene, size_t& render_fn, size_t&
         }
     }
 
-    if (arrows[0]) { scene.camera->keyboard_motion(0, 0,  tspeed); accum = 0; }
-    if (arrows[1]) { scene.camera->keyboard_motion(0, 0, -tspeed); accum = 0; }
-    if (arrows[2]) { scene.camera->keyboard_motion(-tspeed, 0, 0); accum = 0; }
-    if (arrows[3]) { scene.camera->keyboard_motion( tspeed, 0, 0); accum = 0; }
+    if (arrows[0]) { scene.camera->keyboard_motion(0, 0,  tspeed); moved = true; }
+    if (arrows[1]) { scene.camera->keyboard_motion(0, 0, -tspeed); moved = true; }
+    if (arrows[2]) { scene.camera->keyboard_motion(-tspeed, 0, 0); moved = true; }
+    if (arrows[3]) { scene.camera->keyboard_motion( tspeed, 0, 0); moved = true; }
+    if (selected >= 0 && std::find(moves, moves + 6, true) != moves + 6) {
+        float3 offset(
+            (moves[3] ? tspeed : 0.0f) - (moves[2] ? tspeed : 0.0f),
+            (moves[4] ? tspeed : 0.0f) - (moves[5] ? tspeed : 0.0f),
+            (moves[0] ? tspeed : 0.0f) - (moves[1] ? tspeed : 0.0f));
+        auto& instance = scene.instances[selected];
+        scene.set_instance_transform(selected, Transform::translation(offset) * instance.to_world);
+        scene.update_instances();
+        moved = true;
+    }
     if (speed[0]) tspeed *= 1.1f;
     if (speed[1]) tspeed *= 0.9f;
 
@@ -120,25 +153,283 @@ bool handle_events(SDL_Window* window, Scene& scene, size_t& render_fn, size_t&
 }
 #endif // DISABLE_GUI
 
+static size_t find_renderer(const std::string& name) {
+    auto it = std::find_if(renderers.begin(), renderers.end(), [&] (const std::unique_ptr<Renderer>& renderer) {
+        return name == renderer->name();
+    });
+    return it - renderers.begin();
+}
+
+/// Returns a mask of the pixels of the tiles that were finished during the last frame.
+static std::vector<uint8_t> finished_tiles_mask(size_t width, size_t height) {
+    std::vector<uint8_t> mask(width * height, 0);
+    for (auto& tile : ThreadPool::instance().last_tile_stats()) {
+        // Tiles from a frame of another size are clamped to the image
+        auto xmax = std::min(tile.xmax, width), ymax = std::min(tile.ymax, height);
+        if (!tile.done || tile.xmin >= xmax) continue;
+        for (size_t y = tile.ymin; y < ymax; y++)
+            std::fill(mask.begin() + y * width + tile.xmin, mask.begin() + y * width + xmax, 1);
+    }
+    return mask;
+}
+
+#ifndef DISABLE_GUI
+/// Copies a preview rendered at 1/scale of the resolution to the image shown in the window, as blocks of scale x scale pixels.
+/// When the preview frame was interrupted by the deadline, only its finished tiles are copied, and the others keep the previous preview.
+static void upsample_preview(const Image& preview, const std::vector<uint8_t>& mask, size_t scale, Image& frame) {
+    for (size_t y = 0; y < frame.height; y++) {
+        auto py = std::min(y / scale, preview.height - 1);
+        for (size_t x = 0; x < frame.width; x++) {
+            auto px = std::min(x / scale, preview.width - 1);
+            if (mask.empty() || mask[py * preview.width + px])
+                frame(x, y) = preview(px, py);
+        }
+    }
+}
+#endif
+
+/// Returns the number of samples accumulated in a pixel. When the last frame was interrupted by
+/// the deadline, only the pixels in the mask of the finished tiles received the last sample.
+static size_t pixel_samples(const Image& img, size_t accum, const std::vector<uint8_t>& last_frame_mask, size_t x, size_t y) {
+    return last_frame_mask.empty() ? accum : accum - 1 + last_frame_mask[y * img.width + x];
+}
+
+/// Returns the average of the samples accumulated in a pixel.
+static rgba average(const Image& img, size_t accum, const std::vector<uint8_t>& last_frame_mask, size_t x, size_t y) {
+    auto samples = pixel_samples(img, accum, last_frame_mask, x, y);
+    return samples > 0 ? img(x, y) / samples : rgba(0.0f);
+}
+
+/// Saves an image of averaged samples, in PNG or EXR format depending on the extension of the file name.
+/// The extra channels (e.g. the averaged features of the first hits) are only saved in EXR files.
+static bool save_image(const std::string& file_name, Image& img, const ExrOptions& exr_options, const std::vector<ExrChannel>& extra_channels = {}) {
+    bool save_as_png = file_name.rfind(".png") == file_name.length() - 4;
+    bool save_as_exr = file_name.rfind(".exr") == file_name.length() - 4;
+    if (!save_as_png && !save_as_exr) {
+        warn("Could not determine output file type from extension, using PNG");
+        save_as_png = true;
+    }
+    if (save_as_png) {
+        // Perform gamma correction before saving to disk
+        for (auto& pixel : img.pixels)
+            pixel = gamma(pixel);
+        return save_png(file_name, img);
+    }
+    return save_exr(file_name, img, exr_options, extra_channels);
+}
+
+/// Processing of the final images that needs the features of the first hits.
+struct PostProcessing {
+    FeatureBuffers* features = nullptr;     ///< Features written by the renderers, or null if they are not needed
+    bool denoise = false;
+    bool save_aovs = false;
+};
+
+/// Denoises an image of averaged samples if requested, and returns the averaged features to save along with it, if any.
+static std::unique_ptr<FeatureBuffers> post_process(Image& img, const PostProcessing& post) {
+    if (!post.features)
+        return nullptr;
+    auto averaged = std::make_unique<FeatureBuffers>(post.features->average());
+    if (post.denoise) {
+        ProfileScope scope("denoise");
+        denoise(img, *averaged);
+    }
+    return post.save_aovs ? std::move(averaged) : nullptr;
+}
+
+static void save_tile_stats(const std::string& tile_stats_file) {
+    std::ofstream file(tile_stats_file);
+    file << "xmin,ymin,xmax,ymax,worker,time_ms,done\n";
+    for (auto& tile : ThreadPool::instance().last_tile_stats())
+        file << tile.xmin << "," << tile.ymin << "," << tile.xmax << "," << tile.ymax << "," << tile.worker << "," << tile.time_ms << "," << tile.done << "\n";
+    if (!file)
+        error("Failed to save tile timings to '", tile_stats_file, "'.");
+    else
+        info("Tile timings saved to '", tile_stats_file, "'.");
+}
+
+static void save_stats(const std::string& stats_file, const std::string& trace_file, double total_time) {
+    if ((stats_file != "" || trace_file != "") && !Stats::enabled)
+        warn("Performance counters are not available (compile with ENABLE_STATS = ON).");
+    if (Stats::enabled && stats_file != "") {
+        if (!Stats::instance().save_summary(stats_file, total_time))
+            error("Failed to save performance counters to '", stats_file, "'.");
+        else
+            info("Performance counters saved to '", stats_file, "'.");
+    }
+    if (Stats::enabled && trace_file != "") {
+        if (!Stats::instance().save_trace(trace_file))
+            error("Failed to save trace to '", trace_file, "'.");
+        else
+            info("Trace saved to '", trace_file, "'.");
+    }
+}
+
+/// Renders a list of jobs with the loaded scene, replacing its camera and viewport for each of them.
+/// The image of a job is written to the disk while the next job is rendered.
+/// Returns false if a job could not be rendered or saved, and the total render time of all jobs.
+static bool render_batch(Scene& scene, std::vector<RenderJob>& jobs, const ExrOptions& exr_options, AdaptiveSampling* adaptive, const PostProcessing& post, double& batch_time) {
+    using namespace std::chrono;
+
+    auto& thread_pool = ThreadPool::instance();
+    std::future<bool> pending_save;
+    std::string pending_output;
+    auto wait_for_save = [&] {
+        if (!pending_save.valid())
+            return true;
+        if (!pending_save.get()) {
+            error("Failed to save image to '", pending_output, "'.");
+            return false;
+        }
+        info("Image saved to '", pending_output, "'.");
+        return true;
+    };
+
+    bool ok = true;
+    batch_time = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        auto& job = jobs[i];
+        auto render_fn = find_renderer(job.algo);
+        if (render_fn == renderers.size()) {
+            error("No renderer with name '", job.algo, "' for job ", i, ".");
+            ok = false;
+            continue;
+        }
+
+        // Only the renderer state is reset: the geometry, the BVH and the textures are shared by all jobs
+        scene.camera = std::move(job.camera);
+        scene.width  = job.width;
+        scene.height = job.height;
+        scene.update_pixel_spread();
+        renderers[render_fn]->reset();
+        if (adaptive)
+            adaptive->reset(job.width, job.height);
+        if (post.features)
+            post.features->reset(job.width, job.height);
+
+        Image img(job.width, job.height);
+        img.clear();
+        std::vector<uint8_t> last_frame_mask;
+        size_t accum = 0;
+        double total_time = 0;
+        while ((job.samples == 0 || accum < job.samples) && (job.time == 0.0 || total_time < job.time)) {
+            auto start_render = high_resolution_clock::now();
+            thread_pool.begin_frame();
+            if (job.time != 0.0)
+                thread_pool.set_deadline(ThreadPool::Clock::now() + duration_cast<ThreadPool::Clock::duration>(duration<double>(job.time - total_time)));
+            {
+                ProfileScope scope("frame");
+                renderers[render_fn]->render(img);
+            }
+            scene.textures.end_frame();
+            total_time += duration_cast<milliseconds>(high_resolution_clock::now() - start_render).count() * 0.001;
+            accum++;
+
+            if (!thread_pool.last_run_complete()) {
+                last_frame_mask = finished_tiles_mask(img.width, img.height);
+                break;
+            }
+            if (adaptive && adaptive->converged())
+                break;
+        }
+        // The deadline of this job must not apply to the next ones
+        thread_pool.clear_deadline();
+        batch_time += total_time;
+
+        for (size_t y = 0; y < img.height; y++) {
+            for (size_t x = 0; x < img.width; x++)
+                img(x, y) = average(img, accum, last_frame_mask, x, y);
+        }
+        auto aovs = post_process(img, post);
+
+        // At most one image is being saved at a time, so that the memory usage does not grow with the number of jobs.
+        // The messages are printed by the main thread, so that they are not interleaved with those of the renderers.
+        ok &= wait_for_save();
+        info("Job ", i + 1, "/", jobs.size(), " rendered with ", job.algo, " (", accum, " samples, ", total_time, " s).");
+        pending_output = job.output;
+        pending_save = std::async(std::launch::async, [img = std::move(img), aovs = std::move(aovs), output = job.output, &exr_options] () mutable {
+            return save_image(output, img, exr_options, aovs ? aovs->exr_channels() : std::vector<ExrChannel>());
+        });
+    }
+    ok &= wait_for_save();
+    return ok;
+}
+
 int main(int argc, char** argv) {
     ArgParser parser(argc, argv);
 
     bool help;
     size_t width, height;
-    std::string output_image, renderer_name;
+    std::string output_image, renderer_name, bvh_quality, sampler_name;
     double max_time;
     size_t max_samples;
+    size_t num_threads;
+    size_t texture_cache_mb;
+    bool pin_threads;
+    std::string numa_mode;
+    bool no_cache;
+    bool compact;
+    bool guiding;
+    bool spectral;
+    std::string tile_stats_file;
+    std::string stats_file, trace_file;
+    std::string batch_file;
+    std::string exr_compression;
+    bool exr_half;
+    size_t exr_tile;
+    double checkpoint_interval;
+    float adaptive_threshold;
+    size_t adaptive_min_samples;
+    std::string convergence_map_file;
+    bool denoise_image;
+    bool save_aovs;
+    size_t first_sample;
+    bool partial;
+    size_t preview_scale;
+    double frame_budget;
 
     parser.add_option("help",      "h",    "Prints this message",               help,   false);
     parser.add_option("width",     "sx",   "Sets the window width, in pixels",  width,  size_t(1080), "px");
     parser.add_option("height",    "sy",   "Sets the window height, in pixels", height, size_t(720), "px");
 
     parser.add_option("output",    "o",    "Sets the output file name", output_image, std::string("render.exr"), "file.exr");
+    parser.add_option("exr-compression", "ec", "Sets the compression of EXR files: none, zips, zip, piz", exr_compression, std::string("none"));
+    parser.add_option("exr-half",  "eh",   "Stores EXR files with half-precision floats", exr_half, false);
+    parser.add_option("exr-tile",  "et",   "Stores EXR files as tiles of the given size, instead of scanlines (0 = scanlines)", exr_tile, size_t(0), "px");
+    parser.add_option("checkpoint", "cp",  "Saves the output image periodically while rendering (0 = disabled)", checkpoint_interval, 0.0, "s");
 
     parser.add_option("samples",   "s",    "Sets the desired number of samples", max_samples, size_t(0));
     parser.add_option("time",      "t",    "Sets the desired render time in seconds", max_time, 0.0);
+    parser.add_option("adaptive",  "ad",   "Stops sampling the tiles whose relative error is below the given threshold (0 = disabled)", adaptive_threshold, 0.0f);
+    parser.add_option("adaptive-min", "am", "Sets the number of samples per pixel before a tile can converge", adaptive_min_samples, size_t(16));
+    parser.add_option("convergence-map", "cm", "Saves the pixel errors, sample counts and converged tiles to an EXR file (requires --adaptive)", convergence_map_file, std::string(""), "file.exr");
+
+    parser.add_option("preview-scale", "ps", "Renders at 1/n of the resolution while the camera moves, then refines progressively (1 = disabled)", preview_scale, size_t(4));
+    parser.add_option("frame-budget", "fb", "Sets the target frame time while the camera moves, the preview resolution adapts to it", frame_budget, 33.0, "ms");
+
+    parser.add_option("denoise",   "dn",   "Denoises the final image, guided by the albedo, normals and depth of the first hits", denoise_image, false);
+    parser.add_option("aovs",      "ao",   "Saves the albedo, normals and depth of the first hits as extra channels of EXR files", save_aovs, false);
+
+    parser.add_option("first-sample", "fs", "Sets the index of the first sample, to render disjoint ranges of samples of an image on several machines", first_sample, size_t(0));
+    parser.add_option("partial",   "pa",   "Saves the number of samples of each pixel in the EXR image, so that partial renders can be merged with arty_merge", partial, false);
+
+    parser.add_option("batch",     "bt",   "Renders the jobs of a YAML file, reusing the loaded scene", batch_file, std::string(""), "jobs.yml");
+
+    parser.add_option("algo",      "a",    "Sets the algorithm used for rendering: debug, pt, wpt, bpt, ppm, sppm, restir", renderer_name, std::string("debug"));
+    parser.add_option("sampler",   "sp",   "Sets the sampler used by the pt renderer: pcg, sobol", sampler_name, std::string("pcg"));
+    parser.add_option("guiding",   "g",    "Guides the paths of the pt renderer with a radiance cache learned while rendering", guiding, false);
+    parser.add_option("spectral",  "sr",   "Traces the paths of the pt renderer at four wavelengths each, instead of RGB colors", spectral, false);
+    parser.add_option("bvh",       "b",    "Sets the BVH construction quality: high, fast", bvh_quality, std::string("high"));
+    parser.add_option("no-cache",  "nc",   "Ignores the binary scene cache, and does not create it", no_cache, false);
+    parser.add_option("texture-cache", "tc", "Sets the memory budget of the texture cache, in megabytes", texture_cache_mb, size_t(512), "MB");
+    parser.add_option("compact",   "c",    "Uses a compact representation of the mesh and BVH, to render larger scenes", compact, false);
 
-    parser.add_option("algo",      "a",    "Sets the algorithm used for rendering: debug, pt, bpt, ppm", renderer_name, std::string("debug"));
+    parser.add_option("threads",   "j",    "Sets the number of rendering threads (0 = one per hardware thread)", num_threads, size_t(0));
+    parser.add_option("pin",       "p",    "Pins each rendering thread to a core", pin_threads, false);
+    parser.add_option("numa",      "nu",   "Sets the NUMA policy: none, replicate (copies the BVH on every node, implies --pin)", numa_mode, std::string("none"));
+    parser.add_option("tile-stats", "ts",  "Saves the per-tile timings of the last frame to a CSV file", tile_stats_file, std::string(""), "file.csv");
+    parser.add_option("stats",     "st",   "Saves the performance counters to a JSON file (requires ENABLE_STATS)", stats_file, std::string(""), "file.json");
+    parser.add_option("trace",     "tr",   "Saves a trace of the tiles and idle times, in the Chrome trace event format (requires ENABLE_STATS)", trace_file, std::string(""), "file.json");
 
     parser.parse();
     if (help) {
@@ -155,14 +446,160 @@ int main(int argc, char** argv) {
         warn("Too many configuration files specified, all but the first will be ignored.");
     }
 
+    LoadOptions load_options;
+    load_options.use_cache = !no_cache;
+    load_options.compact = compact;
+    load_options.texture_cache_size = texture_cache_mb << 20;
+    if (bvh_quality == "fast") {
+        load_options.bvh_quality = BvhQuality::Fast;
+    } else if (bvh_quality != "high") {
+        error("Unknown BVH quality '", bvh_quality, "'.");
+        return 1;
+    }
+
+    if (spectral && guiding) {
+        error("Path guiding is not supported in spectral mode.");
+        return 1;
+    }
+
+    auto sampler_type = SamplerType::Pcg;
+    if (sampler_name == "sobol") {
+        sampler_type = SamplerType::Sobol;
+    } else if (sampler_name != "pcg") {
+        error("Unknown sampler '", sampler_name, "'.");
+        return 1;
+    }
+
+    ExrOptions exr_options;
+    exr_options.half = exr_half;
+    exr_options.tile_size = exr_tile;
+    if (exr_compression == "zips") {
+        exr_options.compression = ExrCompression::Zips;
+    } else if (exr_compression == "zip") {
+        exr_options.compression = ExrCompression::Zip;
+    } else if (exr_compression == "piz") {
+        exr_options.compression = ExrCompression::Piz;
+    } else if (exr_compression != "none") {
+        error("Unknown EXR compression '", exr_compression, "'.");
+        return 1;
+    }
+    if (exr_options.tile_size > 0 && exr_options.compression == ExrCompression::Piz) {
+        error("Tiled EXR files cannot use PIZ compression.");
+        return 1;
+    }
+    if (partial) {
+        // Merging needs the exact sample counts and the noisy averages
+        if (output_image.rfind(".exr") != output_image.length() - 4 || exr_half) {
+            error("Partial renders must be saved as EXR files with single-precision floats.");
+            return 1;
+        }
+        if (denoise_image) {
+            error("Partial renders cannot be denoised, the merged image should be denoised instead.");
+            return 1;
+        }
+    }
+
+    bool replicate = numa_mode == "replicate";
+    if (!replicate && numa_mode != "none") {
+        error("Unknown NUMA policy '", numa_mode, "'.");
+        return 1;
+    }
+
+    // Replicas are only useful if every thread stays on its node
+    auto& thread_pool = ThreadPool::instance();
+    thread_pool.configure(num_threads, pin_threads || replicate);
+    info("Rendering with ", thread_pool.num_threads(), " thread(s).");
+
     Scene scene;
     scene.width = width;
     scene.height = height;
-    if (!load_scene(args[0], scene))
+    {
+        ProfileScope scope("load_scene");
+        if (!load_scene(args[0], scene, load_options))
+            return 1;
+    }
+    if (replicate) {
+        if (numa_nodes().size() == 1) {
+            warn("This machine has a single NUMA node, the BVH will not be replicated.");
+        } else if (auto n = scene.replicate_bvh()) {
+            info("BVH replicated on ", n, " NUMA nodes.");
+        } else {
+            warn("The BVH cannot be replicated (not supported with Embree).");
+        }
+    }
+    renderers.emplace_back(create_debug_renderer(scene));
+    renderers.emplace_back(create_pt_renderer(scene, 64, sampler_type, guiding, spectral));
+    renderers.emplace_back(create_wpt_renderer(scene));
+    renderers.emplace_back(create_bpt_renderer(scene));
+    renderers.emplace_back(create_ppm_renderer(scene));
+    renderers.emplace_back(create_sppm_renderer(scene));
+    renderers.emplace_back(create_restir_renderer(scene));
+
+    // The statistics are shared by all renderers, as only one of them renders at a time
+    std::unique_ptr<AdaptiveSampling> adaptive;
+    if (adaptive_threshold > 0.0f) {
+        adaptive = std::make_unique<AdaptiveSampling>(adaptive_threshold, adaptive_min_samples);
+        for (auto& renderer : renderers)
+            renderer->set_adaptive(adaptive.get());
+    } else if (convergence_map_file != "") {
+        warn("The convergence map requires adaptive sampling (--adaptive), it will not be saved.");
+    }
+
+    // The features of the first hits are needed by the denoiser, and are otherwise only written to EXR files
+    std::unique_ptr<FeatureBuffers> features;
+    PostProcessing post;
+    if (denoise_image || save_aovs) {
+        features = std::make_unique<FeatureBuffers>();
+        for (auto& renderer : renderers)
+            renderer->set_features(features.get());
+        post.features = features.get();
+        post.denoise = denoise_image;
+        post.save_aovs = save_aovs;
+    }
+
+    for (auto& renderer : renderers)
+        renderer->set_first_frame(first_sample);
+
+    if (batch_file != "") {
+        if (partial || first_sample != 0) {
+            error("Sample ranges and partial renders are not supported in batch mode.");
+            return 1;
+        }
+        // Batch mode is always headless, and the jobs get the settings of the command line by default
+        RenderJob defaults;
+        defaults.width   = width;
+        defaults.height  = height;
+        defaults.algo    = renderer_name;
+        defaults.samples = max_samples;
+        defaults.time    = max_time;
+        std::vector<RenderJob> jobs;
+        if (!load_jobs(batch_file, args[0], defaults, jobs))
+            return 1;
+        info("Rendering ", jobs.size(), " job(s) from '", batch_file, "'.");
+
+        double batch_time = 0;
+        bool ok = render_batch(scene, jobs, exr_options, adaptive.get(), post, batch_time);
+        if (tile_stats_file != "")
+            save_tile_stats(tile_stats_file);
+        save_stats(stats_file, trace_file, batch_time);
+        return ok ? 0 : 1;
+    }
+
+    size_t render_fn = find_renderer(renderer_name);
+    if (render_fn == renderers.size()) {
+        error("No renderer with name '", renderer_name, "'.");
         return 1;
+    }
+    if (adaptive && !renderers[render_fn]->supports_adaptive())
+        warn("The renderer '", renderer_name, "' does not support adaptive sampling, all tiles will be sampled.");
+    if (first_sample != 0 && !renderers[render_fn]->supports_sample_ranges())
+        warn("The samples of the renderer '", renderer_name, "' depend on the previous ones, the sample range will start at 0.");
+    if (features && !renderers[render_fn]->supports_features())
+        warn("The renderer '", renderer_name, "' does not write the albedo, normals and depth: they will be empty, and the denoiser will only use the colors.");
+
 #ifdef DISABLE_GUI
     info("Compiled with GUI disabled (DISABLE_GUI = ON).");
-    if (max_samples == 0) {
+    if (max_samples == 0 && max_time == 0.0) {
         info("Defaulting to 4 samples per pixel (use --samples or -s to change this value).");
         max_samples = 4;
     }
@@ -171,25 +608,16 @@ int main(int argc, char** argv) {
         error("Cannot initialize SDL.");
         return 1;
     }
-#endif
 
-    renderers.emplace_back(create_debug_renderer(scene));
-    renderers.emplace_back(create_pt_renderer(scene));
-    renderers.emplace_back(create_ppm_renderer(scene));
-
-    auto renderer_it = std::find_if(renderers.begin(), renderers.end(), [&] (const std::unique_ptr<Renderer>& renderer) {
-        return renderer_name == renderer->name();
-    });
-    if (renderer_it == renderers.end()) {
-        error("No renderer with name '", renderer_name, "'.");
-        return 1;
-    }
-    size_t render_fn = renderer_it - renderers.begin();
-
-#ifndef DISABLE_GUI
     SDL_Window* window = SDL_CreateWindow("arty", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, 0);
     SDL_Surface* screen = SDL_GetWindowSurface(window);
     SDL_FlushEvents(SDL_FIRSTEVENT, SDL_LASTEVENT);
+
+    // The conversion to the format of the window happens on the display thread, while the next frame renders
+    auto fmt = screen->format;
+    auto display = std::make_unique<DisplayThread>(PixelFormat {
+        fmt->Rshift, fmt->Gshift, fmt->Bshift, fmt->Ashift,
+        fmt->Rmask, fmt->Gmask, fmt->Bmask, fmt->Amask });
 #endif
 
     Image img(width, height);
@@ -208,21 +636,96 @@ int main(int argc, char** argv) {
     double total_time = 0;
     size_t total_frames = 0;
 
+    // Pixels of the tiles that were processed during the last frame, when it was interrupted by the deadline
+    std::vector<uint8_t> last_frame_mask;
+
+    // Checkpoints of the output image, written in the background while rendering continues
+    auto checkpoint_period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(checkpoint_interval));
+    auto next_checkpoint = std::chrono::steady_clock::now() + checkpoint_period;
+    std::future<bool> checkpoint;
+
+#ifndef DISABLE_GUI
+    // While the camera moves, frames are rendered at 1/scale of the resolution within the frame budget.
+    // When it stops, the resolution doubles every frame until the full-resolution accumulation resumes.
+    constexpr size_t max_preview_scale = 32;
+    Image preview(0, 0), preview_frame(width, height);
+    preview_frame.clear();
+    size_t motion_scale = std::min(std::max(preview_scale, size_t(1)), max_preview_scale);
+    size_t scale = motion_scale;
+    bool moving = false;
+#endif
+
     while (!done) {
         using namespace std::chrono;
 
+        bool previewing = false;
+#ifndef DISABLE_GUI
+        previewing = scale > 1;
+        if (previewing) {
+            // Preview frames are not accumulated, nor counted in the render time and samples.
+            // The renderer only restarts when the camera (or the renderer) changes, or when the preview is resized.
+            auto preview_width = (width + scale - 1) / scale, preview_height = (height + scale - 1) / scale;
+            bool restart = moving || preview.width != preview_width || preview.height != preview_height;
+            preview.resize(preview_width, preview_height);
+            preview.clear();
+            renderers[render_fn]->set_adaptive(nullptr);
+            renderers[render_fn]->set_features(nullptr);
+            if (restart)
+                renderers[render_fn]->reset();
+            auto start_preview = high_resolution_clock::now();
+            thread_pool.begin_frame();
+            thread_pool.set_deadline(ThreadPool::Clock::now() + duration_cast<ThreadPool::Clock::duration>(duration<double, std::milli>(frame_budget)));
+            {
+                ProfileScope scope("preview");
+                renderers[render_fn]->render(preview);
+            }
+            thread_pool.clear_deadline();
+            scene.textures.end_frame();
+            auto preview_time = duration<double, std::milli>(high_resolution_clock::now() - start_preview).count();
+            renderers[render_fn]->set_adaptive(adaptive.get());
+            renderers[render_fn]->set_features(features.get());
+
+            // Tiles that missed the deadline keep the content of the previous preview
+            upsample_preview(preview, thread_pool.last_run_complete() ? std::vector<uint8_t>() : finished_tiles_mask(preview.width, preview.height), scale, preview_frame);
+
+            if (moving) {
+                if (preview_time > frame_budget && motion_scale < max_preview_scale)
+                    motion_scale *= 2;
+                else if (preview_time * 4 < frame_budget && motion_scale > 2)
+                    motion_scale /= 2;
+                scale = motion_scale;
+            } else {
+                scale /= 2;
+            }
+        }
+#endif
+
 #ifndef NDEBUG
-        if (debug || (debug_xmin >= debug_xmax && debug_ymin >= debug_ymax)) {
+        if (!previewing && (debug || (debug_xmin >= debug_xmax && debug_ymin >= debug_ymax))) {
+#else
+        if (!previewing) {
 #endif
             if (accum++ == 0) {
                 renderers[render_fn]->reset();
                 total_time = 0;
                 total_frames = 0;
+                last_frame_mask.clear();
                 img.clear();
+                if (adaptive)
+                    adaptive->reset(img.width, img.height);
+                if (features)
+                    features->reset(img.width, img.height);
             }
 
             auto start_render = high_resolution_clock::now();
-            renderers[render_fn]->render(img);
+            thread_pool.begin_frame();
+            if (max_time != 0.0)
+                thread_pool.set_deadline(ThreadPool::Clock::now() + duration_cast<ThreadPool::Clock::duration>(duration<double>(max_time - total_time)));
+            {
+                ProfileScope scope("frame");
+                renderers[render_fn]->render(img);
+            }
+            scene.textures.end_frame();
             auto end_render = high_resolution_clock::now();
             auto render_time = duration_cast<milliseconds>(end_render - start_render).count();
             frame_time += render_time;
@@ -230,11 +733,17 @@ int main(int argc, char** argv) {
             frames++;
             total_frames++;
 
+            if (!thread_pool.last_run_complete()) {
+                // The deadline was reached in the middle of the frame: only the pixels of the finished tiles have one more sample
+                last_frame_mask = finished_tiles_mask(img.width, img.height);
+                done = true;
+            }
+
 #ifndef NDEBUG
             if (debug) info("Debug information dumped.");
             debug = false;
-        }
 #endif
+        }
 
         if (frames > 20 || (frames > 0 && frame_time > 5000)) {
             info("Average frame time: ", frame_time / frames, " ms.");
@@ -242,74 +751,113 @@ int main(int argc, char** argv) {
             frame_time = 0;
         }
 
-#ifndef DISABLE_GUI
-        if (SDL_MUSTLOCK(screen)) SDL_LockSurface(screen);
-        #pragma omp parallel for
-        for (size_t y = 0; y < img.height; y++) {
-            uint32_t* row = (uint32_t*)((uint8_t*)screen->pixels + screen->pitch * y);
-            for (size_t x = 0; x < img.width; x++) {
-                auto pix = gamma(img(x, y) / accum);
-                const uint8_t r = clamp(pix.x, 0.0f, 1.0f) * 255.0f;
-                const uint8_t g = clamp(pix.y, 0.0f, 1.0f) * 255.0f;
-                const uint8_t b = clamp(pix.z, 0.0f, 1.0f) * 255.0f;
-                const uint8_t a = clamp(pix.w, 0.0f, 1.0f) * 255.0f;
-                row[x] = ((r << screen->format->Rshift) & screen->format->Rmask) |
-                         ((g << screen->format->Gshift) & screen->format->Gmask) |
-                         ((b << screen->format->Bshift) & screen->format->Bmask) |
-                         ((a << screen->format->Ashift) & screen->format->Amask);
+        if (checkpoint_interval > 0.0 && output_image != "" && !done && !previewing && steady_clock::now() >= next_checkpoint) {
+            // A checkpoint is skipped if the previous one is still being written
+            if (!checkpoint.valid() || checkpoint.wait_for(seconds(0)) == std::future_status::ready) {
+                if (checkpoint.valid() && !checkpoint.get())
+                    error("Failed to save checkpoint to '", output_image, "'.");
+                Image snapshot(img.width, img.height);
+                for (size_t y = 0; y < img.height; y++) {
+                    for (size_t x = 0; x < img.width; x++)
+                        snapshot(x, y) = average(img, accum, last_frame_mask, x, y);
+                }
+                checkpoint = std::async(std::launch::async, [snapshot = std::move(snapshot), &output_image, &exr_options] () mutable {
+                    return save_image(output_image, snapshot, exr_options);
+                });
             }
+            next_checkpoint = steady_clock::now() + checkpoint_period;
         }
 
+#ifndef DISABLE_GUI
+        if (previewing)
+            display->publish(preview_frame, 1, {});
+        else
+            display->publish(img, accum, last_frame_mask);
+        display->consume([&] (const uint32_t* pixels, size_t frame_w, size_t frame_h) {
+            if (SDL_MUSTLOCK(screen)) SDL_LockSurface(screen);
+            for (size_t y = 0; y < frame_h; y++)
+                std::copy(pixels + y * frame_w, pixels + (y + 1) * frame_w, (uint32_t*)((uint8_t*)screen->pixels + screen->pitch * y));
+
 #ifndef NDEBUG
-        if (debug_xmin < debug_xmax && debug_ymin < debug_ymax) {
-            for (size_t y = std::max(0, debug_ymin), h = std::min(img.height, size_t(debug_ymax)); y < h; y++) {
-                uint32_t* row = (uint32_t*)((uint8_t*)screen->pixels + screen->pitch * y);
-                for (size_t x = std::max(0, debug_xmin), w = std::min(img.width, size_t(debug_xmax)); x < w; x++) {
-                const uint8_t r = row[x] & screen->format->Rmask;
-                const uint8_t g = row[x] & screen->format->Gmask;
-                const uint8_t b = row[x] & screen->format->Bmask;
-                const uint8_t a = row[x] & screen->format->Amask;
-                row[x] = (((r + 64) << screen->format->Rshift) & screen->format->Rmask) |
-                         (((g + 64) << screen->format->Gshift) & screen->format->Gmask) |
-                         (((b + 64) << screen->format->Bshift) & screen->format->Bmask) |
-                         (((a) << screen->format->Ashift) & screen->format->Amask);
+            if (debug_xmin < debug_xmax && debug_ymin < debug_ymax) {
+                for (size_t y = std::max(0, debug_ymin), h = std::min(img.height, size_t(debug_ymax)); y < h; y++) {
+                    uint32_t* row = (uint32_t*)((uint8_t*)screen->pixels + screen->pitch * y);
+                    for (size_t x = std::max(0, debug_xmin), w = std::min(img.width, size_t(debug_xmax)); x < w; x++) {
+                    const uint8_t r = row[x] & screen->format->Rmask;
+                    const uint8_t g = row[x] & screen->format->Gmask;
+                    const uint8_t b = row[x] & screen->format->Bmask;
+                    const uint8_t a = row[x] & screen->format->Amask;
+                    row[x] = (((r + 64) << screen->format->Rshift) & screen->format->Rmask) |
+                             (((g + 64) << screen->format->Gshift) & screen->format->Gmask) |
+                             (((b + 64) << screen->format->Bshift) & screen->format->Bmask) |
+                             (((a) << screen->format->Ashift) & screen->format->Amask);
+                    }
                 }
             }
-        }
 #endif
-        if (SDL_MUSTLOCK(screen)) SDL_UnlockSurface(screen);
-
-        SDL_UpdateWindowSurface(window);
-        done = handle_events(window, scene, render_fn, accum);
+            if (SDL_MUSTLOCK(screen)) SDL_UnlockSurface(screen);
+
+            SDL_UpdateWindowSurface(window);
+        });
+        moving = false;
+        done |= handle_events(window, scene, render_fn, moving);
+        if (moving) {
+            accum = 0;
+            scale = motion_scale;
+        }
 #endif
-        done |= max_samples != 0 && total_frames >= max_samples;
-        done |= max_time != 0.0  && total_time   >= max_time;
+        if (!previewing) {
+            done |= max_samples != 0 && total_frames >= max_samples;
+            done |= max_time != 0.0  && total_time   >= max_time;
+            done |= adaptive && renderers[render_fn]->supports_adaptive() && adaptive->converged();
+        }
     }
 
-    bool save_as_png = output_image.rfind(".png") == output_image.length() - 4;
-    bool save_as_exr = output_image.rfind(".exr") == output_image.length() - 4;
-    if (output_image != "" && !save_as_png && !save_as_exr) {
-        warn("Could not determine output file type from extension, using PNG");
-        save_as_png = true;
-    }
-    if (save_as_png) {
-        // Perform gamma correction before saving to disk
-        for (auto& pix : img.pixels) pix = gamma(pix / accum);
-        if (!save_png(output_image, img)) {
-            error("Failed to save image to '", output_image, "'.");
-            return 1;
+    if (adaptive) {
+        info(adaptive->num_converged_tiles(), "/", adaptive->num_tiles(), " tiles converged.");
+        // The map needs the sums of the frames, before they are averaged
+        if (convergence_map_file != "") {
+            if (!adaptive->save_map(convergence_map_file, img, accum))
+                error("Failed to save convergence map to '", convergence_map_file, "'.");
+            else
+                info("Convergence map saved to '", convergence_map_file, "'.");
         }
     }
-    if (save_as_exr) {
-        for (auto& pix : img.pixels) pix = pix / accum;
-        if (!save_exr(output_image, img)) {
+
+    // The final image replaces the last checkpoint
+    if (checkpoint.valid())
+        checkpoint.get();
+    if (output_image != "") {
+        // Partial renders store the number of samples of every pixel, which is needed to weight them when they are merged
+        Image sample_counts;
+        if (partial) {
+            sample_counts.resize(img.width, img.height);
+            for (size_t y = 0; y < img.height; y++) {
+                for (size_t x = 0; x < img.width; x++)
+                    sample_counts(x, y) = rgba(float(pixel_samples(img, accum, last_frame_mask, x, y)), 0.0f, 0.0f, 0.0f);
+            }
+        }
+        for (size_t y = 0; y < img.height; y++) {
+            for (size_t x = 0; x < img.width; x++)
+                img(x, y) = average(img, accum, last_frame_mask, x, y);
+        }
+        auto aovs = post_process(img, post);
+        auto extra_channels = aovs ? aovs->exr_channels() : std::vector<ExrChannel>();
+        if (partial)
+            extra_channels.push_back(ExrChannel { "samples", &sample_counts, 0 });
+        if (!save_image(output_image, img, exr_options, extra_channels)) {
             error("Failed to save image to '", output_image, "'.");
             return 1;
         }
+        info("Image saved to '", output_image, "' (", accum, " samples, ", total_time, " s).");
     }
-    info("Image saved to '", output_image, "' (", accum, " samples, ", total_time, " s).");
+
+    if (tile_stats_file != "")
+        save_tile_stats(tile_stats_file);
+    save_stats(stats_file, trace_file, total_time);
 
 #ifndef DISABLE_GUI
+    display.reset();
     SDL_DestroyWindow(window);
     SDL_Quit();
 #endif
@@ -0,0 +1,65 @@
+#include <fstream>
+#include <sys/stat.h>
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "mapped_file.h"
+
+bool MappedFile::open(const std::string& path, bool sequential) {
+    close();
+
+#ifdef __unix__
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        auto ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+            madvise(ptr, st.st_size, sequential ? MADV_SEQUENTIAL : MADV_WILLNEED);
+            data_ = static_cast<const char*>(ptr);
+            size_ = st.st_size;
+            mapped_ = true;
+            ::close(fd);
+            return true;
+        }
+    }
+    ::close(fd);
+#endif
+
+    // Fall back to reading the whole file in memory
+    std::ifstream stream(path, std::ios::binary | std::ios::ate);
+    if (!stream) return false;
+    buffer_.resize(stream.tellg());
+    stream.seekg(0);
+    if (!stream.read(buffer_.data(), buffer_.size())) {
+        buffer_.clear();
+        return false;
+    }
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+    return true;
+}
+
+void MappedFile::close() {
+#ifdef __unix__
+    if (mapped_) munmap(const_cast<char*>(data_), size_);
+#endif
+    buffer_.clear();
+    buffer_.shrink_to_fit();
+    data_ = nullptr;
+    size_ = 0;
+    mapped_ = false;
+}
+
+bool file_stamp(const std::string& path, FileStamp& stamp) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    stamp.size  = st.st_size;
+    stamp.mtime = st.st_mtime;
+    return true;
+}
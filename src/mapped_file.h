@@ -0,0 +1,47 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/// Read-only view of the contents of a file. The file is memory-mapped when the platform
+/// supports it, and is otherwise read into memory.
+class MappedFile {
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator = (const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    /// Opens the file at the given path, and returns false if it cannot be read.
+    /// The sequential flag tells the system that the file is going to be read from the beginning to the end,
+    /// otherwise the file is expected to be accessed randomly and is prefetched in the background.
+    bool open(const std::string& path, bool sequential = true);
+    /// Releases the mapping and the memory associated with the file.
+    void close();
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<char> buffer_;
+};
+
+/// Size and last modification time of a file, used to detect changes to the inputs of a cache.
+struct FileStamp {
+    uint64_t size = 0;
+    int64_t  mtime = 0;
+
+    bool operator == (const FileStamp& other) const { return size == other.size && mtime == other.mtime; }
+    bool operator != (const FileStamp& other) const { return !(*this == other); }
+};
+
+/// Gets the size and modification time of a file, returns false if the file does not exist.
+bool file_stamp(const std::string& path, FileStamp& stamp);
+
+#endif // MAPPED_FILE_H
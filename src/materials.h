@@ -1,10 +1,10 @@
 #ifndef MATERIALS_H
 #define MATERIALS_H
 
-#include <memory>
 #include <cassert>
 #include <cmath>
 #include <type_traits>
+#include <variant>
 
 #include "color.h"
 #include "float3.h"
@@ -27,24 +27,18 @@ struct SurfaceParams {
     bool entering;              ///< True if entering the surface
     float3 point;               ///< Hit point in world coordinates
     float2 uv;                  ///< Texture coordinates
+    float footprint;            ///< Approximate width of the ray footprint, in texture space
     float3 face_normal;         ///< Geometric normal
     LocalCoords coords;         ///< Local coordinates at the hit point, w.r.t shading normal
 };
 
 class Light;
-class Bsdf;
 
-/// A material is a combination of a BSDF and an optional light emitter.
-struct Material {
-    const Bsdf* bsdf;       /// BSDF associated with the material (if any)
-    const Light* emitter;   /// Light associated with the material (if any)
-
-    Material() {}
-    Material(const Bsdf* f = nullptr,
-             const Light* e = nullptr)
-        : bsdf(f)
-        , emitter(e)
-    {}
+/// Classification of BSDF shapes
+enum class BsdfType {
+    Diffuse  = 0,       ///< Mostly diffuse, i.e no major features, mostly uniform
+    Glossy   = 1,       ///< Mostly glossy, i.e hard for Photon Mapping
+    Specular = 2        ///< Purely specular, i.e merging/connections are not possible
 };
 
 /// Computes the adjoint ratio used to take non-symmetries coming from shading normals into account.
@@ -54,138 +48,164 @@ inline float shading_normal_adjoint(const float3& in, const SurfaceParams& surf,
     return d != 0 ? n / d : 0.0f;
 }
 
-/// Base class for BSDFs.
-class Bsdf {
-public:
-    /// Classification of BSDF shapes
-    enum class Type {
-        Diffuse  = 0,       ///< Mostly diffuse, i.e no major features, mostly uniform
-        Glossy   = 1,       ///< Mostly glossy, i.e hard for Photon Mapping
-        Specular = 2        ///< Purely specular, i.e merging/connections are not possible
-    };
-
-    Bsdf(Type ty)
-        : ty(ty)
-    {}
+/// Utility function to create a BsdfSample.
+/// It prevents corner cases that will cause issues (zero pdf, direction parallel/under the surface).
+/// When below_surface is true, it expects the direction to be under the surface, otherwise above.
+template <bool below_surface = false>
+inline BsdfSample make_bsdf_sample(const float3& dir, float pdf, const rgb& color, const SurfaceParams& surf) {
+    auto sign = dot(dir, surf.face_normal);
+    return pdf > 0 && ((below_surface && sign < 0) || (!below_surface && sign > 0))
+        ? BsdfSample(dir, pdf, color)
+        : BsdfSample(dir, 1.0f, rgb(0.0f));
+}
 
-    virtual ~Bsdf() {}
+// The BSDFs below are plain values, stored directly in the material table, and dispatched with a switch on their tag.
+// The sample functions take the sampler type as a template parameter, so that renderers can avoid the virtual Sampler calls.
 
-    /// Returns the type of the BSDF, useful to make sampling decisions.
-    Type type() const { return ty; }
+/// BSDF of materials that only absorb light (e.g. pure emitters).
+class BlackBsdf {
+public:
+    static constexpr BsdfType default_type = BsdfType::Diffuse;
 
-    /// Evaluates the material for the given pair of directions and surface point. Does NOT include the cosine term.
-    virtual rgb eval(const float3& /*in*/, const SurfaceParams& /*surf*/, const float3& /*out*/) const { return rgb(0.0f); }
-    /// Samples the material given a surface point and an outgoing direction. The contribution DOES include the cosine term.
-    virtual BsdfSample sample(Sampler& /*sampler*/, const SurfaceParams& surf, const float3& /*out*/, bool /*adjoint*/ = false) const {
+    rgb eval(const float3&, const SurfaceParams&, const float3&) const { return rgb(0.0f); }
+
+    template <typename S>
+    BsdfSample sample(S&, const SurfaceParams& surf, const float3&, bool) const {
         return BsdfSample(surf.face_normal, 1.0f, rgb(0.0f));
     }
-    /// Returns the probability to sample the given input direction (sampled using the sample function).
-    virtual float pdf(const float3& /*in*/, const SurfaceParams& /*surf*/, const float3& /*out*/) const { return 0.0f; }
 
-protected:
-    /// Utility function to create a MaterialSample.
-    /// It prevents corner cases that will cause issues (zero pdf, direction parallel/under the surface).
-    /// When below_surface is true, it expects the direction to be under the surface, otherwise above.
-    template <bool below_surface = false>
-    static BsdfSample make_sample(const float3& dir, float pdf, const rgb& color, const SurfaceParams& surf) {
-        auto sign = dot(dir, surf.face_normal);
-        return pdf > 0 && ((below_surface && sign < 0) || (!below_surface && sign > 0))
-            ? BsdfSample(dir, pdf, color)
-            : BsdfSample(dir, 1.0f, rgb(0.0f));
-    }
+    float pdf(const float3&, const SurfaceParams&, const float3&) const { return 0.0f; }
 
-    Type ty;
+    rgb albedo(const SurfaceParams&) const { return rgb(0.0f); }
 };
 
 /// Purely Lambertian material.
-class DiffuseBsdf : public Bsdf {
+class DiffuseBsdf {
 public:
+    static constexpr BsdfType default_type = BsdfType::Diffuse;
+
     DiffuseBsdf(const Texture& tex)
-        : Bsdf(Type::Diffuse)
-        , tex(tex)
+        : tex(tex)
     {}
 
-    rgb eval(const float3&, const SurfaceParams& surf, const float3&) const override final {
-        return tex(surf.uv.x, surf.uv.y) * kd;
+    rgb eval(const float3&, const SurfaceParams& surf, const float3&) const {
+        return tex(surf.uv.x, surf.uv.y, surf.footprint) * kd;
     }
 
-    BsdfSample sample(Sampler& sampler, const SurfaceParams& surf, const float3&, bool) const override final {
+    template <typename S>
+    BsdfSample sample(S& sampler, const SurfaceParams& surf, const float3&, bool) const {
         auto sample = sample_cosine_hemisphere(surf.coords, sampler(), sampler());
-        auto color = tex(surf.uv.x, surf.uv.y) * (std::max(dot(sample.dir, surf.coords.n), 0.0f) * kd);
-        return make_sample(sample.dir, sample.pdf, color, surf);
+        auto color = tex(surf.uv.x, surf.uv.y, surf.footprint) * (std::max(dot(sample.dir, surf.coords.n), 0.0f) * kd);
+        return make_bsdf_sample(sample.dir, sample.pdf, color, surf);
     }
 
-    float pdf(const float3& in, const SurfaceParams& surf, const float3&) const override final {
+    float pdf(const float3& in, const SurfaceParams& surf, const float3&) const {
         return cosine_hemisphere_pdf(std::max(dot(in, surf.coords.n), 0.0f));
     }
 
+    rgb albedo(const SurfaceParams& surf) const { return tex(surf.uv.x, surf.uv.y, surf.footprint); }
+
 private:
     static constexpr float kd = 1.0f / pi;
 
-    const Texture& tex;
+    Texture tex;
 };
 
 /// Specular part of the modified (physically correct) Phong.
-class GlossyPhongBsdf : public Bsdf {
+class GlossyPhongBsdf {
 public:
+    static constexpr BsdfType default_type = BsdfType::Glossy;
+
     GlossyPhongBsdf(const Texture& tex, float ns)
-        : Bsdf(Type::Glossy)
-        , tex(tex)
+        : tex(tex)
         , ns(ns)
         , ks((ns + 2) / (2.0f * pi))
     {}
 
-    rgb eval(const float3& in, const SurfaceParams& surf, const float3& out) const override final {
-        return tex(surf.uv.x, surf.uv.y) * std::pow(reflect_cosine(in, surf, out), ns) * ks;
+    rgb eval(const float3& in, const SurfaceParams& surf, const float3& out) const {
+        return tex(surf.uv.x, surf.uv.y, surf.footprint) * std::pow(reflect_cosine(in, surf, out), ns) * ks;
     }
 
-    BsdfSample sample(Sampler& sampler, const SurfaceParams& surf, const float3& out, bool) const override final {
+    template <typename S>
+    BsdfSample sample(S& sampler, const SurfaceParams& surf, const float3& out, bool) const {
         auto coords = gen_local_coords(reflect(out, surf.coords.n));
         auto sample = sample_cosine_power_hemisphere(coords, ns, sampler(), sampler());
         auto p = reflect_cosine(sample.dir, surf, out);
-        return make_sample(sample.dir, sample.pdf, tex(surf.uv.x, surf.uv.y) * (std::max(dot(sample.dir, surf.coords.n), 0.0f) * std::pow(p, ns) * ks), surf);
+        return make_bsdf_sample(sample.dir, sample.pdf, tex(surf.uv.x, surf.uv.y, surf.footprint) * (std::max(dot(sample.dir, surf.coords.n), 0.0f) * std::pow(p, ns) * ks), surf);
     }
 
-    float pdf(const float3& in, const SurfaceParams& surf, const float3& out) const override final {
+    float pdf(const float3& in, const SurfaceParams& surf, const float3& out) const {
         return cosine_power_hemisphere_pdf(reflect_cosine(in, surf, out), ns);
     }
 
+    rgb albedo(const SurfaceParams& surf) const { return tex(surf.uv.x, surf.uv.y, surf.footprint); }
+
 private:
     float reflect_cosine(const float3& in, const SurfaceParams& surf, const float3& out) const {
         return std::max(dot(in, reflect(out, surf.coords.n)), 0.0f);
     }
 
-    const Texture& tex;
+    Texture tex;
     float ns, ks;
 };
 
 /// Purely specular mirror.
-class MirrorBsdf : public Bsdf {
+class MirrorBsdf {
 public:
+    static constexpr BsdfType default_type = BsdfType::Specular;
+
     MirrorBsdf(const rgb& ks)
-        : Bsdf(Type::Specular)
-        , ks(ks)
+        : ks(ks)
     {}
 
-    BsdfSample sample(Sampler&, const SurfaceParams& surf, const float3& out, bool) const override final {
-        return make_sample(reflect(out, surf.coords.n), 1.0f, ks, surf);
+    rgb eval(const float3&, const SurfaceParams&, const float3&) const { return rgb(0.0f); }
+
+    template <typename S>
+    BsdfSample sample(S&, const SurfaceParams& surf, const float3& out, bool) const {
+        return make_bsdf_sample(reflect(out, surf.coords.n), 1.0f, ks, surf);
     }
 
+    float pdf(const float3&, const SurfaceParams&, const float3&) const { return 0.0f; }
+
+    rgb albedo(const SurfaceParams&) const { return ks; }
+
 private:
     rgb ks;
 };
 
 /// BSDF that can represent glass or any separation between two mediums.
-class GlassBsdf : public Bsdf {
+class GlassBsdf {
 public:
-    GlassBsdf(float n1 = 1.0f, float n2 = 1.4f, const rgb& ks = rgb(1.0f), const rgb& kt = rgb(1.0f))
-        : Bsdf(Type::Specular)
-        , eta(n1 / n2)
+    static constexpr BsdfType default_type = BsdfType::Specular;
+
+    /// Creates a glass BSDF between two media. The Abbe number of the inner medium gives its dispersion
+    /// (e.g. 64 for crown glass, 36 for flint glass), which is ignored outside of the spectral mode, or 0 for none.
+    GlassBsdf(float n1 = 1.0f, float n2 = 1.4f, const rgb& ks = rgb(1.0f), const rgb& kt = rgb(1.0f), float abbe = 0.0f)
+        : eta(n1 / n2)
+        , n1(n1)
+        , n2(n2)
         , ks(ks)
         , kt(kt)
-    {}
+    {
+        // Cauchy's equation n(lambda) = A + B / lambda^2, with n(587.6 nm) = n2, and the Abbe number (n_d - 1) / (n_F - n_C)
+        constexpr float lambda_f = 486.1f, lambda_c = 656.3f;
+        cauchy_b = abbe > 0.0f ? (n2 - 1.0f) / (abbe * (1.0f / (lambda_f * lambda_f) - 1.0f / (lambda_c * lambda_c))) : 0.0f;
+    }
 
-    BsdfSample sample(Sampler& sampler, const SurfaceParams& surf, const float3& out, bool adjoint) const override final {
+    bool dispersive() const { return cauchy_b > 0.0f; }
+
+    /// Returns the BSDF for light of the given wavelength (in nanometers).
+    GlassBsdf at_wavelength(float lambda) const {
+        constexpr float lambda_d = 587.6f;
+        auto copy = *this;
+        copy.eta = n1 / (n2 + cauchy_b * (1.0f / (lambda * lambda) - 1.0f / (lambda_d * lambda_d)));
+        return copy;
+    }
+
+    rgb eval(const float3&, const SurfaceParams&, const float3&) const { return rgb(0.0f); }
+
+    template <typename S>
+    BsdfSample sample(S& sampler, const SurfaceParams& surf, const float3& out, bool adjoint) const {
         auto k = surf.entering ? eta : 1.0f / eta;
         auto cos_i = dot(out, surf.coords.n);
         auto cos2_t = 1.0f - k * k * (1.0f - cos_i * cos_i);
@@ -196,14 +216,18 @@ public:
             if (sampler() > F) {
                 auto t = (k * cos_i - cos_t) * surf.coords.n - k * out;
                 auto adjoint_term = adjoint ? k * k : 1.0f;
-                return make_sample<true>(t, 1.0f, kt * adjoint_term, surf);
+                return make_bsdf_sample<true>(t, 1.0f, kt * adjoint_term, surf);
             }
         }
 
         // Reflection
-        return make_sample(reflect(out, surf.coords.n), 1.0f, ks, surf);
+        return make_bsdf_sample(reflect(out, surf.coords.n), 1.0f, ks, surf);
     }
 
+    float pdf(const float3&, const SurfaceParams&, const float3&) const { return 0.0f; }
+
+    rgb albedo(const SurfaceParams&) const { return kt; }
+
 private:
     /// Evaluates the fresnel factor given the ratio between two different media and the given cosines of the incoming/transmitted rays.
     static float fresnel_factor(float k, float cos_i, float cos_t) {
@@ -213,36 +237,110 @@ private:
     }
 
     float eta;
+    float n1, n2;
+    float cauchy_b;     ///< Coefficient B of Cauchy's equation, in nm^2
     rgb ks, kt;
 };
 
-/// A BSDF that combines two materials.
-class CombineBsdf : public Bsdf {
+/// A BSDF that combines a diffuse and a glossy lobe, which are stored in place.
+class CombineBsdf {
 public:
-    CombineBsdf(Type ty, const Bsdf* a, const Bsdf* b, float k)
-        : Bsdf(ty), a(a), b(b), k(k)
+    static constexpr BsdfType default_type = BsdfType::Diffuse;
+
+    CombineBsdf(const DiffuseBsdf& a, const GlossyPhongBsdf& b, float k)
+        : a(a), b(b), k(k)
     {}
 
-    rgb eval(const float3& in, const SurfaceParams& surf, const float3& out) const override final {
-        return lerp(a->eval(in, surf, out), b->eval(in, surf, out), k);
+    rgb eval(const float3& in, const SurfaceParams& surf, const float3& out) const {
+        return lerp(a.eval(in, surf, out), b.eval(in, surf, out), k);
     }
 
-    BsdfSample sample(Sampler& sampler, const SurfaceParams& surf, const float3& out, bool adjoint) const override final {
+    template <typename S>
+    BsdfSample sample(S& sampler, const SurfaceParams& surf, const float3& out, bool adjoint) const {
         auto use_b   = sampler() < k;
-        auto sample  = use_b ? b->sample(sampler, surf, out, adjoint) : a->sample(sampler, surf, out, adjoint);
+        auto sample  = use_b ? b.sample(sampler, surf, out, adjoint) : a.sample(sampler, surf, out, adjoint);
         auto cos     = fmaxf(dot(sample.in, surf.coords.n), 0.0f); // The contribution does include the cosine term, but eval() does not
-        sample.pdf   = lerp(use_b ? a->pdf (sample.in, surf, out)       : sample.pdf,   use_b ? sample.pdf   : b->pdf (sample.in, surf, out)      , k);
-        sample.color = lerp(use_b ? a->eval(sample.in, surf, out) * cos : sample.color, use_b ? sample.color : b->eval(sample.in, surf, out) * cos, k);
+        sample.pdf   = lerp(use_b ? a.pdf (sample.in, surf, out)       : sample.pdf,   use_b ? sample.pdf   : b.pdf (sample.in, surf, out)      , k);
+        sample.color = lerp(use_b ? a.eval(sample.in, surf, out) * cos : sample.color, use_b ? sample.color : b.eval(sample.in, surf, out) * cos, k);
         return sample;
     }
 
-    float pdf(const float3& in, const SurfaceParams& surf, const float3& out) const override final {
-        return lerp(a->pdf(in, surf, out), b->pdf(in, surf, out), k);
+    float pdf(const float3& in, const SurfaceParams& surf, const float3& out) const {
+        return lerp(a.pdf(in, surf, out), b.pdf(in, surf, out), k);
     }
 
+    rgb albedo(const SurfaceParams& surf) const { return lerp(a.albedo(surf), b.albedo(surf), k); }
+
 private:
-    std::unique_ptr<const Bsdf> a, b;
+    DiffuseBsdf a;
+    GlossyPhongBsdf b;
     float k;
 };
 
+/// Tagged union of all the BSDFs. Copyable, and small enough to be stored directly in the material table.
+class Bsdf {
+public:
+    using Type = BsdfType;
+
+    Bsdf()
+        : ty(Type::Diffuse), lobes(BlackBsdf())
+    {}
+
+    template <typename T>
+    Bsdf(const T& lobe, Type ty = T::default_type)
+        : ty(ty), lobes(lobe)
+    {}
+
+    /// Returns false for materials that absorb all the light (i.e. black bodies).
+    explicit operator bool () const { return !std::holds_alternative<BlackBsdf>(lobes); }
+
+    /// Returns the type of the BSDF, useful to make sampling decisions.
+    Type type() const { return ty; }
+
+    /// Evaluates the material for the given pair of directions and surface point. Does NOT include the cosine term.
+    rgb eval(const float3& in, const SurfaceParams& surf, const float3& out) const {
+        return std::visit([&] (auto& lobe) { return lobe.eval(in, surf, out); }, lobes);
+    }
+    /// Samples the material given a surface point and an outgoing direction. The contribution DOES include the cosine term.
+    template <typename S>
+    BsdfSample sample(S& sampler, const SurfaceParams& surf, const float3& out, bool adjoint = false) const {
+        return std::visit([&] (auto& lobe) { return lobe.sample(sampler, surf, out, adjoint); }, lobes);
+    }
+    /// Returns the probability to sample the given input direction (sampled using the sample function).
+    float pdf(const float3& in, const SurfaceParams& surf, const float3& out) const {
+        return std::visit([&] (auto& lobe) { return lobe.pdf(in, surf, out); }, lobes);
+    }
+    /// Returns true if the BSDF depends on the wavelength of the light (only in the spectral mode).
+    bool dispersive() const {
+        auto glass = std::get_if<GlassBsdf>(&lobes);
+        return glass && glass->dispersive();
+    }
+    /// Returns the BSDF for light of the given wavelength (in nanometers), which is a copy of this one unless it is dispersive.
+    Bsdf at_wavelength(float lambda) const {
+        auto glass = std::get_if<GlassBsdf>(&lobes);
+        return glass ? Bsdf(glass->at_wavelength(lambda), ty) : *this;
+    }
+    /// Returns the color of the material, independently of the lighting, as used by denoisers (the transmission color for glass).
+    rgb albedo(const SurfaceParams& surf) const {
+        return std::visit([&] (auto& lobe) { return lobe.albedo(surf); }, lobes);
+    }
+
+private:
+    Type ty;
+    std::variant<BlackBsdf, DiffuseBsdf, GlossyPhongBsdf, MirrorBsdf, GlassBsdf, CombineBsdf> lobes;
+};
+
+/// A material is a combination of a BSDF and an optional light emitter.
+/// Materials are plain records stored contiguously in the scene, with the BSDF in place.
+struct Material {
+    Bsdf bsdf;              ///< BSDF associated with the material (evaluates to false if there is none)
+    const Light* emitter;   ///< Light associated with the material (if any)
+
+    Material(const Bsdf& f = Bsdf(),
+             const Light* e = nullptr)
+        : bsdf(f)
+        , emitter(e)
+    {}
+};
+
 #endif // MATERIALS_H
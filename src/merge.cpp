@@ -0,0 +1,66 @@
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "options.h"
+#include "image.h"
+
+/// Merges partial renders of the same image, saved with --partial by renders of disjoint sample ranges.
+/// Every pixel is the average of the partial renders, weighted by their number of samples, and the
+/// merged image keeps the total number of samples, so that merged images can be merged again.
+int main(int argc, char** argv) {
+    ArgParser parser(argc, argv);
+
+    bool help;
+    std::string output_image;
+    parser.add_option("help",   "h", "Prints this message", help, false);
+    parser.add_option("output", "o", "Sets the output file name", output_image, std::string("merged.exr"), "file.exr");
+
+    parser.parse();
+    if (help) {
+        parser.usage();
+        return 0;
+    }
+
+    auto& args = parser.arguments();
+    if (args.empty()) {
+        parser.usage();
+        error("No partial render specified. Exiting.");
+        return 1;
+    }
+
+    Image sum, counts, img, samples;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (!load_exr(args[i], img) || !load_exr_channel(args[i], "samples", samples)) {
+            error("Cannot load partial render '", args[i], "' (partial renders are saved with --partial).");
+            return 1;
+        }
+        if (i == 0) {
+            sum.resize(img.width, img.height);
+            counts.resize(img.width, img.height);
+            sum.clear();
+            counts.clear();
+        } else if (img.width != sum.width || img.height != sum.height) {
+            error("The partial render '", args[i], "' does not have the size of '", args[0], "'.");
+            return 1;
+        }
+
+        for (size_t j = 0; j < img.pixels.size(); j++) {
+            auto n = samples.pixels[j].x;
+            sum.pixels[j] += img.pixels[j] * n;
+            counts.pixels[j].x += n;
+        }
+        info("Partial render '", args[i], "' merged.");
+    }
+
+    for (size_t j = 0; j < img.pixels.size(); j++) {
+        auto n = counts.pixels[j].x;
+        img.pixels[j] = n > 0.0f ? sum.pixels[j] / n : rgba(0.0f);
+    }
+    if (!save_exr(output_image, img, ExrOptions(), { ExrChannel { "samples", &counts, 0 } })) {
+        error("Failed to save image to '", output_image, "'.");
+        return 1;
+    }
+    info("Image saved to '", output_image, "'.");
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "numa.h"
+
+/// Parses a list of CPUs in the format of sysfs, e.g. "0-7,16-23".
+static std::vector<size_t> parse_cpu_list(const std::string& list) {
+    std::vector<size_t> cpus;
+    std::istringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        auto dash = range.find('-');
+        try {
+            auto first = std::stoul(range.substr(0, dash));
+            auto last  = dash != std::string::npos ? std::stoul(range.substr(dash + 1)) : first;
+            for (auto cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        } catch (const std::exception&) {
+            // Empty or malformed ranges (e.g. nodes without CPUs) are ignored
+        }
+    }
+    return cpus;
+}
+
+static std::vector<std::vector<size_t>> detect_numa_nodes() {
+    std::vector<std::vector<size_t>> nodes;
+#ifdef __linux__
+    // Node numbers can have gaps, but rarely large ones
+    for (size_t node = 0, missing = 0; missing < 16; node++) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!file || !std::getline(file, list)) {
+            missing++;
+            continue;
+        }
+        auto cpus = parse_cpu_list(list);
+        if (!cpus.empty())
+            nodes.push_back(std::move(cpus));
+    }
+#endif
+    if (nodes.empty()) {
+        nodes.emplace_back();
+        for (size_t cpu = 0, n = std::max(1u, std::thread::hardware_concurrency()); cpu < n; cpu++)
+            nodes.back().push_back(cpu);
+    }
+    return nodes;
+}
+
+const std::vector<std::vector<size_t>>& numa_nodes() {
+    static const auto nodes = detect_numa_nodes();
+    return nodes;
+}
+
+static thread_local size_t numa_node = 0;
+
+size_t current_numa_node() { return numa_node; }
+void set_numa_node(size_t node) { numa_node = node; }
+
+bool pin_thread(std::thread::native_handle_type handle, const std::vector<size_t>& cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus)
+        CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(handle, sizeof(set), &set) == 0;
+#else
+    (void)handle;
+    (void)cpus;
+    return false;
+#endif
+}
+
+void run_on_numa_node(size_t node, const std::function<void ()>& f) {
+    std::thread thread([&] {
+        // The thread pins itself, so that it is on the node before it touches any memory
+#ifdef __linux__
+        pin_thread(pthread_self(), numa_nodes()[node]);
+#endif
+        set_numa_node(node);
+        f();
+    });
+    thread.join();
+}
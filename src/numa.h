@@ -0,0 +1,24 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <vector>
+#include <thread>
+#include <functional>
+
+/// Returns the CPUs of each NUMA node of the machine, read from sysfs on Linux.
+/// Other platforms, and machines without NUMA, have a single node with all the CPUs.
+const std::vector<std::vector<size_t>>& numa_nodes();
+
+/// Returns the NUMA node of the calling thread, used to select the replicas of the scene data (0 unless set).
+size_t current_numa_node();
+/// Sets the NUMA node of the calling thread. Does not change the affinity of the thread.
+void set_numa_node(size_t node);
+
+/// Pins a thread to the given CPUs. Returns false if the affinity cannot be set (or on platforms other than Linux).
+bool pin_thread(std::thread::native_handle_type handle, const std::vector<size_t>& cpus);
+
+/// Runs a function on a temporary thread pinned to a NUMA node, and waits for it. With the first-touch
+/// policy of the operating system, the memory that the function allocates and fills is placed on that node.
+void run_on_numa_node(size_t node, const std::function<void ()>& f);
+
+#endif // NUMA_H
@@ -2,6 +2,7 @@
 #define PARALLEL_H
 
 #include <iterator>
+#include <atomic>
 
 #ifdef USE_STD_THREAD
 
@@ -45,7 +46,7 @@ private:
 
 template<typename Fn>
 void parallel_for(size_t from, size_t to, Fn fn) {
-    std::for_each(std::execution::par, RangeIter(0), RangeIter(to), [&](size_t i){ fn(i); });
+    std::for_each(std::execution::par, RangeIter(from), RangeIter(to), [&](size_t i){ fn(i); });
 }
 
 #else
@@ -58,4 +59,15 @@ void parallel_for(size_t from, size_t to, Fn fn) {
 
 #endif
 
+/// Atomically adds a value to a variable that is otherwise accessed without atomics (e.g. an element of a vector).
+template <typename T>
+inline void atomic_add(T& x, T value) {
+#ifdef USE_STD_THREAD
+    std::atomic_ref<T>(x).fetch_add(value);
+#else
+    #pragma omp atomic
+    x += value;
+#endif
+}
+
 #endif // PARALLEL_H
\ No newline at end of file
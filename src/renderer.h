@@ -3,9 +3,15 @@
 
 #include <memory>
 #include <string>
+#include <algorithm>
+
+#include "thread_pool.h"
+#include "samplers.h"
 
 struct Scene;
 struct Image;
+class AdaptiveSampling;
+struct FeatureBuffers;
 
 class Renderer {
 public:
@@ -13,51 +19,68 @@ public:
         : scene(scene)
     {}
 
+    virtual ~Renderer() {}
+
     virtual std::string name() const = 0;
     virtual void reset() = 0;
     virtual void render(Image& img) = 0;
 
+    /// Returns true if the renderer skips the converged tiles when adaptive sampling is enabled.
+    virtual bool supports_adaptive() const { return false; }
+    /// Enables adaptive sampling with the given statistics, or disables it if null. The statistics must be reset along with the renderer.
+    void set_adaptive(AdaptiveSampling* adaptive) { this->adaptive = adaptive; }
+
+    /// Returns true if the renderer writes the features of the first hits (albedo, normal, depth) when buffers are set.
+    virtual bool supports_features() const { return false; }
+    /// Enables the output of the features of the first hits, or disables it if null. The buffers must be reset along with the renderer.
+    void set_features(FeatureBuffers* features) { this->features = features; }
+
+    /// Returns true if the samples of a frame only depend on the index of the frame, so that disjoint ranges of frames
+    /// can be rendered by different processes and merged afterwards.
+    virtual bool supports_sample_ranges() const { return false; }
+    /// Sets the index of the first frame rendered after a reset. Only has an effect if sample ranges are supported.
+    void set_first_frame(size_t frame) { first_frame = frame; }
+
 protected:
     static constexpr float offset = 1e-3f;
     const Scene& scene;
+    AdaptiveSampling* adaptive = nullptr;
+    FeatureBuffers* features = nullptr;
+    size_t first_frame = 0;
 };
 
 static constexpr size_t default_tile_width  = 32;
 static constexpr size_t default_tile_height = 32;
 
-#ifdef USE_STD_THREAD
-
-#include "parallel.h"
+/// Size of the square blocks of pixels whose camera rays are traced together as one packet.
+static constexpr size_t packet_block_size = 4;
 
+/// Calls the given function on every pixel of a tile, block by block, so that consecutive pixels are close to each other.
 template <typename F>
-void process_tiles(size_t x, size_t y, size_t w, size_t h, size_t tile_w, size_t tile_h, F f) {
-    size_t cols = (w - x) / tile_w + ((w - x) % tile_w ? 1 : 0);
-    size_t rows = (h - y) / tile_h + ((h - y) % tile_h ? 1 : 0);
-    parallel_for(0, cols * rows,
-        [&](size_t pos){
-            size_t ystart = pos / cols * tile_h + y;
-            size_t xstart = pos % cols * tile_w + x;
-            f(xstart, ystart, std::min(xstart + tile_w, w), std::min(ystart + tile_h, h));
-        });
+void for_each_pixel_in_blocks(size_t xmin, size_t ymin, size_t xmax, size_t ymax, F f) {
+    for (size_t block_y = ymin; block_y < ymax; block_y += packet_block_size) {
+        for (size_t block_x = xmin; block_x < xmax; block_x += packet_block_size) {
+            for (size_t y = block_y; y < std::min(block_y + packet_block_size, ymax); y++) {
+                for (size_t x = block_x; x < std::min(block_x + packet_block_size, xmax); x++)
+                    f(x, y);
+            }
+        }
+    }
 }
 
-#else
-
+/// Renders the given region tile by tile, using the shared thread pool.
+/// Tiles are processed from the center of the region outwards, and are skipped once the pool deadline is reached.
 template <typename F>
 void process_tiles(size_t x, size_t y, size_t w, size_t h, size_t tile_w, size_t tile_h, F f) {
-    #pragma omp parallel for collapse(2) schedule(dynamic)
-    for (size_t tile_x = x; tile_x < w; tile_x += tile_w) {
-        for (size_t tile_y = y; tile_y < h; tile_y += tile_h) {
-            f(tile_x, tile_y, std::min(tile_x + tile_w, w), std::min(tile_y + tile_h, h));
-        }
-    }
+    ThreadPool::instance().run_tiles(x, y, w, h, tile_w, tile_h, f);
 }
 
-#endif
-
 std::unique_ptr<Renderer> create_debug_renderer(const Scene& scene);
-std::unique_ptr<Renderer> create_pt_renderer(const Scene& scene, size_t max_path_len = 64);
+std::unique_ptr<Renderer> create_pt_renderer(const Scene& scene, size_t max_path_len = 64, SamplerType sampler_type = SamplerType::Pcg, bool guiding = false, bool spectral = false);
+std::unique_ptr<Renderer> create_wpt_renderer(const Scene& scene, size_t max_path_len = 64);
 std::unique_ptr<Renderer> create_bpt_renderer(const Scene& scene, bool connect = true, bool light_tracing = true, size_t max_path_len = 64);
 std::unique_ptr<Renderer> create_ppm_renderer(const Scene& scene, size_t max_path_len = 64);
+std::unique_ptr<Renderer> create_sppm_renderer(const Scene& scene, size_t photons_per_pass = 0, size_t max_path_len = 64);
+std::unique_ptr<Renderer> create_restir_renderer(const Scene& scene, size_t num_candidates = 32, size_t num_neighbors = 5, bool temporal_reuse = true, size_t max_path_len = 64);
 
 #endif // RENDERER_H
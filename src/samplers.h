@@ -2,35 +2,142 @@
 #define SAMPLERS_H
 
 #include <cmath>
-#include <random>
+#include <array>
 
 #include "float3.h"
 #include "random.h"
 #include "common.h"
+#include "hash.h"
 
 /// Sampler object, used at the level of the integrator to control how the random number generation is done.
+/// Renderers that want to avoid the virtual call can take the concrete sampler type as a template parameter.
 class Sampler {
 public:
     virtual ~Sampler() {}
     virtual float operator () () = 0;
 };
 
-/// Uniform sampler, the easiest and most simple sampling method.
-class UniformSampler : public Sampler {
+/// Available sampler types, for the renderers that can be instantiated with several of them.
+enum class SamplerType {
+    Pcg,
+    Sobol
+};
+
+/// Converts the upper 24 bits of an integer into a float in [0, 1[.
+inline float bits_to_float01(uint32_t bits) {
+    return float(bits >> 8) * 0x1p-24f;
+}
+
+/// Stateless counter-based sampler: the i-th number is a hash of the seed and of i.
+/// Since the sequence only depends on the seed, it does not depend on the order in which pixels or paths are processed.
+class PcgSampler final : public Sampler {
 public:
-    UniformSampler() : uniform01(0, 1) {}
+    PcgSampler() : PcgSampler(0) {}
+    PcgSampler(uint32_t seed) : seed(seed), dim(0) {}
 
-    UniformSampler(uint32_t seed)
-        : UniformSampler()
-    {
-        rnd_gen.seed(seed);
+    float operator () () override final {
+        return bits_to_float01(pcg_hash(seed + (dim++) * 0x9E3779B9u));
     }
 
-    float operator () () override { return uniform01(rnd_gen); }
+private:
+    uint32_t seed;
+    uint32_t dim;
+};
+
+/// Owen-scrambled Sobol sampler, from "Practical Hash-based Owen Scrambling", Burley.
+/// The dimensions are padded by groups of 4, each group using an independently shuffled index.
+/// The sample index is the iteration count, so that the first N iterations form a stratified set of points.
+class SobolSampler final : public Sampler {
+public:
+    SobolSampler() : SobolSampler(0, 0) {}
+    SobolSampler(uint32_t seed, uint32_t index) : seed(seed), index(index), dim(0) {}
+
+    float operator () () override final {
+        if (dim % num_dims == 0) gen_point();
+        return bits_to_float01(point[dim++ % num_dims]);
+    }
 
 private:
-    std::mt19937 rnd_gen;
-    std::uniform_real_distribution<float> uniform01;
+    static constexpr size_t num_dims = 4;
+    using Directions = std::array<std::array<uint32_t, 32>, num_dims>;
+
+    /// Generates the direction numbers of the first 4 dimensions, with the parameters of Joe and Kuo.
+    static constexpr Directions gen_directions() {
+        constexpr uint32_t degrees[] = { 1, 2, 3 };
+        constexpr uint32_t coeffs[]  = { 0, 1, 1 };
+        constexpr uint32_t init[][3] = { { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+
+        Directions dirs {};
+        for (uint32_t i = 0; i < 32; ++i)
+            dirs[0][i] = 1u << (31 - i);
+        for (size_t d = 1; d < num_dims; ++d) {
+            auto s = degrees[d - 1], a = coeffs[d - 1];
+            auto& v = dirs[d];
+            for (uint32_t i = 0; i < s; ++i)
+                v[i] = init[d - 1][i] << (31 - i);
+            for (uint32_t i = s; i < 32; ++i) {
+                v[i] = v[i - s] ^ (v[i - s] >> s);
+                for (uint32_t k = 1; k < s; ++k)
+                    v[i] ^= ((a >> (s - 1 - k)) & 1) * v[i - k];
+            }
+        }
+        return dirs;
+    }
+
+    /// Generates the 4D point used for the next group of dimensions.
+    void gen_point() {
+        static constexpr Directions directions = gen_directions();
+        auto group_seed = pcg_hash(seed + (dim / num_dims) * 0x9E3779B9u);
+        auto i = nested_uniform_scramble(index, group_seed);
+        uint32_t x[num_dims] = {};
+        for (uint32_t bit = 0; i; i >>= 1, bit++) {
+            auto mask = 0u - (i & 1);
+            for (size_t d = 0; d < num_dims; ++d)
+                x[d] ^= directions[d][bit] & mask;
+        }
+        for (size_t d = 0; d < num_dims; ++d)
+            point[d] = nested_uniform_scramble(x[d], pcg_hash(group_seed + d));
+    }
+
+    static uint32_t reverse_bits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+        x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    /// Permutation where every bit only depends on the lower bits, from "Stratified Sampling for Stochastic Transparency", Laine and Karras.
+    static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+        x += seed;
+        x ^= x * 0x6C50B47Cu;
+        x ^= x * 0xB82F1E52u;
+        x ^= x * 0xC7AFE638u;
+        x ^= x * 0x8D22F6E6u;
+        return x;
+    }
+
+    static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+        return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+    }
+
+    uint32_t seed;
+    uint32_t index;
+    uint32_t dim;
+    uint32_t point[num_dims];
 };
 
+/// Creates the sampler of the given pixel (or path) for the given iteration, where iterations start at 1.
+template <typename S> S make_sampler(uint32_t pixel, uint32_t iter);
+
+template <>
+inline PcgSampler make_sampler<PcgSampler>(uint32_t pixel, uint32_t iter) {
+    return PcgSampler(sampler_seed(pixel, iter));
+}
+
+template <>
+inline SobolSampler make_sampler<SobolSampler>(uint32_t pixel, uint32_t iter) {
+    return SobolSampler(pcg_hash(pixel), iter - 1);
+}
+
 #endif // SAMPLERS_H
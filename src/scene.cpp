@@ -1,11 +1,20 @@
 #include <chrono>
+#include <thread>
 #include <fstream>
 #include <cassert>
+#include <cstring>
+#include <cstdio>
 
 #include <yaml-cpp/yaml.h>
 
 #include "scene.h"
 #include "load_obj.h"
+#include "mapped_file.h"
+#include "serialize.h"
+#include "hash.h"
+#include "arena.h"
+#include "parallel.h"
+#include "thread_pool.h"
 
 namespace YAML {
     static std::ostream& operator << (std::ostream& os, const YAML::Mark& mark) {
@@ -26,33 +35,73 @@ struct TriIdx {
     {}
 };
 
-struct HashIndex {
-    size_t operator () (const obj::Index& i) const {
-        unsigned h = 0, g;
-
-        h = (h << 4) + i.v;
-        g = h & 0xF0000000;
-        h = g ? (h ^ (g >> 24)) : h;
-        h &= ~g;
-
-        h = (h << 4) + i.t;
-        g = h & 0xF0000000;
-        h = g ? (h ^ (g >> 24)) : h;
-        h &= ~g;
-
-        h = (h << 4) + i.n;
-        g = h & 0xF0000000;
-        h = g ? (h ^ (g >> 24)) : h;
-        h &= ~g;
+/// Maps the vertex references of an OBJ object to the vertices of the mesh, in order of insertion.
+/// Uses open addressing with linear probing, which is much faster than a node-based hash map.
+class IndexMap {
+public:
+    IndexMap() : slots(min_capacity, -1) {}
+
+    /// Returns the vertex associated with the given reference, creating it if needed.
+    int insert(const obj::Index& idx) {
+        if (2 * (keys_.size() + 1) > slots.size()) grow();
+        auto mask = slots.size() - 1;
+        for (auto i = hash(idx) & mask; ; i = (i + 1) & mask) {
+            auto slot = slots[i];
+            if (slot < 0) {
+                slots[i] = keys_.size();
+                keys_.push_back(idx);
+                return slots[i];
+            }
+            auto& key = keys_[slot];
+            if (key.v == idx.v && key.t == idx.t && key.n == idx.n)
+                return slot;
+        }
+    }
 
+    /// Returns the references of each vertex, in order of creation.
+    const std::vector<obj::Index>& keys() const { return keys_; }
+    size_t size() const { return keys_.size(); }
+
+private:
+    static constexpr size_t min_capacity = 1024;
+
+    static size_t hash(const obj::Index& idx) {
+        // Mix the components with large odd constants, and finalize with the MurmurHash3 mixer
+        uint32_t h = uint32_t(idx.v) * 0x9E3779B1u ^ uint32_t(idx.t) * 0x85EBCA77u ^ uint32_t(idx.n) * 0xC2B2AE3Du;
+        h ^= h >> 16;
+        h *= 0x85EBCA6Bu;
+        h ^= h >> 13;
+        h *= 0xC2B2AE35u;
+        h ^= h >> 16;
         return h;
     }
-};
 
-struct CompareIndex {
-    bool operator () (const obj::Index& a, const obj::Index& b) const {
-        return a.v == b.v && a.t == b.t && a.n == b.n;
+    void grow() {
+        std::vector<int> new_slots(slots.size() * 2, -1);
+        auto mask = new_slots.size() - 1;
+        for (size_t k = 0; k < keys_.size(); k++) {
+            auto i = hash(keys_[k]) & mask;
+            while (new_slots[i] >= 0) i = (i + 1) & mask;
+            new_slots[i] = k;
+        }
+        std::swap(slots, new_slots);
     }
+
+    std::vector<int> slots;
+    std::vector<obj::Index> keys_;
+};
+
+/// Data needed to recreate the materials and lights of an OBJ mesh when its geometry is loaded from the scene cache.
+struct MeshInfo {
+    std::string file;                               ///< Path to the OBJ file
+    std::vector<std::string> mtl_libs;              ///< Paths to the MTL files
+    std::vector<std::string> materials;             ///< Material names referenced by the OBJ file
+
+    struct Light {
+        uint32_t tri;                               ///< Index of the emitting triangle in the scene
+        uint32_t material;                          ///< Index of the material of the triangle, before it was made emitting
+    };
+    std::vector<Light> lights;                      ///< Emitting triangles of the mesh, in order of creation
 };
 
 typedef std::unordered_map<std::string, int> TextureMap;
@@ -60,20 +109,21 @@ typedef std::unordered_map<std::string, int> TextureMap;
 static void compute_face_normals(const std::vector<uint32_t>& indices,
                                  const std::vector<float3>& vertices,
                                  std::vector<float3>& face_normals,
-                                 size_t first_index) {
-    for (auto i = first_index, k = indices.size(); i < k; i += 4) {
-        const float3& v0 = vertices[indices[i + 0]];
-        const float3& v1 = vertices[indices[i + 1]];
-        const float3& v2 = vertices[indices[i + 2]];
-        face_normals[i / 4] = normalize(cross(v1 - v0, v2 - v0));
-    }
+                                 size_t first_tri) {
+    parallel_for(first_tri, indices.size() / 4, [&] (size_t tri) {
+        const float3& v0 = vertices[indices[tri * 4 + 0]];
+        const float3& v1 = vertices[indices[tri * 4 + 1]];
+        const float3& v2 = vertices[indices[tri * 4 + 2]];
+        face_normals[tri] = normalize(cross(v1 - v0, v2 - v0));
+    });
 }
 
 static void recompute_normals(const std::vector<uint32_t>& indices,
                               const std::vector<float3>& face_normals,
                               std::vector<float3>& normals,
-                              size_t first_index) {
-    for (auto i = first_index, k = indices.size(); i < k; i += 4) {
+                              size_t first_index,
+                              size_t last_index) {
+    for (auto i = first_index; i < last_index; i += 4) {
         float3& n0 = normals[indices[i + 0]];
         float3& n1 = normals[indices[i + 1]];
         float3& n2 = normals[indices[i + 2]];
@@ -84,163 +134,196 @@ static void recompute_normals(const std::vector<uint32_t>& indices,
     }
 }
 
+/// Registers a texture in the texture cache. Textures are only decoded when they are first used.
 static int load_texture(const FilePath& path, TextureMap& tex_map, Scene& scene) {
     auto it = tex_map.find(path);
     if (it != tex_map.end())
         return it->second;
 
-    int id = -1;
-
-    Image img;
-    if (load_png(path, img) || load_tga(path, img) || load_jpeg(path, img) || load_tiff(path, img) || load_exr(path, img)) {
-        id = scene.textures.size();
-        assert(img.width * img.height > 0);
-        scene.textures.emplace_back(new ImageTexture(std::move(img)));
-    } else {
-        warn("Invalid PNG/TGA/JPEG/TIFF/EXR texture '", path.path(), "'.");
-    }
-
+    int id = scene.textures.add(path);
     tex_map[path] = id;
     return id;
 }
 
-static bool load_mesh(const std::string& file, TextureMap& tex_map, Scene& scene) {
-    FilePath path(file);
+/// Loads the MTL files of each mesh, in parallel. Returns, for each mesh, whether all its MTL files were loaded.
+static std::vector<bool> load_material_libs(const std::vector<MeshInfo>& meshes, std::vector<obj::MaterialLib>& mat_libs) {
+    std::vector<const std::string*> missing(meshes.size(), nullptr);
+    mat_libs.resize(meshes.size());
+    ThreadPool::instance().run_tasks(meshes.size(), [&] (size_t i, size_t) {
+        FilePath path(meshes[i].file);
+        for (auto& lib_file : meshes[i].mtl_libs) {
+            if (!load_mtl(path.base_name() + "/" + lib_file, mat_libs[i])) {
+                missing[i] = &lib_file;
+                break;
+            }
+        }
+    });
 
-    obj::File obj_file;
-    if (!load_obj(path, obj_file)) {
-        error("Cannot open OBJ file '", file, "'.");
-        return false;
+    std::vector<bool> loaded(meshes.size());
+    for (size_t i = 0; i < meshes.size(); i++) {
+        if (missing[i])
+            error("Cannot open MTL file '", *missing[i], "'.");
+        loaded[i] = !missing[i];
     }
+    return loaded;
+}
 
-    obj::MaterialLib mat_lib;
-    for (auto& lib_file : obj_file.mtl_libs) {
-        if (!load_mtl(path.base_name() + "/" + lib_file, mat_lib)) {
-            error("Cannot open MTL file '", lib_file, "'.");
-            return false;
+/// Loads the OBJ and MTL files of the given meshes, all in parallel, and fills their MTL files and material names.
+/// Returns, for each mesh, whether all its files were loaded.
+static std::vector<bool> parse_meshes(std::vector<MeshInfo>& meshes, std::vector<obj::File>& obj_files, std::vector<obj::MaterialLib>& mat_libs) {
+    std::vector<std::string> files(meshes.size());
+    for (size_t i = 0; i < meshes.size(); i++)
+        files[i] = meshes[i].file;
+    auto loaded = load_objs(files, obj_files);
+    for (size_t i = 0; i < meshes.size(); i++) {
+        if (!loaded[i]) {
+            error("Cannot open OBJ file '", meshes[i].file, "'.");
+            continue;
         }
+        meshes[i].mtl_libs  = obj_files[i].mtl_libs;
+        meshes[i].materials = obj_files[i].materials;
+    }
+
+    auto libs_loaded = load_material_libs(meshes, mat_libs);
+    for (size_t i = 0; i < meshes.size(); i++)
+        loaded[i] = loaded[i] && libs_loaded[i];
+    return loaded;
+}
+
+/// Creates the BSDF of an OBJ material, registering its textures.
+static Bsdf create_bsdf(const FilePath& path, const obj::Material& mat, TextureMap& tex_map, Scene& scene) {
+    switch (mat.illum) {
+        case 5: return MirrorBsdf(mat.ks);
+        case 7: return GlassBsdf(1.0f, mat.ni, mat.ks, mat.tf, mat.nv);
+        default: break;
     }
 
-    const int mtl_offset = scene.materials.size();
+    const ImageTexture* diff_tex = nullptr;
+    if (mat.map_kd != "") {
+        int id = load_texture(path.base_name() + "/" + mat.map_kd, tex_map, scene);
+        diff_tex = id >= 0 ? &scene.textures[id] : nullptr;
+    }
+
+    const ImageTexture* spec_tex = nullptr;
+    if (mat.map_ks != "") {
+        int id = load_texture(path.base_name() + "/" + mat.map_ks, tex_map, scene);
+        spec_tex = id >= 0 ? &scene.textures[id] : nullptr;
+    }
 
-    // Create a dummy constant texture color for incorrect texture references
-    auto dummy_tex  = new ConstantTexture(rgb(1.0f, 0.0f, 1.0f));
-    auto dummy_bsdf = new DiffuseBsdf(*dummy_tex);
+    auto kd = dot(mat.kd, luminance);
+    auto ks = dot(mat.ks, luminance);
+    bool has_diff = false, has_spec = false;
 
-    // Create one material for objects without materials
-    scene.textures.emplace_back(dummy_tex);
-    scene.bsdfs.emplace_back(dummy_bsdf);
+    if (ks > 0 || spec_tex) {
+        has_spec = true;
+        ks = ks == 0 ? 1.0f : ks;
+    }
+
+    if (kd > 0 || diff_tex) {
+        has_diff = true;
+        kd = kd == 0 ? 1.0f : kd;
+    }
+
+    // Constant colors are stored in the BSDF itself
+    DiffuseBsdf diff(diff_tex ? Texture(*diff_tex) : Texture(mat.kd));
+    GlossyPhongBsdf spec(spec_tex ? Texture(*spec_tex) : Texture(mat.ks), mat.ns);
+    if (has_spec && has_diff) {
+        auto k  = ks / (kd + ks);
+        auto ty = k < 0.2f || mat.ns < 10.0f // Approximate threshold
+            ? Bsdf::Type::Diffuse
+            : Bsdf::Type::Glossy;
+        return Bsdf(CombineBsdf(diff, spec, k), ty);
+    } else if (has_diff) {
+        return diff;
+    } else if (has_spec) {
+        return spec;
+    }
+    return Bsdf();
+}
+
+/// Creates the materials of an OBJ mesh, and returns the emission of each of them.
+static void load_materials(const FilePath& path, const MeshInfo& info, const obj::MaterialLib& mat_lib, TextureMap& tex_map, Scene& scene, int& mtl_offset, std::vector<rgb>& map_ke) {
+    mtl_offset = scene.materials.size();
+
+    // Create one material for objects without materials, with a dummy constant color
+    Bsdf dummy_bsdf(DiffuseBsdf(Texture(rgb(1.0f, 0.0f, 1.0f))));
     scene.materials.emplace_back(dummy_bsdf);
 
-    std::vector<rgb> map_ke(obj_file.materials.size(), rgb(0.0f));
+    map_ke.assign(info.materials.size(), rgb(0.0f));
 
     // Create the materials for this OBJ file
-    for (int i = 1, n = obj_file.materials.size(); i < n; i++) {
-        auto it = mat_lib.find(obj_file.materials[i]);
+    for (int i = 1, n = info.materials.size(); i < n; i++) {
+        auto it = mat_lib.find(info.materials[i]);
         if (it == mat_lib.end()) {
-            warn("Cannot find material '", obj_file.materials[i], "'.");
-            scene.materials.emplace_back(scene.bsdfs[0].get());
+            warn("Cannot find material '", info.materials[i], "'.");
+            scene.materials.emplace_back(dummy_bsdf);
             continue;
         }
 
         const obj::Material& mat = it->second;
+        map_ke[i] = mat.ke;
+        scene.materials.emplace_back(create_bsdf(path, mat, tex_map, scene));
+    }
+}
 
-        Bsdf* bsdf = nullptr;
-        map_ke[i]  = mat.ke;
-
-        switch (mat.illum) {
-            case 5: bsdf = new MirrorBsdf(mat.ks); break;
-            case 7: bsdf = new GlassBsdf(1.0f, mat.ni, mat.ks, mat.tf); break;
-            default:
-                Texture* diff_tex = nullptr;
-                if (mat.map_kd != "") {
-                    int id = load_texture(path.base_name() + "/" + mat.map_kd, tex_map, scene);
-                    diff_tex = id >= 0 ? scene.textures[id].get() : nullptr;
-                }
-
-                Texture* spec_tex = nullptr;
-                if (mat.map_ks != "") {
-                    int id = load_texture(path.base_name() + "/" + mat.map_ks, tex_map, scene);
-                    spec_tex = id >= 0 ? scene.textures[id].get() : nullptr;
-                }
-
-                auto kd = dot(mat.kd, luminance);
-                auto ks = dot(mat.ks, luminance);
-                Bsdf* diff = nullptr, *spec = nullptr;
-
-                if (ks > 0 || spec_tex) {
-                    if (!spec_tex) {
-                        scene.textures.emplace_back(new ConstantTexture(mat.ks));
-                        spec_tex = scene.textures.back().get();
-                    }
-                    spec = new GlossyPhongBsdf(*spec_tex, mat.ns);
-                    ks = ks == 0 ? 1.0f : ks;
-                }
-
-                if (kd > 0 || diff_tex) {
-                    if (!diff_tex) {
-                        scene.textures.emplace_back(new ConstantTexture(mat.kd));
-                        diff_tex = scene.textures.back().get();
-                    }
-                    diff = new DiffuseBsdf(*diff_tex);
-                    kd = kd == 0 ? 1.0f : kd;
-                }
+/// Adds a light for an emitting triangle of an OBJ mesh, and returns the index of the material to use for that triangle.
+static int add_triangle_light(Scene& scene, const float3& v0, const float3& v1, const float3& v2, const rgb& ke, int mtl_idx) {
+    scene.lights.emplace_back(new TriangleLight(v0, v1, v2, ke));
+    auto new_mtl_idx = scene.materials.size();
+    auto bsdf = scene.materials[mtl_idx].bsdf;
+    scene.materials.emplace_back(bsdf, scene.lights.back().get());
+    return new_mtl_idx;
+}
 
-                if (spec && diff) {
-                    auto k  = ks / (kd + ks);
-                    auto ty = k < 0.2f || mat.ns < 10.0f // Approximate threshold
-                        ? Bsdf::Type::Diffuse
-                        : Bsdf::Type::Glossy;
-                    bsdf = new CombineBsdf(ty, diff, spec, k);
-                } else {
-                    bsdf = diff ? diff : spec;
-                }
+/// Adds an OBJ mesh, loaded with parse_meshes(), to the scene. Emitting triangles are turned into lights, unless the mesh is instanced:
+/// a light has a single position, but the material of the triangles (and its light) would be shared by all the instances.
+static void load_mesh(const obj::File& obj_file, const obj::MaterialLib& mat_lib, TextureMap& tex_map, Scene& scene, MeshInfo& info, bool instanced = false) {
+    int mtl_offset;
+    std::vector<rgb> map_ke;
+    load_materials(FilePath(info.file), info, mat_lib, tex_map, scene, mtl_offset, map_ke);
+    if (instanced && std::any_of(map_ke.begin(), map_ke.end(), [] (const rgb& ke) { return lensqr(ke) > 0.0f; }))
+        warn("The instanced mesh '", info.file, "' has emitting materials, which are ignored.");
 
-                break;
-        }
-        scene.bsdfs.emplace_back(bsdf);
-        scene.materials.emplace_back(bsdf);
-    }
+    const size_t first_vertex = scene.vertices.size();
+    const size_t first_tri = scene.indices.size() / 4;
+    // Ranges of indices of the objects whose normals are recomputed, once the face normals of the mesh are known
+    std::vector<std::pair<size_t, size_t>> smoothed;
 
     for (auto& obj: obj_file.objects) {
         // Convert the faces to triangles & build the new list of indices
         std::vector<TriIdx> triangles;
-        std::unordered_map<obj::Index, int, HashIndex, CompareIndex> mapping;
+        std::vector<int> face_vertices;
+        IndexMap mapping;
 
         bool has_normals = false;
         bool has_texcoords = false;
         for (auto& group : obj.groups) {
             for (auto& face : group.faces) {
-                for (size_t i = 0; i < face.indices.size(); i++) {
-                    auto map = mapping.find(face.indices[i]);
-                    if (map == mapping.end()) {
-                        has_normals |= (face.indices[i].n != 0);
-                        has_texcoords |= (face.indices[i].t != 0);
-
-                        mapping.insert(std::make_pair(face.indices[i], mapping.size()));
-                    }
+                auto face_indices = obj_file.indices.data() + face.first_index;
+                face_vertices.resize(face.num_indices);
+                for (size_t i = 0; i < face.num_indices; i++) {
+                    has_normals |= (face_indices[i].n != 0);
+                    has_texcoords |= (face_indices[i].t != 0);
+                    face_vertices[i] = mapping.insert(face_indices[i]);
                 }
 
                 const int mtl_idx = face.material + mtl_offset;
-                const int v0 = mapping[face.indices[0]];
-                int prev = mapping[face.indices[1]];
+                const int v0 = face_vertices[0];
+                int prev = face_vertices[1];
 
-                for (size_t i = 1; i < face.indices.size() - 1; i++) {
-                    const int next = mapping[face.indices[i + 1]];
+                for (size_t i = 1; i < face.num_indices - 1; i++) {
+                    const int next = face_vertices[i + 1];
 
                     int new_mtl_idx = mtl_idx;
                     auto& ke = map_ke[mtl_idx - mtl_offset];
-                    if (lensqr(ke) > 0.0f) {
+                    if (!instanced && lensqr(ke) > 0.0f) {
                         // This triangle is a light
-                        scene.lights.emplace_back(
-                            new TriangleLight(obj_file.vertices[face.indices[0 + 0].v],
-                                              obj_file.vertices[face.indices[i + 0].v],
-                                              obj_file.vertices[face.indices[i + 1].v],
-                                              ke));
-                        new_mtl_idx = scene.materials.size();
-                        scene.materials.emplace_back(
-                            scene.materials[mtl_idx].bsdf,
-                            scene.lights.back().get());
+                        info.lights.push_back(MeshInfo::Light { uint32_t(scene.indices.size() / 4 + triangles.size()), uint32_t(mtl_idx) });
+                        new_mtl_idx = add_triangle_light(scene,
+                            obj_file.vertices[face_indices[0 + 0].v],
+                            obj_file.vertices[face_indices[i + 0].v],
+                            obj_file.vertices[face_indices[i + 1].v],
+                            ke, mtl_idx);
                     }
                     triangles.emplace_back(v0, prev, next, new_mtl_idx);
                     prev = next;
@@ -266,47 +349,202 @@ static bool load_mesh(const std::string& file, TextureMap& tex_map, Scene& scene
             scene.indices[idx_offset + i * 4 + 3] = t.m;
         }
 
-        for (auto& p : mapping) {
-            const auto& v = obj_file.vertices[p.first.v];
-            scene.vertices[vtx_offset + p.second].x = v.x;
-            scene.vertices[vtx_offset + p.second].y = v.y;
-            scene.vertices[vtx_offset + p.second].z = v.z;
-        }
+        auto& keys = mapping.keys();
+        for (size_t i = 0; i < keys.size(); i++)
+            scene.vertices[vtx_offset + i] = obj_file.vertices[keys[i].v];
 
         if (has_texcoords) {
-            for (auto& p : mapping) {
-                const auto& t = obj_file.texcoords[p.first.t];
-                scene.texcoords[vtx_offset + p.second] = t;
-            }
+            for (size_t i = 0; i < keys.size(); i++)
+                scene.texcoords[vtx_offset + i] = obj_file.texcoords[keys[i].t];
         } else std::fill(scene.texcoords.begin() + vtx_offset, scene.texcoords.end(), float2(0.0f));
 
-        // Compute the geometric normals for this mesh
-        scene.face_normals.resize(scene.face_normals.size() + triangles.size());
-        compute_face_normals(scene.indices, scene.vertices, scene.face_normals, idx_offset);
-
         if (has_normals) {
             // Set up mesh normals
-            for (auto& p : mapping) {
-                const auto& n = obj_file.normals[p.first.n];
-                scene.normals[vtx_offset + p.second] = n;
-            }
+            for (size_t i = 0; i < keys.size(); i++)
+                scene.normals[vtx_offset + i] = obj_file.normals[keys[i].n];
         } else {
-            // Recompute normals
             warn("No normals are present, recomputing smooth normals from geometry.");
             std::fill(scene.normals.begin() + vtx_offset, scene.normals.end(), float3(0.0f));
-            recompute_normals(scene.indices, scene.face_normals, scene.normals, idx_offset);
+            smoothed.emplace_back(idx_offset, scene.indices.size());
         }
     }
 
+    // Compute the geometric normals for this mesh, and use them to recompute the missing normals
+    scene.face_normals.resize(scene.indices.size() / 4);
+    compute_face_normals(scene.indices, scene.vertices, scene.face_normals, first_tri);
+    for (auto& range : smoothed)
+        recompute_normals(scene.indices, scene.face_normals, scene.normals, range.first, range.second);
+
     // Re-normalize all the values in the OBJ file to handle invalid meshes
-    for (auto& n : scene.normals) {
+    parallel_for(first_vertex, scene.normals.size(), [&] (size_t i) {
+        auto& n = scene.normals[i];
         auto len2 = lensqr(n);
         if (len2 == 0.0f || std::isnan(len2))
             n = float3(0.0f, 1.0f, 0.0f);
         else
             n *= 1.0f / std::sqrt(len2);
+    });
+}
+
+/// Header of the scene cache. The cache is only used if every field matches the current build and configuration.
+struct CacheHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t endianness;                ///< Written in native byte order, to detect caches created on machines with a different endianness
+    uint64_t config_hash;               ///< Hash of the contents of the YAML configuration file
+};
+
+static constexpr char     cache_magic[8]   = "ARTYSCN";
+static constexpr uint32_t cache_version    = 2;
+static constexpr uint32_t cache_endianness = 0x01020304;
+
+static CacheHeader cache_header(uint64_t config_hash) {
+    CacheHeader header;
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version     = cache_version;
+    header.endianness  = cache_endianness;
+    header.config_hash = config_hash;
+    return header;
+}
+
+static bool write_file_stamp(BinaryWriter& writer, const std::string& file) {
+    FileStamp stamp;
+    if (!file_stamp(file, stamp)) return false;
+    writer.write(stamp);
+    return true;
+}
+
+static bool check_file_stamp(BinaryReader& reader, const std::string& file) {
+    FileStamp stamp, cur_stamp;
+    return reader.read(stamp) && file_stamp(file, cur_stamp) && cur_stamp == stamp;
+}
+
+/// Writes the geometry of the OBJ meshes (the first num_verts vertices and num_tris triangles of the scene) to the scene cache.
+static bool write_scene_cache(const std::string& cache_file, const CacheHeader& header, const std::vector<MeshInfo>& meshes,
+                              const Scene& scene, size_t num_verts, size_t num_tris) {
+    // Write to a temporary file first, so that other processes never see a partially written cache
+    auto tmp_file = cache_file + ".tmp";
+    {
+        std::ofstream stream(tmp_file, std::ios::binary);
+        BinaryWriter writer(stream);
+        writer.write(header);
+        writer.write(uint64_t(meshes.size()));
+        bool ok = true;
+        for (auto& mesh : meshes) {
+            FilePath path(mesh.file);
+            ok &= write_file_stamp(writer, mesh.file);
+            writer.write(uint64_t(mesh.mtl_libs.size()));
+            for (auto& lib_file : mesh.mtl_libs) {
+                writer.write_string(lib_file);
+                ok &= write_file_stamp(writer, path.base_name() + "/" + lib_file);
+            }
+            writer.write(uint64_t(mesh.materials.size()));
+            for (auto& material : mesh.materials)
+                writer.write_string(material);
+            writer.write_array(mesh.lights.data(), mesh.lights.size());
+        }
+        writer.write_array(scene.vertices.data(),     num_verts);
+        writer.write_array(scene.texcoords.data(),    num_verts);
+        writer.write_array(scene.normals.data(),      num_verts);
+        writer.write_array(scene.indices.data(),      num_tris * 4);
+        writer.write_array(scene.face_normals.data(), num_tris);
+        if (!ok || !writer.ok()) {
+            stream.close();
+            std::remove(tmp_file.c_str());
+            return false;
+        }
+    }
+    return std::rename(tmp_file.c_str(), cache_file.c_str()) == 0;
+}
+
+/// Loads the geometry of the OBJ meshes from the scene cache, and recreates their materials and lights.
+/// Returns false and leaves the scene empty if the cache is missing or out of date.
+static bool load_scene_cache(const std::string& cache_file, const CacheHeader& header, const std::vector<std::string>& mesh_files, TextureMap& tex_map, Scene& scene) {
+    MappedFile file;
+    if (!file.open(cache_file))
+        return false;
+
+    BinaryReader reader(file.data(), file.size());
+    CacheHeader file_header;
+    if (!reader.read(file_header) || std::memcmp(&file_header, &header, sizeof(CacheHeader))) {
+        info("Scene cache '", cache_file, "' is out of date.");
+        return false;
+    }
+
+    uint64_t num_meshes = 0;
+    if (!reader.read(num_meshes) || num_meshes != mesh_files.size()) {
+        info("Scene cache '", cache_file, "' is out of date.");
+        return false;
+    }
+
+    std::vector<MeshInfo> meshes(mesh_files.size());
+    for (size_t i = 0; i < meshes.size(); i++) {
+        auto& mesh = meshes[i];
+        mesh.file = mesh_files[i];
+        FilePath path(mesh.file);
+        uint64_t num_libs = 0, num_materials = 0;
+        bool up_to_date = check_file_stamp(reader, mesh.file) && reader.read(num_libs);
+        mesh.mtl_libs.resize(std::min(num_libs, uint64_t(file.size())));
+        for (auto& lib_file : mesh.mtl_libs)
+            up_to_date &= reader.read_string(lib_file) && check_file_stamp(reader, path.base_name() + "/" + lib_file);
+        reader.read(num_materials);
+        mesh.materials.resize(std::min(num_materials, uint64_t(file.size())));
+        for (auto& material : mesh.materials)
+            reader.read_string(material);
+        reader.read_vector(mesh.lights);
+        if (!up_to_date) {
+            info("Scene cache '", cache_file, "' is out of date.");
+            return false;
+        }
+    }
+
+    reader.read_vector(scene.vertices);
+    reader.read_vector(scene.texcoords);
+    reader.read_vector(scene.normals);
+    reader.read_vector(scene.indices);
+    reader.read_vector(scene.face_normals);
+    bool ok = reader.ok() &&
+        scene.texcoords.size() == scene.vertices.size() &&
+        scene.normals.size() == scene.vertices.size() &&
+        scene.face_normals.size() * 4 == scene.indices.size();
+
+    // Recreate the materials and lights, in the same order as when loading the meshes
+    std::vector<obj::MaterialLib> mat_libs;
+    auto libs_loaded = ok ? load_material_libs(meshes, mat_libs) : std::vector<bool>();
+    for (size_t i = 0; ok && i < meshes.size(); i++) {
+        auto& mesh = meshes[i];
+        int mtl_offset;
+        std::vector<rgb> map_ke;
+        ok &= libs_loaded[i];
+        if (ok) load_materials(FilePath(mesh.file), mesh, mat_libs[i], tex_map, scene, mtl_offset, map_ke);
+        for (auto& light : mesh.lights) {
+            auto tri = light.tri;
+            if (!ok || tri >= scene.face_normals.size() || light.material < uint32_t(mtl_offset) || light.material - mtl_offset >= map_ke.size()) {
+                ok = false;
+                break;
+            }
+            auto mtl_idx = add_triangle_light(scene,
+                scene.vertices[scene.indices[tri * 4 + 0]],
+                scene.vertices[scene.indices[tri * 4 + 1]],
+                scene.vertices[scene.indices[tri * 4 + 2]],
+                map_ke[light.material - mtl_offset], light.material);
+            ok &= scene.indices[tri * 4 + 3] == uint32_t(mtl_idx);
+        }
     }
 
+    if (!ok) {
+        warn("Scene cache '", cache_file, "' is invalid.");
+        scene.vertices.clear();
+        scene.texcoords.clear();
+        scene.normals.clear();
+        scene.indices.clear();
+        scene.face_normals.clear();
+        scene.materials.clear();
+        scene.lights.clear();
+        scene.textures.clear();
+        tex_map.clear();
+        return false;
+    }
     return true;
 }
 
@@ -314,19 +552,23 @@ static float3 parse_float3(const YAML::Node& node) {
     return float3(node[0].as<float>(), node[1].as<float>(), node[2].as<float>());
 }
 
-static void setup_camera(Scene& scene, const YAML::Node& node) {
+static std::unique_ptr<Camera> parse_camera(const YAML::Node& node, size_t width, size_t height) {
     if (node.Tag() == "!perspective_camera") {
-        scene.camera.reset(new PerspectiveCamera(
+        return std::make_unique<PerspectiveCamera>(
             parse_float3(node["eye"]),
             parse_float3(node["center"]),
             parse_float3(node["up"]),
             node["fov"].as<float>(),
-            float(scene.width) / float(scene.height)));
+            float(width) / float(height));
     } else {
         throw YAML::Exception(node.Mark(), "unknown camera type");
     }
 }
 
+static void setup_camera(Scene& scene, const YAML::Node& node) {
+    scene.camera = parse_camera(node, scene.width, scene.height);
+}
+
 static void setup_light(Scene& scene, const YAML::Node& node) {
     if (node.Tag() == "!point_light") {
         scene.lights.emplace_back(new PointLight(
@@ -356,12 +598,104 @@ static void setup_light(Scene& scene, const YAML::Node& node) {
         uint32_t mat = scene.materials.size();
         scene.indices.insert(scene.indices.end(),
             {first, first + 1, first + 2, mat});
-        scene.materials.emplace_back(nullptr, scene.lights.back().get());
+        scene.materials.emplace_back(Bsdf(), scene.lights.back().get());
     } else {
         throw YAML::Exception(node.Mark(), "unknown light type");
     }
 }
 
+static Transform parse_transform(const YAML::Node& node) {
+    auto transform = Transform::identity();
+    if (auto scale = node["scale"])
+        transform = Transform::scaling(scale.IsSequence() ? parse_float3(scale) : float3(scale.as<float>()));
+    if (auto rotate = node["rotate"]) {
+        // Axis and angle in degrees
+        if (!rotate.IsSequence() || rotate.size() != 4)
+            throw YAML::Exception(rotate.Mark(), "rotations must be given as [x, y, z, angle]");
+        auto axis = float3(rotate[0].as<float>(), rotate[1].as<float>(), rotate[2].as<float>());
+        transform = Transform::rotation(normalize(axis), rotate[3].as<float>() * pi / 180.0f) * transform;
+    }
+    if (auto translate = node["translate"])
+        transform = Transform::translation(parse_float3(translate)) * transform;
+    return transform;
+}
+
+/// Adds an instance to the scene. The OBJ file of the instance is only loaded for its first instance.
+static void setup_instance(Scene& scene, const YAML::Node& node, const FilePath& config_path, TextureMap& tex_map) {
+    auto file = config_path.base_name() + "/" + node["mesh"].as<std::string>();
+    auto it = std::find_if(scene.instanced_meshes.begin(), scene.instanced_meshes.end(), [&] (auto& mesh) { return mesh->file == file; });
+    auto mesh_id = uint32_t(it - scene.instanced_meshes.begin());
+    if (it == scene.instanced_meshes.end()) {
+        auto mesh = std::make_unique<InstancedMesh>();
+        mesh->file = file;
+        mesh->first_tri = scene.indices.size() / 4;
+        std::vector<MeshInfo> info(1);
+        std::vector<obj::File> obj_files;
+        std::vector<obj::MaterialLib> mat_libs;
+        info[0].file = file;
+        if (!parse_meshes(info, obj_files, mat_libs)[0])
+            throw YAML::Exception(node.Mark(), "cannot load instanced mesh");
+        load_mesh(obj_files[0], mat_libs[0], tex_map, scene, info[0], true);
+        mesh->num_tris = scene.indices.size() / 4 - mesh->first_tri;
+        if (mesh->num_tris == 0)
+            throw YAML::Exception(node.Mark(), "instanced mesh has no triangles");
+        mesh->bbox = BBox::empty();
+        for (size_t i = mesh->first_tri * 4; i < scene.indices.size(); i++) {
+            if (i % 4 != 3)
+                mesh->bbox = extend(mesh->bbox, scene.vertices[scene.indices[i]]);
+        }
+        scene.instanced_meshes.emplace_back(std::move(mesh));
+    }
+
+    Instance instance;
+    instance.mesh = mesh_id;
+    scene.instances.push_back(instance);
+    scene.set_instance_transform(scene.instances.size() - 1, parse_transform(node));
+}
+
+bool Scene::update_instances() {
+    // Refitting keeps the tree, which degrades as instances move: past a point, a rebuild is cheaper than tracing rays through it
+    static constexpr float max_cost_ratio = 1.5f;
+
+    ArenaScope scope;
+    auto bboxes = scope.arena.alloc<BBox>(instances.size());
+    for (size_t i = 0; i < instances.size(); i++)
+        bboxes[i] = instances[i].bbox;
+    tlas.refit(bboxes);
+    if (tlas.cost() <= max_cost_ratio * tlas_build_cost)
+        return false;
+    tlas.build(bboxes, instances.size());
+    tlas_build_cost = tlas.cost();
+    return true;
+}
+
+size_t Scene::replicate_bvh() {
+    auto& nodes = numa_nodes();
+    unique_vector<Bvh> replicas(nodes.size());
+    bool copied = true;
+    for (size_t node = 0; node < nodes.size() && copied; node++) {
+        run_on_numa_node(node, [&] {
+            replicas[node].reset(new Bvh);
+            copied = replicas[node]->copy(bvh);
+        });
+    }
+    if (!copied) return 0;
+    bvh_replicas = std::move(replicas);
+    return bvh_replicas.size();
+}
+
+BBox Scene::bounds() const {
+    auto bbox = BBox::empty();
+    auto num_tris = instanced_meshes.empty() ? indices.size() / 4 : instanced_meshes[0]->first_tri;
+    for (size_t i = 0; i < num_tris * 4; i++) {
+        if (i % 4 != 3)
+            bbox = extend(bbox, vertices[indices[i]]);
+    }
+    for (auto& instance : instances)
+        bbox = extend(bbox, instance.bbox);
+    return bbox;
+}
+
 bool validate_scene(const Scene& scene) {
     if (scene.vertices.size() == 0) {
         error("There is no mesh in the scene.");
@@ -381,7 +715,7 @@ bool validate_scene(const Scene& scene) {
     return true;
 }
 
-bool load_scene(const std::string& config, Scene& scene) {
+bool load_scene(const std::string& config, Scene& scene, const LoadOptions& options) {
     using namespace std::chrono;
 
     if (!std::ifstream(config)) {
@@ -390,13 +724,50 @@ bool load_scene(const std::string& config, Scene& scene) {
     }
 
     auto start_load = high_resolution_clock::now();
+    auto cache_file = config + ".cache";
+    bool cached = false, cache_valid = options.use_cache;
+    size_t num_mesh_verts = 0, num_mesh_tris = 0;
+    size_t num_world_verts = 0, num_world_tris = 0;
+    std::vector<MeshInfo> meshes;
+    CacheHeader header;
     try {
+        if (options.use_cache) {
+            MappedFile config_file;
+            config_file.open(config);
+            header = cache_header(fnv64_hash(fnv64_init(), config_file.data(), config_file.size()));
+        }
+
         auto node = YAML::LoadFile(config);
+        scene.textures.set_budget(options.texture_cache_size);
         TextureMap tex_map;
         FilePath config_path(config);
-        for (const auto& mesh : node["meshes"]) load_mesh(config_path.base_name() + "/" + mesh.as<std::string>(), tex_map, scene);
+        std::vector<std::string> mesh_files;
+        for (const auto& mesh : node["meshes"]) mesh_files.push_back(config_path.base_name() + "/" + mesh.as<std::string>());
+        cached = options.use_cache && load_scene_cache(cache_file, header, mesh_files, tex_map, scene);
+        if (!cached) {
+            // The files are parsed in parallel, but the meshes are added to the scene in order, so that the result is deterministic
+            meshes.resize(mesh_files.size());
+            for (size_t i = 0; i < mesh_files.size(); i++)
+                meshes[i].file = mesh_files[i];
+            std::vector<obj::File> obj_files;
+            std::vector<obj::MaterialLib> mat_libs;
+            auto loaded = parse_meshes(meshes, obj_files, mat_libs);
+            for (size_t i = 0; i < mesh_files.size(); i++) {
+                cache_valid &= loaded[i];
+                if (loaded[i])
+                    load_mesh(obj_files[i], mat_libs[i], tex_map, scene, meshes[i]);
+                obj_files[i] = obj::File();
+            }
+        }
+        num_mesh_verts = scene.vertices.size();
+        num_mesh_tris  = scene.indices.size() / 4;
         for (const auto& light : node["lights"]) setup_light(scene, light);
+        // Instanced meshes are stored last, so that the other triangles form a contiguous range for the scene cache and the BVH
+        num_world_verts = scene.vertices.size();
+        num_world_tris  = scene.indices.size() / 4;
+        for (const auto& instance : node["instances"]) setup_instance(scene, instance, config_path, tex_map);
         setup_camera(scene, node["camera"]);
+        scene.update_pixel_spread();
     } catch (YAML::Exception& e) {
         error("Configuration error: ", e.msg, " ", e.mark);
         return false;
@@ -404,18 +775,135 @@ bool load_scene(const std::string& config, Scene& scene) {
     auto end_load = high_resolution_clock::now();
 
     if (!validate_scene(scene)) return false;
+    if (num_world_tris == 0) {
+        error("Instances need at least one mesh or triangle light that is not instanced in the scene.");
+        return false;
+    }
 
     int num_verts = scene.vertices.size();
     int num_tris  = scene.indices.size() / 4;
-    info("Scene loaded in ", duration_cast<milliseconds>(end_load - start_load).count(), " ms (",
-         num_verts, " vertices, ", num_tris, " triangles).");
+    info("Scene loaded", cached ? " from cache" : "", " in ", duration_cast<milliseconds>(end_load - start_load).count(), " ms (",
+         num_verts, " vertices, ", num_tris, " triangles, ", scene.textures.size(), " textures).");
+    if (!scene.instances.empty())
+        info(scene.instances.size(), " instance(s) of ", scene.instanced_meshes.size(), " mesh(es), with ", num_tris - num_world_tris, " instanced triangles.");
+
+    // Textures are decoded in the background, without delaying the construction of the BVH, which only needs the geometry
+    size_t num_prefetched = 0;
+    milliseconds prefetch_time(0);
+    std::thread prefetch_thread;
+    if (scene.textures.size() > 0) {
+        prefetch_thread = std::thread([&] {
+            auto start_textures = high_resolution_clock::now();
+            num_prefetched = scene.textures.prefetch();
+            prefetch_time = duration_cast<milliseconds>(high_resolution_clock::now() - start_textures);
+        });
+    }
 
-    // Build BVH
+    if (!cached && cache_valid) {
+        if (write_scene_cache(cache_file, header, meshes, scene, num_mesh_verts, num_mesh_tris))
+            info("Scene cache written to '", cache_file, "'.");
+        else
+            warn("Cannot write scene cache '", cache_file, "'.");
+    }
+
+    // Load the BVH from the disk if it matches the scene, otherwise build it
     auto start_bvh = high_resolution_clock::now();
-    scene.bvh.build(scene.vertices.data(), scene.indices.data(), num_tris);
-    auto end_bvh = high_resolution_clock::now();
-    info("BVH constructed in ", duration_cast<milliseconds>(end_bvh - start_bvh).count(), " ms (",
-         scene.bvh.node_count(), " nodes).");
+    auto bvh_layout = options.compact ? BvhLayout::Compact : BvhLayout::Standard;
+    auto bvh_file = config + (options.bvh_quality == BvhQuality::Fast ? ".fast" : "") + (options.compact ? ".compact" : "") + ".bvh";
+    auto bvh_key = options.use_cache ? Bvh::key(scene.vertices.data(), num_world_verts, scene.indices.data(), num_world_tris, options.bvh_quality, bvh_layout) : 0;
+    if (options.use_cache && scene.bvh.load(bvh_file, bvh_key, scene.vertices.data(), scene.indices.data())) {
+        auto end_bvh = high_resolution_clock::now();
+        info("BVH loaded from '", bvh_file, "' in ", duration_cast<milliseconds>(end_bvh - start_bvh).count(), " ms (",
+             scene.bvh.node_count(), " nodes).");
+    } else {
+        scene.bvh.build(scene.vertices.data(), scene.indices.data(), num_world_tris, options.bvh_quality, bvh_layout);
+        auto end_bvh = high_resolution_clock::now();
+        info("BVH constructed in ", duration_cast<milliseconds>(end_bvh - start_bvh).count(), " ms (",
+             scene.bvh.node_count(), " nodes, ", options.bvh_quality == BvhQuality::Fast ? "fast" : "high quality", " builder).");
+
+        if (options.use_cache && !scene.bvh.save(bvh_file, bvh_key))
+            warn("Cannot save BVH to '", bvh_file, "'.");
+    }
+
+    if (!scene.instances.empty()) {
+        // Each instanced mesh has its own BVH, in object space, and the top-level BVH places them in the scene
+        auto start_instances = high_resolution_clock::now();
+        for (auto& mesh : scene.instanced_meshes)
+            mesh->bvh.build(scene.vertices.data(), scene.indices.data() + mesh->first_tri * 4, mesh->num_tris, options.bvh_quality, bvh_layout);
+        std::vector<BBox> bboxes(scene.instances.size());
+        for (size_t i = 0; i < scene.instances.size(); i++)
+            bboxes[i] = scene.instances[i].bbox;
+        scene.tlas.build(bboxes.data(), bboxes.size());
+        scene.tlas_build_cost = scene.tlas.cost();
+        auto end_instances = high_resolution_clock::now();
+        info("Instance BVHs constructed in ", duration_cast<milliseconds>(end_instances - start_instances).count(), " ms.");
+    }
 
+    if (options.compact) {
+        // Quantize the shading data, face normals are recomputed from the vertices when needed
+        scene.packed_normals.resize(num_verts);
+        scene.packed_texcoords.resize(num_verts);
+        for (int i = 0; i < num_verts; i++) {
+            scene.packed_normals[i]   = pack_unit_vector(scene.normals[i]);
+            scene.packed_texcoords[i] = pack_half2(scene.texcoords[i]);
+        }
+        scene.normals      = std::vector<float3>();
+        scene.texcoords    = std::vector<float2>();
+        scene.face_normals = std::vector<float3>();
+        scene.compact = true;
+    }
+
+    // Build the light sampling structures
+    auto start_lights = high_resolution_clock::now();
+    scene.light_sampler.build(scene.lights);
+    auto end_lights = high_resolution_clock::now();
+    info("Light tree constructed in ", duration_cast<milliseconds>(end_lights - start_lights).count(), " ms (",
+         scene.lights.size(), " lights, ", scene.light_sampler.node_count(), " nodes).");
+
+    if (prefetch_thread.joinable()) {
+        prefetch_thread.join();
+        info("Textures decoded in ", prefetch_time.count(), " ms, during the construction of the BVH (",
+             num_prefetched, " of ", scene.textures.size(), " textures, ", scene.textures.resident_size() >> 20, " MB).");
+    }
+
+    return true;
+}
+
+bool load_jobs(const std::string& file, const std::string& config, const RenderJob& defaults, std::vector<RenderJob>& jobs) {
+    if (!std::ifstream(file)) {
+        error("The job file '", file, "' cannot be opened.");
+        return false;
+    }
+
+    try {
+        auto scene_camera = YAML::LoadFile(config)["camera"];
+        auto node = YAML::LoadFile(file);
+        for (const auto& job_node : node["jobs"]) {
+            RenderJob job;
+            job.width   = job_node["width"]   ? job_node["width"].as<size_t>()        : defaults.width;
+            job.height  = job_node["height"]  ? job_node["height"].as<size_t>()       : defaults.height;
+            job.algo    = job_node["algo"]    ? job_node["algo"].as<std::string>()    : defaults.algo;
+            job.samples = job_node["samples"] ? job_node["samples"].as<size_t>()      : defaults.samples;
+            job.time    = job_node["time"]    ? job_node["time"].as<double>()         : defaults.time;
+            if (!job_node["output"])
+                throw YAML::Exception(job_node.Mark(), "missing output file");
+            job.output  = job_node["output"].as<std::string>();
+            if (job.width == 0 || job.height == 0)
+                throw YAML::Exception(job_node.Mark(), "invalid resolution");
+            // Like on the command line, jobs without any limit get 4 samples per pixel
+            if (job.samples == 0 && job.time == 0.0)
+                job.samples = 4;
+            job.camera = parse_camera(job_node["camera"] ? job_node["camera"] : scene_camera, job.width, job.height);
+            jobs.emplace_back(std::move(job));
+        }
+    } catch (YAML::Exception& e) {
+        error("Job file error: ", e.msg, " ", e.mark);
+        return false;
+    }
+
+    if (jobs.empty()) {
+        error("There are no jobs in '", file, "'.");
+        return false;
+    }
     return true;
 }
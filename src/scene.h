@@ -4,14 +4,25 @@
 #include <vector>
 #include <memory>
 #include <string>
+#include <algorithm>
 
 #include "lights.h"
+#include "light_sampler.h"
 #include "materials.h"
 #include "cameras.h"
 #include "textures.h"
 #include "float3.h"
 #include "float2.h"
 #include "bvh.h"
+#include "instances.h"
+#include "stats.h"
+#include "numa.h"
+
+/// Triangle that blocked the previous shadow ray of a thread. Shadow rays from nearby points towards the same
+/// light are often blocked by the same triangle, which is then tested before traversing the BVH.
+struct OccluderCache {
+    int32_t tri = -1;   ///< Triangle that is not instanced, or -1
+};
 
 struct Scene {
     template <typename T>
@@ -20,15 +31,52 @@ struct Scene {
     // Camera and viewport
     std::unique_ptr<Camera>     camera;
     size_t                      width, height;
+    float                       pixel_spread = 0.0f;    ///< Angle covered by one pixel at the center of the image, in radians
+
+    /// Updates the pixel spread, after the camera or the viewport has changed.
+    void update_pixel_spread() {
+        // The area of a pixel (relative to the image plane) gives the spread of the ray cones used for texture filtering
+        pixel_spread = 1.0f / std::sqrt(camera->geometry(0.0f, 0.0f).area * width * height);
+    }
 
     // Shading data
-    unique_vector<Bsdf>         bsdfs;
     unique_vector<Light>        lights;
-    unique_vector<Texture>      textures;
-    std::vector<Material>       materials;
+    TextureCache                textures;
+    std::vector<Material>       materials;      ///< Material table, with the BSDFs stored in place
+    LightSampler                light_sampler;
 
     // Traversal data
-    Bvh                         bvh;
+    Bvh                         bvh;            ///< BVH of the triangles that are not instanced, in world space
+    unique_vector<Bvh>          bvh_replicas;   ///< Copies of the BVH placed on every NUMA node, empty unless replicated
+
+    /// Copies the BVH on every NUMA node, so that the rendering threads of a node traverse a BVH in local memory.
+    /// The threads must be pinned to their node (see ThreadPool). Returns the number of replicas, 0 if the BVH cannot be copied.
+    size_t replicate_bvh();
+
+    /// Returns the BVH replica of the NUMA node of the calling thread, or the BVH if it is not replicated.
+    const Bvh& local_bvh() const {
+        return bvh_replicas.empty() ? bvh : *bvh_replicas[current_numa_node()];
+    }
+
+    // Instanced meshes, whose triangles are stored after the others, in object space
+    unique_vector<InstancedMesh> instanced_meshes;
+    std::vector<Instance>       instances;
+    TopLevelBvh                 tlas;
+    float                       tlas_build_cost = 0.0f;     ///< SAH cost of the top-level BVH when it was last built
+
+    /// Moves an instance. The top-level BVH is only updated by update_instances().
+    void set_instance_transform(size_t i, const Transform& to_world) {
+        instances[i].to_world  = to_world;
+        instances[i].to_object = to_world.inverse();
+        instances[i].bbox      = transform_bbox(to_world, instanced_meshes[instances[i].mesh]->bbox);
+    }
+
+    /// Refits the top-level BVH after instances have moved, and rebuilds it if refitting degraded it too much.
+    /// Returns true if the BVH was rebuilt.
+    bool update_instances();
+
+    /// Returns the bounding box of the scene, including the instances.
+    BBox bounds() const;
 
     // Mesh data
     std::vector<float3>         vertices;
@@ -38,27 +86,169 @@ struct Scene {
 
     std::vector<float3>         face_normals;
 
+    // Compact mesh data, replacing the normals, texture coordinates, and face normals when set
+    bool                        compact = false;
+    std::vector<uint32_t>       packed_normals;     ///< Octahedral-encoded normals
+    std::vector<uint32_t>       packed_texcoords;   ///< Texture coordinates, as pairs of half-precision floats
+
+    /// Returns the normal of the given vertex.
+    float3 normal(uint32_t i) const {
+        return compact ? unpack_unit_vector(packed_normals[i]) : normals[i];
+    }
+
+    /// Returns the texture coordinates of the given vertex.
+    float2 texcoord(uint32_t i) const {
+        return compact ? unpack_half2(packed_texcoords[i]) : texcoords[i];
+    }
+
+    /// Returns the geometric normal of the given triangle.
+    float3 face_normal(int tri) const {
+        if (!compact) return face_normals[tri];
+        auto& v0 = vertices[indices[tri * 4 + 0]];
+        auto& v1 = vertices[indices[tri * 4 + 1]];
+        auto& v2 = vertices[indices[tri * 4 + 2]];
+        return normalize(cross(v1 - v0, v2 - v0));
+    }
+
     /// Returns the intersection point between a ray and the scene.
-    /// If not intersection is found, hit.tri == -1.
-    Hit intersect(const Ray& ray) const {
+    /// If not intersection is found, hit.tri == -1. The stage of the ray is only used by the performance counters.
+    Hit intersect(const Ray& ray, RayStage stage = RayStage::Bounce) const {
+        Stats::count_rays(stage, 1);
         Hit hit;
-        bvh.traverse(ray, hit);
+        local_bvh().traverse(ray, hit);
+        if (!instances.empty())
+            intersect_instances(ray, hit);
         return hit;
     }
 
     /// Returns true if the given ray hits the scene.
     bool occluded(const Ray& ray) const {
+        Stats::count_rays(RayStage::Shadow, 1);
         Hit hit;
-        bvh.traverse<true>(ray, hit);
+        local_bvh().traverse<true>(ray, hit);
+        if (hit.tri < 0 && !instances.empty())
+            intersect_instances<true>(ray, hit);
         return hit.tri >= 0;
     }
 
+    /// Returns true if the given ray hits the scene, testing the triangle of the cache first, and updating the cache.
+    bool occluded(const Ray& ray, OccluderCache& cache) const {
+        Stats::count_rays(RayStage::Shadow, 1);
+        if (hits_occluder(ray, cache))
+            return true;
+        Hit hit;
+        local_bvh().traverse<true>(ray, hit);
+        if (hit.tri < 0 && !instances.empty())
+            intersect_instances<true>(ray, hit);
+        if (hit.tri >= 0 && hit.inst < 0)
+            cache.tri = hit.tri;
+        return hit.tri >= 0;
+    }
+
+    /// Returns true if the ray hits the triangle of the cache.
+    bool hits_occluder(const Ray& ray, const OccluderCache& cache) const {
+        if (cache.tri < 0)
+            return false;
+        PrecomputedTri tri(
+            vertices[indices[cache.tri * 4 + 0]],
+            vertices[indices[cache.tri * 4 + 1]],
+            vertices[indices[cache.tri * 4 + 2]]);
+        float t = ray.tmax, u, v;
+        return intersect_ray_tri(ray, tri, t, u, v);
+    }
+
+    /// Looks for an intersection with the instances that is closer than the given hit, and replaces the hit if there is one.
+    /// The ray is transformed into the space of each instance whose bounding box it hits, and traverses the BVH of its mesh.
+    template <bool any = false>
+    void intersect_instances(const Ray& ray, Hit& hit) const {
+        tlas.traverse(ray, hit.tri >= 0 ? hit.t : ray.tmax, [&] (uint32_t i, float& tmax) {
+            auto& instance = instances[i];
+            auto& mesh = *instanced_meshes[instance.mesh];
+            // The direction is not normalized, so that the distances along the ray are the same in both spaces
+            Ray local_ray(instance.to_object.point(ray.org), instance.to_object.vector(ray.dir), ray.tmin, tmax);
+            Hit local_hit;
+            mesh.bvh.traverse<any>(local_ray, local_hit);
+            if (local_hit.tri < 0)
+                return false;
+            hit = Hit(local_hit.tri + mesh.first_tri, local_hit.t, local_hit.u, local_hit.v, i);
+            tmax = local_hit.t;
+            return any;
+        });
+    }
+
+    /// Intersects a batch of rays with the scene. Coherent rays (e.g. camera rays of a tile) should be stored next to each other.
+    void intersect_stream(const Ray* rays, Hit* hits, size_t count, RayStage stage = RayStage::Primary) const {
+        Stats::count_rays(stage, count);
+        local_bvh().traverse_packet(rays, hits, count);
+        if (!instances.empty()) {
+            for (size_t i = 0; i < count; i++)
+                intersect_instances(rays[i], hits[i]);
+        }
+    }
+
+    /// Tests a batch of rays for occlusion, typically shadow rays. Sets occluded[i] to true if rays[i] hits the scene.
+    /// The rays that miss the triangle of the cache are traversed in packets, and the cache keeps the last occluder found.
+    void occluded_stream(const Ray* rays, bool* occluded, size_t count, OccluderCache& cache) const {
+        Stats::count_rays(RayStage::Shadow, count);
+        auto& bvh = local_bvh();
+        Ray misses[Bvh::packet_size];
+        size_t ids[Bvh::packet_size];
+        Hit hits[Bvh::packet_size];
+        size_t n = 0;
+        auto trace_misses = [&] {
+            bvh.traverse_packet<true>(misses, hits, n);
+            for (size_t j = 0; j < n; j++) {
+                if (hits[j].tri < 0 && !instances.empty())
+                    intersect_instances<true>(misses[j], hits[j]);
+                if (hits[j].tri >= 0 && hits[j].inst < 0)
+                    cache.tri = hits[j].tri;
+                occluded[ids[j]] = hits[j].tri >= 0;
+            }
+            n = 0;
+        };
+        for (size_t i = 0; i < count; i++) {
+            if (hits_occluder(rays[i], cache)) {
+                occluded[i] = true;
+                continue;
+            }
+            misses[n] = rays[i];
+            ids[n++] = i;
+            if (n == Bvh::packet_size)
+                trace_misses();
+        }
+        if (n > 0)
+            trace_misses();
+    }
+
+    /// Tests a batch of rays for occlusion, typically shadow rays. Sets occluded[i] to true if rays[i] hits the scene.
+    void occluded_stream(const Ray* rays, bool* occluded, size_t count) const {
+        Stats::count_rays(RayStage::Shadow, count);
+        auto& bvh = local_bvh();
+        Hit hits[Bvh::packet_size];
+        for (size_t i = 0; i < count; i += Bvh::packet_size) {
+            auto n = std::min(Bvh::packet_size, count - i);
+            bvh.traverse_packet<true>(rays + i, hits, n);
+            for (size_t j = 0; j < n; j++) {
+                if (hits[j].tri < 0 && !instances.empty())
+                    intersect_instances<true>(rays[i + j], hits[j]);
+                occluded[i + j] = hits[j].tri >= 0;
+            }
+        }
+    }
+
     /// Returns the material associated with a hit point.
     const Material& material(const Hit& hit) const {
         assert(hit.tri >= 0);
         return materials[indices[hit.tri * 4 + 3]];
     }
 
+    /// Returns the interpolated shading normal at a hit point, in world space.
+    float3 shading_normal(const Hit& hit) const {
+        assert(hit.tri >= 0);
+        auto n = lerp(normal(indices[hit.tri * 4 + 0]), normal(indices[hit.tri * 4 + 1]), normal(indices[hit.tri * 4 + 2]), hit.u, hit.v);
+        return normalize(hit.inst >= 0 ? instances[hit.inst].to_object.normal(n) : n);
+    }
+
     /// Returns the surface parameters for a hit point.
     SurfaceParams surface_params(const Ray& ray, const Hit& hit) const {
         assert(hit.tri >= 0);
@@ -66,9 +256,29 @@ struct Scene {
         auto i1 = indices[hit.tri * 4 + 1];
         auto i2 = indices[hit.tri * 4 + 2];
 
-        auto& fn = face_normals[hit.tri];
-        auto n = normalize(lerp(normals[i0], normals[i1], normals[i2], hit.u, hit.v));
-        auto uv = lerp(texcoords[i0], texcoords[i1], texcoords[i2], hit.u, hit.v);
+        auto fn = face_normal(hit.tri);
+        auto n = normalize(lerp(normal(i0), normal(i1), normal(i2), hit.u, hit.v));
+        auto t0 = texcoord(i0), t1 = texcoord(i1), t2 = texcoord(i2);
+        auto uv = lerp(t0, t1, t2, hit.u, hit.v);
+
+        // Approximate the ray footprint with a cone whose spread is the size of a pixel, starting at the ray origin.
+        // Ray differentials are not tracked through bounces, so the footprint after a bounce is underestimated.
+        auto& v0 = vertices[i0];
+        auto e1 = vertices[i1] - v0;
+        auto e2 = vertices[i2] - v0;
+
+        // Instanced triangles are stored in object space: normals are transformed by the transpose of the inverse transformation
+        if (hit.inst >= 0) {
+            auto& instance = instances[hit.inst];
+            fn = normalize(instance.to_object.normal(fn));
+            n  = normalize(instance.to_object.normal(n));
+            e1 = instance.to_world.vector(e1);
+            e2 = instance.to_world.vector(e2);
+        }
+        auto world_area = length(cross(e1, e2));
+        auto tex_area = std::fabs((t1.x - t0.x) * (t2.y - t0.y) - (t2.x - t0.x) * (t1.y - t0.y));
+        auto cos_theta = std::max(std::fabs(dot(ray.dir, fn)), 1e-3f);
+        auto footprint = world_area > 0.0f ? hit.t * pixel_spread * std::sqrt(tex_area / world_area) / cos_theta : 0.0f;
 
         // Compute the surface parameters, and make sure the face and per-vertex normal agree
         SurfaceParams surf;
@@ -77,11 +287,35 @@ struct Scene {
         surf.point = ray.org + ray.dir * hit.t;
         surf.coords = gen_local_coords(dot(ray.dir, n) <= 0 ? n : -n);
         surf.uv = uv;
+        surf.footprint = footprint;
         return surf;
     }
 };
 
+/// Options controlling how a scene is loaded.
+struct LoadOptions {
+    BvhQuality bvh_quality = BvhQuality::High;     ///< Quality of the BVH, trading rendering speed for construction time
+    size_t texture_cache_size = TextureCache::default_budget;  ///< Memory budget of the texture cache, in bytes
+    bool compact = false;                           ///< Quantizes the shading data and uses a compact BVH, which reduces memory usage at a small rendering cost
+    bool use_cache = true;                          ///< Loads the meshes and the BVH from binary files next to the configuration file, and creates them if they are missing or out of date
+};
+
 /// Load a scene from the given YAML configuration file.
-bool load_scene(const std::string& config, Scene& scene);
+bool load_scene(const std::string& config, Scene& scene, const LoadOptions& options = LoadOptions());
+
+/// Rendering job of a batch, which reuses the scene loaded by load_scene().
+struct RenderJob {
+    std::unique_ptr<Camera> camera;
+    size_t width, height;
+    std::string algo;       ///< Name of the renderer
+    size_t samples;         ///< Number of samples per pixel, or 0 for no limit
+    double time;            ///< Render time in seconds, or 0 for no limit
+    std::string output;     ///< Output image, in PNG or EXR format
+};
+
+/// Load a list of rendering jobs from the given YAML file. The settings that are not given by a job are
+/// taken from the defaults, and the camera of the scene configuration file is used when a job has none.
+/// Jobs that end up with neither a sample count nor a render time are rendered with 4 samples per pixel.
+bool load_jobs(const std::string& file, const std::string& config, const RenderJob& defaults, std::vector<RenderJob>& jobs);
 
 #endif // SCENE_H
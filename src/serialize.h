@@ -0,0 +1,103 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include <ostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+/// Writes plain data, arrays and strings to a binary stream, in the native byte order.
+class BinaryWriter {
+public:
+    BinaryWriter(std::ostream& stream) : stream(stream) {}
+
+    template <typename T>
+    void write(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable types can be written");
+        stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    /// Writes the number of elements, followed by the elements themselves.
+    template <typename T>
+    void write_array(const T* values, size_t count) {
+        static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable types can be written");
+        write(uint64_t(count));
+        stream.write(reinterpret_cast<const char*>(values), sizeof(T) * count);
+    }
+
+    void write_string(const std::string& str) { write_array(str.data(), str.size()); }
+
+    bool ok() const { return bool(stream); }
+
+private:
+    std::ostream& stream;
+};
+
+/// Reads data written by a BinaryWriter from a buffer. Reading past the end of the buffer
+/// does not modify the destination, and makes the reader fail.
+class BinaryReader {
+public:
+    BinaryReader(const char* data, size_t size) : cur(data), end(data + size) {}
+
+    template <typename T>
+    bool read(T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable types can be read");
+        if (!ok_ || size_t(end - cur) < sizeof(T)) return ok_ = false;
+        std::memcpy(&value, cur, sizeof(T));
+        cur += sizeof(T);
+        return true;
+    }
+
+    /// Returns a pointer to an array of elements in the buffer, and its number of elements.
+    /// The pointer may not be suitably aligned for T, and should only be used with std::memcpy.
+    template <typename T>
+    const char* read_array(size_t& count) {
+        uint64_t n;
+        if (!read(n) || n > size_t(end - cur) / sizeof(T)) {
+            ok_ = false;
+            return nullptr;
+        }
+        auto ptr = cur;
+        cur += sizeof(T) * n;
+        count = n;
+        return ptr;
+    }
+
+    template <typename T>
+    bool read_array(T* values, size_t count) {
+        size_t n;
+        auto ptr = read_array<T>(n);
+        if (!ptr || n != count) return ok_ = false;
+        std::memcpy(values, ptr, sizeof(T) * n);
+        return true;
+    }
+
+    template <typename T>
+    bool read_vector(std::vector<T>& values) {
+        size_t n;
+        auto ptr = read_array<T>(n);
+        if (!ptr) return false;
+        values.resize(n);
+        std::memcpy(values.data(), ptr, sizeof(T) * n);
+        return true;
+    }
+
+    bool read_string(std::string& str) {
+        size_t n;
+        auto ptr = read_array<char>(n);
+        if (!ptr) return false;
+        str.assign(ptr, n);
+        return true;
+    }
+
+    bool ok() const { return ok_; }
+
+private:
+    const char* cur;
+    const char* end;
+    bool ok_ = true;
+};
+
+#endif // SERIALIZE_H
@@ -0,0 +1,52 @@
+#include <algorithm>
+
+#include "shadows.h"
+#include "hash.h"
+
+/// Mask of the bits of the sorting keys that hold the index of the ray.
+static constexpr uint64_t index_mask = (uint64_t(1) << 31) - 1;
+
+ShadowBatch::ShadowBatch(const Scene& scene, Arena& arena, rgb* targets)
+    : scene(scene), targets(targets)
+{
+    rays          = arena.alloc<Ray>(capacity);
+    contribs      = arena.alloc<rgb>(capacity);
+    ray_targets   = arena.alloc<uint32_t>(capacity);
+    keys          = arena.alloc<uint64_t>(capacity);
+    sorted_rays   = arena.alloc<Ray>(capacity);
+    occluded_rays = arena.alloc<bool>(capacity);
+}
+
+void ShadowBatch::flush() {
+    if (count == 0)
+        return;
+
+    auto bbox = BBox::empty();
+    for (size_t i = 0; i < count; i++)
+        bbox = extend(bbox, rays[i].org);
+    auto extents = bbox.max - bbox.min;
+    auto scale = float3(
+        extents.x > 0.0f ? 1023.0f / extents.x : 0.0f,
+        extents.y > 0.0f ? 1023.0f / extents.y : 0.0f,
+        extents.z > 0.0f ? 1023.0f / extents.z : 0.0f);
+
+    // The key is made of the octant of the direction, then the Morton code of the origin, then the index of the ray
+    for (size_t i = 0; i < count; i++) {
+        auto& dir = rays[i].dir;
+        auto octant = uint64_t(dir.x < 0.0f) | (uint64_t(dir.y < 0.0f) << 1) | (uint64_t(dir.z < 0.0f) << 2);
+        auto p = (rays[i].org - bbox.min) * scale;
+        auto code = morton_code(uint32_t(p.x), uint32_t(p.y), uint32_t(p.z));
+        keys[i] = (octant << 61) | (uint64_t(code) << 31) | uint64_t(i);
+    }
+    std::sort(keys, keys + count);
+    for (size_t i = 0; i < count; i++)
+        sorted_rays[i] = rays[keys[i] & index_mask];
+
+    scene.occluded_stream(sorted_rays, occluded_rays, count, cache);
+    for (size_t i = 0; i < count; i++) {
+        auto j = keys[i] & index_mask;
+        if (!occluded_rays[i])
+            targets[ray_targets[j]] += contribs[j];
+    }
+    count = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef SHADOWS_H
+#define SHADOWS_H
+
+#include <cstdint>
+
+#include "scene.h"
+#include "arena.h"
+#include "color.h"
+
+/// Shadow rays of Next Event Estimation whose visibility is tested later, all together. The contribution of
+/// each ray is added to its target (e.g. the color of a pixel) once the ray is known to be unoccluded.
+/// Before being traced, the rays are sorted by direction octant and by origin, so that consecutive rays traverse
+/// the same parts of the BVH and are often blocked by the same triangle (see OccluderCache).
+class ShadowBatch {
+public:
+    /// Number of rays after which the batch is traced.
+    static constexpr size_t capacity = 1024;
+
+    /// Creates a batch whose arrays are allocated in the given arena, adding contributions to the given targets.
+    ShadowBatch(const Scene& scene, Arena& arena, rgb* targets);
+
+    /// Adds a shadow ray, and traces the batch if it is full.
+    void add(const Ray& ray, const rgb& contrib, uint32_t target) {
+        rays[count] = ray;
+        contribs[count] = contrib;
+        ray_targets[count] = target;
+        if (++count == capacity)
+            flush();
+    }
+
+    /// Tests a single shadow ray immediately, with the occluder cache of the batch.
+    bool occluded(const Ray& ray) { return scene.occluded(ray, cache); }
+
+    /// Traces the rays of the batch, and adds the contributions of the unoccluded ones to their targets.
+    void flush();
+
+private:
+    const Scene& scene;
+    rgb* targets;
+    Ray* rays;
+    rgb* contribs;
+    uint32_t* ray_targets;
+    uint64_t* keys;
+    Ray* sorted_rays;
+    bool* occluded_rays;
+    size_t count = 0;
+    OccluderCache cache;
+};
+
+#endif // SHADOWS_H
@@ -0,0 +1,160 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "common.h"
+
+/// Number of lanes in a SIMD vector.
+static constexpr int simd_width = 4;
+
+/// Mask of four booleans, one per SIMD lane.
+struct vbool4 {
+#ifdef SIMD_SSE2
+    __m128 v;
+
+    vbool4() {}
+    vbool4(__m128 v) : v(v) {}
+
+    /// Returns a bit mask with one bit per lane.
+    int mask() const { return _mm_movemask_ps(v); }
+#else
+    bool v[4];
+
+    vbool4() {}
+    vbool4(bool a, bool b, bool c, bool d) : v { a, b, c, d } {}
+
+    int mask() const { return int(v[0]) | (int(v[1]) << 1) | (int(v[2]) << 2) | (int(v[3]) << 3); }
+#endif
+
+    bool any() const { return mask() != 0; }
+    bool all() const { return mask() == 0xF; }
+};
+
+/// Vector of four floats, using SSE when available.
+struct vfloat4 {
+#ifdef SIMD_SSE2
+    __m128 v;
+
+    vfloat4() {}
+    vfloat4(__m128 v) : v(v) {}
+    explicit vfloat4(float x) : v(_mm_set1_ps(x)) {}
+    vfloat4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+
+    static vfloat4 load(const float* p) { return _mm_loadu_ps(p); }
+    /// Loads four bytes and converts them to floats.
+    static vfloat4 load(const uint8_t* p) {
+        int32_t bytes;
+        std::memcpy(&bytes, p, sizeof(int32_t));
+        auto zero = _mm_setzero_si128();
+        auto ints = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+        return _mm_cvtepi32_ps(ints);
+    }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    float operator [] (size_t i) const { alignas(16) float f[4]; _mm_store_ps(f, v); return f[i]; }
+#else
+    float v[4];
+
+    vfloat4() {}
+    explicit vfloat4(float x) : v { x, x, x, x } {}
+    vfloat4(float a, float b, float c, float d) : v { a, b, c, d } {}
+
+    static vfloat4 load(const float* p) { return vfloat4(p[0], p[1], p[2], p[3]); }
+    /// Loads four bytes and converts them to floats.
+    static vfloat4 load(const uint8_t* p) { return vfloat4(p[0], p[1], p[2], p[3]); }
+    void store(float* p) const { std::copy(v, v + 4, p); }
+
+    float operator [] (size_t i) const { return v[i]; }
+#endif
+};
+
+#ifdef SIMD_SSE2
+inline vfloat4 operator + (const vfloat4& a, const vfloat4& b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat4 operator - (const vfloat4& a, const vfloat4& b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat4 operator * (const vfloat4& a, const vfloat4& b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat4 operator / (const vfloat4& a, const vfloat4& b) { return _mm_div_ps(a.v, b.v); }
+
+inline vfloat4 min(const vfloat4& a, const vfloat4& b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat4 max(const vfloat4& a, const vfloat4& b) { return _mm_max_ps(a.v, b.v); }
+
+inline vbool4 operator <  (const vfloat4& a, const vfloat4& b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vbool4 operator <= (const vfloat4& a, const vfloat4& b) { return _mm_cmple_ps(a.v, b.v); }
+inline vbool4 operator >  (const vfloat4& a, const vfloat4& b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline vbool4 operator >= (const vfloat4& a, const vfloat4& b) { return _mm_cmpge_ps(a.v, b.v); }
+
+inline vbool4 operator & (const vbool4& a, const vbool4& b) { return _mm_and_ps(a.v, b.v); }
+inline vbool4 operator | (const vbool4& a, const vbool4& b) { return _mm_or_ps(a.v, b.v); }
+
+/// Selects the elements of a where the mask is set, and the elements of b otherwise.
+inline vfloat4 select(const vbool4& m, const vfloat4& a, const vfloat4& b) {
+    return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v));
+}
+
+inline vfloat4 abs(const vfloat4& a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline vfloat4 rcp(const vfloat4& a) { return _mm_div_ps(_mm_set1_ps(1.0f), a.v); }
+inline vfloat4 sqrt(const vfloat4& a) { return _mm_sqrt_ps(a.v); }
+
+/// Multiplies the first operand by the sign of the second one.
+inline vfloat4 prodsign(const vfloat4& a, const vfloat4& b) {
+    return _mm_xor_ps(a.v, _mm_and_ps(b.v, _mm_set1_ps(-0.0f)));
+}
+#else
+#define SIMD_MAP(op) \
+    vfloat4(op(0), op(1), op(2), op(3))
+#define SIMD_CMP(op) \
+    vbool4(op(0), op(1), op(2), op(3))
+
+inline vfloat4 operator + (const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return a.v[i] + b.v[i]; }; return SIMD_MAP(f); }
+inline vfloat4 operator - (const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return a.v[i] - b.v[i]; }; return SIMD_MAP(f); }
+inline vfloat4 operator * (const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return a.v[i] * b.v[i]; }; return SIMD_MAP(f); }
+inline vfloat4 operator / (const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return a.v[i] / b.v[i]; }; return SIMD_MAP(f); }
+
+inline vfloat4 min(const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return a.v[i] < b.v[i] ? a.v[i] : b.v[i]; }; return SIMD_MAP(f); }
+inline vfloat4 max(const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return a.v[i] > b.v[i] ? a.v[i] : b.v[i]; }; return SIMD_MAP(f); }
+
+inline vbool4 operator <  (const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return a.v[i] <  b.v[i]; }; return SIMD_CMP(f); }
+inline vbool4 operator <= (const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return a.v[i] <= b.v[i]; }; return SIMD_CMP(f); }
+inline vbool4 operator >  (const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return a.v[i] >  b.v[i]; }; return SIMD_CMP(f); }
+inline vbool4 operator >= (const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return a.v[i] >= b.v[i]; }; return SIMD_CMP(f); }
+
+inline vbool4 operator & (const vbool4& a, const vbool4& b) { auto f = [&] (int i) { return a.v[i] && b.v[i]; }; return SIMD_CMP(f); }
+inline vbool4 operator | (const vbool4& a, const vbool4& b) { auto f = [&] (int i) { return a.v[i] || b.v[i]; }; return SIMD_CMP(f); }
+
+inline vfloat4 select(const vbool4& m, const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return m.v[i] ? a.v[i] : b.v[i]; }; return SIMD_MAP(f); }
+
+inline vfloat4 abs(const vfloat4& a) { auto f = [&] (int i) { return std::fabs(a.v[i]); }; return SIMD_MAP(f); }
+inline vfloat4 rcp(const vfloat4& a) { auto f = [&] (int i) { return 1.0f / a.v[i]; }; return SIMD_MAP(f); }
+inline vfloat4 sqrt(const vfloat4& a) { auto f = [&] (int i) { return std::sqrt(a.v[i]); }; return SIMD_MAP(f); }
+
+inline vfloat4 prodsign(const vfloat4& a, const vfloat4& b) { auto f = [&] (int i) { return prodsign(a.v[i], b.v[i]); }; return SIMD_MAP(f); }
+
+#undef SIMD_MAP
+#undef SIMD_CMP
+#endif
+
+/// Returns the horizontal minimum of a vector.
+inline float reduce_min(const vfloat4& a) {
+    return std::min(std::min(a[0], a[1]), std::min(a[2], a[3]));
+}
+
+/// Returns the index of the lowest bit set in a non-zero mask.
+inline int first_bit(int mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) mask >>= 1, i++;
+    return i;
+#endif
+}
+
+#endif // SIMD_H
@@ -0,0 +1,99 @@
+#include <cmath>
+
+#include "spectrum.h"
+
+/// Piecewise Gaussian used by the fit of the color matching functions.
+static inline float piecewise_gaussian(float lambda, float mu, float sigma1, float sigma2) {
+    auto t = (lambda - mu) / (lambda < mu ? sigma1 : sigma2);
+    return std::exp(-0.5f * t * t);
+}
+
+/// CIE 1931 color matching functions, with the multi-lobe fit of "Simple Analytic Approximations to the
+/// CIE XYZ Color Matching Functions" (C. Wyman et al., 2013).
+static inline float3 color_matching(float lambda) {
+    return float3(
+        1.056f * piecewise_gaussian(lambda, 599.8f, 37.9f, 31.0f) +
+        0.362f * piecewise_gaussian(lambda, 442.0f, 16.0f, 26.7f) -
+        0.065f * piecewise_gaussian(lambda, 501.1f, 20.4f, 26.2f),
+        0.821f * piecewise_gaussian(lambda, 568.8f, 46.9f, 40.5f) +
+        0.286f * piecewise_gaussian(lambda, 530.9f, 16.3f, 31.1f),
+        1.217f * piecewise_gaussian(lambda, 437.0f, 11.8f, 36.0f) +
+        0.681f * piecewise_gaussian(lambda, 459.0f, 26.0f, 13.8f));
+}
+
+static inline rgb xyz_to_rgb(const float3& xyz) {
+    return rgb(
+         3.2406f * xyz.x - 1.5372f * xyz.y - 0.4986f * xyz.z,
+        -0.9689f * xyz.x + 1.8758f * xyz.y + 0.0415f * xyz.z,
+         0.0557f * xyz.x - 0.2040f * xyz.y + 1.0570f * xyz.z);
+}
+
+/// Basis functions of the RGB to spectrum conversion: smooth steps that split the range into blue, green and red parts,
+/// and sum to one everywhere.
+static inline float3 rgb_basis(float lambda) {
+    auto step = [] (float lambda, float edge) {
+        auto t = std::min(std::max((lambda - edge) / 20.0f + 0.5f, 0.0f), 1.0f);
+        return t * t * (3.0f - 2.0f * t);
+    };
+    auto blue_green = step(lambda, 490.0f);
+    auto green_red  = step(lambda, 585.0f);
+    return float3(green_red, blue_green - green_red, 1.0f - blue_green);
+}
+
+/// Constants of the conversions, integrated once over the range of wavelengths.
+struct SpectralConstants {
+    float inv_y_integral;   ///< Inverse of the integral of the Y color matching function
+    float3 inv_basis[3];    ///< Rows of the inverse of the matrix giving the RGB color of each basis function
+
+    SpectralConstants() {
+        float y_integral = 0.0f;
+        float3 basis_xyz[3] = { float3(0.0f), float3(0.0f), float3(0.0f) };
+        for (float lambda = min_wavelength + 0.5f; lambda < max_wavelength; lambda += 1.0f) {
+            auto cmf = color_matching(lambda);
+            auto basis = rgb_basis(lambda);
+            y_integral += cmf.y;
+            for (int k = 0; k < 3; k++)
+                basis_xyz[k] += cmf * basis[k];
+        }
+        inv_y_integral = 1.0f / y_integral;
+
+        // Column k of the matrix is the color of the basis function k
+        float3 m[3];
+        for (int k = 0; k < 3; k++) {
+            auto color = xyz_to_rgb(basis_xyz[k] * inv_y_integral);
+            m[0][k] = color.x;
+            m[1][k] = color.y;
+            m[2][k] = color.z;
+        }
+        auto det = dot(m[0], cross(m[1], m[2]));
+        auto c0 = cross(m[1], m[2]), c1 = cross(m[2], m[0]), c2 = cross(m[0], m[1]);
+        for (int i = 0; i < 3; i++)
+            inv_basis[i] = float3(c0[i], c1[i], c2[i]) / det;
+    }
+};
+
+static const SpectralConstants& spectral_constants() {
+    static const SpectralConstants constants;
+    return constants;
+}
+
+float4 rgb_to_spectrum(const rgb& color, const SampledWavelengths& wavelengths) {
+    auto& constants = spectral_constants();
+    auto coeffs = float3(
+        dot(constants.inv_basis[0], color),
+        dot(constants.inv_basis[1], color),
+        dot(constants.inv_basis[2], color));
+    float4 values;
+    for (size_t i = 0; i < 4; i++)
+        values[i] = std::max(dot(coeffs, rgb_basis(wavelengths.lambda[i])), 0.0f);
+    return values;
+}
+
+rgb spectrum_to_rgb(const float4& values, const SampledWavelengths& wavelengths) {
+    float3 xyz(0.0f);
+    for (size_t i = 0; i < 4; i++) {
+        if (wavelengths.pdf[i] > 0.0f)
+            xyz += color_matching(wavelengths.lambda[i]) * (values[i] / wavelengths.pdf[i]);
+    }
+    return xyz_to_rgb(xyz * (0.25f * spectral_constants().inv_y_integral));
+}
@@ -0,0 +1,78 @@
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include <algorithm>
+
+#include "float4.h"
+#include "color.h"
+
+/// Range of wavelengths of the spectral mode, in nanometers.
+static constexpr float min_wavelength = 360.0f;
+static constexpr float max_wavelength = 830.0f;
+
+/// Wavelengths carried by a path, one per SIMD lane: a hero wavelength, sampled uniformly, and three others
+/// rotated by a quarter of the range ("Hero Wavelength Spectral Sampling", A. Wilkie et al., 2014).
+struct SampledWavelengths {
+    float4 lambda;      ///< Wavelengths, in nanometers
+    float4 pdf;         ///< Probability densities of the wavelengths, 0 for terminated wavelengths
+
+    /// Samples the wavelengths with a random number in [0, 1).
+    static SampledWavelengths sample(float u) {
+        static constexpr float range = max_wavelength - min_wavelength;
+        SampledWavelengths wavelengths;
+        for (size_t i = 0; i < 4; i++) {
+            auto v = u + float(i) * 0.25f;
+            wavelengths.lambda[i] = min_wavelength + (v >= 1.0f ? v - 1.0f : v) * range;
+        }
+        wavelengths.pdf = float4(1.0f / range);
+        return wavelengths;
+    }
+
+    float hero() const { return lambda.x; }
+
+    /// Keeps only the hero wavelength, after an event that depends on the wavelength (e.g. dispersion)
+    /// has sent the other wavelengths in other directions.
+    void terminate_secondary() {
+        if (pdf.y == 0.0f) return;
+        pdf = float4(pdf.x * 0.25f, 0.0f, 0.0f, 0.0f);
+    }
+};
+
+/// Converts an RGB color (reflectance or emission) into its spectrum, evaluated at the given wavelengths.
+/// The spectrum is a combination of three smooth basis functions, chosen so that converting it back
+/// with spectrum_to_rgb gives the original color, on average (except where the spectrum is clamped to zero).
+float4 rgb_to_spectrum(const rgb& color, const SampledWavelengths& wavelengths);
+
+/// Converts the values of a spectrum at the given wavelengths into linear sRGB, with the CIE 1931 color matching functions.
+rgb spectrum_to_rgb(const float4& values, const SampledWavelengths& wavelengths);
+
+/// Colors carried along the paths of a renderer in RGB mode. Renderers templated on the color policy
+/// are written once for the RGB and spectral modes, and lift the RGB colors of the scene with lift().
+struct RgbColors {
+    using Color = rgb;
+    static constexpr bool spectral = false;
+
+    template <typename S>
+    static RgbColors sample(S&) { return RgbColors(); }
+
+    rgb lift(const rgb& color) const { return color; }
+    rgb to_rgb(const rgb& color) const { return color; }
+    static float max_component(const rgb& color) { return std::max(color.x, std::max(color.y, color.z)); }
+};
+
+/// Colors carried along the paths of a renderer in spectral mode: the values of the spectra at the wavelengths of the path.
+struct SpectralColors {
+    using Color = float4;
+    static constexpr bool spectral = true;
+
+    SampledWavelengths wavelengths;
+
+    template <typename S>
+    static SpectralColors sample(S& sampler) { return SpectralColors { SampledWavelengths::sample(sampler()) }; }
+
+    float4 lift(const rgb& color) const { return rgb_to_spectrum(color, wavelengths); }
+    rgb to_rgb(const float4& values) const { return spectrum_to_rgb(values, wavelengths); }
+    static float max_component(const float4& values) { return std::max(std::max(values.x, values.y), std::max(values.z, values.w)); }
+};
+
+#endif // SPECTRUM_H
@@ -0,0 +1,136 @@
+#include <fstream>
+#include <algorithm>
+
+#include "stats.h"
+
+static const char* ray_stage_names[num_ray_stages] = { "primary", "bounce", "shadow", "photon", "gather" };
+
+Stats& Stats::instance() {
+    static Stats stats;
+    return stats;
+}
+
+ThreadStats* Stats::register_thread() {
+    std::lock_guard<std::mutex> lock(mutex);
+    threads.emplace_back(new ThreadStats());
+    return threads.back().get();
+}
+
+void Stats::trace(const char* name, Clock::time_point start, Clock::time_point end, size_t tid, int32_t x, int32_t y) {
+    auto& stats = local();
+    if (stats.events.size() >= max_events_per_thread) {
+        stats.dropped_events++;
+        return;
+    }
+    auto start_us = to_us(start);
+    stats.events.push_back(ThreadStats::Event { name, start_us, to_us(end) - start_us, uint32_t(tid), x, y });
+}
+
+void Stats::add_idle_time(size_t worker, Clock::time_point start, Clock::time_point end) {
+    if (end <= start) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle_ms.size() <= worker)
+            idle_ms.resize(worker + 1, 0.0);
+        idle_ms[worker] += std::chrono::duration<double, std::milli>(end - start).count();
+    }
+    trace("idle", start, end, worker);
+}
+
+ThreadStats Stats::total() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    ThreadStats total;
+    for (auto& stats : threads) {
+        for (size_t i = 0; i < num_ray_stages; i++) {
+            total.rays[i]  += stats->rays[i];
+            total.nodes[i] += stats->nodes[i];
+            total.tris[i]  += stats->tris[i];
+        }
+        total.photons += stats->photons;
+        total.tiles   += stats->tiles;
+        total.tile_ms += stats->tile_ms;
+        total.max_tile_ms = std::max(total.max_tile_ms, stats->max_tile_ms);
+        total.dropped_events += stats->dropped_events;
+    }
+    return total;
+}
+
+bool Stats::save_summary(const std::string& file_name, double render_time) const {
+    auto total = this->total();
+    auto ratio = [] (uint64_t a, uint64_t b) { return b > 0 ? double(a) / double(b) : 0.0; };
+
+    uint64_t total_rays = 0, total_nodes = 0, total_tris = 0;
+    for (size_t i = 0; i < num_ray_stages; i++) {
+        total_rays  += total.rays[i];
+        total_nodes += total.nodes[i];
+        total_tris  += total.tris[i];
+    }
+
+    std::ofstream file(file_name);
+    file << "{\n";
+    file << "    \"render_time_s\": " << render_time << ",\n";
+    file << "    \"rays\": {\n";
+    for (size_t i = 0; i < num_ray_stages; i++) {
+        file << "        \"" << ray_stage_names[i] << "\": { "
+             << "\"count\": " << total.rays[i] << ", "
+             << "\"nodes_per_ray\": " << ratio(total.nodes[i], total.rays[i]) << ", "
+             << "\"tris_per_ray\": " << ratio(total.tris[i], total.rays[i]) << " },\n";
+    }
+    file << "        \"total\": { "
+         << "\"count\": " << total_rays << ", "
+         << "\"nodes_per_ray\": " << ratio(total_nodes, total_rays) << ", "
+         << "\"tris_per_ray\": " << ratio(total_tris, total_rays) << " }\n";
+    file << "    },\n";
+    file << "    \"rays_per_second\": " << (render_time > 0 ? total_rays / render_time : 0.0) << ",\n";
+    file << "    \"photons_stored\": " << total.photons << ",\n";
+    file << "    \"tiles\": { "
+         << "\"count\": " << total.tiles << ", "
+         << "\"total_ms\": " << total.tile_ms << ", "
+         << "\"mean_ms\": " << (total.tiles > 0 ? total.tile_ms / total.tiles : 0.0) << ", "
+         << "\"max_ms\": " << total.max_tile_ms << " },\n";
+    file << "    \"idle_ms\": [";
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < idle_ms.size(); i++)
+            file << (i > 0 ? ", " : "") << idle_ms[i];
+    }
+    file << "]\n";
+    file << "}\n";
+    return static_cast<bool>(file);
+}
+
+bool Stats::save_trace(const std::string& file_name) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ofstream file(file_name);
+    file << "{ \"traceEvents\": [\n";
+
+    // Name the timelines after the workers of the thread pool
+    size_t num_tids = 0;
+    for (auto& stats : threads) {
+        for (auto& event : stats->events)
+            num_tids = std::max(num_tids, size_t(event.tid) + 1);
+    }
+    bool first = true;
+    for (size_t i = 0; i < num_tids; i++) {
+        file << (first ? "" : ",\n") << "{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << i
+             << ", \"args\": { \"name\": \"worker " << i << "\" } }";
+        first = false;
+    }
+
+    for (auto& stats : threads) {
+        for (auto& event : stats->events) {
+            file << (first ? "" : ",\n")
+                 << "{ \"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << event.tid
+                 << ", \"ts\": " << event.start_us << ", \"dur\": " << event.dur_us;
+            if (event.x >= 0) {
+                file << ", \"args\": { \"x\": " << event.x;
+                if (event.y >= 0) file << ", \"y\": " << event.y;
+                file << " }";
+            }
+            file << " }";
+            first = false;
+        }
+    }
+    file << "\n] }\n";
+    return static_cast<bool>(file);
+}
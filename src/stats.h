@@ -0,0 +1,153 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+/// Kinds of rays traced by the renderers, counted separately by the performance counters.
+enum class RayStage {
+    Primary,    ///< Rays starting at the camera
+    Bounce,     ///< Continuation rays of camera paths
+    Shadow,     ///< Visibility rays for next event estimation, or for connecting path vertices
+    Photon,     ///< Rays of light paths (photon tracing, light tracing)
+    Gather      ///< Camera path rays of the photon mapping renderers, which gather photons at their hit points
+};
+
+static constexpr size_t num_ray_stages = 5;
+
+/// Counters of one thread. Only the owning thread modifies them, so that counting does not require any synchronization.
+struct ThreadStats {
+    uint64_t rays[num_ray_stages] = {};
+    uint64_t nodes[num_ray_stages] = {};    ///< BVH nodes visited by the rays of each stage
+    uint64_t tris[num_ray_stages] = {};     ///< Triangles tested by the rays of each stage, including the padding of SIMD groups
+    uint64_t photons = 0;
+    uint64_t tiles = 0;
+    double tile_ms = 0.0;
+    double max_tile_ms = 0.0;
+    RayStage stage = RayStage::Primary;     ///< Stage of the rays being traced, to which BVH traversal statistics are attributed
+
+    struct Event {
+        const char* name;
+        int64_t start_us, dur_us;
+        uint32_t tid;
+        int32_t x, y;                        ///< Arguments of the event, or -1
+    };
+    std::vector<Event> events;
+    size_t dropped_events = 0;
+};
+
+/// Global performance counters and trace events, collected from every thread.
+/// Counters are only compiled in when the ENABLE_STATS option is set. Otherwise, the counting functions do nothing.
+/// Totals must be read when no thread is rendering.
+class Stats {
+public:
+    using Clock = std::chrono::steady_clock;
+
+#ifdef ENABLE_STATS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    /// Maximum number of trace events recorded by each thread, to bound memory usage on long runs.
+    static constexpr size_t max_events_per_thread = size_t(1) << 20;
+
+    static Stats& instance();
+
+    /// Returns the counters of the calling thread.
+    static ThreadStats& local() {
+        static thread_local ThreadStats* stats = nullptr;
+        if (!stats) stats = instance().register_thread();
+        return *stats;
+    }
+
+    /// Counts rays traced by the calling thread. The BVH traversals that follow are attributed to the same stage.
+    static void count_rays(RayStage stage, uint64_t n) {
+#ifdef ENABLE_STATS
+        auto& stats = local();
+        stats.stage = stage;
+        stats.rays[size_t(stage)] += n;
+#else
+        (void)stage;
+        (void)n;
+#endif
+    }
+
+    /// Counts photons stored by the calling thread.
+    static void count_photons(uint64_t n) {
+#ifdef ENABLE_STATS
+        local().photons += n;
+#else
+        (void)n;
+#endif
+    }
+
+    /// Records an event of the trace, on the timeline of the given worker.
+    void trace(const char* name, Clock::time_point start, Clock::time_point end, size_t tid, int32_t x = -1, int32_t y = -1);
+    /// Records the time spent by a worker waiting for the others, in the thread pool.
+    void add_idle_time(size_t worker, Clock::time_point start, Clock::time_point end);
+
+    /// Returns the sum of the counters of every thread.
+    ThreadStats total() const;
+
+    /// Saves the counters as a JSON summary, given the total render time in seconds.
+    bool save_summary(const std::string& file_name, double render_time) const;
+    /// Saves the recorded events in the Chrome trace event format, which can be opened with chrome://tracing or Perfetto.
+    bool save_trace(const std::string& file_name) const;
+
+private:
+    Stats() : origin(Clock::now()) {}
+
+    ThreadStats* register_thread();
+    int64_t to_us(Clock::time_point time) const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(time - origin).count();
+    }
+
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadStats>> threads;
+    std::vector<double> idle_ms;
+    Clock::time_point origin;
+};
+
+/// Counts the nodes and triangles visited during the traversal of one ray (or packet), and adds them to the counters of the thread on destruction.
+/// For packets, a node visited by several rays counts once per ray.
+struct TraversalStats {
+#ifdef ENABLE_STATS
+    uint64_t nodes = 0, tris = 0;
+    void visit_node(uint64_t num_rays = 1) { nodes += num_rays; }
+    void test_tris(uint64_t n) { tris += n; }
+    ~TraversalStats() {
+        auto& stats = Stats::local();
+        stats.nodes[size_t(stats.stage)] += nodes;
+        stats.tris[size_t(stats.stage)] += tris;
+    }
+#else
+    void visit_node(uint64_t = 1) {}
+    void test_tris(uint64_t) {}
+#endif
+};
+
+/// Records a trace event covering the lifetime of the object.
+class ProfileScope {
+public:
+#ifdef ENABLE_STATS
+    ProfileScope(const char* name, size_t tid = 0)
+        : stats(Stats::instance()), name(name), tid(tid), start(Stats::Clock::now())
+    {}
+    ~ProfileScope() { stats.trace(name, start, Stats::Clock::now(), tid); }
+
+private:
+    Stats& stats;   ///< Obtained first, so that the time origin of the trace precedes the start of the event
+    const char* name;
+    size_t tid;
+    Stats::Clock::time_point start;
+#else
+    ProfileScope(const char*, size_t = 0) {}
+#endif
+};
+
+#endif // STATS_H
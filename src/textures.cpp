@@ -0,0 +1,201 @@
+#include <cmath>
+#include <fstream>
+#include <algorithm>
+
+#include "textures.h"
+#include "float2.h"
+#include "common.h"
+#include "thread_pool.h"
+
+MipMap::MipMap(const Image& img, Format format)
+    : format(format)
+{
+    // Compute the dimensions of each level, down to a single texel
+    size_t w = std::max(img.width, size_t(1)), h = std::max(img.height, size_t(1));
+    size_t num_texels = 0;
+    while (true) {
+        auto tiles_x = (w + tile_size - 1) / tile_size;
+        auto tiles_y = (h + tile_size - 1) / tile_size;
+        levels.push_back(Level { w, h, tiles_x, num_texels });
+        num_texels += tiles_x * tiles_y * tile_size * tile_size;
+        if (w == 1 && h == 1) break;
+        w = std::max(w / 2, size_t(1));
+        h = std::max(h / 2, size_t(1));
+    }
+    if (format == Format::Byte)
+        bytes.resize(num_texels, 0);
+    else
+        halves.resize(num_texels, 0);
+
+    std::vector<rgba> cur(img.width * img.height), next;
+    if (cur.empty())
+        cur.assign(1, rgba(1.0f, 0.0f, 1.0f, 1.0f));
+    else
+        std::copy(img.pixels.begin(), img.pixels.end(), cur.begin());
+    store(levels[0], cur);
+
+    // Each texel of a level is the average of (up to) 2x2 texels of the previous level
+    for (size_t i = 1; i < levels.size(); i++) {
+        auto& src = levels[i - 1];
+        auto& dst = levels[i];
+        next.resize(dst.width * dst.height);
+        for (size_t y = 0; y < dst.height; y++) {
+            auto y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+            for (size_t x = 0; x < dst.width; x++) {
+                auto x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+                next[y * dst.width + x] =
+                    (cur[y0 * src.width + x0] + cur[y0 * src.width + x1] +
+                     cur[y1 * src.width + x0] + cur[y1 * src.width + x1]) * 0.25f;
+            }
+        }
+        store(dst, next);
+        std::swap(cur, next);
+    }
+}
+
+void MipMap::store(const Level& level, const std::vector<rgba>& texels) {
+    auto to_byte = [] (float x) { return uint32_t(clamp(x, 0.0f, 1.0f) * 255.0f + 0.5f); };
+    for (size_t y = 0; y < level.height; y++) {
+        for (size_t x = 0; x < level.width; x++) {
+            auto& c = texels[y * level.width + x];
+            auto i = level.offset + ((y / tile_size) * level.tiles_x + x / tile_size) * tile_size * tile_size + (y % tile_size) * tile_size + x % tile_size;
+            if (format == Format::Byte) {
+                bytes[i] = to_byte(c.x) | (to_byte(c.y) << 8) | (to_byte(c.z) << 16) | (to_byte(c.w) << 24);
+            } else {
+                halves[i] =
+                     uint64_t(float_to_half(c.x))        |
+                    (uint64_t(float_to_half(c.y)) << 16) |
+                    (uint64_t(float_to_half(c.z)) << 32) |
+                    (uint64_t(float_to_half(c.w)) << 48);
+            }
+        }
+    }
+}
+
+rgb MipMap::fetch(const Level& level, size_t x, size_t y) const {
+    auto i = level.offset + ((y / tile_size) * level.tiles_x + x / tile_size) * tile_size * tile_size + (y % tile_size) * tile_size + x % tile_size;
+    if (format == Format::Byte) {
+        auto p = bytes[i];
+        return rgb(float(p & 0xFF), float((p >> 8) & 0xFF), float((p >> 16) & 0xFF)) * (1.0f / 255.0f);
+    }
+    auto p = halves[i];
+    return rgb(half_to_float(p & 0xFFFF), half_to_float((p >> 16) & 0xFFFF), half_to_float((p >> 32) & 0xFFFF));
+}
+
+rgb MipMap::bilinear(const Level& level, float u, float v) const {
+    u = u - std::floor(u);
+    v = 1.0f - (v - std::floor(v));
+    auto kx = u * level.width  - 0.5f;
+    auto ky = v * level.height - 0.5f;
+    auto fx = kx - std::floor(kx);
+    auto fy = ky - std::floor(ky);
+    // Wrap around the borders (the texture repeats itself)
+    auto wrap = [] (float k, size_t n) {
+        auto i = int64_t(std::floor(k)) % int64_t(n);
+        return size_t(i < 0 ? i + n : i);
+    };
+    auto x0 = wrap(kx, level.width),  x1 = x0 + 1 >= level.width  ? 0 : x0 + 1;
+    auto y0 = wrap(ky, level.height), y1 = y0 + 1 >= level.height ? 0 : y0 + 1;
+    return lerp(lerp(fetch(level, x0, y0), fetch(level, x1, y0), fx),
+                lerp(fetch(level, x0, y1), fetch(level, x1, y1), fx),
+                fy);
+}
+
+rgb MipMap::operator () (float u, float v, float footprint) const {
+    // Select the level whose texels have about the size of the footprint
+    auto& base = levels[0];
+    auto lod = std::log2(std::max(footprint * std::max(base.width, base.height), 1.0f));
+    lod = std::min(lod, float(levels.size() - 1));
+    auto i = size_t(lod);
+    auto t = lod - i;
+    auto color = bilinear(levels[i], u, v);
+    if (t > 0.0f && i + 1 < levels.size())
+        color = lerp(color, bilinear(levels[i + 1], u, v), t);
+    return color;
+}
+
+int TextureCache::add(const std::string& path) {
+    if (!std::ifstream(path)) {
+        warn("Cannot open texture '", path, "'.");
+        return -1;
+    }
+    textures.emplace_back(new ImageTexture(path, *this));
+    return textures.size() - 1;
+}
+
+void TextureCache::clear() {
+    textures.clear();
+    retired.clear();
+    resident = 0;
+}
+
+void TextureCache::end_frame() {
+    std::lock_guard<std::mutex> lock(mutex);
+    retired.clear();
+    frame++;
+}
+
+size_t TextureCache::prefetch() {
+    std::atomic<size_t> count { 0 };
+    ThreadPool::instance().run_tasks(textures.size(), [&] (size_t i, size_t) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (resident >= budget) return;
+        }
+        auto& texture = *textures[i];
+        if (!texture.mipmap.load(std::memory_order_acquire)) {
+            load(texture);
+            count++;
+        }
+    });
+    return count;
+}
+
+const MipMap* TextureCache::load(const ImageTexture& texture) {
+    // Only one thread decodes a given texture, the others wait for it to finish
+    std::lock_guard<std::mutex> texture_lock(texture.load_mutex);
+    if (auto data = texture.mipmap.load(std::memory_order_acquire))
+        return data;
+
+    // The format is detected from the header of the file, so that only one decoder is ever run
+    Image img;
+    auto& path = texture.path();
+    auto file_format = ImageFormat::Unknown;
+    if (!load_image(path, img, &file_format)) {
+        // The mip map uses a single magenta texel for empty images
+        warn("Invalid PNG/TGA/JPEG/TIFF/EXR texture '", path, "'.");
+        img = Image(0, 0);
+    }
+    auto format = file_format == ImageFormat::Exr ? MipMap::Format::Half : MipMap::Format::Byte;
+    std::unique_ptr<const MipMap> data(new MipMap(img, format));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    resident += data->memory_size();
+    loads++;
+    evict(texture);
+    texture.owned = std::move(data);
+    texture.mipmap.store(texture.owned.get(), std::memory_order_release);
+    return texture.owned.get();
+}
+
+void TextureCache::evict(const ImageTexture& keep) {
+    // Textures used during the current frame are never evicted, otherwise they could be reloaded
+    // and retired over and over until the end of the frame. The budget is exceeded instead.
+    auto cur_frame = frame.load(std::memory_order_relaxed);
+    while (resident > budget) {
+        ImageTexture* lru = nullptr;
+        for (auto& texture : textures) {
+            if (texture->owned && texture.get() != &keep && texture->last_use != cur_frame &&
+                (!lru || texture->last_use < lru->last_use))
+                lru = texture.get();
+        }
+        if (!lru) {
+            if (!over_budget) warn("Texture cache budget exceeded by the textures of the current frame.");
+            over_budget = true;
+            break;
+        }
+        resident -= lru->owned->memory_size();
+        lru->mipmap.store(nullptr, std::memory_order_release);
+        retired.emplace_back(std::move(lru->owned));
+    }
+}
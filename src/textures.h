@@ -1,56 +1,153 @@
 #ifndef TEXTURES_H
 #define TEXTURES_H
 
+#include <vector>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
 #include "color.h"
 #include "image.h"
 
-/// Base class for all textures
-class Texture {
+/// Mip-mapped image, stored with 8 bits or 16 bits (half-precision floats) per channel.
+/// Each level is stored in tiles of 8x8 texels, so that neighboring lookups share cache lines.
+class MipMap {
 public:
-    virtual ~Texture() {}
-    virtual rgb operator () (float u, float v) const = 0;
+    enum class Format {
+        Byte,   ///< 8 bits per channel, for LDR images
+        Half    ///< Half-precision floats, for HDR images
+    };
+
+    /// Builds the mip pyramid of the given image, using a box filter.
+    MipMap(const Image& img, Format format);
+
+    /// Returns the trilinearly filtered color at the given texture coordinates,
+    /// where footprint is the width of the lookup in texture space (0 = finest level).
+    rgb operator () (float u, float v, float footprint) const;
+
+    /// Returns the memory used by the texels of every level, in bytes.
+    size_t memory_size() const { return format == Format::Byte ? bytes.size() * sizeof(uint32_t) : halves.size() * sizeof(uint64_t); }
+
+private:
+    static constexpr size_t tile_size = 8;
+
+    struct Level {
+        size_t width, height;
+        size_t tiles_x;
+        size_t offset;          ///< Index of the first texel of the level
+    };
+
+    rgb fetch(const Level& level, size_t x, size_t y) const;
+    rgb bilinear(const Level& level, float u, float v) const;
+    void store(const Level& level, const std::vector<rgba>& texels);
+
+    Format format;
+    std::vector<Level> levels;
+    std::vector<uint32_t> bytes;    ///< Texels as packed RGBA8, when the format is Byte
+    std::vector<uint64_t> halves;   ///< Texels as packed half-precision RGBA, when the format is Half
 };
 
-/// Constant texture, returns the same value everywhere.
-class ConstantTexture : public Texture {
+class TextureCache;
+
+/// Image texture, decoded on first use, and owned by a texture cache which can evict it to keep memory bounded.
+class ImageTexture {
 public:
-    ConstantTexture(const rgb& c) : color(c) {}
-    rgb operator () (float, float) const override final { return color; }
+    ImageTexture(const std::string& path, TextureCache& cache)
+        : file(path), cache(cache)
+    {}
+
+    /// Returns the filtered color of the texture, loading the texture if it is not resident.
+    inline rgb operator () (float u, float v, float footprint) const;
+
+    const std::string& path() const { return file; }
 
 private:
-    rgb color;
+    friend class TextureCache;
+
+    std::string file;
+    TextureCache& cache;
+
+    // The following members are only modified by the cache
+    mutable std::atomic<const MipMap*> mipmap { nullptr };
+    mutable std::unique_ptr<const MipMap> owned;
+    mutable std::atomic<uint32_t> last_use { 0 };
+    mutable std::mutex load_mutex;
+};
+
+/// Set of image textures, loaded on demand, with a memory budget.
+/// When loading a texture would exceed the budget, the least recently used textures are evicted,
+/// unless they were used during the current frame. Evicted data is only freed at the end of the frame, since other threads may still be reading it.
+class TextureCache {
+public:
+    TextureCache(size_t budget = default_budget)
+        : budget(budget)
+    {}
+
+    static constexpr size_t default_budget = size_t(512) << 20;
+
+    /// Sets the memory budget, in bytes.
+    void set_budget(size_t bytes) { budget = bytes; }
+
+    /// Registers a texture without loading it, and returns its index. Returns -1 if the file does not exist.
+    int add(const std::string& path);
+
+    const ImageTexture& operator [] (size_t i) const { return *textures[i]; }
+    size_t size() const { return textures.size(); }
+    void clear();
+
+    /// Decodes the textures that are not resident, in parallel on the thread pool, until the budget is reached.
+    /// It can run on another thread while the rest of the scene is prepared (e.g. the BVH is built), but not during rendering,
+    /// since it keeps the thread pool busy. Returns the number of decoded textures.
+    size_t prefetch();
+
+    /// Frees the evicted textures. Must be called between frames, when no thread is rendering.
+    void end_frame();
+
+    /// Returns the memory used by the resident textures, in bytes.
+    size_t resident_size() const { return resident; }
+    /// Returns the number of textures that were decoded since the beginning.
+    size_t num_loads() const { return loads; }
+
+private:
+    friend class ImageTexture;
+
+    const MipMap* load(const ImageTexture& texture);
+    void evict(const ImageTexture& keep);
+
+    std::vector<std::unique_ptr<ImageTexture>> textures;
+    std::vector<std::unique_ptr<const MipMap>> retired;
+    std::mutex mutex;
+    std::atomic<uint32_t> frame { 1 };
+    size_t budget;
+    size_t resident = 0;
+    size_t loads = 0;
+    bool over_budget = false;
 };
 
-/// Image-based texture, using bilinear filtering.
-class ImageTexture : public Texture {
+rgb ImageTexture::operator () (float u, float v, float footprint) const {
+    auto data = mipmap.load(std::memory_order_acquire);
+    if (!data) data = cache.load(*this);
+    // Only write the timestamp when it changes, to avoid sharing the cache line between threads
+    auto cur_frame = cache.frame.load(std::memory_order_relaxed);
+    if (last_use.load(std::memory_order_relaxed) != cur_frame)
+        last_use.store(cur_frame, std::memory_order_relaxed);
+    return (*data)(u, v, footprint);
+}
+
+/// Texture as stored in materials: either a constant color, or a reference to an image texture.
+/// Constant textures are evaluated in place, without any memory access or indirect call.
+class Texture {
 public:
-    ImageTexture(Image&& img) : img(img) {}
-
-    rgb operator () (float u, float v) const override final {
-        u = u - (int)u;
-        u = u < 0.0f ? 1.0f + u : u;
-        v = v - (int)v;
-        v = v < 0.0f ? 1.0f + v : v;
-        v = 1.0f - v;
-        auto kx = u * img.width;;
-        auto ky = v * img.height;
-        auto ix = size_t(kx);
-        auto iy = size_t(ky);
-        auto fx = kx - ix;
-        auto fy = ky - iy;
-        auto x0 = clamp(ix, size_t(0), img.width - 1);
-        auto y0 = clamp(iy, size_t(0), img.height - 1);
-        auto x1 = x0 + 1 >= img.width  ? 0 : x0 + 1;
-        auto y1 = y0 + 1 >= img.height ? 0 : y0 + 1;
-        return lerp(lerp(rgb(img(x0, y0)), rgb(img(x1, y0)), fx),
-                    lerp(rgb(img(x0, y1)), rgb(img(x1, y1)), fx),
-                    fy);
-    }
-
-    const Image& image() const { return img; }
+    Texture(const rgb& color = rgb(0.0f)) : color(color), image(nullptr) {}
+    Texture(const ImageTexture& image) : color(1.0f), image(&image) {}
+
+    rgb operator () (float u, float v, float footprint) const { return image ? (*image)(u, v, footprint) : color; }
 
 private:
-    Image img;
+    rgb color;
+    const ImageTexture* image;
 };
 
-#endif // TEXTURES_h
+#endif // TEXTURES_H
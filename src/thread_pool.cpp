@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#include "thread_pool.h"
+#include "common.h"
+#include "stats.h"
+#include "numa.h"
+
+ThreadPool::~ThreadPool() {
+    stop();
+}
+
+ThreadPool& ThreadPool::instance() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::configure(size_t num_threads, bool pin_threads) {
+    stop();
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    start(num_threads, pin_threads);
+}
+
+void ThreadPool::start(size_t num_threads, bool pin_threads) {
+#ifndef __linux__
+    if (pin_threads)
+        warn("Thread pinning is not supported on this platform.");
+#endif
+
+    // Pinned workers are spread over the NUMA nodes in contiguous blocks, so that each node gets a share of the
+    // threads proportional to its number of CPUs, and each worker is pinned to one CPU of its node.
+    // Unpinned workers can run anywhere, and use the data of the first node.
+    auto& nodes = numa_nodes();
+    std::vector<size_t> worker_cpus(num_threads, 0);
+    worker_nodes.assign(num_threads, 0);
+    if (pin_threads) {
+        size_t total_cpus = 0;
+        for (auto& cpus : nodes) total_cpus += cpus.size();
+        for (size_t i = 0, node = 0, first = 0, cpus_before = 0; i < num_threads; ++i) {
+            while (node + 1 < nodes.size() && i * total_cpus >= (cpus_before + nodes[node].size()) * num_threads) {
+                cpus_before += nodes[node].size();
+                first = i;
+                node++;
+            }
+            worker_nodes[i] = node;
+            worker_cpus[i] = nodes[node][(i - first) % nodes[node].size()];
+        }
+    }
+
+    // The calling thread acts as the first worker
+    queues.reset(new Queue[num_threads]);
+#ifdef ENABLE_STATS
+    process_times.reset(new std::pair<Clock::time_point, Clock::time_point>[num_threads]);
+#endif
+    quit = false;
+    for (size_t i = 1; i < num_threads; ++i) {
+        workers.emplace_back([this, i, first_generation = generation] { worker_loop(i, first_generation); });
+        if (pin_threads && !pin_thread(workers.back().native_handle(), { worker_cpus[i] }))
+            warn("Cannot pin thread to CPU ", worker_cpus[i], ".");
+    }
+#ifdef __linux__
+    if (pin_threads && !pin_thread(pthread_self(), { worker_cpus[0] }))
+        warn("Cannot pin thread to CPU ", worker_cpus[0], ".");
+#endif
+    set_numa_node(worker_nodes[0]);
+}
+
+void ThreadPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    start_cond.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+    workers.clear();
+}
+
+void ThreadPool::worker_loop(size_t worker, uint64_t last_generation) {
+    set_numa_node(worker_nodes[worker]);
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cond.wait(lock, [&] { return quit || generation != last_generation; });
+            if (quit) return;
+            last_generation = generation;
+        }
+
+        process(worker);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy_workers--;
+        }
+        done_cond.notify_one();
+    }
+}
+
+bool ThreadPool::pop(size_t worker, uint32_t& tile) {
+    // Take tiles from the front of the local queue, which holds the tiles closest to the center
+    {
+        auto& queue = queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tiles.empty()) {
+            tile = queue.tiles.front();
+            queue.tiles.pop_front();
+            return true;
+        }
+    }
+
+    // Steal from the back of the other queues, starting with the workers of the same NUMA node
+    auto n = num_threads();
+    for (int same_node = 1; same_node >= 0; --same_node) {
+        for (size_t i = 1; i < n; ++i) {
+            auto victim = (worker + i) % n;
+            if ((worker_nodes[victim] == worker_nodes[worker]) != bool(same_node))
+                continue;
+            auto& queue = queues[victim];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tiles.empty()) {
+                tile = queue.tiles.back();
+                queue.tiles.pop_back();
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void ThreadPool::process(size_t worker) {
+#ifdef ENABLE_STATS
+    process_times[worker].first = Clock::now();
+#endif
+    uint32_t task;
+    while (pop(worker, task)) {
+        if (!job_tiles) {
+#ifdef ENABLE_STATS
+            ProfileScope scope("task", worker);
+#endif
+            (*job)(task, worker);
+            continue;
+        }
+
+        auto& stats = tile_stats[task];
+        stats.worker = worker;
+        auto start = Clock::now();
+        if (has_deadline && start >= deadline) {
+            num_skipped++;
+            continue;
+        }
+        (*job)(task, worker);
+        auto end = Clock::now();
+        stats.time_ms = std::chrono::duration<double, std::milli>(end - start).count();
+        stats.done = true;
+#ifdef ENABLE_STATS
+        auto& counters = Stats::local();
+        counters.tiles++;
+        counters.tile_ms += stats.time_ms;
+        counters.max_tile_ms = std::max(counters.max_tile_ms, stats.time_ms);
+        Stats::instance().trace("tile", start, end, worker, stats.xmin, stats.ymin);
+#endif
+    }
+#ifdef ENABLE_STATS
+    process_times[worker].second = Clock::now();
+#endif
+}
+
+void ThreadPool::run_tiles(size_t x, size_t y, size_t w, size_t h, size_t tile_w, size_t tile_h, const TileFn& f) {
+    // The tiles are only replaced once the previous job (possibly submitted by another thread) is finished
+    std::lock_guard<std::mutex> run_lock(run_mutex);
+
+    // Create the tiles, and sort them from the center of the region outwards
+    tile_stats.clear();
+    for (size_t tile_y = y; tile_y < h; tile_y += tile_h) {
+        for (size_t tile_x = x; tile_x < w; tile_x += tile_w)
+            tile_stats.push_back(TileStats { tile_x, tile_y, std::min(tile_x + tile_w, w), std::min(tile_y + tile_h, h), 0.0, 0, false });
+    }
+    auto cx = (x + w) * 0.5f, cy = (y + h) * 0.5f;
+    auto center_dist = [&] (const TileStats& t) {
+        auto dx = (t.xmin + t.xmax) * 0.5f - cx;
+        auto dy = (t.ymin + t.ymax) * 0.5f - cy;
+        return dx * dx + dy * dy;
+    };
+    std::stable_sort(tile_stats.begin(), tile_stats.end(), [&] (const TileStats& a, const TileStats& b) {
+        return center_dist(a) < center_dist(b);
+    });
+
+    run(tile_stats.size(), [&] (size_t tile, size_t) {
+        auto& stats = tile_stats[tile];
+        f(stats.xmin, stats.ymin, stats.xmax, stats.ymax);
+    }, true);
+}
+
+void ThreadPool::begin_frame() {
+    std::lock_guard<std::mutex> run_lock(run_mutex);
+    tile_stats.clear();
+    num_skipped = 0;
+}
+
+void ThreadPool::run_tasks(size_t count, const TaskFn& f) {
+    std::lock_guard<std::mutex> run_lock(run_mutex);
+    run(count, f, false);
+}
+
+void ThreadPool::run(size_t count, const TaskFn& f, bool tiles) {
+    // Distribute the tasks in a round-robin fashion, so that every worker starts with the first ones (i.e. tiles close to the center)
+    auto n = num_threads();
+    for (size_t i = 0; i < count; ++i)
+        queues[i % n].tiles.push_back(i);
+
+    job = &f;
+    job_tiles = tiles;
+#ifdef ENABLE_STATS
+    auto start = Clock::now();
+#endif
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy_workers = workers.size();
+        generation++;
+    }
+    start_cond.notify_all();
+
+    process(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cond.wait(lock, [&] { return busy_workers == 0; });
+    job = nullptr;
+
+#ifdef ENABLE_STATS
+    // Workers are idle until they wake up, and once they have no more work while the others are still busy
+    auto end = Clock::now();
+    auto& stats = Stats::instance();
+    for (size_t i = 0; i < n; i++) {
+        stats.add_idle_time(i, start, process_times[i].first);
+        stats.add_idle_time(i, process_times[i].second, end);
+    }
+#endif
+}
@@ -0,0 +1,105 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <utility>
+#include <cstdint>
+
+/// Timing information for one tile rendered by the thread pool.
+struct TileStats {
+    size_t xmin, ymin, xmax, ymax;  ///< Tile coordinates
+    double time_ms;                 ///< Time spent rendering the tile, in milliseconds
+    size_t worker;                  ///< Index of the worker that rendered the tile
+    bool done;                      ///< False if the tile was skipped because the deadline was reached
+};
+
+/// Persistent pool of worker threads, with per-worker queues and work stealing.
+/// Tiles are scheduled from the center of the image outwards, and can be cancelled with a deadline.
+class ThreadPool {
+public:
+    using Clock = std::chrono::steady_clock;
+    using TileFn = std::function<void (size_t, size_t, size_t, size_t)>;
+    using TaskFn = std::function<void (size_t, size_t)>;
+
+    ~ThreadPool();
+
+    /// Returns the pool shared by all the renderers.
+    static ThreadPool& instance();
+
+    /// Restarts the pool with the given number of threads (0 = one per hardware thread), optionally pinning each thread to a core.
+    void configure(size_t num_threads, bool pin_threads);
+    /// Returns the number of threads of the pool, including the calling thread.
+    size_t num_threads() const { return workers.size() + 1; }
+    /// Returns the NUMA node of a worker. Workers are only spread over the nodes when they are pinned.
+    size_t worker_node(size_t worker) const { return worker_nodes[worker]; }
+
+    /// Tiles that have not started when the deadline is reached are skipped.
+    void set_deadline(Clock::time_point time) { deadline = time; has_deadline = true; }
+    void clear_deadline() { has_deadline = false; }
+
+    /// Calls f(xmin, ymin, xmax, ymax) for every tile of the given region, in parallel. The calling thread takes part in the work.
+    void run_tiles(size_t x, size_t y, size_t w, size_t h, size_t tile_w, size_t tile_h, const TileFn& f);
+
+    /// Calls f(task, worker) for every task in [0, count[, in parallel, where worker is in [0, num_threads()[.
+    /// Tasks are never skipped, even when the deadline is reached.
+    /// Both functions can be called from any thread, but not from within a tile or a task.
+    void run_tasks(size_t count, const TaskFn& f);
+
+    /// Forgets the tiles of the previous frame. Must be called before rendering a frame, as some renderers never call run_tiles.
+    void begin_frame();
+
+    /// Returns the timings of the tiles processed by the last call to run_tiles since begin_frame.
+    const std::vector<TileStats>& last_tile_stats() const { return tile_stats; }
+    /// Returns true if no tile was skipped since begin_frame, i.e. the deadline was not reached.
+    bool last_run_complete() const { return num_skipped == 0; }
+
+private:
+    ThreadPool() { configure(0, false); }
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<uint32_t> tiles;
+    };
+
+    void start(size_t num_threads, bool pin_threads);
+    void stop();
+    void worker_loop(size_t worker, uint64_t last_generation);
+    /// Runs a job on the workers and the calling thread. The caller must hold run_mutex.
+    void run(size_t count, const TaskFn& f, bool tiles);
+    void process(size_t worker);
+    bool pop(size_t worker, uint32_t& tile);
+
+    std::vector<std::thread> workers;
+    std::vector<size_t> worker_nodes;
+    std::unique_ptr<Queue[]> queues;
+
+    // Synchronization between the calling thread and the workers
+    std::mutex mutex;
+    std::condition_variable start_cond, done_cond;
+    uint64_t generation = 0;
+    size_t busy_workers = 0;
+    bool quit = false;
+
+    // Current job, jobs submitted from several threads (e.g. an image saved while the next frame renders) run one after the other
+    std::mutex run_mutex;
+    const TaskFn* job = nullptr;
+    bool job_tiles = false;
+    std::vector<TileStats> tile_stats;
+    std::atomic<size_t> num_skipped { 0 };
+    Clock::time_point deadline;
+    bool has_deadline = false;
+#ifdef ENABLE_STATS
+    /// Times at which each worker started and stopped processing the current job
+    std::unique_ptr<std::pair<Clock::time_point, Clock::time_point>[]> process_times;
+#endif
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,121 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cmath>
+
+#include "float3.h"
+#include "bbox.h"
+
+/// Affine transformation, stored as a 3x4 matrix whose last column is the translation.
+struct Transform {
+    float m[3][4];
+
+    static Transform identity() {
+        return Transform {{
+            { 1.0f, 0.0f, 0.0f, 0.0f },
+            { 0.0f, 1.0f, 0.0f, 0.0f },
+            { 0.0f, 0.0f, 1.0f, 0.0f }
+        }};
+    }
+
+    static Transform translation(const float3& t) {
+        return Transform {{
+            { 1.0f, 0.0f, 0.0f, t.x },
+            { 0.0f, 1.0f, 0.0f, t.y },
+            { 0.0f, 0.0f, 1.0f, t.z }
+        }};
+    }
+
+    static Transform scaling(const float3& s) {
+        return Transform {{
+            { s.x,  0.0f, 0.0f, 0.0f },
+            { 0.0f, s.y,  0.0f, 0.0f },
+            { 0.0f, 0.0f, s.z,  0.0f }
+        }};
+    }
+
+    /// Rotation around the given normalized axis, by an angle in radians.
+    static Transform rotation(const float3& axis, float angle) {
+        auto c = std::cos(angle), s = std::sin(angle), k = 1.0f - c;
+        auto x = axis.x, y = axis.y, z = axis.z;
+        return Transform {{
+            { x * x * k + c,     x * y * k - z * s, x * z * k + y * s, 0.0f },
+            { y * x * k + z * s, y * y * k + c,     y * z * k - x * s, 0.0f },
+            { z * x * k - y * s, z * y * k + x * s, z * z * k + c,     0.0f }
+        }};
+    }
+
+    float3 point(const float3& p) const {
+        return float3(
+            m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+            m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+            m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    float3 vector(const float3& v) const {
+        return float3(
+            m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    /// Transforms a normal by the transpose of this matrix. Called on the inverse of a transformation, this gives the transformed normal (not normalized).
+    float3 normal(const float3& n) const {
+        return float3(
+            m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+            m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+            m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z);
+    }
+
+    /// Returns the inverse of the transformation, which must not be singular.
+    Transform inverse() const {
+        // Inverse of the linear part, using the cofactors
+        float c[3][3];
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+                int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+                c[j][i] = m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1];
+            }
+        }
+        auto inv_det = 1.0f / (m[0][0] * c[0][0] + m[0][1] * c[1][0] + m[0][2] * c[2][0]);
+        Transform inv;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++)
+                inv.m[i][j] = c[i][j] * inv_det;
+        }
+        auto t = inv.vector(float3(m[0][3], m[1][3], m[2][3]));
+        inv.m[0][3] = -t.x;
+        inv.m[1][3] = -t.y;
+        inv.m[2][3] = -t.z;
+        return inv;
+    }
+};
+
+/// Composes two transformations: the resulting transformation applies b first, then a.
+inline Transform operator * (const Transform& a, const Transform& b) {
+    Transform r;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+            if (j == 3) r.m[i][j] += a.m[i][3];
+        }
+    }
+    return r;
+}
+
+/// Returns the bounding box of a transformed bounding box (see "Transforming Axis-Aligned Bounding Boxes", J. Arvo, 1990).
+inline BBox transform_bbox(const Transform& t, const BBox& bb) {
+    BBox r(float3(t.m[0][3], t.m[1][3], t.m[2][3]));
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            auto a = t.m[i][j] * bb.min[j];
+            auto b = t.m[i][j] * bb.max[j];
+            r.min[i] += std::min(a, b);
+            r.max[i] += std::max(a, b);
+        }
+    }
+    return r;
+}
+
+#endif // TRANSFORM_H